@@ -8,6 +8,8 @@
 #include "context.h"
 #include "parse_context.h"
 #include "vm_assembler.h"
+#include "vm_optimizer.h"
+#include "serializer.h"
 #include <stdio.h>
 
 static ID
@@ -17,8 +19,15 @@ static ID
     intern_parse,
     intern_square_brackets,
     intern_unknown_tag_in_liquid_tag,
-    intern_ivar_nodelist;
+    intern_ivar_nodelist,
+    intern_compile_render;
 
+// Each render moves the average output size 1/8 of the way to its output size
+#define OUTPUT_SIZE_AVERAGE_SHIFT 3
+// Reserves an extra 1/8 of the average output size for renders that are a bit larger
+#define OUTPUT_SIZE_HEADROOM_SHIFT 3
+
+static VALUE cLiquidCBlockBody;
 static VALUE tag_registry;
 static VALUE variable_placeholder = Qnil;
 
@@ -46,6 +55,7 @@ static void block_body_mark(void *ptr)
     if (body->compiled) {
         document_body_entry_mark(&body->as.compiled.document_body_entry);
         rb_gc_mark(body->as.compiled.nodelist);
+        rb_gc_mark(body->as.compiled.unspecialized);
     } else {
         rb_gc_mark(body->as.intermediate.parse_context);
         if (body->as.intermediate.vm_assembler_pool)
@@ -82,8 +92,6 @@ const rb_data_type_t block_body_data_type = {
     NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
 };
 
-#define BlockBody_Get_Struct(obj, sval) TypedData_Get_Struct(obj, block_body_t, &block_body_data_type, sval)
-
 static VALUE block_body_allocate(VALUE klass)
 {
     block_body_t *body;
@@ -116,6 +124,28 @@ static int is_id(int c)
     return rb_isalnum(c) || c == '_';
 }
 
+// Tags that support being compiled into VM instructions implement
+// compile_render(code), which returns false if it can't be compiled
+static bool try_compile_tag(block_body_t *body, VALUE tag)
+{
+    vm_assembler_t *code = body->as.intermediate.code;
+    size_t instructions_size = c_buffer_size(&code->instructions);
+    size_t stack_size = code->stack_size;
+
+    vm_assembler_add_render_tag_rescue(code, tag);
+    VALUE compiled = rb_check_funcall(tag, intern_compile_render, 1, &body->obj);
+
+    if (compiled == Qundef || !RTEST(compiled)) {
+        vm_assembler_truncate_instructions(code, instructions_size);
+        return false;
+    }
+    if (code->stack_size != stack_size) {
+        rb_raise(rb_eRuntimeError, "%"PRIsVALUE"#compile_render didn't leave the stack unchanged", rb_obj_class(tag));
+    }
+    vm_assembler_add_end_tag(code);
+    return true;
+}
+
 static tag_markup_t internal_block_body_parse(block_body_t *body, parse_context_t *parse_context)
 {
     tokenizer_t *tokenizer = parse_context->tokenizer;
@@ -251,7 +281,7 @@ static tag_markup_t internal_block_body_parse(block_body_t *body, parse_context_
                     }
                     tokenizer->raw_tag_body = NULL;
                     tokenizer->raw_tag_body_len = 0;
-                } else {
+                } else if (!try_compile_tag(body, new_tag)) {
                     vm_assembler_add_write_node(body->as.intermediate.code, new_tag);
                 }
 
@@ -306,6 +336,27 @@ static VALUE block_body_parse(VALUE self, VALUE tokenizer_obj, VALUE parse_conte
 }
 
 
+// Writes the optimized instructions to the document body, with their output as the last
+// constant of the block body when it doesn't depend on the context, so it can be appended
+// in one go, followed by the instructions from before builtin filters were folded
+static document_body_entry_t write_optimized_block_body(VALUE document_body, bool blank, uint32_t render_score,
+                                                        vm_assembler_t *code, vm_unfolded_instructions_t *unfolded)
+{
+    VALUE constant_output = vm_assembler_constant_output(code);
+    if (constant_output != Qundef)
+        c_buffer_write(&code->constants, &constant_output, sizeof(VALUE));
+
+    document_body_entry_t entry = document_body_write_block_body(document_body, blank, render_score, code);
+    if (constant_output != Qundef)
+        document_body_get_block_body_header_ptr(&entry)->flags |= BLOCK_BODY_HEADER_FLAG_CONSTANT_OUTPUT;
+    if (unfolded->folded_filters) {
+        document_body_write_unfolded_block_body(document_body, &entry, unfolded);
+        c_buffer_free(&unfolded->instructions);
+    }
+    RB_GC_GUARD(constant_output);
+    return entry;
+}
+
 static VALUE block_body_freeze(VALUE self)
 {
     block_body_t *body;
@@ -322,8 +373,12 @@ static VALUE block_body_freeze(VALUE self)
     bool blank = body->as.intermediate.blank;
     uint32_t render_score = body->as.intermediate.render_score;
     vm_assembler_t *code = body->as.intermediate.code;
-    body->as.compiled.document_body_entry = document_body_write_block_body(document_body, blank, render_score, code);
+    vm_unfolded_instructions_t unfolded;
+    vm_assembler_optimize(code, &unfolded);
+    body->as.compiled.document_body_entry = write_optimized_block_body(document_body, blank, render_score, code, &unfolded);
     body->as.compiled.nodelist = Qundef;
+    body->as.compiled.render_stats = (block_body_render_stats_t) { 0 };
+    body->as.compiled.unspecialized = Qnil;
     body->compiled = true;
     vm_assembler_pool_recycle_assembler(assembler_pool, assembler);
 
@@ -332,7 +387,54 @@ static VALUE block_body_freeze(VALUE self)
     return Qnil;
 }
 
-static VALUE block_body_render_to_output_buffer(VALUE self, VALUE context, VALUE output)
+typedef struct shadowed_variables_args {
+    VALUE hash;
+    bool shadowed;
+} shadowed_variables_args_t;
+
+static int static_variable_shadowed_i(VALUE key, VALUE value, VALUE args_ptr)
+{
+    shadowed_variables_args_t *args = (shadowed_variables_args_t *)args_ptr;
+    // like the search of Liquid::Context#find_variable, which calls the default proc
+    if (rb_hash_lookup2(args->hash, key, Qundef) != Qundef || rb_hash_aref(args->hash, key) != Qnil) {
+        args->shadowed = true;
+        return ST_STOP;
+    }
+    return ST_CONTINUE;
+}
+
+// Whether a variable of the static environment would be found in one of the
+// scopes or environments that are searched before it
+static bool static_variables_shadowed(VALUE static_environment, VALUE hashes)
+{
+    for (long i = 0; i < RARRAY_LEN(hashes); i++) {
+        shadowed_variables_args_t args = { .hash = RARRAY_AREF(hashes, i), .shadowed = false };
+        if (!RB_TYPE_P(args.hash, T_HASH))
+            return true;
+        rb_hash_foreach(static_environment, static_variable_shadowed_i, (VALUE)&args);
+        if (args.shadowed)
+            return true;
+    }
+    return false;
+}
+
+// A specialized copy only renders like the block body it was copied from with its
+// static environment as the first one of the context, when none of its variables
+// are shadowed and the values written don't go through a global filter
+static bool specialization_applies(document_body_t *document_body, VALUE context_obj)
+{
+    context_t *context = &vm_from_context(context_obj)->context;
+    if (context->global_filter != Qnil)
+        return false;
+    Check_Type(context->static_environments, T_ARRAY);
+    if (RARRAY_LEN(context->static_environments) == 0 ||
+            RARRAY_AREF(context->static_environments, 0) != document_body->static_environment)
+        return false;
+    return !static_variables_shadowed(document_body->static_environment, context->scopes) &&
+        !static_variables_shadowed(document_body->static_environment, context->environments);
+}
+
+VALUE block_body_render_to_output_buffer(VALUE self, VALUE context, VALUE output)
 {
     Check_Type(output, T_STRING);
     check_utf8_encoding(output, "output");
@@ -343,10 +445,75 @@ static VALUE block_body_render_to_output_buffer(VALUE self, VALUE context, VALUE
     document_body_entry_t *entry = &body->as.compiled.document_body_entry;
     document_body_ensure_compile_finished(entry->body);
 
+    if (body->as.compiled.unspecialized != Qnil && !specialization_applies(entry->body, context))
+        return block_body_render_to_output_buffer(body->as.compiled.unspecialized, context, output);
+
+    if (liquid_vm_stream_buffer_p(output)) {
+        // the output size isn't known when it is flushed while rendering
+        liquid_vm_render(document_body_get_block_body_header_ptr(entry), document_body_get_constants_ptr(entry), context, output);
+        return output;
+    }
+
+    block_body_render_stats_t *stats = &body->as.compiled.render_stats;
+    long start_size = RSTRING_LEN(output);
+    size_t expected_size = stats->output_size_hint;
+    if (!expected_size)
+        expected_size = stats->average_output_size + (stats->average_output_size >> OUTPUT_SIZE_HEADROOM_SHIFT);
+    // Avoids repeatedly growing the buffer while rendering large outputs
+    if (expected_size && rb_str_capacity(output) < start_size + expected_size)
+        rb_str_modify_expand(output, expected_size);
+
     liquid_vm_render(document_body_get_block_body_header_ptr(entry), document_body_get_constants_ptr(entry), context, output);
+
+    size_t output_size = RSTRING_LEN(output) - start_size;
+    if (stats->render_count == 0) {
+        stats->average_output_size = output_size;
+    } else if (output_size >= stats->average_output_size) {
+        stats->average_output_size += (output_size - stats->average_output_size) >> OUTPUT_SIZE_AVERAGE_SHIFT;
+    } else {
+        stats->average_output_size -= (stats->average_output_size - output_size) >> OUTPUT_SIZE_AVERAGE_SHIFT;
+    }
+    stats->last_output_size = output_size;
+    stats->render_count++;
     return output;
 }
 
+static VALUE block_body_render_stats(VALUE self)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_body_compiled(body);
+    block_body_render_stats_t *stats = &body->as.compiled.render_stats;
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("render_count")), ULL2NUM(stats->render_count));
+    rb_hash_aset(hash, ID2SYM(rb_intern("last_output_size")), SIZET2NUM(stats->last_output_size));
+    rb_hash_aset(hash, ID2SYM(rb_intern("average_output_size")), SIZET2NUM(stats->average_output_size));
+    rb_hash_aset(hash, ID2SYM(rb_intern("output_size_hint")), stats->output_size_hint ? SIZET2NUM(stats->output_size_hint) : Qnil);
+    return hash;
+}
+
+static VALUE block_body_reset_render_stats(VALUE self)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_body_compiled(body);
+    block_body_render_stats_t *stats = &body->as.compiled.render_stats;
+    size_t output_size_hint = stats->output_size_hint;
+    *stats = (block_body_render_stats_t) { 0 };
+    stats->output_size_hint = output_size_hint;
+    return Qnil;
+}
+
+static VALUE block_body_set_output_size_hint(VALUE self, VALUE size)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_body_compiled(body);
+    body->as.compiled.render_stats.output_size_hint = NIL_P(size) ? 0 : NUM2SIZET(size);
+    return size;
+}
+
 static VALUE block_body_blank_p(VALUE self)
 {
     block_body_t *body;
@@ -359,6 +526,20 @@ static VALUE block_body_blank_p(VALUE self)
     }
 }
 
+// Returns the output that is rendered without running the instructions when it
+// doesn't depend on the context, or nil
+static VALUE block_body_constant_output(VALUE self)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_body_compiled(body);
+    document_body_entry_t *entry = &body->as.compiled.document_body_entry;
+    block_body_header_t *header = document_body_get_block_body_header_ptr(entry);
+    if (!BLOCK_BODY_HEADER_CONSTANT_OUTPUT_P(header))
+        return Qnil;
+    return document_body_get_constants_ptr(entry)[header->constants_len - 1];
+}
+
 static VALUE block_body_remove_blank_strings(VALUE self)
 {
     block_body_t *body;
@@ -414,7 +595,7 @@ static VALUE block_body_nodelist(VALUE self)
 
     VALUE nodelist = rb_ary_new_capa(body_header->render_score);
 
-    const VALUE *constants = &entry->body->constants;
+    const VALUE *constants = document_body_get_constants_ptr(entry);
     const uint8_t *ip = block_body_instructions_ptr(body_header);
     while (true) {
         switch (*ip) {
@@ -437,14 +618,17 @@ static VALUE block_body_nodelist(VALUE self)
                 break;
             }
             case OP_WRITE_NODE:
+            case OP_RENDER_TAG_RESCUE:
             {
                 uint16_t constant_index = (ip[1] << 8) | ip[2];
-                VALUE node = RARRAY_AREF(*constants, constant_index);
+                VALUE node = constants[constant_index];
                 rb_ary_push(nodelist, node);
                 break;
             }
 
             case OP_RENDER_VARIABLE_RESCUE:
+            case OP_WRITE_STATIC_VAR:
+            case OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY:
                 rb_ary_push(nodelist, variable_placeholder);
                 break;
         }
@@ -467,11 +651,265 @@ static VALUE block_body_disassemble(VALUE self)
     return vm_assembler_disassemble(
         start_ip,
         start_ip + header->instructions_bytes,
-        &entry->body->constants
+        document_body_get_constants_ptr(entry)
     );
 }
 
 
+static VALUE block_body_new_from_entry(document_body_entry_t entry)
+{
+    block_body_t *body;
+    VALUE obj = block_body_allocate(cLiquidCBlockBody);
+    BlockBody_Get_Struct(obj, body);
+
+    body->compiled = true;
+    body->as.compiled.document_body_entry = entry;
+    body->as.compiled.nodelist = Qundef;
+    body->as.compiled.render_stats = (block_body_render_stats_t) { 0 };
+    body->as.compiled.unspecialized = Qnil;
+    return obj;
+}
+
+VALUE block_body_new_compiled(VALUE document_body, uint32_t buffer_offset)
+{
+    return block_body_new_from_entry(document_body_get_entry(document_body, buffer_offset));
+}
+
+/*
+ *  call-seq:
+ *    dump { |node| string } -> String
+ *
+ *  Serializes the compiled template for Liquid::C::BlockBody.load, e.g. to cache
+ *  compiled templates on disk. This block body must be the root of its document,
+ *  which also includes the block bodies of the tags within it. Tag nodes and other
+ *  objects that aren't literals are serialized using the block, which defaults
+ *  to Marshal.dump.
+ */
+static VALUE block_body_dump(VALUE self)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_body_compiled(body);
+
+    // the static environment that it renders with couldn't be checked after loading
+    if (body->as.compiled.document_body_entry.body->static_environment != Qnil)
+        rb_raise(rb_eArgError, "specialized block bodies can't be dumped");
+
+    VALUE node_dumper = rb_block_given_p() ? rb_block_proc() : Qnil;
+    return document_body_dump(&body->as.compiled.document_body_entry, node_dumper);
+}
+
+/*
+ *  call-seq:
+ *    Liquid::C::BlockBody.load(data, offset = 0) { |string| node } -> block_body
+ *
+ *  Loads a compiled template serialized by Liquid::C::BlockBody#dump, with the
+ *  block re-creating the nodes serialized by the node dumper, which defaults to
+ *  Marshal.load. Raises Liquid::C::InvalidDump if the data is corrupt or was
+ *  dumped by an incompatible version of liquid-c, in which case the template
+ *  should be parsed again.
+ *
+ *  The data can be a String or a Liquid::C::MappedFile of concatenated dumps,
+ *  in which case the instructions are used in place instead of being copied.
+ */
+static VALUE block_body_load(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE data, offset, node_loader;
+    rb_scan_args(argc, argv, "11&", &data, &offset, &node_loader);
+    long offset_value = NIL_P(offset) ? 0 : NUM2LONG(offset);
+    if (offset_value < 0)
+        rb_raise(rb_eArgError, "negative offset");
+    return block_body_new_from_entry(document_body_load(data, (size_t)offset_value, node_loader));
+}
+
+typedef struct specialize_args {
+    VALUE static_environment;
+    VALUE assigned_names;
+    document_body_t *source_document_body;
+    VALUE document_body; // of the specialized block bodies
+    VALUE specialized_bodies; // block body => its specialized copy
+    vm_assembler_pool_t *vm_assembler_pool;
+} specialize_args_t;
+
+static bool nested_block_body_p(document_body_t *document_body, VALUE constant)
+{
+    if (RB_SPECIAL_CONST_P(constant) || !rb_typeddata_is_kind_of(constant, &block_body_data_type))
+        return false;
+    block_body_t *body;
+    BlockBody_Get_Struct(constant, body);
+    return body->compiled && body->as.compiled.document_body_entry.body == document_body;
+}
+
+// Collects the names of the variables that the compiled tags of a block body and
+// the block bodies nested in it can assign, which would be found before the static ones
+static void collect_assigned_names(specialize_args_t *args, VALUE self, VALUE visited)
+{
+    if (rb_hash_lookup2(visited, self, Qundef) != Qundef)
+        return;
+    rb_hash_aset(visited, self, Qtrue);
+
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    document_body_entry_t *entry = &body->as.compiled.document_body_entry;
+    block_body_header_t *header = document_body_get_block_body_header_ptr(entry);
+    VALUE constants = entry->body->constants;
+
+    const uint8_t *ip = block_body_instructions_ptr(header);
+    const uint8_t *end_ip = ip + header->instructions_bytes;
+    while (ip < end_ip) {
+        switch (*ip) {
+            case OP_FOR_INIT:
+                rb_hash_aset(args->assigned_names, rb_str_new_cstr("forloop"), Qtrue);
+                // fallthrough
+            case OP_ASSIGN:
+            case OP_CAPTURE:
+                rb_hash_aset(args->assigned_names, RARRAY_AREF(constants, header->constants_offset + ((ip[1] << 8) | ip[2])), Qtrue);
+                break;
+        }
+        liquid_vm_next_instruction(&ip);
+    }
+
+    for (uint32_t i = 0; i < header->constants_len; i++) {
+        VALUE constant = RARRAY_AREF(constants, header->constants_offset + i);
+        if (nested_block_body_p(args->source_document_body, constant))
+            collect_assigned_names(args, constant, visited);
+    }
+}
+
+// Copies a compiled block body into the specialized document body, after the block
+// bodies nested in it so their copies are rendered instead
+static VALUE block_body_specialized_copy(specialize_args_t *args, VALUE self)
+{
+    VALUE copy_obj = rb_hash_lookup2(args->specialized_bodies, self, Qundef);
+    if (copy_obj != Qundef)
+        return copy_obj;
+
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    document_body_entry_t *entry = &body->as.compiled.document_body_entry;
+    block_body_header_t *header = document_body_get_block_body_header_ptr(entry);
+    // builtin filters are folded again for the copy, unless overridden when it is rendered
+    if (header->folded_filters)
+        header = block_body_unfolded_header(header);
+
+    // an intermediate block body keeps the constants of the copy marked while it is optimized
+    copy_obj = block_body_allocate(cLiquidCBlockBody);
+    block_body_t *copy;
+    BlockBody_Get_Struct(copy_obj, copy);
+    copy->as.intermediate.parse_context = Qnil;
+    copy->as.intermediate.vm_assembler_pool = args->vm_assembler_pool;
+    vm_assembler_t *code = vm_assembler_pool_alloc_assembler(args->vm_assembler_pool);
+    copy->as.intermediate.code = code;
+
+    // the constant output isn't referenced by the instructions
+    uint32_t constants_len = header->constants_len - (BLOCK_BODY_HEADER_CONSTANT_OUTPUT_P(header) ? 1 : 0);
+    for (uint32_t i = 0; i < constants_len; i++) {
+        VALUE constant = RARRAY_AREF(entry->body->constants, header->constants_offset + i);
+        if (nested_block_body_p(args->source_document_body, constant))
+            constant = block_body_specialized_copy(args, constant);
+        st_insert(code->constants_table, constant, i);
+        c_buffer_write(&code->constants, &constant, sizeof(VALUE));
+    }
+    c_buffer_write(&code->instructions, block_body_instructions_ptr(header), header->instructions_bytes);
+    code->parsing = false;
+    // the instructions that replace superinstructions can need one more value on the stack
+    code->max_stack_size = header->max_stack_size + 1;
+
+    vm_unfolded_instructions_t unfolded;
+    vm_assembler_specialize(code, args->static_environment, args->assigned_names, &unfolded);
+
+    copy->as.compiled.document_body_entry = write_optimized_block_body(args->document_body,
+            BLOCK_BODY_HEADER_BLANK_P(header), header->render_score, code, &unfolded);
+    copy->as.compiled.nodelist = Qundef;
+    copy->as.compiled.render_stats = (block_body_render_stats_t) { 0 };
+    copy->as.compiled.unspecialized = self;
+    copy->compiled = true;
+    vm_assembler_pool_recycle_assembler(args->vm_assembler_pool, code);
+
+    rb_hash_aset(args->specialized_bodies, self, copy_obj);
+    return copy_obj;
+}
+
+/*
+ *  call-seq:
+ *    specialize(static_environment) -> block_body
+ *
+ *  Returns a copy of the compiled template in a new document body, where the
+ *  variables of the frozen static_environment and the keys of its frozen
+ *  hashes are replaced by their values, so they can be folded with the
+ *  filters, conditions and variable renders that use them.
+ *
+ *  The copy renders like this block body, which must be the root of its
+ *  document, unless the variables of static_environment are assigned by tags
+ *  rendered through Ruby. Contexts whose first static environment isn't
+ *  static_environment, whose scopes or environments have one of its variables,
+ *  or that have a global filter render with this block body instead.
+ */
+static VALUE block_body_specialize(VALUE self, VALUE static_environment)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_body_compiled(body);
+    Check_Type(static_environment, T_HASH);
+    if (!RB_OBJ_FROZEN(static_environment))
+        rb_raise(rb_eArgError, "static environment must be frozen");
+
+    document_body_t *source_document_body = body->as.compiled.document_body_entry.body;
+    document_body_ensure_compile_finished(source_document_body);
+
+    VALUE vm_assembler_pool_obj = vm_assembler_pool_new();
+    specialize_args_t args = {
+        .static_environment = static_environment,
+        .assigned_names = rb_hash_new(),
+        .source_document_body = source_document_body,
+        .document_body = document_body_new_instance(),
+        .specialized_bodies = rb_funcall(rb_hash_new(), rb_intern("compare_by_identity"), 0),
+    };
+    VMAssemblerPool_Get_Struct(vm_assembler_pool_obj, args.vm_assembler_pool);
+
+    collect_assigned_names(&args, self, rb_funcall(rb_hash_new(), rb_intern("compare_by_identity"), 0));
+    VALUE specialized = block_body_specialized_copy(&args, self);
+
+    document_body_t *document_body;
+    DocumentBody_Get_Struct(args.document_body, document_body);
+    document_body->inlined_partials = source_document_body->inlined_partials;
+    document_body->static_environment = static_environment;
+    rb_obj_freeze(args.document_body);
+
+    RB_GC_GUARD(vm_assembler_pool_obj);
+    RB_GC_GUARD(args.assigned_names);
+    RB_GC_GUARD(args.specialized_bodies);
+    return specialized;
+}
+
+// Allows nodes that reference the block bodies of the document being dumped to be marshaled
+static VALUE block_body_marshal_dump(VALUE self, VALUE level)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+
+    VALUE document_body = document_body_dumping();
+    if (!body->compiled || body->as.compiled.document_body_entry.body->self != document_body)
+        rb_raise(rb_eTypeError, "Liquid::C::BlockBody can only be marshaled by Liquid::C::BlockBody#dump");
+
+    uint32_t buffer_offset = (uint32_t)body->as.compiled.document_body_entry.buffer_offset;
+    return rb_str_new((const char *)&buffer_offset, sizeof(buffer_offset));
+}
+
+static VALUE block_body_marshal_load(VALUE klass, VALUE data)
+{
+    VALUE document_body = document_body_loading();
+    if (NIL_P(document_body))
+        rb_raise(rb_eTypeError, "Liquid::C::BlockBody can only be unmarshaled by Liquid::C::BlockBody.load");
+
+    StringValue(data);
+    uint32_t buffer_offset;
+    if (RSTRING_LEN(data) != sizeof(buffer_offset))
+        raise_invalid_dump("invalid block body reference");
+    memcpy(&buffer_offset, RSTRING_PTR(data), sizeof(buffer_offset));
+    return block_body_new_compiled(document_body, buffer_offset);
+}
+
 static VALUE block_body_add_evaluate_expression(VALUE self, VALUE expression)
 {
     block_body_t *body;
@@ -535,6 +973,203 @@ static VALUE block_body_add_filter(VALUE self, VALUE filter_name, VALUE num_args
     return self;
 }
 
+static VALUE block_body_add_compare(VALUE self, VALUE condition)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    vm_assembler_add_compare_from_ruby(body->as.intermediate.code, condition);
+    return self;
+}
+
+static VALUE block_body_add_jump(VALUE self)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    return SIZET2NUM(vm_assembler_add_jump_from_ruby(body->as.intermediate.code, OP_JUMP));
+}
+
+static VALUE block_body_add_jump_if_false(VALUE self)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    return SIZET2NUM(vm_assembler_add_jump_from_ruby(body->as.intermediate.code, OP_JUMP_IF_FALSE));
+}
+
+static VALUE block_body_add_jump_if_true(VALUE self)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    return SIZET2NUM(vm_assembler_add_jump_from_ruby(body->as.intermediate.code, OP_JUMP_IF_TRUE));
+}
+
+static VALUE block_body_patch_jump(VALUE self, VALUE label)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    vm_assembler_patch_jump_from_ruby(body->as.intermediate.code, label);
+    return self;
+}
+
+static void ensure_nested_body_compiled(block_body_t *body, VALUE nested_body_obj)
+{
+    block_body_t *nested_body;
+    BlockBody_Get_Struct(nested_body_obj, nested_body);
+    ensure_body_compiled(nested_body);
+    if (!body->as.intermediate.code->parsing)
+        rb_raise(rb_eRuntimeError, "cannot extend code after it has finished being compiled");
+}
+
+static VALUE block_body_add_render_body(VALUE self, VALUE block_body_obj)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    ensure_nested_body_compiled(body, block_body_obj);
+
+    vm_assembler_add_render_body(body->as.intermediate.code, block_body_obj);
+    return self;
+}
+
+static VALUE block_body_add_for_init(VALUE self, VALUE variable_name, VALUE name, VALUE reversed, VALUE offset_continue)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    size_t label = vm_assembler_add_for_init_from_ruby(body->as.intermediate.code, variable_name, name,
+                                                       reversed, offset_continue);
+    return SIZET2NUM(label);
+}
+
+static VALUE block_body_add_for_next(VALUE self, VALUE block_body_obj)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    ensure_nested_body_compiled(body, block_body_obj);
+
+    vm_assembler_add_for_next(body->as.intermediate.code, block_body_obj);
+    return self;
+}
+
+static VALUE block_body_add_case_dispatch(VALUE self, VALUE table, VALUE branch_count)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    return SIZET2NUM(vm_assembler_add_case_dispatch_from_ruby(body->as.intermediate.code, table, branch_count));
+}
+
+static VALUE block_body_patch_case_dispatch(VALUE self, VALUE label, VALUE target)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    vm_assembler_patch_case_dispatch_from_ruby(body->as.intermediate.code, label, target);
+    return self;
+}
+
+static VALUE block_body_add_for_end(VALUE self)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    if (!body->as.intermediate.code->parsing)
+        rb_raise(rb_eRuntimeError, "cannot extend code after it has finished being compiled");
+
+    vm_assembler_add_for_end(body->as.intermediate.code);
+    return self;
+}
+static VALUE block_body_add_assign(VALUE self, VALUE name)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    vm_assembler_add_assign_from_ruby(body->as.intermediate.code, name);
+    return self;
+}
+
+static VALUE block_body_add_capture(VALUE self, VALUE name, VALUE block_body_obj)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    ensure_nested_body_compiled(body, block_body_obj);
+
+    vm_assembler_add_capture_from_ruby(body->as.intermediate.code, name, block_body_obj);
+    return self;
+}
+
+static VALUE block_body_add_render_partial(VALUE self, VALUE node, VALUE template_name, VALUE variable_name,
+                                           VALUE attribute_count, VALUE for_loop)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+
+    vm_assembler_add_render_partial_from_ruby(body->as.intermediate.code, node, template_name, variable_name,
+                                              attribute_count, for_loop);
+    return self;
+}
+
+/*
+ * Writes the raw text of a partial in place of rendering it when that is all
+ * its body does, so it doesn't depend on the isolated context it would be
+ * rendered in. Returns false without changing the code otherwise.
+ *
+ * The only tags left in such a body are the render tags of partials that
+ * were inlined into it, so their rescue instructions are dropped along with
+ * them, and the render tag being compiled checks the render length instead.
+ */
+static VALUE block_body_add_inlined_partial(VALUE self, VALUE template_name, VALUE source, VALUE partial_body_obj)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_intermediate(body);
+    ensure_nested_body_compiled(body, partial_body_obj);
+    StringValue(template_name);
+    StringValue(source);
+
+    block_body_t *partial_body;
+    BlockBody_Get_Struct(partial_body_obj, partial_body);
+    document_body_entry_t *entry = &partial_body->as.compiled.document_body_entry;
+    block_body_header_t *header = document_body_get_block_body_header_ptr(entry);
+    if (header->folded_filters)
+        return Qfalse;
+    const uint8_t *start_ip = block_body_instructions_ptr(header);
+
+    const uint8_t *ip = start_ip;
+    while (*ip != OP_LEAVE) {
+        if (*ip != OP_WRITE_RAW && *ip != OP_WRITE_RAW_W && *ip != OP_RENDER_TAG_RESCUE && *ip != OP_END_TAG)
+            return Qfalse;
+        liquid_vm_next_instruction(&ip);
+    }
+
+    vm_assembler_t *code = body->as.intermediate.code;
+    for (ip = start_ip; *ip != OP_LEAVE; liquid_vm_next_instruction(&ip)) {
+        if (*ip == OP_WRITE_RAW_W) {
+            vm_assembler_add_write_raw(code, (const char *)&ip[4], bytes_to_uint24(&ip[1]));
+        } else if (*ip == OP_WRITE_RAW) {
+            vm_assembler_add_write_raw(code, (const char *)&ip[2], ip[1]);
+        }
+    }
+
+    VALUE document_body = parse_context_get_document_body(body->as.intermediate.parse_context);
+    document_body_add_inlined_partial(document_body, rb_str_new_frozen(template_name), rb_str_new_frozen(source), entry->body);
+    return Qtrue;
+}
+
+static VALUE block_body_inlined_partials(VALUE self)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    ensure_body_compiled(body);
+    return document_body_inlined_partials(body->as.compiled.document_body_entry.body);
+}
 
 void liquid_define_block_body(void)
 {
@@ -545,21 +1180,33 @@ void liquid_define_block_body(void)
     intern_square_brackets = rb_intern("[]");
     intern_unknown_tag_in_liquid_tag = rb_intern("unknown_tag_in_liquid_tag");
     intern_ivar_nodelist = rb_intern("@nodelist");
+    intern_compile_render = rb_intern("compile_render");
 
     tag_registry = rb_funcall(cLiquidTemplate, rb_intern("tags"), 0);
     rb_global_variable(&tag_registry);
 
-    VALUE cLiquidCBlockBody = rb_define_class_under(mLiquidC, "BlockBody", rb_cObject);
+    cLiquidCBlockBody = rb_define_class_under(mLiquidC, "BlockBody", rb_cObject);
+    rb_global_variable(&cLiquidCBlockBody);
     rb_define_alloc_func(cLiquidCBlockBody, block_body_allocate);
 
     rb_define_method(cLiquidCBlockBody, "initialize", block_body_initialize, 1);
     rb_define_method(cLiquidCBlockBody, "parse", block_body_parse, 2);
     rb_define_method(cLiquidCBlockBody, "freeze", block_body_freeze, 0);
     rb_define_method(cLiquidCBlockBody, "render_to_output_buffer", block_body_render_to_output_buffer, 2);
+    rb_define_method(cLiquidCBlockBody, "render_stats", block_body_render_stats, 0);
+    rb_define_method(cLiquidCBlockBody, "reset_render_stats", block_body_reset_render_stats, 0);
+    rb_define_method(cLiquidCBlockBody, "output_size_hint=", block_body_set_output_size_hint, 1);
     rb_define_method(cLiquidCBlockBody, "remove_blank_strings", block_body_remove_blank_strings, 0);
     rb_define_method(cLiquidCBlockBody, "blank?", block_body_blank_p, 0);
+    rb_define_method(cLiquidCBlockBody, "constant_output", block_body_constant_output, 0);
     rb_define_method(cLiquidCBlockBody, "nodelist", block_body_nodelist, 0);
     rb_define_method(cLiquidCBlockBody, "disassemble", block_body_disassemble, 0);
+    rb_define_method(cLiquidCBlockBody, "inlined_partials", block_body_inlined_partials, 0);
+    rb_define_method(cLiquidCBlockBody, "specialize", block_body_specialize, 1);
+    rb_define_method(cLiquidCBlockBody, "dump", block_body_dump, 0);
+    rb_define_singleton_method(cLiquidCBlockBody, "load", block_body_load, -1);
+    rb_define_method(cLiquidCBlockBody, "_dump", block_body_marshal_dump, 1);
+    rb_define_singleton_method(cLiquidCBlockBody, "_load", block_body_marshal_load, 1);
 
     rb_define_method(cLiquidCBlockBody, "add_evaluate_expression", block_body_add_evaluate_expression, 1);
     rb_define_method(cLiquidCBlockBody, "add_find_variable", block_body_add_find_variable, 1);
@@ -570,6 +1217,22 @@ void liquid_define_block_body(void)
     rb_define_method(cLiquidCBlockBody, "add_hash_new", block_body_add_hash_new, 1);
     rb_define_method(cLiquidCBlockBody, "add_filter", block_body_add_filter, 2);
 
+    rb_define_method(cLiquidCBlockBody, "add_compare", block_body_add_compare, 1);
+    rb_define_method(cLiquidCBlockBody, "add_jump", block_body_add_jump, 0);
+    rb_define_method(cLiquidCBlockBody, "add_jump_if_false", block_body_add_jump_if_false, 0);
+    rb_define_method(cLiquidCBlockBody, "add_jump_if_true", block_body_add_jump_if_true, 0);
+    rb_define_method(cLiquidCBlockBody, "patch_jump", block_body_patch_jump, 1);
+    rb_define_method(cLiquidCBlockBody, "add_render_body", block_body_add_render_body, 1);
+    rb_define_method(cLiquidCBlockBody, "add_for_init", block_body_add_for_init, 4);
+    rb_define_method(cLiquidCBlockBody, "add_for_next", block_body_add_for_next, 1);
+    rb_define_method(cLiquidCBlockBody, "add_for_end", block_body_add_for_end, 0);
+    rb_define_method(cLiquidCBlockBody, "add_assign", block_body_add_assign, 1);
+    rb_define_method(cLiquidCBlockBody, "add_capture", block_body_add_capture, 2);
+    rb_define_method(cLiquidCBlockBody, "add_case_dispatch", block_body_add_case_dispatch, 2);
+    rb_define_method(cLiquidCBlockBody, "patch_case_dispatch", block_body_patch_case_dispatch, 2);
+    rb_define_method(cLiquidCBlockBody, "add_render_partial", block_body_add_render_partial, 5);
+    rb_define_method(cLiquidCBlockBody, "add_inlined_partial", block_body_add_inlined_partial, 3);
+
     rb_global_variable(&variable_placeholder);
 }
 
@@ -4,6 +4,15 @@
 #include "document_body.h"
 #include "vm_assembler_pool.h"
 
+// Sizes of the output written by renders of a block body, used to reserve
+// capacity in the output buffer before rendering
+typedef struct block_body_render_stats {
+    uint64_t render_count;
+    size_t last_output_size;
+    size_t average_output_size; // exponential moving average
+    size_t output_size_hint; // overrides average_output_size when non-zero
+} block_body_render_stats_t;
+
 typedef struct block_body {
     bool compiled;
     VALUE obj;
@@ -12,6 +21,8 @@ typedef struct block_body {
         struct {
             document_body_entry_t document_body_entry;
             VALUE nodelist;
+            block_body_render_stats_t render_stats;
+            VALUE unspecialized; // the block body this is a specialized copy of, or Qnil
         } compiled;
         struct {
             VALUE parse_context;
@@ -23,7 +34,12 @@ typedef struct block_body {
     } as;
 } block_body_t;
 
+extern const rb_data_type_t block_body_data_type;
+#define BlockBody_Get_Struct(obj, sval) TypedData_Get_Struct(obj, block_body_t, &block_body_data_type, sval)
+
 void liquid_define_block_body(void);
+VALUE block_body_new_compiled(VALUE document_body, uint32_t buffer_offset);
+VALUE block_body_render_to_output_buffer(VALUE self, VALUE context, VALUE output);
 
 static inline uint8_t *block_body_instructions_ptr(block_body_header_t *body)
 {
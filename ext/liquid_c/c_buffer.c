@@ -6,6 +6,9 @@ static void c_buffer_expand_for_write(c_buffer_t *buffer, size_t write_size)
     size_t size = c_buffer_size(buffer);
     size_t required_capacity = size + write_size;
 
+    if (buffer->borrowed)
+        rb_raise(rb_eRuntimeError, "can't write to a borrowed buffer");
+
     if (capacity < 1)
         capacity = 1;
     do {
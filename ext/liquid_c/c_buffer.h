@@ -2,27 +2,37 @@
 #define LIQUID_C_BUFFER_H
 
 #include <ruby.h>
+#include <stdbool.h>
 
 typedef struct c_buffer {
     uint8_t *data;
     uint8_t *data_end;
     uint8_t *capacity_end;
+    bool borrowed; // data is owned elsewhere and is read-only
 } c_buffer_t;
 
 static inline c_buffer_t c_buffer_init(void)
 {
-    return (c_buffer_t) { NULL, NULL, NULL };
+    return (c_buffer_t) { NULL, NULL, NULL, false };
 }
 
 static inline c_buffer_t c_buffer_allocate(size_t capacity)
 {
     uint8_t *data = xmalloc(capacity);
-    return (c_buffer_t) { data, data, data + capacity };
+    return (c_buffer_t) { data, data, data + capacity, false };
+}
+
+// Wraps read-only memory, such as a memory mapped file, which must outlive the buffer
+static inline c_buffer_t c_buffer_borrow(const uint8_t *data, size_t size)
+{
+    uint8_t *borrowed_data = (uint8_t *)data;
+    return (c_buffer_t) { borrowed_data, borrowed_data + size, borrowed_data + size, true };
 }
 
 static inline void c_buffer_free(c_buffer_t *buffer)
 {
-    xfree(buffer->data);
+    if (!buffer->borrowed)
+        xfree(buffer->data);
 }
 
 static inline void c_buffer_reset(c_buffer_t *buffer)
@@ -40,6 +50,12 @@ static inline size_t c_buffer_capacity(const c_buffer_t *buffer)
     return buffer->capacity_end - buffer->data;
 }
 
+// Memory allocated for the buffer, which excludes borrowed memory
+static inline size_t c_buffer_memsize(const c_buffer_t *buffer)
+{
+    return buffer->borrowed ? 0 : c_buffer_capacity(buffer);
+}
+
 void c_buffer_zero_pad_for_alignment(c_buffer_t *buffer, size_t alignment);
 
 void c_buffer_reserve_for_write(c_buffer_t *buffer, size_t write_size);
@@ -0,0 +1,232 @@
+#include "liquid.h"
+#include <ruby/re.h>
+#include "condition.h"
+
+VALUE cLiquidCondition;
+static ID id_c_interpret_operation;
+
+static const char *operator_names[] = {
+    [COMPARE_CUSTOM] = "custom",
+    [COMPARE_EQ] = "==",
+    [COMPARE_NE] = "!=",
+    [COMPARE_LT] = "<",
+    [COMPARE_GT] = ">",
+    [COMPARE_GE] = ">=",
+    [COMPARE_LE] = "<=",
+    [COMPARE_CONTAINS] = "contains",
+};
+
+uint8_t condition_operator_from_ruby(VALUE operator)
+{
+    if (!RB_TYPE_P(operator, T_STRING))
+        return COMPARE_CUSTOM;
+
+    const char *str = RSTRING_PTR(operator);
+    long len = RSTRING_LEN(operator);
+
+    if (len == 2 && memcmp(str, "<>", 2) == 0)
+        return COMPARE_NE;
+
+    for (uint8_t op = COMPARE_EQ; op <= COMPARE_CONTAINS; op++) {
+        const char *name = operator_names[op];
+        if ((size_t)len == strlen(name) && memcmp(str, name, len) == 0)
+            return op;
+    }
+    return COMPARE_CUSTOM;
+}
+
+const char *condition_operator_name(uint8_t comparison_operator)
+{
+    if (comparison_operator > COMPARE_CONTAINS)
+        return "invalid";
+    return operator_names[comparison_operator];
+}
+
+static inline bool plain_string_p(VALUE value)
+{
+    return RB_TYPE_P(value, T_STRING) && RBASIC_CLASS(value) == rb_cString;
+}
+
+static inline bool number_p(VALUE value)
+{
+    return RB_FIXNUM_P(value) || RB_FLOAT_TYPE_P(value);
+}
+
+// Values with a builtin #== that only considers values of the same type equal
+static inline bool basic_value_p(VALUE value)
+{
+    return RB_SPECIAL_CONST_P(value) || number_p(value) || plain_string_p(value);
+}
+
+#define MAX_EXACT_DOUBLE_INTEGER (1L << 53)
+
+// Compares numbers like Integer#<=> and Float#<=>, returning false when the
+// comparison can't be done exactly in C or when the result is unordered (NaN)
+static bool compare_numbers(VALUE left, VALUE right, int *result)
+{
+    double left_value, right_value;
+
+    if (RB_FIXNUM_P(left) && RB_FIXNUM_P(right)) {
+        long left_long = FIX2LONG(left), right_long = FIX2LONG(right);
+        *result = (left_long > right_long) - (left_long < right_long);
+        return true;
+    }
+
+    if (RB_FIXNUM_P(left)) {
+        long num = FIX2LONG(left);
+        if (num > MAX_EXACT_DOUBLE_INTEGER || num < -MAX_EXACT_DOUBLE_INTEGER)
+            return false;
+        left_value = (double)num;
+    } else {
+        left_value = RFLOAT_VALUE(left);
+    }
+
+    if (RB_FIXNUM_P(right)) {
+        long num = FIX2LONG(right);
+        if (num > MAX_EXACT_DOUBLE_INTEGER || num < -MAX_EXACT_DOUBLE_INTEGER)
+            return false;
+        right_value = (double)num;
+    } else {
+        right_value = RFLOAT_VALUE(right);
+    }
+
+    if (left_value < right_value) {
+        *result = -1;
+    } else if (left_value > right_value) {
+        *result = 1;
+    } else if (left_value == right_value) {
+        *result = 0;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Returns Qtrue or Qfalse, or Qundef if it can't be determined without calling #==
+static VALUE native_equal(VALUE left, VALUE right)
+{
+    if (number_p(left) && number_p(right)) {
+        int result;
+        if (compare_numbers(left, right, &result))
+            return result == 0 ? Qtrue : Qfalse;
+        if (RB_FLOAT_TYPE_P(left) && RB_FLOAT_TYPE_P(right))
+            return Qfalse; // NaN
+        return Qundef;
+    }
+
+    if (plain_string_p(left) && plain_string_p(right))
+        return rb_str_equal(left, right);
+
+    if (basic_value_p(left) && basic_value_p(right))
+        return left == right ? Qtrue : Qfalse;
+
+    return Qundef;
+}
+
+static VALUE native_relational(uint8_t comparison_operator, VALUE left, VALUE right)
+{
+    int cmp;
+
+    if (number_p(left) && number_p(right)) {
+        if (!compare_numbers(left, right, &cmp)) {
+            if (RB_FLOAT_TYPE_P(left) && RB_FLOAT_TYPE_P(right))
+                return Qfalse; // NaN
+            return Qundef;
+        }
+    } else if (plain_string_p(left) && plain_string_p(right)) {
+        cmp = rb_str_cmp(left, right);
+    } else {
+        return Qundef;
+    }
+
+    bool result;
+    switch (comparison_operator) {
+        case COMPARE_LT: result = cmp < 0; break;
+        case COMPARE_GT: result = cmp > 0; break;
+        case COMPARE_GE: result = cmp >= 0; break;
+        case COMPARE_LE: result = cmp <= 0; break;
+        default:
+            rb_bug("invalid relational operator: %u", comparison_operator);
+    }
+    return result ? Qtrue : Qfalse;
+}
+
+static VALUE native_contains(VALUE left, VALUE right)
+{
+    if (!RTEST(left) || !RTEST(right))
+        return Qfalse;
+
+    if (plain_string_p(left)) {
+        if (!plain_string_p(right) || ENCODING_GET(left) != ENCODING_GET(right))
+            return Qundef;
+
+        long pos = rb_memsearch(RSTRING_PTR(right), RSTRING_LEN(right), RSTRING_PTR(left), RSTRING_LEN(left),
+                                rb_enc_get(left));
+        return pos >= 0 ? Qtrue : Qfalse;
+    }
+
+    if (RB_TYPE_P(left, T_ARRAY) && RBASIC_CLASS(left) == rb_cArray) {
+        // Equivalent to Array#include?, which compares using item == right
+        for (long i = 0; i < RARRAY_LEN(left); i++) {
+            VALUE item = RARRAY_AREF(left, i);
+            VALUE equal = native_equal(item, right);
+            if (equal == Qundef)
+                equal = rb_equal(item, right);
+            if (RTEST(equal))
+                return Qtrue;
+        }
+        return Qfalse;
+    }
+
+    return Qundef;
+}
+
+// Returns Qundef for operands that aren't compared natively, with the operands
+// already converted by value_to_liquid_value
+VALUE condition_compare_native(uint8_t comparison_operator, VALUE left, VALUE right)
+{
+    VALUE result = Qundef;
+    switch (comparison_operator) {
+        case COMPARE_EQ:
+            result = native_equal(left, right);
+            break;
+        case COMPARE_NE:
+            result = native_equal(left, right);
+            if (result != Qundef)
+                result = result == Qtrue ? Qfalse : Qtrue;
+            break;
+        case COMPARE_LT:
+        case COMPARE_GT:
+        case COMPARE_GE:
+        case COMPARE_LE:
+            result = native_relational(comparison_operator, left, right);
+            break;
+        case COMPARE_CONTAINS:
+            result = native_contains(left, right);
+            break;
+        case COMPARE_CUSTOM:
+            break;
+    }
+    return result;
+}
+
+VALUE condition_compare(VALUE condition, uint8_t comparison_operator, VALUE left, VALUE right)
+{
+    left = value_to_liquid_value(left);
+    right = value_to_liquid_value(right);
+
+    VALUE result = condition_compare_native(comparison_operator, left, right);
+    if (result == Qundef) {
+        // Slow path: e.g. drops, custom operators or Liquid::Condition::MethodLiteral
+        result = rb_funcall(condition, id_c_interpret_operation, 2, left, right);
+    }
+    return result;
+}
+
+void liquid_define_condition(void)
+{
+    id_c_interpret_operation = rb_intern("c_interpret_operation");
+
+    cLiquidCondition = rb_const_get(mLiquid, rb_intern("Condition"));
+    rb_global_variable(&cLiquidCondition);
+}
@@ -0,0 +1,55 @@
+#if !defined(LIQUID_CONDITION_H)
+#define LIQUID_CONDITION_H
+
+#include "liquid.h"
+
+// Operators from Liquid::Condition.operators that are evaluated natively
+// for basic types, anything else is delegated to the Liquid::Condition node
+enum comparison_operator {
+    COMPARE_CUSTOM = 0,
+    COMPARE_EQ,
+    COMPARE_NE,
+    COMPARE_LT,
+    COMPARE_GT,
+    COMPARE_GE,
+    COMPARE_LE,
+    COMPARE_CONTAINS,
+};
+
+extern VALUE cLiquidCondition;
+
+void liquid_define_condition(void);
+uint8_t condition_operator_from_ruby(VALUE operator);
+const char *condition_operator_name(uint8_t comparison_operator);
+VALUE condition_compare_native(uint8_t comparison_operator, VALUE left, VALUE right);
+VALUE condition_compare(VALUE condition, uint8_t comparison_operator, VALUE left, VALUE right);
+
+// Equivalent to Liquid::Utils.to_liquid_value
+inline static VALUE value_to_liquid_value(VALUE value)
+{
+    if (RB_SPECIAL_CONST_P(value))
+        return value;
+
+    VALUE klass = RBASIC_CLASS(value);
+    if (klass == rb_cString || klass == rb_cArray || klass == rb_cHash || klass == rb_cFloat || klass == rb_cInteger)
+        return value;
+
+    VALUE liquid_value = rb_check_funcall(value, id_to_liquid_value, 0, 0);
+    return liquid_value != Qundef ? liquid_value : value;
+}
+
+// Values that can only be equal to values of the same type with the same
+// hash, so a Hash can be used to find an equal value without calling #==
+inline static bool case_dispatch_key_p(VALUE value)
+{
+    if (RB_SPECIAL_CONST_P(value))
+        return value == Qnil || value == Qtrue || value == Qfalse || RB_FIXNUM_P(value);
+    return RB_TYPE_P(value, T_STRING) && RBASIC_CLASS(value) == rb_cString;
+}
+
+inline static bool value_truthy_p(VALUE value)
+{
+    return RTEST(value_to_liquid_value(value));
+}
+
+#endif
@@ -5,12 +5,65 @@
 #include "liquid_vm.h"
 #include "expression.h"
 #include "document_body.h"
+#include "vm_assembler.h"
 
 static VALUE cLiquidUndefinedVariable;
 ID id_aset, id_set_context;
-static ID id_has_key, id_aref, id_strainer, id_filter_methods_hash, id_strict_filters, id_global_filter;
+static ID id_value_class_capabilities;
+static ID id_has_key, id_aref, id_default_proc, id_strainer, id_filter_methods_hash, id_standard_filter_methods_hash, id_strict_filters, id_global_filter;
 static ID id_ivar_scopes, id_ivar_environments, id_ivar_static_environments, id_ivar_strict_variables, id_ivar_interrupts, id_ivar_resource_limits, id_ivar_document_body;
 
+uint64_t class_cache_generation = 1;
+value_class_cache_entry_t value_class_cache[VALUE_CLASS_CACHE_SIZE];
+static VALUE value_class_cache_obj;
+
+static_assert(VALUE_CLASS_CACHE_SIZE == 1 << (64 - 58), "value class cache index must cover the cache");
+
+static void value_class_cache_mark(void *ptr)
+{
+    for (size_t i = 0; i < VALUE_CLASS_CACHE_SIZE; i++) {
+        value_class_cache_entry_t *entry = &value_class_cache[i];
+        if (entry->generation == class_cache_generation)
+            rb_gc_mark(entry->klass);
+    }
+}
+
+static const rb_data_type_t value_class_cache_data_type = {
+    "liquid_value_class_cache",
+    { value_class_cache_mark, NULL, NULL, },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+unsigned int value_class_cache_fill(value_class_cache_entry_t *entry, VALUE klass)
+{
+    // methods added to singleton classes wouldn't clear the cache
+    if (FL_TEST(klass, FL_SINGLETON))
+        return VALUE_CLASS_UNCACHED;
+
+    // the cache could be cleared while ruby code is running
+    uint64_t generation = class_cache_generation;
+    unsigned int flags = VALUE_CLASS_UNCACHED;
+    VALUE capabilities = rb_funcall(mLiquidC, id_value_class_capabilities, 1, klass);
+    if (capabilities != Qnil) {
+        Check_Type(capabilities, T_ARRAY);
+        flags = 0;
+        if (RTEST(rb_ary_entry(capabilities, 0)))
+            flags |= VALUE_CLASS_SET_CONTEXT;
+        if (RTEST(rb_ary_entry(capabilities, 1)))
+            flags |= VALUE_CLASS_TO_LIQUID_SELF;
+    }
+    entry->klass = klass;
+    entry->flags = flags;
+    entry->generation = generation;
+    return flags;
+}
+
+static VALUE liquid_c_clear_class_caches(VALUE self)
+{
+    class_cache_generation++;
+    return Qnil;
+}
+
 void context_internal_init(VALUE context_obj, context_t *context)
 {
     context->self = context_obj;
@@ -30,6 +83,18 @@ void context_internal_init(VALUE context_obj, context_t *context)
     context->filter_methods = rb_funcall(RBASIC_CLASS(context->strainer), id_filter_methods_hash, 0);
     Check_Type(context->filter_methods, T_HASH);
 
+    VALUE standard_filter_methods = rb_funcall(RBASIC_CLASS(context->strainer), id_standard_filter_methods_hash, 0);
+    Check_Type(standard_filter_methods, T_HASH);
+    context->standard_filters = 0;
+    context->native_filters = 0;
+    for (size_t i = 0; i < builtin_filters_count; i++) {
+        if (!RTEST(rb_hash_lookup(standard_filter_methods, builtin_filters[i].sym)))
+            continue;
+        context->standard_filters |= UINT64_C(1) << i;
+        if (builtin_filters[i].native)
+            context->native_filters |= UINT64_C(1) << i;
+    }
+
     context->interrupts = rb_ivar_get(context->self, id_ivar_interrupts);
     Check_Type(context->interrupts, T_ARRAY);
 
@@ -39,6 +104,9 @@ void context_internal_init(VALUE context_obj, context_t *context)
     context->strict_variables = false;
     context->strict_filters = RTEST(rb_funcall(context->self, id_strict_filters, 0));
     context->global_filter = rb_funcall(context->self, id_global_filter, 0);
+
+    context->variable_cache_generation = 1;
+    memset(context->variable_cache, 0, sizeof(context->variable_cache));
 }
 
 void context_mark(context_t *context)
@@ -52,6 +120,15 @@ void context_mark(context_t *context)
     rb_gc_mark(context->interrupts);
     rb_gc_mark(context->resource_limits_obj);
     rb_gc_mark(context->global_filter);
+
+    // entries from older generations are never dereferenced
+    for (size_t i = 0; i < CONTEXT_VARIABLE_CACHE_SIZE; i++) {
+        variable_cache_entry_t *entry = &context->variable_cache[i];
+        if (entry->generation == context->variable_cache_generation) {
+            rb_gc_mark(entry->key);
+            rb_gc_mark(entry->hash);
+        }
+    }
 }
 
 static context_t *context_from_obj(VALUE self)
@@ -98,7 +175,15 @@ void context_maybe_raise_undefined_variable(VALUE self, VALUE key)
     }
 }
 
-static bool environments_find_variable(VALUE environments, VALUE key, bool strict_variables, VALUE raise_on_not_found, VALUE *scope_out, VALUE *variable_out) {
+static bool hash_has_default_proc(VALUE hash)
+{
+    return rb_funcall(hash, id_default_proc, 0) != Qnil;
+}
+
+// cacheable_hash_out is set to the hash the variable was found in if the search
+// would find it in the same hash until the variable cache is invalidated
+static bool environments_find_variable(VALUE environments, VALUE key, bool strict_variables, VALUE raise_on_not_found,
+                                       VALUE *scope_out, VALUE *variable_out, VALUE *cacheable_hash_out) {
     VALUE variable = Qnil;
     Check_Type(environments, T_ARRAY);
 
@@ -111,6 +196,8 @@ static bool environments_find_variable(VALUE environments, VALUE key, bool stric
             if (variable != Qundef) {
                 *variable_out = variable;
                 *scope_out = this_environ;
+                if (cacheable_hash_out)
+                    *cacheable_hash_out = this_environ;
                 return true;
             }
 
@@ -123,6 +210,9 @@ static bool environments_find_variable(VALUE environments, VALUE key, bool stric
                     *scope_out = this_environ;
                     return true;
                 }
+                // the default proc could return a value for the key later
+                if (cacheable_hash_out && hash_has_default_proc(this_environ))
+                    cacheable_hash_out = NULL;
             }
         } else if (RTEST(rb_funcall(this_environ, id_has_key, 1, key))) {
             // Slow path: It is valid to pass a non-hash value to Liquid as an
@@ -130,12 +220,14 @@ static bool environments_find_variable(VALUE environments, VALUE key, bool stric
             *variable_out = rb_funcall(this_environ, id_aref, 1, key);
             *scope_out = this_environ;
             return true;
+        } else {
+            cacheable_hash_out = NULL;
         }
     }
     return false;
 }
 
-VALUE context_find_variable(context_t *context, VALUE key, VALUE raise_on_not_found)
+static VALUE find_variable(context_t *context, VALUE key, VALUE raise_on_not_found, VALUE *cacheable_hash_out)
 {
     VALUE self = context->self;
     VALUE scope = Qnil, variable = Qnil;
@@ -149,6 +241,8 @@ VALUE context_find_variable(context_t *context, VALUE key, VALUE raise_on_not_fo
             variable = rb_hash_lookup2(this_scope, key, Qundef);
             if (variable != Qundef) {
                 scope = this_scope;
+                if (cacheable_hash_out)
+                    *cacheable_hash_out = this_scope;
                 goto variable_found;
             }
         } else if (RTEST(rb_funcall(this_scope, id_has_key, 1, key))) {
@@ -156,15 +250,17 @@ VALUE context_find_variable(context_t *context, VALUE key, VALUE raise_on_not_fo
             // scope if it supports #key? and #[]
             variable = rb_funcall(this_scope, id_aref, 1, key);
             goto variable_found;
+        } else {
+            cacheable_hash_out = NULL;
         }
     }
 
     if (environments_find_variable(context->environments, key, context->strict_variables, raise_on_not_found,
-                                   &scope, &variable))
+                                   &scope, &variable, cacheable_hash_out))
         goto variable_found;
 
     if (environments_find_variable(context->static_environments, key, context->strict_variables, raise_on_not_found,
-                                   &scope, &variable))
+                                   &scope, &variable, cacheable_hash_out))
         goto variable_found;
 
     if (RTEST(raise_on_not_found)) {
@@ -179,15 +275,67 @@ variable_found:
     return variable;
 }
 
+VALUE context_find_variable(context_t *context, VALUE key, VALUE raise_on_not_found)
+{
+    return find_variable(context, key, raise_on_not_found, NULL);
+}
+
+static inline variable_cache_entry_t *variable_cache_entry(context_t *context, VALUE key)
+{
+    uint64_t hash = ((uint64_t)key >> 3) * UINT64_C(0x9E3779B97F4A7C15);
+    return &context->variable_cache[hash >> 59];
+}
+static_assert(CONTEXT_VARIABLE_CACHE_SIZE == 1 << (64 - 59), "variable cache index must cover the cache");
+
+/*
+ * Finds a variable with a name from the constants of compiled code, which
+ * is looked up in the hash it was last found in if the variable cache hasn't
+ * been invalidated since, instead of searching every scope and environment.
+ */
+VALUE context_find_static_variable(context_t *context, VALUE key)
+{
+    variable_cache_entry_t *entry = variable_cache_entry(context, key);
+    if (entry->key == key && entry->generation == context->variable_cache_generation) {
+        VALUE variable = rb_hash_lookup2(entry->hash, key, Qundef);
+        if (RB_LIKELY(variable != Qundef)) {
+            variable = materialize_proc(context->self, entry->hash, key, variable);
+            return value_to_liquid_and_set_context(variable, context->self);
+        }
+    }
+
+    // ruby code invoked by find_variable (e.g. #to_liquid) could invalidate
+    // the cache, which should also invalidate this entry
+    uint64_t generation = context->variable_cache_generation;
+    VALUE cacheable_hash = Qnil;
+    VALUE variable = find_variable(context, key, Qtrue, &cacheable_hash);
+    if (cacheable_hash != Qnil) {
+        entry->key = key;
+        entry->hash = cacheable_hash;
+        entry->generation = generation;
+    }
+    return variable;
+}
+
 static VALUE context_find_variable_method(VALUE self, VALUE key, VALUE raise_on_not_found)
 {
     return context_find_variable(context_from_obj(self), key, raise_on_not_found);
 }
 
+// Called by the Liquid::Context methods that change the scopes, which ruby code
+// like filters and drops can use while the VM renders with the context
+static VALUE context_invalidate_variable_cache_method(VALUE self)
+{
+    vm_t *vm = vm_from_context_if_created(self);
+    if (vm)
+        context_invalidate_variable_cache(&vm->context);
+    return Qnil;
+}
+
 static VALUE context_set_strict_variables(VALUE self, VALUE strict_variables)
 {
     context_t *context = context_from_obj(self);
     context->strict_variables = RTEST(strict_variables);
+    context_invalidate_variable_cache(context);
     rb_ivar_set(self, id_ivar_strict_variables, strict_variables);
     return Qnil;
 }
@@ -205,9 +353,12 @@ void liquid_define_context(void)
     id_has_key = rb_intern("key?");
     id_aset = rb_intern("[]=");
     id_aref = rb_intern("[]");
+    id_default_proc = rb_intern("default_proc");
+    id_value_class_capabilities = rb_intern("value_class_capabilities");
     id_set_context = rb_intern("context=");
     id_strainer = rb_intern("strainer");
     id_filter_methods_hash = rb_intern("filter_methods_hash");
+    id_standard_filter_methods_hash = rb_intern("standard_filter_methods_hash");
     id_strict_filters = rb_intern("strict_filters");
     id_global_filter = rb_intern("global_filter");
 
@@ -225,9 +376,14 @@ void liquid_define_context(void)
     cLiquidUndefinedVariable = rb_const_get(mLiquid, rb_intern("UndefinedVariable"));
     rb_global_variable(&cLiquidUndefinedVariable);
 
+    rb_define_singleton_method(mLiquidC, "clear_class_caches", liquid_c_clear_class_caches, 0);
+    value_class_cache_obj = TypedData_Wrap_Struct(0, &value_class_cache_data_type, value_class_cache);
+    rb_global_variable(&value_class_cache_obj);
+
     VALUE cLiquidContext = rb_const_get(mLiquid, rb_intern("Context"));
     rb_define_method(cLiquidContext, "c_evaluate", context_evaluate, 1);
     rb_define_method(cLiquidContext, "c_find_variable", context_find_variable_method, 2);
     rb_define_method(cLiquidContext, "c_strict_variables=", context_set_strict_variables, 1);
+    rb_define_method(cLiquidContext, "c_invalidate_variable_cache", context_invalidate_variable_cache_method, 0);
     rb_define_private_method(cLiquidContext, "c_filtering?", context_filtering_p, 0);
 }
@@ -3,6 +3,19 @@
 
 #include "resource_limits.h"
 
+#define CONTEXT_VARIABLE_CACHE_SIZE 32
+
+/*
+ * Remembers which hash in the scopes, environments or static_environments a
+ * variable with a constant name was found in, so later lookups of the name
+ * with the same variable_cache_generation can skip the hashes searched before it.
+ */
+typedef struct variable_cache_entry {
+    VALUE key;
+    VALUE hash;
+    uint64_t generation;
+} variable_cache_entry_t;
+
 typedef struct context {
     VALUE self;
     VALUE environments;
@@ -10,18 +23,25 @@ typedef struct context {
     VALUE scopes;
     VALUE strainer;
     VALUE filter_methods;
+    uint64_t standard_filters; // bitmask of builtin_filters that the strainer doesn't override
+    uint64_t native_filters; // bitmask of builtin_filters that can use their native implementation
     VALUE interrupts;
     VALUE resource_limits_obj;
     resource_limits_t *resource_limits;
     VALUE global_filter;
     bool strict_variables;
     bool strict_filters;
+    // incremented when a hash may have been added to or removed from the
+    // scopes or when a key may have been added to one of them
+    uint64_t variable_cache_generation;
+    variable_cache_entry_t variable_cache[CONTEXT_VARIABLE_CACHE_SIZE];
 } context_t;
 
 void liquid_define_context(void);
 void context_internal_init(VALUE context_obj, context_t *context);
 void context_mark(context_t *context);
 VALUE context_find_variable(context_t *context, VALUE key, VALUE raise_on_not_found);
+VALUE context_find_static_variable(context_t *context, VALUE key);
 void context_maybe_raise_undefined_variable(VALUE self, VALUE key);
 
 extern ID id_aset, id_set_context;
@@ -31,6 +51,51 @@ extern ID id_aset, id_set_context;
 #define RB_SPECIAL_CONST_P SPECIAL_CONST_P
 #endif
 
+/*
+ * What value_to_liquid_and_set_context needs to know about the class of a
+ * value, which is cached for classes that clear the cache when their
+ * methods change (see Liquid::C.value_class_capabilities).
+ */
+#define VALUE_CLASS_SET_CONTEXT 0x1 // instances respond to #context=
+#define VALUE_CLASS_TO_LIQUID_SELF 0x2 // #to_liquid returns self
+#define VALUE_CLASS_UNCACHED 0x4 // instances need to be checked dynamically
+#define VALUE_CLASS_CACHE_SIZE 64
+
+typedef struct value_class_cache_entry {
+    VALUE klass;
+    uint64_t generation;
+    unsigned int flags;
+} value_class_cache_entry_t;
+
+// incremented by Liquid::C.clear_class_caches when a method of a class with cached information changes
+extern uint64_t class_cache_generation;
+extern value_class_cache_entry_t value_class_cache[VALUE_CLASS_CACHE_SIZE];
+unsigned int value_class_cache_fill(value_class_cache_entry_t *entry, VALUE klass);
+
+static inline unsigned int value_class_flags(VALUE value)
+{
+    VALUE klass = RBASIC_CLASS(value);
+    value_class_cache_entry_t *entry = &value_class_cache[(((uint64_t)klass >> 3) * UINT64_C(0x9E3779B97F4A7C15)) >> 58];
+    if (RB_LIKELY(entry->klass == klass && entry->generation == class_cache_generation))
+        return entry->flags;
+    return value_class_cache_fill(entry, klass);
+}
+
+// Equivalent to `value.context = context_to_set if value.respond_to?(:context=)`
+static inline void value_set_context(VALUE value, VALUE context_to_set)
+{
+    if (RB_SPECIAL_CONST_P(value))
+        return;
+    unsigned int flags = value_class_flags(value);
+    if (flags & VALUE_CLASS_UNCACHED) {
+        if (!rb_respond_to(value, id_set_context))
+            return;
+    } else if (!(flags & VALUE_CLASS_SET_CONTEXT)) {
+        return;
+    }
+    rb_funcall(value, id_set_context, 1, context_to_set);
+}
+
 inline static VALUE value_to_liquid_and_set_context(VALUE value, VALUE context_to_set)
 {
     // Scalar type stored directly in the VALUE, these all have a #to_liquid
@@ -44,18 +109,39 @@ inline static VALUE value_to_liquid_and_set_context(VALUE value, VALUE context_t
     if (klass == rb_cString || klass == rb_cArray || klass == rb_cHash)
         return value;
 
-    // set value's context before invoking #to_liquid
-    if (rb_respond_to(value, id_set_context))
+    unsigned int flags = value_class_flags(value);
+    if (!(flags & VALUE_CLASS_UNCACHED)) {
+        if (flags & VALUE_CLASS_SET_CONTEXT)
+            rb_funcall(value, id_set_context, 1, context_to_set);
+        if (flags & VALUE_CLASS_TO_LIQUID_SELF)
+            return value;
+    } else if (rb_respond_to(value, id_set_context)) {
+        // set value's context before invoking #to_liquid
         rb_funcall(value, id_set_context, 1, context_to_set);
+    }
 
     VALUE liquid_value = rb_funcall(value, id_to_liquid, 0);
 
-    if (liquid_value != value && rb_respond_to(liquid_value, id_set_context))
-        rb_funcall(liquid_value, id_set_context, 1, context_to_set);
+    if (liquid_value != value)
+        value_set_context(liquid_value, context_to_set);
 
     return liquid_value;
 }
 
+static inline void context_invalidate_variable_cache(context_t *context)
+{
+    context->variable_cache_generation++;
+}
+
+// Equivalent to `hash[key] = value` for a hash in the scopes or environments
+static inline void context_hash_aset(context_t *context, VALUE hash, VALUE key, VALUE value)
+{
+    size_t old_size = RHASH_SIZE(hash);
+    rb_hash_aset(hash, key, value);
+    // replacing the value of an existing key doesn't change where it is found
+    if (RHASH_SIZE(hash) != old_size)
+        context_invalidate_variable_cache(context);
+}
 
 inline static VALUE materialize_proc(VALUE context, VALUE scope, VALUE key, VALUE value)
 {
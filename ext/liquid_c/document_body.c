@@ -1,10 +1,14 @@
 #include <ruby.h>
 #include <stdalign.h>
+#include <string.h>
 #include "liquid.h"
 #include "vm_assembler.h"
 #include "document_body.h"
+#include "serializer.h"
+#include "mapped_file.h"
 
 static VALUE cLiquidCDocumentBody;
+static ID id_dumping_document_body, id_loading_document_body;
 
 static void document_body_mark(void *ptr)
 {
@@ -18,6 +22,9 @@ static void document_body_mark(void *ptr)
      * point to an incorrect object. */
     rb_gc_mark(body->self);
     rb_gc_mark(body->constants);
+    rb_gc_mark(body->buffer_owner);
+    rb_gc_mark(body->inlined_partials);
+    rb_gc_mark(body->static_environment);
 }
 
 static void document_body_free(void *ptr)
@@ -30,7 +37,8 @@ static void document_body_free(void *ptr)
 static size_t document_body_memsize(const void *ptr)
 {
     const document_body_t *body = ptr;
-    return sizeof(document_body_t) + c_buffer_size(&body->buffer);
+    // excludes a borrowed buffer, which is shared memory
+    return sizeof(document_body_t) + c_buffer_memsize(&body->buffer);
 }
 
 const rb_data_type_t document_body_data_type = {
@@ -46,13 +54,14 @@ static VALUE document_body_allocate(VALUE klass)
     VALUE obj = TypedData_Make_Struct(klass, document_body_t, &document_body_data_type, body);
     body->self = obj;
     body->constants = rb_ary_new();
+    body->buffer_owner = Qnil;
+    body->inlined_partials = Qnil;
+    body->static_environment = Qnil;
     body->buffer = c_buffer_init();
 
     return obj;
 }
 
-#define DocumentBody_Get_Struct(obj, sval) TypedData_Get_Struct(obj, document_body_t, &document_body_data_type, sval)
-
 VALUE document_body_new_instance(void)
 {
     return rb_class_new_instance(0, NULL, cLiquidCDocumentBody);
@@ -81,6 +90,7 @@ document_body_entry_t document_body_write_block_body(VALUE self, bool blank, uin
     if (blank) buf_block_body->flags |= BLOCK_BODY_HEADER_FLAG_BLANK;
     buf_block_body->render_score = render_score;
     buf_block_body->max_stack_size = code->max_stack_size;
+    buf_block_body->folded_filters = 0;
 
     c_buffer_concat(&body->buffer, &code->instructions);
 
@@ -89,8 +99,330 @@ document_body_entry_t document_body_write_block_body(VALUE self, bool blank, uin
     return (document_body_entry_t) { .body = body, .buffer_offset = buffer_offset };
 }
 
+/*
+ * Writes the instructions from before the builtin filters were folded right after
+ * the block body at entry, which must be the last one written, sharing its constants
+ * other than the constant output, see block_body_unfolded_header.
+ */
+void document_body_write_unfolded_block_body(VALUE self, const document_body_entry_t *entry, vm_unfolded_instructions_t *unfolded)
+{
+    assert(!RB_OBJ_FROZEN(self) && unfolded->folded_filters);
+
+    document_body_t *body;
+    DocumentBody_Get_Struct(self, body);
+
+    block_body_header_t *header = document_body_get_block_body_header_ptr(entry);
+    assert(entry->buffer_offset + header->instructions_offset + header->instructions_bytes == c_buffer_size(&body->buffer));
+    header->folded_filters = unfolded->folded_filters;
+    block_body_header_t unfolded_header = {
+        .instructions_offset = (uint32_t)sizeof(block_body_header_t),
+        .instructions_bytes = (uint32_t)c_buffer_size(&unfolded->instructions),
+        .constants_offset = header->constants_offset,
+        .constants_len = header->constants_len - (BLOCK_BODY_HEADER_CONSTANT_OUTPUT_P(header) ? 1 : 0),
+        .flags = header->flags & BLOCK_BODY_HEADER_FLAG_BLANK,
+        .render_score = header->render_score,
+        .max_stack_size = unfolded->max_stack_size,
+        .folded_filters = 0,
+    };
+
+    // header is invalidated by writes that grow the buffer
+    c_buffer_zero_pad_for_alignment(&body->buffer, alignof(block_body_header_t));
+    c_buffer_write(&body->buffer, &unfolded_header, sizeof(unfolded_header));
+    c_buffer_concat(&body->buffer, &unfolded->instructions);
+}
+
+static int add_inlined_partial_i(VALUE template_name, VALUE source, VALUE inlined_partials)
+{
+    rb_hash_aset(inlined_partials, template_name, source);
+    return ST_CONTINUE;
+}
+
+/*
+ * Records a partial whose output was written into one of the block bodies,
+ * along with the partials that were inlined into it, so the document can
+ * be parsed again when one of their sources changes.
+ */
+void document_body_add_inlined_partial(VALUE self, VALUE template_name, VALUE source, document_body_t *partial_body)
+{
+    document_body_t *body;
+    DocumentBody_Get_Struct(self, body);
+    rb_check_frozen(self);
+
+    if (body->inlined_partials == Qnil)
+        body->inlined_partials = rb_hash_new();
+    rb_hash_aset(body->inlined_partials, template_name, source);
+    if (partial_body->inlined_partials != Qnil)
+        rb_hash_foreach(partial_body->inlined_partials, add_inlined_partial_i, body->inlined_partials);
+}
+
+VALUE document_body_inlined_partials(document_body_t *body)
+{
+    if (body->inlined_partials == Qnil)
+        return rb_hash_freeze(rb_hash_new());
+    return rb_hash_freeze(rb_hash_dup(body->inlined_partials));
+}
+
+/*
+ * Dump format, where the buffer is copied as is since it is relocatable and
+ * is followed by the serialized inlined partials and constants.
+ * DOCUMENT_BODY_DUMP_VERSION must be
+ * incremented when the buffer layout or the semantics of an instruction change.
+ *
+ * The buffer and the dump size are padded to DOCUMENT_BODY_DUMP_ALIGNMENT, so
+ * dumps concatenated into a memory mapped file can use the buffer in place.
+ */
+#define DOCUMENT_BODY_DUMP_MAGIC "LQCD"
+#define DOCUMENT_BODY_DUMP_VERSION 4
+#define DOCUMENT_BODY_DUMP_ALIGNMENT 8
+#define DOCUMENT_BODY_DUMP_BYTE_ORDER 0x01020304
+
+typedef struct document_body_dump_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t instruction_set_fingerprint;
+    uint32_t byte_order;
+    uint32_t root_offset;
+    uint32_t buffer_bytes;
+    uint32_t constants_len;
+    uint32_t constants_bytes;
+} document_body_dump_header_t;
+
+// keeps the buffer aligned when the dump is aligned
+static_assert(sizeof(document_body_dump_header_t) % DOCUMENT_BODY_DUMP_ALIGNMENT == 0,
+        "document body dump header size must preserve the buffer alignment");
+static_assert(DOCUMENT_BODY_DUMP_ALIGNMENT % alignof(block_body_header_t) == 0,
+        "document body dumps must be aligned for block body headers");
+
+static void dump_zero_pad_for_alignment(VALUE output)
+{
+    static const char padding[DOCUMENT_BODY_DUMP_ALIGNMENT] = { 0 };
+    size_t unaligned_bytes = RSTRING_LEN(output) % DOCUMENT_BODY_DUMP_ALIGNMENT;
+    if (unaligned_bytes)
+        rb_str_buf_cat(output, padding, DOCUMENT_BODY_DUMP_ALIGNMENT - unaligned_bytes);
+}
+
+document_body_entry_t document_body_get_entry(VALUE self, uint32_t buffer_offset)
+{
+    document_body_t *body;
+    DocumentBody_Get_Struct(self, body);
+
+    size_t buffer_bytes = c_buffer_size(&body->buffer);
+    if (buffer_offset % alignof(block_body_header_t) != 0 || buffer_offset > buffer_bytes ||
+            buffer_bytes - buffer_offset < sizeof(block_body_header_t))
+        raise_invalid_dump("block body offset out of bounds");
+
+    return (document_body_entry_t) { .body = body, .buffer_offset = buffer_offset };
+}
+
+// The document body being dumped or loaded is available to Marshal methods called for nodes
+typedef struct session_args {
+    ID session_id;
+    VALUE previous;
+} session_args_t;
+
+static VALUE end_document_body_session(VALUE arg)
+{
+    session_args_t *args = (session_args_t *)arg;
+    rb_thread_local_aset(rb_thread_current(), args->session_id, args->previous);
+    return Qnil;
+}
+
+static VALUE with_document_body_session(ID session_id, VALUE document_body, VALUE (*func)(VALUE), VALUE arg)
+{
+    VALUE thread = rb_thread_current();
+    session_args_t session_args = { .session_id = session_id, .previous = rb_thread_local_aref(thread, session_id) };
+    rb_thread_local_aset(thread, session_id, document_body);
+    return rb_ensure(func, arg, end_document_body_session, (VALUE)&session_args);
+}
+
+VALUE document_body_dumping(void)
+{
+    return rb_thread_local_aref(rb_thread_current(), id_dumping_document_body);
+}
+
+VALUE document_body_loading(void)
+{
+    return rb_thread_local_aref(rb_thread_current(), id_loading_document_body);
+}
+
+static VALUE dump_constants(VALUE arg)
+{
+    serializer_t *serializer = (serializer_t *)arg;
+    document_body_t *body;
+    DocumentBody_Get_Struct(serializer->document_body, body);
+
+    serializer_write_value(serializer, body->inlined_partials);
+    for (long i = 0; i < RARRAY_LEN(body->constants); i++) {
+        serializer_write_value(serializer, RARRAY_AREF(body->constants, i));
+    }
+    return Qnil;
+}
+
+VALUE document_body_dump(const document_body_entry_t *root, VALUE node_dumper)
+{
+    document_body_t *body = root->body;
+    document_body_ensure_compile_finished(body);
+
+    size_t buffer_bytes = c_buffer_size(&body->buffer);
+    document_body_dump_header_t header = {
+        .magic = DOCUMENT_BODY_DUMP_MAGIC,
+        .version = DOCUMENT_BODY_DUMP_VERSION,
+        .instruction_set_fingerprint = vm_assembler_instruction_set_fingerprint(),
+        .byte_order = DOCUMENT_BODY_DUMP_BYTE_ORDER,
+        .root_offset = (uint32_t)root->buffer_offset,
+        .buffer_bytes = (uint32_t)buffer_bytes,
+        .constants_len = (uint32_t)RARRAY_LEN(body->constants),
+    };
+
+    VALUE output = rb_str_buf_new(sizeof(header) + buffer_bytes);
+    rb_str_buf_cat(output, (const char *)&header, sizeof(header));
+    rb_str_buf_cat(output, (const char *)body->buffer.data, buffer_bytes);
+    dump_zero_pad_for_alignment(output);
+
+    size_t constants_start = RSTRING_LEN(output);
+    serializer_t serializer = { .output = output, .document_body = body->self, .node_dumper = node_dumper };
+    with_document_body_session(id_dumping_document_body, body->self, dump_constants, (VALUE)&serializer);
+
+    size_t constants_bytes = RSTRING_LEN(output) - constants_start;
+    if (constants_bytes > UINT32_MAX)
+        rb_raise(rb_eArgError, "constants too large to dump");
+    header.constants_bytes = (uint32_t)constants_bytes;
+    memcpy(RSTRING_PTR(output), &header, sizeof(header));
+    dump_zero_pad_for_alignment(output);
+    return output;
+}
+
+// Checks that the block bodies are within the buffer and reference existing constants,
+// the instructions themselves aren't verified, so dumps should only be loaded from a
+// trusted source, like with Marshal.
+static void validate_loaded_buffer(document_body_t *body, uint32_t constants_len)
+{
+    size_t offset = 0;
+    size_t buffer_bytes = c_buffer_size(&body->buffer);
+
+    while (offset < buffer_bytes) {
+        offset = (offset + alignof(block_body_header_t) - 1) & ~(alignof(block_body_header_t) - 1);
+        if (buffer_bytes - offset < sizeof(block_body_header_t))
+            raise_invalid_dump("truncated block body header");
+
+        block_body_header_t *header = (block_body_header_t *)(body->buffer.data + offset);
+        offset += sizeof(block_body_header_t);
+        if (header->instructions_offset != sizeof(block_body_header_t) ||
+                header->instructions_bytes == 0 || header->instructions_bytes > buffer_bytes - offset)
+            raise_invalid_dump("block body instructions out of bounds");
+        if (header->constants_offset > constants_len || header->constants_len > constants_len - header->constants_offset)
+            raise_invalid_dump("block body constants out of bounds");
+        if (BLOCK_BODY_HEADER_CONSTANT_OUTPUT_P(header) && header->constants_len == 0)
+            raise_invalid_dump("missing block body constant output");
+        offset += header->instructions_bytes;
+        if (body->buffer.data[offset - 1] != OP_LEAVE)
+            raise_invalid_dump("unterminated block body");
+        if (header->folded_filters) {
+            size_t unfolded_offset = (offset + alignof(block_body_header_t) - 1) & ~(alignof(block_body_header_t) - 1);
+            if (unfolded_offset >= buffer_bytes || buffer_bytes - unfolded_offset < sizeof(block_body_header_t))
+                raise_invalid_dump("missing unfolded block body");
+            block_body_header_t *unfolded = block_body_unfolded_header(header);
+            if (unfolded->folded_filters || unfolded->constants_offset != header->constants_offset ||
+                    unfolded->constants_len > header->constants_len)
+                raise_invalid_dump("invalid unfolded block body");
+        }
+    }
+}
+
+static VALUE load_constants(VALUE arg)
+{
+    deserializer_t *deserializer = (deserializer_t *)arg;
+    document_body_t *body;
+    DocumentBody_Get_Struct(deserializer->document_body, body);
+
+    if (deserializer->cursor < deserializer->end) {
+        VALUE inlined_partials = deserializer_read_value(deserializer);
+        if (inlined_partials != Qnil && !RB_TYPE_P(inlined_partials, T_HASH))
+            raise_invalid_dump("invalid inlined partials");
+        body->inlined_partials = inlined_partials;
+    }
+    while (deserializer->cursor < deserializer->end) {
+        rb_ary_push(body->constants, deserializer_read_value(deserializer));
+    }
+    return Qnil;
+}
+
+static document_body_entry_t load_dump(VALUE source, const uint8_t *data, size_t data_len, bool borrow, VALUE node_loader)
+{
+    document_body_dump_header_t header;
+    if (data_len < sizeof(header))
+        raise_invalid_dump("missing header");
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, DOCUMENT_BODY_DUMP_MAGIC, sizeof(header.magic)) != 0)
+        raise_invalid_dump("not a liquid-c document body");
+    if (header.version != DOCUMENT_BODY_DUMP_VERSION || header.byte_order != DOCUMENT_BODY_DUMP_BYTE_ORDER ||
+            header.instruction_set_fingerprint != vm_assembler_instruction_set_fingerprint())
+        raise_invalid_dump("dumped by an incompatible version of liquid-c");
+
+    size_t constants_start = sizeof(header) + header.buffer_bytes;
+    constants_start += (DOCUMENT_BODY_DUMP_ALIGNMENT - constants_start % DOCUMENT_BODY_DUMP_ALIGNMENT) % DOCUMENT_BODY_DUMP_ALIGNMENT;
+    if (constants_start > data_len || header.constants_bytes > data_len - constants_start)
+        raise_invalid_dump("truncated data");
+
+    VALUE self = document_body_new_instance();
+    document_body_t *body;
+    DocumentBody_Get_Struct(self, body);
+
+    const uint8_t *buffer_data = data + sizeof(header);
+    if (borrow) {
+        body->buffer = c_buffer_borrow(buffer_data, header.buffer_bytes);
+        body->buffer_owner = source;
+    } else {
+        c_buffer_write(&body->buffer, (void *)buffer_data, header.buffer_bytes);
+    }
+    validate_loaded_buffer(body, header.constants_len);
+
+    deserializer_t deserializer = {
+        .cursor = data + constants_start,
+        .end = data + constants_start + header.constants_bytes,
+        .document_body = self,
+        .node_loader = node_loader,
+    };
+    with_document_body_session(id_loading_document_body, self, load_constants, (VALUE)&deserializer);
+    if (RARRAY_LEN(body->constants) != header.constants_len)
+        raise_invalid_dump("constants count mismatch");
+    RB_GC_GUARD(source);
+
+    rb_obj_freeze(self);
+    return document_body_get_entry(self, header.root_offset);
+}
+
+/*
+ * Loads a dump from a String, which is copied, or from the offset of a
+ * Liquid::C::MappedFile, whose buffer is used in place and shared with
+ * other processes that map the same file.
+ */
+document_body_entry_t document_body_load(VALUE source, size_t offset, VALUE node_loader)
+{
+    if (rb_typeddata_is_kind_of(source, &mapped_file_data_type)) {
+        mapped_file_t *file;
+        MappedFile_Get_Struct(source, file);
+        if (offset > file->size)
+            rb_raise(rb_eArgError, "offset is past the end of the file");
+        if (offset % DOCUMENT_BODY_DUMP_ALIGNMENT != 0)
+            rb_raise(rb_eArgError, "offset must be a multiple of %d", DOCUMENT_BODY_DUMP_ALIGNMENT);
+        return load_dump(source, file->data + offset, file->size - offset, true, node_loader);
+    }
+
+    StringValue(source);
+    if (offset > (size_t)RSTRING_LEN(source))
+        rb_raise(rb_eArgError, "offset is past the end of the data");
+    // node loaders can't modify the data being loaded
+    source = rb_str_new_frozen(source);
+    const uint8_t *data = (const uint8_t *)RSTRING_PTR(source) + offset;
+    return load_dump(source, data, RSTRING_LEN(source) - offset, false, node_loader);
+}
+
 void liquid_define_document_body(void)
 {
+    id_dumping_document_body = rb_intern("__liquid_c_dumping_document_body");
+    id_loading_document_body = rb_intern("__liquid_c_loading_document_body");
+
     cLiquidCDocumentBody = rb_define_class_under(mLiquidC, "DocumentBody", rb_cObject);
     rb_global_variable(&cLiquidCDocumentBody);
     rb_define_alloc_func(cLiquidCDocumentBody, document_body_allocate);
@@ -3,6 +3,7 @@
 
 #include "c_buffer.h"
 #include "vm_assembler.h"
+#include "vm_optimizer.h"
 
 typedef struct block_body_header {
     uint32_t instructions_offset;
@@ -12,15 +13,24 @@ typedef struct block_body_header {
     uint32_t flags;
     uint32_t render_score;
     uint64_t max_stack_size;
+    // bitmask of the builtin_filters that were folded, in which case the block body
+    // from before they were folded follows it, see block_body_unfolded_header
+    uint64_t folded_filters;
 } block_body_header_t;
 
 #define BLOCK_BODY_HEADER_FLAG_BLANK (1 << 0)
 #define BLOCK_BODY_HEADER_BLANK_P(header) (header->flags & BLOCK_BODY_HEADER_FLAG_BLANK)
+// The output doesn't depend on the context and is the last constant of the block body
+#define BLOCK_BODY_HEADER_FLAG_CONSTANT_OUTPUT (1 << 1)
+#define BLOCK_BODY_HEADER_CONSTANT_OUTPUT_P(header) (header->flags & BLOCK_BODY_HEADER_FLAG_CONSTANT_OUTPUT)
 
 typedef struct document_body {
     VALUE self;
     VALUE constants;
     c_buffer_t buffer;
+    VALUE buffer_owner; // keeps a borrowed buffer alive
+    VALUE inlined_partials; // template name => source of the partials written into the block bodies, or nil
+    VALUE static_environment; // what the block bodies were specialized for, or nil
 } document_body_t;
 
 typedef struct document_body_entry {
@@ -28,9 +38,21 @@ typedef struct document_body_entry {
     size_t buffer_offset;
 } document_body_entry_t;
 
+extern const rb_data_type_t document_body_data_type;
+#define DocumentBody_Get_Struct(obj, sval) TypedData_Get_Struct(obj, document_body_t, &document_body_data_type, sval)
+
 void liquid_define_document_body(void);
 VALUE document_body_new_instance(void);
 document_body_entry_t document_body_write_block_body(VALUE self, bool blank, uint32_t render_score, vm_assembler_t *code);
+void document_body_write_unfolded_block_body(VALUE self, const document_body_entry_t *entry, vm_unfolded_instructions_t *unfolded);
+document_body_entry_t document_body_get_entry(VALUE self, uint32_t buffer_offset);
+void document_body_add_inlined_partial(VALUE self, VALUE template_name, VALUE source, document_body_t *partial_body);
+VALUE document_body_inlined_partials(document_body_t *body);
+
+VALUE document_body_dump(const document_body_entry_t *root, VALUE node_dumper);
+document_body_entry_t document_body_load(VALUE source, size_t offset, VALUE node_loader);
+VALUE document_body_dumping(void);
+VALUE document_body_loading(void);
 
 static inline void document_body_entry_mark(document_body_entry_t *entry)
 {
@@ -43,6 +65,20 @@ static inline block_body_header_t *document_body_get_block_body_header_ptr(const
     return (block_body_header_t *)(entry->body->buffer.data + entry->buffer_offset);
 }
 
+static inline size_t block_body_header_aligned_size(const block_body_header_t *header)
+{
+    size_t size = header->instructions_offset + header->instructions_bytes;
+    return (size + alignof(block_body_header_t) - 1) & ~(alignof(block_body_header_t) - 1);
+}
+
+// The block body to render when the strainer overrides one of the folded_filters,
+// which shares the constants of the block body it follows
+static inline block_body_header_t *block_body_unfolded_header(block_body_header_t *header)
+{
+    assert(header->folded_filters);
+    return (block_body_header_t *)((uint8_t *)header + block_body_header_aligned_size(header));
+}
+
 static inline const VALUE *document_body_get_constants_ptr(const document_body_entry_t *entry)
 {
     block_body_header_t *header = document_body_get_block_body_header_ptr(entry);
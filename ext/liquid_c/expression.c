@@ -3,6 +3,7 @@
 #include "parser.h"
 #include "liquid_vm.h"
 #include "expression.h"
+#include "serializer.h"
 
 VALUE cLiquidCExpression;
 
@@ -95,17 +96,38 @@ static VALUE expression_disassemble(VALUE self)
     expression_t *expression;
     Expression_Get_Struct(self, expression);
 
-    VALUE constants = rb_ary_new();
-    uint32_t constants_len = (uint32_t)(c_buffer_size(&expression->code.constants) / sizeof(VALUE));
-    rb_ary_cat(constants, (VALUE *)expression->code.constants.data, constants_len);
-
     return vm_assembler_disassemble(
         expression->code.instructions.data,
         expression->code.instructions.data_end,
-        &constants
+        (const VALUE *)expression->code.constants.data
     );
 }
 
+// Allows nodes referencing expressions to be serialized with Marshal
+static VALUE expression_marshal_dump(VALUE self, VALUE level)
+{
+    serializer_t serializer = { .output = rb_str_buf_new(64), .document_body = Qnil, .node_dumper = Qnil };
+    serializer_write_value(&serializer, self);
+    return serializer.output;
+}
+
+static VALUE expression_marshal_load(VALUE klass, VALUE data)
+{
+    StringValue(data);
+    data = rb_str_new_frozen(data);
+    deserializer_t deserializer = {
+        .cursor = (const uint8_t *)RSTRING_PTR(data),
+        .end = (const uint8_t *)RSTRING_END(data),
+        .document_body = Qnil,
+        .node_loader = Qnil,
+    };
+    VALUE expression = deserializer_read_value(&deserializer);
+    if (!rb_typeddata_is_kind_of(expression, &expression_data_type) || deserializer.cursor != deserializer.end)
+        raise_invalid_dump("invalid expression");
+    RB_GC_GUARD(data);
+    return expression;
+}
+
 void liquid_define_expression(void)
 {
     cLiquidCExpression = rb_define_class_under(mLiquidC, "Expression", rb_cObject);
@@ -113,4 +135,6 @@ void liquid_define_expression(void)
     rb_define_singleton_method(cLiquidCExpression, "strict_parse", expression_strict_parse, 1);
     rb_define_method(cLiquidCExpression, "evaluate", expression_evaluate, 1);
     rb_define_method(cLiquidCExpression, "disassemble", expression_disassemble, 0);
+    rb_define_method(cLiquidCExpression, "_dump", expression_marshal_dump, 1);
+    rb_define_singleton_method(cLiquidCExpression, "_load", expression_marshal_load, 1);
 }
@@ -20,7 +20,14 @@ else
   $CFLAGS << " -DNDEBUG"
 end
 
+# Use the switch statement instead of computed gotos for VM instruction dispatch,
+# e.g. to compare their performance with `rake benchmark:dispatch`
+unless ENV["LIQUID_C_SWITCH_DISPATCH"].to_s.empty?
+  $CFLAGS << " -DLIQUID_C_SWITCH_DISPATCH"
+end
+
 have_func "rb_hash_bulk_insert"
+have_header "sys/mman.h"
 
 $warnflags&.gsub!("-Wdeclaration-after-statement", "")
 create_makefile("liquid_c")
@@ -0,0 +1,266 @@
+#include "liquid.h"
+#include "for_loop.h"
+
+static VALUE cLiquidCForloopDrop, mLiquidUtils;
+static VALUE sym_for, sym_for_stack, str_forloop;
+static ID id_registers, id_aref, id_push, id_pop, id_to_a, id_to_i, id_to_integer, id_slice_collection,
+          id_ivar_this_stack_used;
+
+static void for_loop_mark(void *ptr)
+{
+    for_loop_t *loop = ptr;
+    rb_gc_mark(loop->name);
+    rb_gc_mark(loop->parentloop);
+    rb_gc_mark(loop->segment);
+    rb_gc_mark(loop->variable_name);
+    rb_gc_mark(loop->scope);
+    rb_gc_mark(loop->for_stack);
+    rb_gc_mark(loop->old_this_stack_used);
+}
+
+static size_t for_loop_memsize(const void *ptr)
+{
+    return sizeof(for_loop_t);
+}
+
+const rb_data_type_t for_loop_data_type = {
+    "liquid_for_loop",
+    { for_loop_mark, RUBY_TYPED_DEFAULT_FREE, for_loop_memsize, },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE registers_fetch(VALUE registers, VALUE key, VALUE (*init)(void))
+{
+    // equivalent to `registers[key] ||= init`
+    VALUE value = rb_funcall(registers, id_aref, 1, key);
+    if (!RTEST(value)) {
+        value = init();
+        rb_funcall(registers, id_aset, 2, key, value);
+    }
+    return value;
+}
+
+static VALUE to_integer(VALUE value)
+{
+    if (RB_INTEGER_TYPE_P(value))
+        return value;
+    return rb_funcall(mLiquidUtils, id_to_integer, 1, value);
+}
+
+// Equivalent to Liquid::Utils.slice_collection with a fast path for arrays
+static VALUE slice_collection(VALUE collection, VALUE from, VALUE to)
+{
+    if (RB_TYPE_P(collection, T_ARRAY) && RBASIC_CLASS(collection) == rb_cArray &&
+        RB_FIXNUM_P(from) && (to == Qnil || RB_FIXNUM_P(to)))
+    {
+        long length = RARRAY_LEN(collection);
+        long start = FIX2LONG(from);
+        long end = to == Qnil ? length : FIX2LONG(to);
+        if (start < 0)
+            start = 0;
+        if (end > length)
+            end = length;
+        if (end <= start)
+            return rb_ary_new();
+        return rb_ary_subseq(collection, start, end - start);
+    }
+
+    VALUE segment = rb_funcall(mLiquidUtils, id_slice_collection, 3, collection, from, to);
+    if (!RB_TYPE_P(segment, T_ARRAY))
+        segment = rb_convert_type(segment, T_ARRAY, "Array", "to_a");
+    return segment;
+}
+
+// Equivalent to Liquid::For#collection_segment with the tag's expressions already evaluated
+VALUE for_loop_collection_segment(context_t *context, VALUE collection, VALUE from, VALUE limit,
+                                  VALUE name, uint8_t flags)
+{
+    VALUE registers = rb_funcall(context->self, id_registers, 0);
+    VALUE offsets = registers_fetch(registers, sym_for, rb_hash_new);
+
+    if (flags & FOR_LOOP_OFFSET_CONTINUE) {
+        from = rb_funcall(offsets, id_aref, 1, name);
+        if (!RB_FIXNUM_P(from))
+            from = rb_funcall(from, id_to_i, 0);
+    } else if (from == Qnil) {
+        from = INT2FIX(0);
+    } else {
+        from = to_integer(from);
+    }
+
+    if (rb_obj_is_kind_of(collection, rb_cRange))
+        collection = rb_funcall(collection, id_to_a, 0);
+
+    VALUE to = Qnil;
+    if (limit != Qnil) {
+        limit = to_integer(limit);
+        if (RB_FIXNUM_P(limit) && RB_FIXNUM_P(from)) {
+            to = LONG2NUM(FIX2LONG(limit) + FIX2LONG(from));
+        } else {
+            to = rb_funcall(limit, '+', 1, from);
+        }
+    }
+
+    VALUE segment = slice_collection(collection, from, to);
+    if (flags & FOR_LOOP_REVERSED)
+        rb_ary_reverse(segment);
+
+    long length = RARRAY_LEN(segment);
+    VALUE offset = RB_FIXNUM_P(from) ? LONG2NUM(FIX2LONG(from) + length) : rb_funcall(from, '+', 1, LONG2NUM(length));
+    rb_funcall(offsets, id_aset, 2, name, offset);
+
+    return segment;
+}
+
+// Sets up the scope for the for loop like Liquid::For#render_segment
+// and returns the forloop drop used to iterate over the segment.
+VALUE for_loop_enter(context_t *context, VALUE segment, VALUE variable_name, VALUE name)
+{
+    VALUE registers = rb_funcall(context->self, id_registers, 0);
+    VALUE for_stack = registers_fetch(registers, sym_for_stack, rb_ary_new);
+    Check_Type(for_stack, T_ARRAY);
+
+    for_loop_t *loop;
+    VALUE loop_obj = TypedData_Make_Struct(cLiquidCForloopDrop, for_loop_t, &for_loop_data_type, loop);
+    loop->name = name;
+    long for_stack_size = RARRAY_LEN(for_stack);
+    loop->parentloop = for_stack_size ? RARRAY_AREF(for_stack, for_stack_size - 1) : Qnil;
+    loop->length = RARRAY_LEN(segment);
+    loop->index = 0;
+    loop->done = false;
+    loop->segment = segment;
+    loop->variable_name = variable_name;
+    loop->for_stack = for_stack;
+    loop->scope = Qnil;
+
+    // context.stack, where the scope is pushed when forloop is assigned
+    loop->old_this_stack_used = rb_ivar_get(context->self, id_ivar_this_stack_used);
+    rb_funcall(context->self, id_push, 0);
+    rb_ivar_set(context->self, id_ivar_this_stack_used, Qtrue);
+    loop->scope = RARRAY_AREF(context->scopes, 0);
+
+    rb_ary_push(for_stack, loop_obj);
+    rb_hash_aset(loop->scope, str_forloop, loop_obj);
+    context_invalidate_variable_cache(context);
+    return loop_obj;
+}
+
+void for_loop_exit(context_t *context, VALUE loop_obj)
+{
+    for_loop_t *loop = for_loop_ptr(loop_obj);
+    rb_ary_pop(loop->for_stack);
+    rb_funcall(context->self, id_pop, 0);
+    rb_ivar_set(context->self, id_ivar_this_stack_used, loop->old_this_stack_used);
+    context_invalidate_variable_cache(context);
+}
+
+// Returns a forloop drop that isn't used to iterate over a for tag's segment,
+// like the one Liquid::Render creates to render a partial for each item
+VALUE for_loop_new_drop(VALUE name, long length)
+{
+    for_loop_t *loop;
+    VALUE loop_obj = TypedData_Make_Struct(cLiquidCForloopDrop, for_loop_t, &for_loop_data_type, loop);
+    loop->name = name;
+    loop->parentloop = Qnil;
+    loop->length = length;
+    loop->index = 0;
+    loop->done = false;
+    loop->segment = Qnil;
+    loop->variable_name = Qnil;
+    loop->scope = Qnil;
+    loop->for_stack = Qnil;
+    loop->old_this_stack_used = Qnil;
+    return loop_obj;
+}
+
+static for_loop_t *for_loop_get_struct(VALUE self)
+{
+    for_loop_t *loop;
+    TypedData_Get_Struct(self, for_loop_t, &for_loop_data_type, loop);
+    return loop;
+}
+
+static VALUE forloop_drop_name(VALUE self)
+{
+    return for_loop_get_struct(self)->name;
+}
+
+static VALUE forloop_drop_length(VALUE self)
+{
+    return LONG2NUM(for_loop_get_struct(self)->length);
+}
+
+static VALUE forloop_drop_parentloop(VALUE self)
+{
+    return for_loop_get_struct(self)->parentloop;
+}
+
+static VALUE forloop_drop_index(VALUE self)
+{
+    return LONG2NUM(for_loop_get_struct(self)->index + 1);
+}
+
+static VALUE forloop_drop_index0(VALUE self)
+{
+    return LONG2NUM(for_loop_get_struct(self)->index);
+}
+
+static VALUE forloop_drop_rindex(VALUE self)
+{
+    for_loop_t *loop = for_loop_get_struct(self);
+    return LONG2NUM(loop->length - loop->index);
+}
+
+static VALUE forloop_drop_rindex0(VALUE self)
+{
+    for_loop_t *loop = for_loop_get_struct(self);
+    return LONG2NUM(loop->length - loop->index - 1);
+}
+
+static VALUE forloop_drop_first(VALUE self)
+{
+    return for_loop_get_struct(self)->index == 0 ? Qtrue : Qfalse;
+}
+
+static VALUE forloop_drop_last(VALUE self)
+{
+    for_loop_t *loop = for_loop_get_struct(self);
+    return loop->index == loop->length - 1 ? Qtrue : Qfalse;
+}
+
+void liquid_define_for_loop(void)
+{
+    id_registers = rb_intern("registers");
+    id_aref = rb_intern("[]");
+    id_push = rb_intern("push");
+    id_pop = rb_intern("pop");
+    id_to_a = rb_intern("to_a");
+    id_to_i = rb_intern("to_i");
+    id_to_integer = rb_intern("to_integer");
+    id_slice_collection = rb_intern("slice_collection");
+    id_ivar_this_stack_used = rb_intern("@this_stack_used");
+
+    sym_for = ID2SYM(rb_intern("for"));
+    sym_for_stack = ID2SYM(rb_intern("for_stack"));
+
+    str_forloop = rb_obj_freeze(rb_str_new_cstr("forloop"));
+    rb_global_variable(&str_forloop);
+
+    mLiquidUtils = rb_const_get(mLiquid, rb_intern("Utils"));
+    rb_global_variable(&mLiquidUtils);
+
+    VALUE cLiquidForloopDrop = rb_const_get(mLiquid, rb_intern("ForloopDrop"));
+    cLiquidCForloopDrop = rb_define_class_under(mLiquidC, "ForloopDrop", cLiquidForloopDrop);
+    rb_global_variable(&cLiquidCForloopDrop);
+    rb_undef_alloc_func(cLiquidCForloopDrop);
+
+    rb_define_method(cLiquidCForloopDrop, "name", forloop_drop_name, 0);
+    rb_define_method(cLiquidCForloopDrop, "length", forloop_drop_length, 0);
+    rb_define_method(cLiquidCForloopDrop, "parentloop", forloop_drop_parentloop, 0);
+    rb_define_method(cLiquidCForloopDrop, "index", forloop_drop_index, 0);
+    rb_define_method(cLiquidCForloopDrop, "index0", forloop_drop_index0, 0);
+    rb_define_method(cLiquidCForloopDrop, "rindex", forloop_drop_rindex, 0);
+    rb_define_method(cLiquidCForloopDrop, "rindex0", forloop_drop_rindex0, 0);
+    rb_define_method(cLiquidCForloopDrop, "first", forloop_drop_first, 0);
+    rb_define_method(cLiquidCForloopDrop, "last", forloop_drop_last, 0);
+}
@@ -0,0 +1,41 @@
+#if !defined(LIQUID_FOR_LOOP_H)
+#define LIQUID_FOR_LOOP_H
+
+#include "liquid.h"
+#include "context.h"
+
+// Flags for the OP_FOR_INIT instruction
+#define FOR_LOOP_REVERSED 0x1
+#define FOR_LOOP_OFFSET_CONTINUE 0x2
+
+// Liquid::C::ForloopDrop, which also holds the iteration state of the for loop
+typedef struct for_loop {
+    VALUE name;
+    VALUE parentloop;
+    long length;
+    long index; // forloop.index0, so the other properties are computed from it on demand
+    bool done;
+
+    VALUE segment;
+    VALUE variable_name;
+    VALUE scope;
+    VALUE for_stack;
+    VALUE old_this_stack_used;
+} for_loop_t;
+
+extern const rb_data_type_t for_loop_data_type;
+
+void liquid_define_for_loop(void);
+VALUE for_loop_collection_segment(context_t *context, VALUE collection, VALUE from, VALUE limit,
+                                  VALUE name, uint8_t flags);
+VALUE for_loop_enter(context_t *context, VALUE segment, VALUE variable_name, VALUE name);
+void for_loop_exit(context_t *context, VALUE loop_obj);
+VALUE for_loop_new_drop(VALUE name, long length);
+
+static inline for_loop_t *for_loop_ptr(VALUE loop_obj)
+{
+    // only created internally, so safe to unwrap without type checking
+    return DATA_PTR(loop_obj);
+}
+
+#endif
@@ -12,11 +12,20 @@
 #include "parse_context.h"
 #include "variable_lookup.h"
 #include "vm_assembler_pool.h"
+#include "vm_optimizer.h"
+#include "standard_filters.h"
+#include "serializer.h"
+#include "mapped_file.h"
 #include "liquid_vm.h"
+#include "vm_stats.h"
 #include "usage.h"
+#include "condition.h"
+#include "for_loop.h"
+#include "partial.h"
 
 ID id_evaluate;
 ID id_to_liquid;
+ID id_to_liquid_value;
 ID id_to_s;
 ID id_call;
 ID id_compile_evaluate;
@@ -38,6 +47,7 @@ RUBY_FUNC_EXPORTED void Init_liquid_c(void)
 {
     id_evaluate = rb_intern("evaluate");
     id_to_liquid = rb_intern("to_liquid");
+    id_to_liquid_value = rb_intern("to_liquid_value");
     id_to_s = rb_intern("to_s");
     id_call = rb_intern("call");
     id_compile_evaluate = rb_intern("compile_evaluate");
@@ -82,6 +92,8 @@ RUBY_FUNC_EXPORTED void Init_liquid_c(void)
     liquid_define_resource_limits();
     liquid_define_expression();
     liquid_define_variable();
+    liquid_define_serializer();
+    liquid_define_mapped_file();
     liquid_define_document_body();
     liquid_define_block_body();
     liquid_define_context();
@@ -89,7 +101,13 @@ RUBY_FUNC_EXPORTED void Init_liquid_c(void)
     liquid_define_variable_lookup();
     liquid_define_vm_assembler_pool();
     liquid_define_vm_assembler();
+    liquid_define_vm_optimizer();
+    liquid_define_standard_filters();
     liquid_define_vm();
+    liquid_define_vm_stats();
     liquid_define_usage();
+    liquid_define_condition();
+    liquid_define_for_loop();
+    liquid_define_partial();
 }
 
@@ -5,32 +5,45 @@
 #include "liquid_vm.h"
 #include "variable_lookup.h"
 #include "intutil.h"
+#include "number_format.h"
+#include "vm_stats.h"
 #include "document_body.h"
+#include "condition.h"
+#include "for_loop.h"
+#include "partial.h"
 
 ID id_render_node;
 ID id_vm;
+static ID id_line_number, id_blank_p, id_ivar_chunk_size, id_write_chunk;
+static ID id_ivar_profiler, id_template_name, id_raw, id_c_profile_start_node, id_c_profile_end_node, id_c_profile_render_node;
+static ID id_profile_compiled_nodes;
 
-static VALUE cLiquidCVM;
+static VALUE cLiquidCVM, cLiquidCStreamBuffer, cLiquidBreakInterrupt;
 
 static void vm_mark(void *ptr)
 {
     vm_t *vm = ptr;
 
     c_buffer_rb_gc_mark(&vm->stack);
+    c_buffer_rb_gc_mark(&vm->for_loops);
     context_mark(&vm->context);
+    rb_gc_mark(vm->stream.output);
+    rb_gc_mark(vm->profiler);
+    rb_gc_mark(vm->partials);
 }
 
 static void vm_free(void *ptr)
 {
     vm_t *vm = ptr;
     c_buffer_free(&vm->stack);
+    c_buffer_free(&vm->for_loops);
     xfree(vm);
 }
 
 static size_t vm_memsize(const void *ptr)
 {
     const vm_t *vm = ptr;
-    return sizeof(vm_t) + c_buffer_capacity(&vm->stack);
+    return sizeof(vm_t) + c_buffer_capacity(&vm->stack) + c_buffer_capacity(&vm->for_loops);
 }
 
 const rb_data_type_t vm_data_type = {
@@ -44,8 +57,13 @@ static VALUE vm_internal_new(VALUE context)
     vm_t *vm;
     VALUE obj = TypedData_Make_Struct(cLiquidCVM, vm_t, &vm_data_type, vm);
     vm->stack = c_buffer_init();
+    vm->for_loops = c_buffer_init();
 
     vm->invoking_filter = false;
+    vm->stream.output = Qnil;
+    vm->profiler = Qnil;
+    vm->partials = Qnil;
+    vm->rendering = false;
 
     context_internal_init(context, &vm->context);
 
@@ -63,33 +81,24 @@ vm_t *vm_from_context(VALUE context)
     return DATA_PTR(vm_obj);
 }
 
-bool liquid_vm_filtering(VALUE context)
+// Returns NULL if the VM hasn't been created for the context
+vm_t *vm_from_context_if_created(VALUE context)
 {
     VALUE vm_obj = rb_attr_get(context, id_vm);
-    if (vm_obj == Qnil)
-        return false;
-    vm_t *vm = DATA_PTR(vm_obj);
-    return vm->invoking_filter;
+    return vm_obj == Qnil ? NULL : DATA_PTR(vm_obj);
 }
 
-static void write_fixnum(VALUE output, VALUE fixnum)
+bool liquid_vm_filtering(VALUE context)
 {
-    long long number = RB_NUM2LL(fixnum);
-    int write_length = snprintf(NULL, 0, "%lld", number);
-    long old_size = RSTRING_LEN(output);
-    long new_size = old_size + write_length;
-    long capacity = rb_str_capacity(output);
-
-    if (new_size > capacity) {
-        capacity *= 2;
-        if (new_size > capacity) {
-            capacity = new_size;
-        }
-        rb_str_resize(output, capacity);
-    }
-    rb_str_set_len(output, new_size);
+    vm_t *vm = vm_from_context_if_created(context);
+    return vm && vm->invoking_filter;
+}
 
-    snprintf(RSTRING_PTR(output) + old_size, write_length + 1, "%lld", number);
+static void write_fixnum(VALUE output, VALUE fixnum)
+{
+    char buf[NUMBER_FORMAT_BUFFER_SIZE];
+    int length = format_long_long(RB_NUM2LL(fixnum), buf);
+    rb_str_buf_cat(output, buf, length);
 }
 
 static VALUE obj_to_s(VALUE obj)
@@ -106,6 +115,16 @@ static VALUE obj_to_s(VALUE obj)
 static void write_obj(VALUE output, VALUE obj)
 {
     switch (TYPE(obj)) {
+        case T_FLOAT:
+        {
+            char buf[NUMBER_FORMAT_BUFFER_SIZE];
+            int length = format_double(RFLOAT_VALUE(obj), buf);
+            if (RB_LIKELY(length >= 0)) {
+                rb_str_buf_cat(output, buf, length);
+                break;
+            }
+            // fallthrough for values that need Float#to_s
+        }
         default:
             obj = obj_to_s(obj);
             // fallthrough
@@ -129,6 +148,15 @@ static void write_obj(VALUE output, VALUE obj)
                 }
             }
             break;
+        case T_SYMBOL:
+            rb_str_buf_append(output, rb_sym2str(obj));
+            break;
+        case T_TRUE:
+            rb_str_buf_cat(output, "true", 4);
+            break;
+        case T_FALSE:
+            rb_str_buf_cat(output, "false", 5);
+            break;
         case T_NIL:
             break;
     }
@@ -191,6 +219,36 @@ static VALUE vm_invoke_filter(vm_t *vm, VALUE filter_name, size_t num_args)
     return rb_funcall(result, id_to_liquid, 0);
 }
 
+static VALUE stream_buffer_write_chunk(VALUE chunk)
+{
+    VALUE *output = (VALUE *)chunk;
+    return rb_funcall(output[0], id_write_chunk, 1, output[1]);
+}
+
+// Moves the buffered output to a new string which is passed to the
+// Liquid::C::StreamBuffer#write_chunk method, keeping the buffer's capacity.
+static void vm_stream_flush(vm_t *vm, VALUE output)
+{
+    long size = RSTRING_LEN(output);
+    VALUE args[2] = { output, rb_enc_str_new(RSTRING_PTR(output), size, utf8_encoding) };
+    rb_str_set_len(output, 0);
+    // keeps counting the flushed output towards the render length limit
+    vm->context.resource_limits->flushed_output_length += size;
+
+    int state;
+    rb_protect(stream_buffer_write_chunk, (VALUE)args, &state);
+    if (state) {
+        vm->stream.failed = true;
+        rb_jump_tag(state);
+    }
+}
+
+static inline void vm_stream_flush_point(vm_t *vm, VALUE output)
+{
+    if (RB_UNLIKELY(output == vm->stream.output) && RSTRING_LEN(output) >= vm->stream.chunk_size)
+        vm_stream_flush(vm, output);
+}
+
 typedef struct vm_render_until_error_args {
     vm_t *vm;
     const uint8_t *ip; // use for initial address and to save an address for rescuing
@@ -199,8 +257,49 @@ typedef struct vm_render_until_error_args {
     /* rendering fields */
     VALUE output;
     const uint8_t *node_line_number;
+    VALUE tag_node; // compiled tag being rendered or Qnil, used by vm_render_rescue
+    bool capturing; // restore old_capture_length if rescued while rendering a capture body
+    long old_capture_length;
+    // Liquid::Profiler timings started by this block body that haven't ended, or Qfalse
+    VALUE variable_timing;
+    VALUE tag_timing;
 } vm_render_until_error_args_t;
 
+/*
+ * Compiled variables and tags are timed for the Liquid::Profiler of the
+ * context like Liquid::BlockBody#render_node would. Since the VM doesn't
+ * render each node in a block, Liquid::BlockBody.c_profile_start_node and
+ * c_profile_end_node are called around them instead. Variables are
+ * identified by their line number, since their markup isn't kept after
+ * compiling them.
+ */
+static VALUE vm_profile_start(vm_t *vm, VALUE code, VALUE line_number)
+{
+    VALUE template_name = rb_funcall(vm->context.self, id_template_name, 0);
+    return rb_funcall(cLiquidBlockBody, id_c_profile_start_node, 4, vm->profiler, template_name, code, line_number);
+}
+
+static void vm_profile_end(vm_t *vm, VALUE *timing)
+{
+    VALUE started = *timing;
+    *timing = Qfalse;
+    rb_funcall(cLiquidBlockBody, id_c_profile_end_node, 2, vm->profiler, started);
+}
+
+static void vm_profile_start_variable(vm_t *vm, vm_render_until_error_args_t *args)
+{
+    unsigned int line_number = bytes_to_uint24(args->node_line_number);
+    args->variable_timing = vm_profile_start(vm, Qnil, line_number != 0 ? UINT2NUM(line_number) : Qnil);
+}
+
+static void vm_profile_end_all(vm_t *vm, vm_render_until_error_args_t *args)
+{
+    if (args->variable_timing)
+        vm_profile_end(vm, &args->variable_timing);
+    if (args->tag_timing)
+        vm_profile_end(vm, &args->tag_timing);
+}
+
 static VALUE raise_invalid_integer(VALUE unused_arg, VALUE exc)
 {
     rb_raise(cLiquidArgumentError, "invalid integer");
@@ -237,6 +336,131 @@ static void hash_bulk_insert(long argc, const VALUE *argv, VALUE hash)
 }
 #endif
 
+static void vm_render(vm_t *vm, block_body_header_t *body, const VALUE *const_ptr, VALUE output);
+
+static inline VALUE vm_current_for_loop(vm_t *vm)
+{
+    assert(c_buffer_size(&vm->for_loops) >= sizeof(VALUE));
+    return ((VALUE *)vm->for_loops.data_end)[-1];
+}
+
+static VALUE vm_pop_for_loop(vm_t *vm)
+{
+    VALUE loop_obj = vm_current_for_loop(vm);
+    vm->for_loops.data_end -= sizeof(VALUE);
+    for_loop_exit(&vm->context, loop_obj);
+    return loop_obj;
+}
+
+// Exits the for loops left from an exception, like the ensure
+// blocks in Liquid::For#render_segment would
+static void vm_unwind_for_loops(vm_t *vm, size_t old_for_loops_byte_size)
+{
+    while (c_buffer_size(&vm->for_loops) > old_for_loops_byte_size) {
+        vm_pop_for_loop(vm);
+    }
+}
+
+static void vm_render_block_body(vm_t *vm, VALUE block_body_obj, VALUE output)
+{
+    // type and compilation were checked when the instruction was added
+    block_body_t *body = DATA_PTR(block_body_obj);
+    document_body_entry_t *entry = &body->as.compiled.document_body_entry;
+    vm_render(vm, document_body_get_block_body_header_ptr(entry), document_body_get_constants_ptr(entry), output);
+}
+
+/*
+ * The instruction dispatch in vm_render_until_error uses a jump table of
+ * label addresses (direct threading) when the compiler supports it, so
+ * each instruction ends with its own indirect branch to the next one
+ * instead of sharing the switch statement's branch. The switch is still
+ * used to enter the loop and is the fallback for other compilers or
+ * when LIQUID_C_SWITCH_DISPATCH is defined.
+ */
+#if defined(__GNUC__) && !defined(LIQUID_C_SWITCH_DISPATCH)
+#define VM_DIRECT_THREADED 1
+#define VM_CASE(op) label_##op: case op:
+#define VM_DEFAULT() label_invalid_opcode: default:
+#define VM_NEXT() goto *dispatch[*ip++]
+#define VM_DISPATCH_TABLE_ENTRY(op) [op] = &&label_##op
+// the opcode entries override the default entry for invalid opcodes
+#if defined(__clang__)
+#define VM_DISPATCH_TABLE_BEGIN \
+    _Pragma("clang diagnostic push") \
+    _Pragma("clang diagnostic ignored \"-Winitializer-overrides\"")
+#define VM_DISPATCH_TABLE_END _Pragma("clang diagnostic pop")
+#else
+#define VM_DISPATCH_TABLE_BEGIN \
+    _Pragma("GCC diagnostic push") \
+    _Pragma("GCC diagnostic ignored \"-Woverride-init\"")
+#define VM_DISPATCH_TABLE_END _Pragma("GCC diagnostic pop")
+#endif
+#else
+#define VM_DIRECT_THREADED 0
+#define VM_CASE(op) case op:
+#define VM_DEFAULT() default:
+#define VM_NEXT() break
+#endif
+
+static int assign_score_of_hash_entry(VALUE key, VALUE value, VALUE sum_ptr);
+
+// Equivalent to Liquid::Assign#assign_score_of
+static long assign_score_of(VALUE value)
+{
+    if (RB_SPECIAL_CONST_P(value))
+        return 1;
+
+    VALUE klass = RBASIC_CLASS(value);
+    if (klass == rb_cString)
+        return RSTRING_LEN(value);
+
+    if (klass == rb_cArray || klass == rb_cHash) {
+        if (ruby_stack_check())
+            rb_raise(rb_eSysStackError, "stack level too deep");
+
+        long sum = 1;
+        if (klass == rb_cArray) {
+            for (long i = 0; i < RARRAY_LEN(value); i++) {
+                sum += assign_score_of(RARRAY_AREF(value, i));
+            }
+        } else {
+            rb_hash_foreach(value, assign_score_of_hash_entry, (VALUE)&sum);
+        }
+        return sum;
+    }
+    return 1;
+}
+
+static int assign_score_of_hash_entry(VALUE key, VALUE value, VALUE sum_ptr)
+{
+    long *sum = (long *)sum_ptr;
+    *sum += assign_score_of(key);
+    *sum += assign_score_of(value);
+    return ST_CONTINUE;
+}
+
+// Equivalent to `context.scopes.last[key] = value`
+static void vm_assign(vm_t *vm, VALUE key, VALUE value)
+{
+    VALUE scopes = vm->context.scopes;
+    VALUE scope = RARRAY_AREF(scopes, RARRAY_LEN(scopes) - 1);
+    if (RB_TYPE_P(scope, T_HASH)) {
+        context_hash_aset(&vm->context, scope, key, value);
+    } else {
+        rb_funcall(scope, id_aset, 2, key, value);
+        context_invalidate_variable_cache(&vm->context);
+    }
+}
+
+// Writes the result of a variable render, like the end of Liquid::Variable#render_to_output_buffer
+static inline void vm_write_variable(vm_t *vm, VALUE output, VALUE value)
+{
+    if (vm->context.global_filter != Qnil)
+        value = rb_funcall(vm->context.global_filter, id_call, 1, value);
+    write_obj(output, value);
+    resource_limits_increment_write_score(vm->context.resource_limits, output);
+}
+
 // Actually returns a bool resume_rendering value
 static VALUE vm_render_until_error(VALUE uncast_args)
 {
@@ -249,76 +473,134 @@ static VALUE vm_render_until_error(VALUE uncast_args)
     VALUE constant = Qnil;
     args->ip = NULL; // used by vm_render_rescue, NULL to indicate that it isn't in a rescue block
 
+#if VM_DIRECT_THREADED
+    VM_DISPATCH_TABLE_BEGIN
+    static const void *const dispatch_table[256] = {
+        [0 ... 255] = &&label_invalid_opcode,
+        VM_DISPATCH_TABLE_ENTRY(OP_LEAVE),
+        VM_DISPATCH_TABLE_ENTRY(OP_WRITE_RAW_W),
+        VM_DISPATCH_TABLE_ENTRY(OP_WRITE_NODE),
+        VM_DISPATCH_TABLE_ENTRY(OP_POP_WRITE),
+        VM_DISPATCH_TABLE_ENTRY(OP_PUSH_CONST),
+        VM_DISPATCH_TABLE_ENTRY(OP_PUSH_NIL),
+        VM_DISPATCH_TABLE_ENTRY(OP_PUSH_TRUE),
+        VM_DISPATCH_TABLE_ENTRY(OP_PUSH_FALSE),
+        VM_DISPATCH_TABLE_ENTRY(OP_PUSH_INT8),
+        VM_DISPATCH_TABLE_ENTRY(OP_PUSH_INT16),
+        VM_DISPATCH_TABLE_ENTRY(OP_FIND_STATIC_VAR),
+        VM_DISPATCH_TABLE_ENTRY(OP_FIND_VAR),
+        VM_DISPATCH_TABLE_ENTRY(OP_LOOKUP_CONST_KEY),
+        VM_DISPATCH_TABLE_ENTRY(OP_LOOKUP_KEY),
+        VM_DISPATCH_TABLE_ENTRY(OP_LOOKUP_COMMAND),
+        VM_DISPATCH_TABLE_ENTRY(OP_NEW_INT_RANGE),
+        VM_DISPATCH_TABLE_ENTRY(OP_HASH_NEW),
+        VM_DISPATCH_TABLE_ENTRY(OP_FILTER),
+        VM_DISPATCH_TABLE_ENTRY(OP_BUILTIN_FILTER),
+        VM_DISPATCH_TABLE_ENTRY(OP_RENDER_VARIABLE_RESCUE),
+        VM_DISPATCH_TABLE_ENTRY(OP_WRITE_RAW),
+        VM_DISPATCH_TABLE_ENTRY(OP_JUMP_FWD_W),
+        VM_DISPATCH_TABLE_ENTRY(OP_JUMP_FWD),
+        VM_DISPATCH_TABLE_ENTRY(OP_RENDER_TAG_RESCUE),
+        VM_DISPATCH_TABLE_ENTRY(OP_END_TAG),
+        VM_DISPATCH_TABLE_ENTRY(OP_COMPARE),
+        VM_DISPATCH_TABLE_ENTRY(OP_JUMP),
+        VM_DISPATCH_TABLE_ENTRY(OP_JUMP_IF_FALSE),
+        VM_DISPATCH_TABLE_ENTRY(OP_JUMP_IF_TRUE),
+        VM_DISPATCH_TABLE_ENTRY(OP_RENDER_BODY),
+        VM_DISPATCH_TABLE_ENTRY(OP_FOR_INIT),
+        VM_DISPATCH_TABLE_ENTRY(OP_FOR_NEXT),
+        VM_DISPATCH_TABLE_ENTRY(OP_FOR_END),
+        VM_DISPATCH_TABLE_ENTRY(OP_ASSIGN),
+        VM_DISPATCH_TABLE_ENTRY(OP_CAPTURE),
+        VM_DISPATCH_TABLE_ENTRY(OP_CASE_DISPATCH),
+        VM_DISPATCH_TABLE_ENTRY(OP_RENDER_PARTIAL),
+        VM_DISPATCH_TABLE_ENTRY(OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY),
+        VM_DISPATCH_TABLE_ENTRY(OP_WRITE_STATIC_VAR),
+        VM_DISPATCH_TABLE_ENTRY(OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY),
+    };
+    VM_DISPATCH_TABLE_END
+    // Records VM stats before going to the instruction
+    static const void *const stats_dispatch_table[256] = { [0 ... 255] = &&label_vm_stats };
+    const void *const *dispatch = vm_stats_enabled ? stats_dispatch_table : dispatch_table;
+#endif
+    vm_stats_position_t stats_caller = vm_stats_position;
+
     while (true) {
+        if (RB_UNLIKELY(vm_stats_enabled))
+            vm_stats_record(ip, constants);
         switch (*ip++) {
-            case OP_LEAVE:
+            VM_CASE(OP_LEAVE)
+                if (RB_UNLIKELY(vm_stats_enabled))
+                    vm_stats_leave(stats_caller);
                 return false;
-            case OP_PUSH_NIL:
+            VM_CASE(OP_PUSH_NIL)
                 vm_stack_push(vm, Qnil);
-                break;
-            case OP_PUSH_TRUE:
+                VM_NEXT();
+            VM_CASE(OP_PUSH_TRUE)
                 vm_stack_push(vm, Qtrue);
-                break;
-            case OP_PUSH_FALSE:
+                VM_NEXT();
+            VM_CASE(OP_PUSH_FALSE)
                 vm_stack_push(vm, Qfalse);
-                break;
-            case OP_PUSH_INT8:
+                VM_NEXT();
+            VM_CASE(OP_PUSH_INT8)
             {
                 int num = *(int8_t *)ip++; // signed
                 vm_stack_push(vm, RB_INT2FIX(num));
-                break;
+                VM_NEXT();
             }
-            case OP_PUSH_INT16:
+            VM_CASE(OP_PUSH_INT16)
             {
                 int num = *(int8_t *)ip++; // big endian encoding, so first byte has sign
                 num = (num << 8) | *ip++;
                 vm_stack_push(vm, RB_INT2FIX(num));
-                break;
+                VM_NEXT();
             }
-            case OP_FIND_STATIC_VAR:
+            VM_CASE(OP_FIND_STATIC_VAR)
             {
                 constant_index = (ip[0] << 8) | ip[1];
                 constant = constants[constant_index];
                 ip += 2;
-                VALUE value = context_find_variable(&vm->context, constant, Qtrue);
+                VALUE value = context_find_static_variable(&vm->context, constant);
                 vm_stack_push(vm, value);
-                break;
+                VM_NEXT();
             }
-            case OP_FIND_VAR:
+            VM_CASE(OP_FIND_VAR)
             {
                 VALUE key = vm_stack_pop(vm);
                 VALUE value = context_find_variable(&vm->context, key, Qtrue);
                 vm_stack_push(vm, value);
-                break;
+                VM_NEXT();
             }
-            case OP_LOOKUP_CONST_KEY:
-            case OP_LOOKUP_COMMAND:
+            VM_CASE(OP_LOOKUP_CONST_KEY)
+            VM_CASE(OP_LOOKUP_COMMAND)
             {
+                bool is_command = ip[-1] == OP_LOOKUP_COMMAND;
                 constant_index = (ip[0] << 8) | ip[1];
                 constant = constants[constant_index];
                 ip += 2;
-                vm_stack_push(vm, constant);
+                VALUE object = vm_stack_pop(vm);
+                VALUE result = variable_lookup_const_key(vm->context.self, object, constant, is_command);
+                vm_stack_push(vm, result);
+                VM_NEXT();
             }
-            /* fallthrough */
-            case OP_LOOKUP_KEY:
+            VM_CASE(OP_LOOKUP_KEY)
             {
-                bool is_command = ip[-3] == OP_LOOKUP_COMMAND;
                 VALUE key = vm_stack_pop(vm);
                 VALUE object = vm_stack_pop(vm);
-                VALUE result = variable_lookup_key(vm->context.self, object, key, is_command);
+                VALUE result = variable_lookup_key(vm->context.self, object, key, false);
                 vm_stack_push(vm, result);
-                break;
+                VM_NEXT();
             }
 
-            case OP_NEW_INT_RANGE:
+            VM_CASE(OP_NEW_INT_RANGE)
             {
                 VALUE end = range_value_to_integer(vm_stack_pop(vm));
                 VALUE begin = range_value_to_integer(vm_stack_pop(vm));
                 bool exclude_end = false;
                 vm_stack_push(vm, rb_range_new(begin, end, exclude_end));
-                break;
+                VM_NEXT();
             }
-            case OP_HASH_NEW:
+            VM_CASE(OP_HASH_NEW)
             {
                 size_t hash_size = *ip++;
                 size_t num_keys_and_values = hash_size * 2;
@@ -329,10 +611,10 @@ static VALUE vm_render_until_error(VALUE uncast_args)
                 vm_stack_pop_n(vm, num_keys_and_values);
 
                 vm_stack_push(vm, hash);
-                break;
+                VM_NEXT();
             }
-            case OP_FILTER:
-            case OP_BUILTIN_FILTER:
+            VM_CASE(OP_FILTER)
+            VM_CASE(OP_BUILTIN_FILTER)
             {
                 VALUE filter_name;
                 unsigned long num_args;
@@ -345,19 +627,32 @@ static VALUE vm_render_until_error(VALUE uncast_args)
                     ip += 2;
                 } else {
                     assert(ip[-1] == OP_BUILTIN_FILTER);
-                    filter_name = builtin_filters[*ip++].sym;
+                    uint8_t filter_index = *ip++;
                     num_args = *ip++; // includes input argument
+
+                    if (vm->context.native_filters & (UINT64_C(1) << filter_index)) {
+                        // arguments are left on the stack to keep them from being garbage collected
+                        vm->invoking_filter = true;
+                        VALUE result = builtin_filters[filter_index].native((int)num_args, vm_stack_peek_n(vm, num_args));
+                        vm->invoking_filter = false;
+                        if (result != Qundef) {
+                            vm_stack_pop_n(vm, num_args);
+                            vm_stack_push(vm, result);
+                            VM_NEXT();
+                        }
+                    }
+                    filter_name = builtin_filters[filter_index].sym;
                 }
 
                 VALUE result = vm_invoke_filter(vm, filter_name, num_args);
                 vm_stack_push(vm, result);
-                break;
+                VM_NEXT();
             }
 
             // Rendering instructions
 
-            case OP_WRITE_RAW_W:
-            case OP_WRITE_RAW:
+            VM_CASE(OP_WRITE_RAW_W)
+            VM_CASE(OP_WRITE_RAW)
             {
                 const char *text;
                 size_t size;
@@ -372,66 +667,296 @@ static VALUE vm_render_until_error(VALUE uncast_args)
                 }
                 rb_str_cat(output, text, size);
                 resource_limits_increment_write_score(vm->context.resource_limits, output);
-                break;
+                vm_stream_flush_point(vm, output);
+                VM_NEXT();
             }
-            case OP_JUMP_FWD_W:
+            VM_CASE(OP_JUMP_FWD_W)
             {
                 size_t size = bytes_to_uint24(ip);
                 ip += 3 + size;
-                break;
+                VM_NEXT();
             }
 
-            case OP_JUMP_FWD:
+            VM_CASE(OP_JUMP_FWD)
             {
                 uint8_t size = *ip;
                 ip += 1 + size;
-                break;
+                VM_NEXT();
             }
 
-            case OP_PUSH_CONST:
+            VM_CASE(OP_PUSH_CONST)
             {
                 constant_index = (ip[0] << 8) | ip[1];
                 constant = constants[constant_index];
                 ip += 2;
                 vm_stack_push(vm, constant);
-                break;
+                VM_NEXT();
             }
 
-            case OP_WRITE_NODE:
+            VM_CASE(OP_WRITE_NODE)
             {
                 constant_index = (ip[0] << 8) | ip[1];
                 constant = constants[constant_index];
                 ip += 2;
-                rb_funcall(cLiquidBlockBody, id_render_node, 3, vm->context.self, output, constant);
+                if (RB_UNLIKELY(vm->profiler != Qnil)) {
+                    rb_funcall(cLiquidBlockBody, id_c_profile_render_node, 3, vm->context.self, output, constant);
+                } else {
+                    rb_funcall(cLiquidBlockBody, id_render_node, 3, vm->context.self, output, constant);
+                }
+                // the tag could have changed the scopes or environments
+                context_invalidate_variable_cache(&vm->context);
 
                 if (RARRAY_LEN(vm->context.interrupts)) {
                     return false;
                 }
 
                 resource_limits_increment_write_score(vm->context.resource_limits, output);
-                break;
+                vm_stream_flush_point(vm, output);
+                VM_NEXT();
             }
-            case OP_RENDER_VARIABLE_RESCUE:
+            VM_CASE(OP_RENDER_VARIABLE_RESCUE)
                 // Save state used by vm_render_rescue to rescue from a variable rendering exception
                 args->node_line_number = ip;
                 // vm_render_rescue will iterate from this instruction to the instruction
                 // following OP_POP_WRITE_VARIABLE to resume rendering from
                 ip += 3;
                 args->ip = ip;
-                break;
-            case OP_POP_WRITE:
+                if (RB_UNLIKELY(vm->profiler != Qnil))
+                    vm_profile_start_variable(vm, args);
+                VM_NEXT();
+            VM_CASE(OP_POP_WRITE)
             {
                 VALUE var_result = vm_stack_pop(vm);
-                if (vm->context.global_filter != Qnil)
-                    var_result = rb_funcall(vm->context.global_filter, id_call, 1, var_result);
-                write_obj(output, var_result);
+                vm_write_variable(vm, output, var_result);
                 args->ip = NULL; // mark the end of a rescue block, used by vm_render_rescue
+                if (RB_UNLIKELY(args->variable_timing))
+                    vm_profile_end(vm, &args->variable_timing);
+                vm_stream_flush_point(vm, output);
+                VM_NEXT();
+            }
+
+            // Superinstructions
+
+            VM_CASE(OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY)
+            {
+                VALUE name = constants[(ip[0] << 8) | ip[1]];
+                VALUE key = constants[(ip[2] << 8) | ip[3]];
+                ip += 4;
+                VALUE object = context_find_static_variable(&vm->context, name);
+                vm_stack_push(vm, variable_lookup_const_key(vm->context.self, object, key, false));
+                VM_NEXT();
+            }
+            VM_CASE(OP_WRITE_STATIC_VAR)
+            VM_CASE(OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY)
+            {
+                bool lookup = ip[-1] == OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY;
+                // vm_render_rescue skips over this instruction from its start
+                args->ip = ip - 1;
+                args->node_line_number = lookup ? ip + 4 : ip + 2;
+                if (RB_UNLIKELY(vm->profiler != Qnil))
+                    vm_profile_start_variable(vm, args);
+                VALUE value = context_find_static_variable(&vm->context, constants[(ip[0] << 8) | ip[1]]);
+                if (lookup) {
+                    value = variable_lookup_const_key(vm->context.self, value, constants[(ip[2] << 8) | ip[3]], false);
+                    ip += 7;
+                } else {
+                    ip += 5;
+                }
+                vm_write_variable(vm, output, value);
+                args->ip = NULL;
+                if (RB_UNLIKELY(args->variable_timing))
+                    vm_profile_end(vm, &args->variable_timing);
+                vm_stream_flush_point(vm, output);
+                VM_NEXT();
+            }
+
+            // Compiled tag instructions
+
+            VM_CASE(OP_RENDER_TAG_RESCUE)
+                constant_index = (ip[0] << 8) | ip[1];
+                ip += 2;
+                // Save state used by vm_render_rescue to skip to the OP_END_TAG
+                // instruction and rescue like Liquid::BlockBody.render_node
+                args->tag_node = constants[constant_index];
+                args->ip = ip;
+                if (RB_UNLIKELY(vm->profiler != Qnil)) {
+                    VALUE node = args->tag_node;
+                    args->tag_timing = vm_profile_start(vm, rb_funcall(node, id_raw, 0), rb_funcall(node, id_line_number, 0));
+                }
+                VM_NEXT();
+            VM_CASE(OP_END_TAG)
+                args->ip = NULL;
+                args->tag_node = Qnil;
+                if (RB_UNLIKELY(args->tag_timing))
+                    vm_profile_end(vm, &args->tag_timing);
                 resource_limits_increment_write_score(vm->context.resource_limits, output);
-                break;
+                VM_NEXT();
+            VM_CASE(OP_COMPARE)
+            {
+                constant_index = (ip[0] << 8) | ip[1];
+                constant = constants[constant_index];
+                uint8_t comparison_operator = ip[2];
+                ip += 3;
+                VALUE right = vm_stack_pop(vm);
+                VALUE left = vm_stack_pop(vm);
+                vm_stack_push(vm, condition_compare(constant, comparison_operator, left, right));
+                VM_NEXT();
+            }
+            VM_CASE(OP_JUMP)
+            {
+                size_t offset = bytes_to_uint24(ip);
+                ip += 3 + offset;
+                VM_NEXT();
+            }
+            VM_CASE(OP_JUMP_IF_FALSE)
+            VM_CASE(OP_JUMP_IF_TRUE)
+            {
+                bool jump_when = ip[-1] == OP_JUMP_IF_TRUE;
+                size_t offset = bytes_to_uint24(ip);
+                ip += 3;
+                if (value_truthy_p(vm_stack_pop(vm)) == jump_when)
+                    ip += offset;
+                VM_NEXT();
+            }
+            VM_CASE(OP_RENDER_BODY)
+            {
+                constant_index = (ip[0] << 8) | ip[1];
+                constant = constants[constant_index];
+                ip += 2;
+                vm_render_block_body(vm, constant, output);
+
+                if (RARRAY_LEN(vm->context.interrupts)) {
+                    return false;
+                }
+                VM_NEXT();
+            }
+            VM_CASE(OP_FOR_INIT)
+            {
+                VALUE variable_name = constants[(ip[0] << 8) | ip[1]];
+                VALUE name = constants[(ip[2] << 8) | ip[3]];
+                uint8_t flags = ip[4];
+                size_t else_offset = bytes_to_uint24(&ip[5]);
+                ip += 8;
+                VALUE limit = vm_stack_pop(vm);
+                VALUE collection = vm_stack_pop(vm);
+                VALUE from = vm_stack_pop(vm);
+
+                VALUE segment = for_loop_collection_segment(&vm->context, collection, from, limit, name, flags);
+                if (RARRAY_LEN(segment) == 0) {
+                    ip += else_offset;
+                    VM_NEXT();
+                }
+                VALUE loop_obj = for_loop_enter(&vm->context, segment, variable_name, name);
+                c_buffer_write_ruby_value(&vm->for_loops, loop_obj);
+                VM_NEXT();
+            }
+            VM_CASE(OP_CASE_DISPATCH)
+            {
+                constant_index = (ip[0] << 8) | ip[1];
+                constant = constants[constant_index];
+                unsigned int branch_count = ip[2];
+                const uint8_t *targets = &ip[3];
+                ip = targets + (branch_count + 2) * 3;
+                VALUE value = value_to_liquid_value(vm_stack_pop(vm));
+
+                unsigned int target = branch_count + 1;
+                if (case_dispatch_key_p(value)) {
+                    VALUE branch = rb_hash_lookup2(constant, value, Qnil);
+                    target = RB_FIXNUM_P(branch) && FIX2ULONG(branch) < branch_count ? FIX2UINT(branch) : branch_count;
+                }
+                ip += bytes_to_uint24(&targets[target * 3]);
+                VM_NEXT();
+            }
+            VM_CASE(OP_RENDER_PARTIAL)
+            {
+                constant_index = (ip[0] << 8) | ip[1];
+                constant = constants[constant_index];
+                VALUE template_name = constants[(ip[2] << 8) | ip[3]];
+                VALUE variable_name = constants[(ip[4] << 8) | ip[5]];
+                uint8_t attribute_count = ip[6];
+                uint8_t flags = ip[7];
+                ip += 8;
+                // copied off the stack, which the VM could reuse while the partial renders
+                VALUE attributes = Qnil;
+                if (attribute_count)
+                    attributes = rb_ary_new_from_values(attribute_count * 2, vm_stack_pop_n(vm, attribute_count * 2));
+                VALUE variable = vm_stack_pop(vm);
+
+                partial_render(vm, constant, template_name, variable_name, variable, attributes, flags, output);
+                VM_NEXT();
+            }
+            VM_CASE(OP_FOR_NEXT)
+            {
+                const uint8_t *instruction_start = ip - 1;
+                constant_index = (ip[0] << 8) | ip[1];
+                constant = constants[constant_index];
+                ip += 2;
+
+                for_loop_t *loop = for_loop_ptr(vm_current_for_loop(vm));
+                if (loop->done || loop->index >= loop->length)
+                    VM_NEXT(); // continue to OP_FOR_END
+
+                context_hash_aset(&vm->context, loop->scope, loop->variable_name, RARRAY_AREF(loop->segment, loop->index));
+                vm_render_block_body(vm, constant, output);
+                loop->index++;
+
+                if (RARRAY_LEN(vm->context.interrupts)) {
+                    VALUE interrupt = rb_ary_pop(vm->context.interrupts);
+                    if (rb_obj_is_kind_of(interrupt, cLiquidBreakInterrupt))
+                        loop->done = true;
+                }
+                ip = instruction_start; // loop back
+                VM_NEXT();
+            }
+            VM_CASE(OP_FOR_END)
+                vm_pop_for_loop(vm);
+                VM_NEXT();
+            VM_CASE(OP_ASSIGN)
+            {
+                constant_index = (ip[0] << 8) | ip[1];
+                constant = constants[constant_index];
+                ip += 2;
+                VALUE value = vm_stack_pop(vm);
+                if (vm->context.global_filter != Qnil)
+                    value = rb_funcall(vm->context.global_filter, id_call, 1, value);
+                vm_assign(vm, constant, value);
+                resource_limits_increment_assign_score(vm->context.resource_limits, assign_score_of(value));
+                VM_NEXT();
+            }
+            VM_CASE(OP_CAPTURE)
+            {
+                constant_index = (ip[0] << 8) | ip[1];
+                constant = constants[constant_index];
+                VALUE block_body = constants[(ip[2] << 8) | ip[3]];
+                ip += 4;
+
+                // Equivalent to ResourceLimits#with_capture, with the old capture
+                // length restored by vm_render_rescue if an exception is raised
+                resource_limits_t *resource_limits = vm->context.resource_limits;
+                args->old_capture_length = resource_limits->last_capture_length;
+                args->capturing = true;
+                resource_limits->last_capture_length = 0;
+
+                VALUE captured = rb_enc_str_new("", 0, utf8_encoding);
+                vm_render_block_body(vm, block_body, captured);
+
+                resource_limits->last_capture_length = args->old_capture_length;
+                args->capturing = false;
+                vm_assign(vm, constant, captured);
+
+                if (RARRAY_LEN(vm->context.interrupts)) {
+                    return false;
+                }
+                VM_NEXT();
             }
 
-            default:
+            VM_DEFAULT()
                 rb_bug("invalid opcode: %u", ip[-1]);
+#if VM_DIRECT_THREADED
+            label_vm_stats:
+                vm_stats_record(ip - 1, constants);
+                goto *dispatch_table[ip[-1]];
+#endif
         }
     }
 }
@@ -458,12 +983,15 @@ static VALUE vm_evaluate_rescue(VALUE uncast_args, VALUE exception)
 VALUE liquid_vm_evaluate(VALUE context, vm_assembler_t *code)
 {
     vm_t *vm = vm_from_context(context);
+    // the scopes or environments could have been changed since the VM last ran
+    context_invalidate_variable_cache(&vm->context);
     vm_stack_reserve_for_write(vm, code->max_stack_size);
 
     vm_render_until_error_args_t args = {
         .vm = vm,
         .const_ptr = (const size_t *)code->constants.data,
-        .ip = code->instructions.data
+        .ip = code->instructions.data,
+        .tag_node = Qnil,
     };
     vm_evaluate_rescue_args_t rescue_args = {
         .render_args = &args,
@@ -483,6 +1011,8 @@ void liquid_vm_next_instruction(const uint8_t **ip_ptr)
     switch (*ip++) {
         case OP_LEAVE:
         case OP_POP_WRITE:
+        case OP_END_TAG:
+        case OP_FOR_END:
         case OP_PUSH_NIL:
         case OP_PUSH_TRUE:
         case OP_PUSH_FALSE:
@@ -504,10 +1034,36 @@ void liquid_vm_next_instruction(const uint8_t **ip_ptr)
         case OP_LOOKUP_CONST_KEY:
         case OP_LOOKUP_COMMAND:
         case OP_FILTER:
+        case OP_RENDER_TAG_RESCUE:
+        case OP_RENDER_BODY:
+        case OP_FOR_NEXT:
+        case OP_ASSIGN:
             ip += 2;
             break;
 
+        case OP_FOR_INIT:
+        case OP_RENDER_PARTIAL:
+            ip += 8;
+            break;
+
+        case OP_CAPTURE:
+        case OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY:
+            ip += 4;
+            break;
+
+        case OP_WRITE_STATIC_VAR:
+            ip += 5;
+            break;
+
+        case OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY:
+            ip += 7;
+            break;
+
         case OP_RENDER_VARIABLE_RESCUE:
+        case OP_COMPARE:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
             ip += 3;
             break;
 
@@ -527,6 +1083,10 @@ void liquid_vm_next_instruction(const uint8_t **ip_ptr)
             break;
         }
 
+        case OP_CASE_DISPATCH:
+            ip += 3 + (ip[2] + 2) * 3;
+            break;
+
         default:
             rb_bug("invalid opcode: %u", ip[-1]);
     }
@@ -545,66 +1105,227 @@ VALUE vm_translate_if_filter_argument_error(vm_t *vm, VALUE exception)
     return exception;
 }
 
+// Superinstructions that render a whole variable, so they also end its rescue block
+static inline bool vm_variable_superinstruction_p(uint8_t op)
+{
+    return op == OP_WRITE_STATIC_VAR || op == OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY;
+}
+
 typedef struct vm_render_rescue_args {
     vm_render_until_error_args_t *render_args;
     size_t old_stack_byte_size;
+    size_t old_for_loops_byte_size;
 } vm_render_rescue_args_t;
 
 // Actually returns a bool resume_rendering value
 static VALUE vm_render_rescue(VALUE uncast_args, VALUE exception)
 {
     vm_render_rescue_args_t *args = (void *)uncast_args;
-    VALUE blank_tag = Qfalse; // tags are still rendered using Liquid::BlockBody.render_node
+    VALUE blank_tag = Qfalse; // only compiled tags can be blank
     vm_render_until_error_args_t *render_args = args->render_args;
     vm_t *vm = render_args->vm;
 
     exception = vm_translate_if_filter_argument_error(vm, exception);
 
+    // the timings end like they would in Liquid::Profiler#profile_node's ensure block
+    if (RB_UNLIKELY(render_args->variable_timing || render_args->tag_timing))
+        vm_profile_end_all(vm, render_args);
+
     const uint8_t *ip = render_args->ip;
-    if (!ip)
+    if (!ip || vm->stream.failed)
         rb_exc_raise(exception);
 
-    // rescue for variable render, where ip is at the start of the render and we need to
-    // skip to the end of the variable render to resume rendering if the error is handled
+    VALUE line_number;
+    enum opcode end_op;
+    if (render_args->tag_node != Qnil) {
+        // rescue for a compiled tag, which behaves like the tag node being rendered
+        // by Liquid::BlockBody.render_node, so rendering resumes after the tag
+        VALUE node = render_args->tag_node;
+        render_args->tag_node = Qnil;
+        end_op = OP_END_TAG;
+        line_number = rb_funcall(node, id_line_number, 0);
+        blank_tag = RTEST(rb_funcall(node, id_blank_p, 0)) ? Qtrue : Qfalse;
+    } else {
+        end_op = OP_POP_WRITE;
+        assert(render_args->node_line_number);
+        unsigned int node_line_number = bytes_to_uint24(render_args->node_line_number);
+        line_number = node_line_number != 0 ? UINT2NUM(node_line_number) : Qnil;
+    }
+
+    // ip is at the start of the variable or tag render and we need to skip
+    // to the end of that render to resume rendering if the error is handled
     enum opcode last_op;
     do {
         last_op = *ip;
         liquid_vm_next_instruction(&ip);
-    } while (last_op != OP_POP_WRITE);
+    } while (last_op != end_op && !(end_op == OP_POP_WRITE && vm_variable_superinstruction_p(last_op)));
     render_args->ip = ip;
     // remove temporary stack values from variable evaluation
     vm->stack.data_end = vm->stack.data + args->old_stack_byte_size;
-
-    assert(render_args->node_line_number);
-    unsigned int node_line_number = bytes_to_uint24(render_args->node_line_number);
-    VALUE line_number = node_line_number != 0 ? UINT2NUM(node_line_number) : Qnil;
+    vm_unwind_for_loops(vm, args->old_for_loops_byte_size);
+    if (render_args->capturing) {
+        vm->context.resource_limits->last_capture_length = render_args->old_capture_length;
+        render_args->capturing = false;
+    }
 
     rb_funcall(cLiquidBlockBody, rb_intern("c_rescue_render_node"), 5,
         vm->context.self, render_args->output, line_number, exception, blank_tag);
+    context_invalidate_variable_cache(&vm->context);
     return true;
 }
 
-void liquid_vm_render(block_body_header_t *body, const VALUE *const_ptr, VALUE context, VALUE output)
+static void vm_render(vm_t *vm, block_body_header_t *body, const VALUE *const_ptr, VALUE output)
 {
-    vm_t *vm = vm_from_context(context);
+    // builtin filters were folded with their standard implementation
+    if (RB_UNLIKELY(body->folded_filters & ~vm->context.standard_filters))
+        body = block_body_unfolded_header(body);
 
     vm_stack_reserve_for_write(vm, body->max_stack_size);
     resource_limits_increment_render_score(vm->context.resource_limits, body->render_score);
 
+    // The instructions would only write constants, unless the global filter changes their output
+    if (BLOCK_BODY_HEADER_CONSTANT_OUTPUT_P(body) && vm->context.global_filter == Qnil &&
+        vm->profiler == Qnil && !vm_stats_enabled)
+    {
+        VALUE constant_output = const_ptr[body->constants_len - 1];
+        rb_str_cat(output, RSTRING_PTR(constant_output), RSTRING_LEN(constant_output));
+        resource_limits_increment_write_score(vm->context.resource_limits, output);
+        vm_stream_flush_point(vm, output);
+        return;
+    }
+
     vm_render_until_error_args_t render_args = {
         .vm = vm,
         .const_ptr = const_ptr,
         .ip = block_body_instructions_ptr(body),
         .output = output,
+        .tag_node = Qnil,
     };
     vm_render_rescue_args_t rescue_args = {
         .render_args = &render_args,
         .old_stack_byte_size = c_buffer_size(&vm->stack),
+        .old_for_loops_byte_size = c_buffer_size(&vm->for_loops),
     };
 
     while (rb_rescue(vm_render_until_error, (VALUE)&render_args, vm_render_rescue, (VALUE)&rescue_args)) {
     }
+    // e.g. when a break or continue interrupt left a compiled tag
+    if (RB_UNLIKELY(render_args.variable_timing || render_args.tag_timing))
+        vm_profile_end_all(vm, &render_args);
     assert(rescue_args.old_stack_byte_size == c_buffer_size(&vm->stack));
+    assert(rescue_args.old_for_loops_byte_size == c_buffer_size(&vm->for_loops));
+}
+
+bool liquid_vm_stream_buffer_p(VALUE output)
+{
+    return RBASIC_CLASS(output) == cLiquidCStreamBuffer;
+}
+
+typedef struct vm_stream_render_args {
+    vm_t *vm;
+    block_body_header_t *body;
+    const VALUE *const_ptr;
+    VALUE output;
+    VALUE old_stream_output;
+} vm_stream_render_args_t;
+
+static VALUE vm_stream_render(VALUE uncast_args)
+{
+    vm_stream_render_args_t *args = (void *)uncast_args;
+    vm_render(args->vm, args->body, args->const_ptr, args->output);
+    return Qnil;
+}
+
+static VALUE vm_stream_render_ensure(VALUE uncast_args)
+{
+    vm_stream_render_args_t *args = (void *)uncast_args;
+    vm_t *vm = args->vm;
+    vm->stream.output = args->old_stream_output;
+    if (args->old_stream_output == Qnil) {
+        vm->stream.failed = false;
+        vm->context.resource_limits->flushed_output_length = 0;
+    }
+    return Qnil;
+}
+
+static void vm_render_with_context(vm_t *vm, block_body_header_t *body, const VALUE *const_ptr, VALUE context, VALUE output)
+{
+    // the scopes or environments could have been changed since the VM last ran
+    context_invalidate_variable_cache(&vm->context);
+    // set by Liquid::Template#render when the template was parsed with the profile option
+    VALUE profiler = rb_attr_get(context, id_ivar_profiler);
+    // otherwise the compiled nodes of templates parsed before profiling render without timings
+    if (profiler != Qnil && !RTEST(rb_const_get(mLiquidC, id_profile_compiled_nodes)))
+        profiler = Qnil;
+    vm->profiler = profiler;
+
+    if (RB_LIKELY(vm->stream.output == Qnil && !liquid_vm_stream_buffer_p(output))) {
+        vm_render(vm, body, const_ptr, output);
+        return;
+    }
+
+    vm_stream_render_args_t args = {
+        .vm = vm,
+        .body = body,
+        .const_ptr = const_ptr,
+        .output = output,
+        .old_stream_output = vm->stream.output,
+    };
+    if (vm->stream.output == Qnil) {
+        vm->stream.output = output;
+        vm->stream.chunk_size = NUM2LONG(rb_ivar_get(output, id_ivar_chunk_size));
+        vm->stream.failed = false;
+        vm->context.resource_limits->flushed_output_length = 0;
+    } else {
+        // Only flush from the outermost render, since a ruby tag rendering a block
+        // body in between could rescue an exception from flushing
+        vm->stream.output = Qnil;
+    }
+    rb_ensure(vm_stream_render, (VALUE)&args, vm_stream_render_ensure, (VALUE)&args);
+}
+
+typedef struct vm_outermost_render_args {
+    vm_t *vm;
+    block_body_header_t *body;
+    const VALUE *const_ptr;
+    VALUE context;
+    VALUE output;
+} vm_outermost_render_args_t;
+
+static VALUE vm_outermost_render(VALUE uncast_args)
+{
+    vm_outermost_render_args_t *args = (void *)uncast_args;
+    vm_render_with_context(args->vm, args->body, args->const_ptr, args->context, args->output);
+    return Qnil;
+}
+
+static VALUE vm_outermost_render_ensure(VALUE uncast_args)
+{
+    vm_outermost_render_args_t *args = (void *)uncast_args;
+    args->vm->rendering = false;
+    return Qnil;
+}
+
+void liquid_vm_render(block_body_header_t *body, const VALUE *const_ptr, VALUE context, VALUE output)
+{
+    vm_t *vm = vm_from_context(context);
+    if (vm->rendering) {
+        // e.g. a block body rendered by a tag through ruby
+        vm_render_with_context(vm, body, const_ptr, context, output);
+        return;
+    }
+
+    // a context that is rendered again reads the partials from the file system again
+    vm->partials = Qnil;
+    vm->rendering = true;
+    vm_outermost_render_args_t args = {
+        .vm = vm,
+        .body = body,
+        .const_ptr = const_ptr,
+        .context = context,
+        .output = output,
+    };
+    rb_ensure(vm_outermost_render, (VALUE)&args, vm_outermost_render_ensure, (VALUE)&args);
 }
 
 
@@ -612,8 +1333,29 @@ void liquid_define_vm(void)
 {
     id_render_node = rb_intern("render_node");
     id_vm = rb_intern("vm");
+    id_line_number = rb_intern("line_number");
+    id_blank_p = rb_intern("blank?");
+    id_ivar_chunk_size = rb_intern("@chunk_size");
+    id_write_chunk = rb_intern("write_chunk");
+    id_ivar_profiler = rb_intern("@profiler");
+    id_template_name = rb_intern("template_name");
+    id_raw = rb_intern("raw");
+    id_c_profile_start_node = rb_intern("c_profile_start_node");
+    id_c_profile_end_node = rb_intern("c_profile_end_node");
+    id_c_profile_render_node = rb_intern("c_profile_render_node");
+    id_profile_compiled_nodes = rb_intern("PROFILE_COMPILED_NODES");
 
     cLiquidCVM = rb_define_class_under(mLiquidC, "VM", rb_cObject);
     rb_undef_alloc_func(cLiquidCVM);
     rb_global_variable(&cLiquidCVM);
+
+    // Instruction dispatch the extension was compiled with
+    rb_define_const(cLiquidCVM, "DISPATCH", rb_str_freeze(rb_str_new_cstr(VM_DIRECT_THREADED ? "computed_goto" : "switch")));
+
+    // Output buffer that is flushed in chunks while rendering, see Liquid::Template#render_to_stream
+    cLiquidCStreamBuffer = rb_define_class_under(mLiquidC, "StreamBuffer", rb_cString);
+    rb_global_variable(&cLiquidCStreamBuffer);
+
+    cLiquidBreakInterrupt = rb_const_get(mLiquid, rb_intern("BreakInterrupt"));
+    rb_global_variable(&cLiquidBreakInterrupt);
 }
@@ -8,13 +8,24 @@
 
 typedef struct vm {
     c_buffer_t stack;
+    c_buffer_t for_loops; // Liquid::C::ForloopDrop objects for the for loops being rendered
     bool invoking_filter;
     context_t context;
+    VALUE profiler; // Liquid::Profiler of the context being rendered, or Qnil
+    VALUE partials; // render tag node => loaded partial, shared with the VMs of the partials' contexts, or Qnil
+    bool rendering; // in a render of the context, or of the context of a partial rendered by the VM
+    struct {
+        VALUE output; // Liquid::C::StreamBuffer being flushed while rendering, or Qnil
+        long chunk_size;
+        bool failed; // so the exception from flushing isn't rescued as a render error
+    } stream;
 } vm_t;
 
 void liquid_define_vm(void);
 vm_t *vm_from_context(VALUE context);
+vm_t *vm_from_context_if_created(VALUE context);
 void liquid_vm_render(block_body_header_t *block, const VALUE *const_ptr, VALUE context, VALUE output);
+bool liquid_vm_stream_buffer_p(VALUE output);
 void liquid_vm_next_instruction(const uint8_t **ip_ptr);
 bool liquid_vm_filtering(VALUE context);
 VALUE liquid_vm_evaluate(VALUE context, vm_assembler_t *code);
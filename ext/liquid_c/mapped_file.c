@@ -0,0 +1,139 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#endif
+#include "liquid.h"
+#include "mapped_file.h"
+
+/*
+ * A read-only view of a file, which is memory mapped when supported so
+ * that the pages are shared through the page cache by all the processes
+ * that map the file, e.g. by forked workers loading the same template cache.
+ */
+
+static VALUE cLiquidCMappedFile;
+
+static void mapped_file_unmap(mapped_file_t *file)
+{
+    if (!file->data)
+        return;
+#if defined(HAVE_SYS_MMAN_H)
+    if (file->mapped) {
+        munmap((void *)file->data, file->size);
+    } else
+#endif
+    {
+        xfree((void *)file->data);
+    }
+    file->data = NULL;
+}
+
+static void mapped_file_free(void *ptr)
+{
+    mapped_file_t *file = ptr;
+    mapped_file_unmap(file);
+    xfree(file);
+}
+
+static size_t mapped_file_memsize(const void *ptr)
+{
+    const mapped_file_t *file = ptr;
+    // mapped pages are shared, so they aren't counted as memory of this process
+    return sizeof(mapped_file_t) + (file->mapped ? 0 : file->size);
+}
+
+const rb_data_type_t mapped_file_data_type = {
+    "liquid_mapped_file",
+    { NULL, mapped_file_free, mapped_file_memsize, },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE mapped_file_allocate(VALUE klass)
+{
+    mapped_file_t *file;
+    VALUE obj = TypedData_Make_Struct(klass, mapped_file_t, &mapped_file_data_type, file);
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = false;
+    return obj;
+}
+
+static void read_file(mapped_file_t *file, int fd)
+{
+    uint8_t *data = xmalloc(file->size ? file->size : 1);
+    size_t bytes_read = 0;
+    while (bytes_read < file->size) {
+        ssize_t result = read(fd, data + bytes_read, file->size - bytes_read);
+        if (result <= 0) {
+            int read_errno = result < 0 ? errno : EIO;
+            xfree(data);
+            close(fd);
+            rb_syserr_fail(read_errno, "read");
+        }
+        bytes_read += result;
+    }
+    file->data = data;
+}
+
+static VALUE mapped_file_initialize(VALUE self, VALUE path)
+{
+    mapped_file_t *file;
+    MappedFile_Get_Struct(self, file);
+    if (file->data)
+        rb_raise(rb_eRuntimeError, "Liquid::C::MappedFile already initialized");
+
+    FilePathValue(path);
+    int fd = rb_cloexec_open(StringValueCStr(path), O_RDONLY, 0);
+    if (fd < 0)
+        rb_sys_fail_str(path);
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+        int stat_errno = errno;
+        close(fd);
+        rb_syserr_fail_str(stat_errno, path);
+    }
+    file->size = file_stat.st_size;
+
+#if defined(HAVE_SYS_MMAN_H)
+    if (file->size > 0) {
+        void *data = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            file->data = data;
+            file->mapped = true;
+        }
+    }
+#endif
+    if (!file->data)
+        read_file(file, fd);
+
+    close(fd);
+    return Qnil;
+}
+
+static VALUE mapped_file_bytesize(VALUE self)
+{
+    mapped_file_t *file;
+    MappedFile_Get_Struct(self, file);
+    return SIZET2NUM(file->size);
+}
+
+static VALUE mapped_file_mapped_p(VALUE self)
+{
+    mapped_file_t *file;
+    MappedFile_Get_Struct(self, file);
+    return file->mapped ? Qtrue : Qfalse;
+}
+
+void liquid_define_mapped_file(void)
+{
+    cLiquidCMappedFile = rb_define_class_under(mLiquidC, "MappedFile", rb_cObject);
+    rb_global_variable(&cLiquidCMappedFile);
+    rb_define_alloc_func(cLiquidCMappedFile, mapped_file_allocate);
+    rb_define_method(cLiquidCMappedFile, "initialize", mapped_file_initialize, 1);
+    rb_define_method(cLiquidCMappedFile, "bytesize", mapped_file_bytesize, 0);
+    rb_define_method(cLiquidCMappedFile, "mapped?", mapped_file_mapped_p, 0);
+}
@@ -0,0 +1,17 @@
+#ifndef LIQUID_MAPPED_FILE_H
+#define LIQUID_MAPPED_FILE_H
+
+#include "liquid.h"
+
+typedef struct mapped_file {
+    const uint8_t *data;
+    size_t size;
+    bool mapped; // otherwise data was read into private memory
+} mapped_file_t;
+
+extern const rb_data_type_t mapped_file_data_type;
+#define MappedFile_Get_Struct(obj, sval) TypedData_Get_Struct(obj, mapped_file_t, &mapped_file_data_type, sval)
+
+void liquid_define_mapped_file(void);
+
+#endif
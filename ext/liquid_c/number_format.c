@@ -0,0 +1,135 @@
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include "number_format.h"
+
+static int format_digits(uint64_t number, char *buf)
+{
+    char digits[20];
+    char *p = digits + sizeof(digits);
+
+    // Digits are produced in reverse order, so fill a temporary buffer from the end
+    do {
+        *--p = '0' + (number % 10);
+        number /= 10;
+    } while (number);
+
+    int length = (int)(digits + sizeof(digits) - p);
+    memcpy(buf, p, length);
+    return length;
+}
+
+int format_long_long(long long number, char *buf)
+{
+    if (number < 0) {
+        buf[0] = '-';
+        // Negate in unsigned arithmetic so that LLONG_MIN doesn't overflow
+        return 1 + format_digits(-(uint64_t)number, buf + 1);
+    }
+    return format_digits(number, buf);
+}
+
+#define MAX_FLOAT_SCALE 15
+
+static const double powers_of_ten[MAX_FLOAT_SCALE + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+    1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+};
+
+/*
+ * Float#to_s uses the shortest digit string that round-trips to the same
+ * double. When a value can be written as an integer mantissa of at most 15
+ * digits divided by a power of ten, there is only one such mantissa for the
+ * smallest round-tripping power of ten, since doubles are more precise than
+ * 15 significant digits. Mantissas with more digits fall back to Float#to_s,
+ * which can pick between several candidates.
+ */
+int format_double(double value, char *buf)
+{
+#if FLT_EVAL_METHOD != 0
+    // Extended precision intermediates could double-round the checks below
+    (void)value; (void)buf;
+    return -1;
+#else
+    char *p = buf;
+
+    if (isnan(value)) {
+        memcpy(p, "NaN", 3);
+        return 3;
+    }
+    if (signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+    if (isinf(value)) {
+        memcpy(p, "Infinity", 8);
+        return (int)(p - buf) + 8;
+    }
+    if (value == 0.0) {
+        memcpy(p, "0.0", 3);
+        return (int)(p - buf) + 3;
+    }
+
+    uint64_t mantissa = 0;
+    int scale;
+    for (scale = 0; scale <= MAX_FLOAT_SCALE; scale++) {
+        double scaled = value * powers_of_ten[scale];
+        if (scaled >= powers_of_ten[MAX_FLOAT_SCALE])
+            return -1;
+        mantissa = (uint64_t)round(scaled);
+        // Both operands are exact, so the division rounds the same way parsing the decimal would
+        if (mantissa && (double)mantissa / powers_of_ten[scale] == value)
+            break;
+    }
+    if (scale > MAX_FLOAT_SCALE)
+        return -1;
+
+    char digits[20];
+    int digit_count = format_digits(mantissa, digits);
+    int decimal_point = digit_count - scale;
+    while (digit_count > 1 && digits[digit_count - 1] == '0')
+        digit_count--;
+
+    if (decimal_point > 0) {
+        // decimal_point <= MAX_FLOAT_SCALE, so Float#to_s would use fixed notation
+        if (decimal_point < digit_count) {
+            memcpy(p, digits, decimal_point);
+            p += decimal_point;
+            *p++ = '.';
+            memcpy(p, digits + decimal_point, digit_count - decimal_point);
+            p += digit_count - decimal_point;
+        } else {
+            memcpy(p, digits, digit_count);
+            p += digit_count;
+            memset(p, '0', decimal_point - digit_count);
+            p += decimal_point - digit_count;
+            memcpy(p, ".0", 2);
+            p += 2;
+        }
+    } else if (decimal_point > -4) {
+        memcpy(p, "0.", 2);
+        p += 2;
+        memset(p, '0', -decimal_point);
+        p += -decimal_point;
+        memcpy(p, digits, digit_count);
+        p += digit_count;
+    } else {
+        // Exponent notation, with at least one digit after the decimal point and two in the exponent
+        *p++ = digits[0];
+        *p++ = '.';
+        if (digit_count > 1) {
+            memcpy(p, digits + 1, digit_count - 1);
+            p += digit_count - 1;
+        } else {
+            *p++ = '0';
+        }
+        memcpy(p, "e-", 2);
+        p += 2;
+        int exponent = 1 - decimal_point;
+        if (exponent < 10)
+            *p++ = '0';
+        p += format_digits(exponent, p);
+    }
+    return (int)(p - buf);
+#endif
+}
@@ -0,0 +1,21 @@
+#ifndef LIQUID_NUMBER_FORMAT_H
+#define LIQUID_NUMBER_FORMAT_H
+
+#include <stdint.h>
+
+/*
+ * Formatting of numbers into a caller provided buffer of at least
+ * NUMBER_FORMAT_BUFFER_SIZE bytes, producing the same output as the
+ * corresponding ruby to_s methods. The buffer is not NUL terminated.
+ */
+#define NUMBER_FORMAT_BUFFER_SIZE 32
+
+// Returns the length of the decimal representation of number
+int format_long_long(long long number, char *buf);
+
+// Returns the length of the output of Float#to_s, or -1 if the value
+// needs more digits than are handled natively, in which case Float#to_s
+// should be used instead.
+int format_double(double value, char *buf);
+
+#endif
@@ -0,0 +1,179 @@
+#include "liquid.h"
+#include "partial.h"
+#include "block.h"
+#include "for_loop.h"
+
+static VALUE str_forloop;
+static ID id_c_load_partial, id_compare_by_identity, id_with_disabled_tags, id_new_isolated_subcontext,
+          id_render_to_output_buffer, id_handle_error, id_each, id_count, id_ivar_template_name, id_ivar_partial,
+          id_ivar_scopes;
+
+// Indexes of the array returned by Liquid::Render#c_load_partial
+enum {
+    PARTIAL_TEMPLATE,
+    PARTIAL_NAME,
+    PARTIAL_BODY, // compiled Liquid::C::BlockBody of the partial's document, or nil
+    PARTIAL_DISABLED_TAGS,
+    PARTIAL_ENTRY_LENGTH,
+};
+
+typedef struct partial_render_args {
+    vm_t *vm;
+    VALUE entry;
+    VALUE template_name;
+    VALUE variable_name;
+    VALUE variable;
+    VALUE attributes;
+    uint8_t flags;
+    VALUE output;
+    VALUE forloop;
+    VALUE inner_context;
+} partial_render_args_t;
+
+/*
+ * Loads the partial through Liquid::PartialCache the first time the render
+ * tag node is rendered, then looks it up in the VM's partials, which are
+ * shared with the VMs of the isolated contexts the partials are rendered in,
+ * so nested render tags also only load their partial once per render.
+ */
+static VALUE partial_load(vm_t *vm, VALUE node)
+{
+    if (vm->partials == Qnil)
+        vm->partials = rb_funcall(rb_hash_new(), id_compare_by_identity, 0);
+
+    VALUE entry = rb_hash_lookup(vm->partials, node);
+    if (entry == Qnil) {
+        entry = rb_funcall(node, id_c_load_partial, 1, vm->context.self);
+        Check_Type(entry, T_ARRAY);
+        if (RARRAY_LEN(entry) != PARTIAL_ENTRY_LENGTH)
+            rb_raise(rb_eArgError, "invalid loaded partial");
+        rb_hash_aset(vm->partials, node, entry);
+    }
+    return entry;
+}
+
+static VALUE partial_render_body(VALUE uncast_args)
+{
+    partial_render_args_t *args = (void *)uncast_args;
+    // Like Liquid::Template#render, which resets the resource usage
+    resource_limits_reset(args->vm->context.resource_limits);
+    block_body_render_to_output_buffer(RARRAY_AREF(args->entry, PARTIAL_BODY), args->inner_context, args->output);
+    return Qnil;
+}
+
+static VALUE partial_render_memory_error(VALUE uncast_args, VALUE exception)
+{
+    partial_render_args_t *args = (void *)uncast_args;
+    rb_funcall(args->inner_context, id_handle_error, 1, exception);
+    return Qnil;
+}
+
+// Equivalent to the render_partial_func lambda in Liquid::Render#render_tag
+static void partial_render_once(partial_render_args_t *args, VALUE variable)
+{
+    vm_t *vm = args->vm;
+    VALUE inner_context = rb_funcall(vm->context.self, id_new_isolated_subcontext, 0);
+    rb_ivar_set(inner_context, id_ivar_template_name, RARRAY_AREF(args->entry, PARTIAL_NAME));
+    rb_ivar_set(inner_context, id_ivar_partial, Qtrue);
+
+    VALUE scopes = rb_ivar_get(inner_context, id_ivar_scopes);
+    Check_Type(scopes, T_ARRAY);
+    VALUE scope = rb_ary_entry(scopes, 0);
+    Check_Type(scope, T_HASH);
+    if (args->forloop != Qnil)
+        rb_hash_aset(scope, str_forloop, args->forloop);
+    if (args->attributes != Qnil) {
+        for (long i = 0; i < RARRAY_LEN(args->attributes); i += 2) {
+            rb_hash_aset(scope, RARRAY_AREF(args->attributes, i), RARRAY_AREF(args->attributes, i + 1));
+        }
+    }
+    if (variable != Qnil)
+        rb_hash_aset(scope, args->variable_name, variable);
+
+    vm_t *inner_vm = vm_from_context(inner_context);
+    // part of the caller's render, so the partials it loads are kept for it
+    inner_vm->partials = vm->partials;
+    inner_vm->rendering = true;
+
+    VALUE body = RARRAY_AREF(args->entry, PARTIAL_BODY);
+    if (body != Qnil && vm->profiler == Qnil) {
+        // Skips Liquid::Template#render_to_output_buffer, which doesn't do anything
+        // else for a partial, to render its instructions directly
+        args->inner_context = inner_context;
+        rb_rescue2(partial_render_body, (VALUE)args, partial_render_memory_error, (VALUE)args, cMemoryError, (VALUE)0);
+    } else {
+        rb_funcall(RARRAY_AREF(args->entry, PARTIAL_TEMPLATE), id_render_to_output_buffer, 2, inner_context, args->output);
+    }
+
+    if (args->forloop != Qnil)
+        for_loop_ptr(args->forloop)->index++;
+}
+
+static VALUE partial_render_item(RB_BLOCK_CALL_FUNC_ARGLIST(item, uncast_args))
+{
+    partial_render_once((partial_render_args_t *)uncast_args, item);
+    return Qnil;
+}
+
+static VALUE partial_render_with_disabled_tags(RB_BLOCK_CALL_FUNC_ARGLIST(_unused, uncast_args))
+{
+    partial_render_args_t *args = (void *)uncast_args;
+    VALUE variable = args->variable;
+
+    if ((args->flags & RENDER_PARTIAL_FOR_LOOP) && rb_respond_to(variable, id_each) && rb_respond_to(variable, id_count)) {
+        VALUE count = rb_funcall(variable, id_count, 0);
+        args->forloop = for_loop_new_drop(args->template_name, NUM2LONG(count));
+        rb_block_call(variable, id_each, 0, NULL, partial_render_item, uncast_args);
+    } else {
+        partial_render_once(args, variable);
+    }
+    return Qnil;
+}
+
+/*
+ * Renders a partial like Liquid::Render#render_to_output_buffer with the
+ * variable and attributes already evaluated. Unlike the render tag, the
+ * attributes are evaluated once rather than for each item of a for loop,
+ * which only differs for drops that return a different value each time.
+ */
+void partial_render(vm_t *vm, VALUE node, VALUE template_name, VALUE variable_name, VALUE variable,
+                    VALUE attributes, uint8_t flags, VALUE output)
+{
+    VALUE entry = partial_load(vm, node);
+    partial_render_args_t args = {
+        .vm = vm,
+        .entry = entry,
+        .template_name = template_name,
+        .variable_name = variable_name,
+        .variable = variable,
+        .attributes = attributes,
+        .flags = flags,
+        .output = output,
+        .forloop = Qnil,
+        .inner_context = Qnil,
+    };
+
+    // Liquid::Tag.disable_tags wraps the render tag's rendering in Liquid::Context#with_disabled_tags
+    VALUE disabled_tags = RARRAY_AREF(entry, PARTIAL_DISABLED_TAGS);
+    rb_block_call(vm->context.self, id_with_disabled_tags, 1, &disabled_tags, partial_render_with_disabled_tags, (VALUE)&args);
+    RB_GC_GUARD(entry);
+    RB_GC_GUARD(attributes);
+}
+
+void liquid_define_partial(void)
+{
+    id_c_load_partial = rb_intern("c_load_partial");
+    id_compare_by_identity = rb_intern("compare_by_identity");
+    id_with_disabled_tags = rb_intern("with_disabled_tags");
+    id_new_isolated_subcontext = rb_intern("new_isolated_subcontext");
+    id_render_to_output_buffer = rb_intern("render_to_output_buffer");
+    id_handle_error = rb_intern("handle_error");
+    id_each = rb_intern("each");
+    id_count = rb_intern("count");
+    id_ivar_template_name = rb_intern("@template_name");
+    id_ivar_partial = rb_intern("@partial");
+    id_ivar_scopes = rb_intern("@scopes");
+
+    str_forloop = rb_obj_freeze(rb_str_new_cstr("forloop"));
+    rb_global_variable(&str_forloop);
+}
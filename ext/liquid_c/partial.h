@@ -0,0 +1,14 @@
+#if !defined(LIQUID_PARTIAL_H)
+#define LIQUID_PARTIAL_H
+
+#include "liquid.h"
+#include "liquid_vm.h"
+
+// Flags for the OP_RENDER_PARTIAL instruction
+#define RENDER_PARTIAL_FOR_LOOP 0x1
+
+void liquid_define_partial(void);
+void partial_render(vm_t *vm, VALUE node, VALUE template_name, VALUE variable_name, VALUE variable,
+                    VALUE attributes, uint8_t flags, VALUE output);
+
+#endif
@@ -20,12 +20,13 @@ const rb_data_type_t resource_limits_data_type = {
     NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
 };
 
-static void resource_limits_reset(resource_limits_t *resource_limit)
+void resource_limits_reset(resource_limits_t *resource_limit)
 {
     resource_limit->reached_limit = true;
     resource_limit->last_capture_length = -1;
     resource_limit->render_score = 0;
     resource_limit->assign_score = 0;
+    resource_limit->flushed_output_length = 0;
 }
 
 static VALUE resource_limits_allocate(VALUE klass)
@@ -157,7 +158,7 @@ static VALUE resource_limits_increment_render_score_method(VALUE self, VALUE amo
     return Qnil;
 }
 
-static void resource_limits_increment_assign_score(resource_limits_t *resource_limits, long amount)
+void resource_limits_increment_assign_score(resource_limits_t *resource_limits, long amount)
 {
     resource_limits->assign_score = resource_limits->assign_score + amount;
 
@@ -184,7 +185,7 @@ void resource_limits_increment_write_score(resource_limits_t *resource_limits, V
         long increment = captured - resource_limits->last_capture_length;
         resource_limits->last_capture_length = captured;
         resource_limits_increment_assign_score(resource_limits, increment);
-    } else if (captured > resource_limits->render_length_limit) {
+    } else if (captured + resource_limits->flushed_output_length > resource_limits->render_length_limit) {
         resource_limits_raise_limits_reached(resource_limits);
     }
 }
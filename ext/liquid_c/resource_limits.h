@@ -9,6 +9,7 @@ typedef struct resource_limits {
     long last_capture_length;
     long render_score;
     long assign_score;
+    long flushed_output_length; // written by a streaming render before the current output
 } resource_limits_t;
 
 extern VALUE cLiquidResourceLimits;
@@ -16,8 +17,10 @@ extern const rb_data_type_t resource_limits_data_type;
 #define ResourceLimits_Get_Struct(obj, sval) TypedData_Get_Struct(obj, resource_limits_t, &resource_limits_data_type, sval)
 
 void liquid_define_resource_limits(void);
+void resource_limits_reset(resource_limits_t *resource_limit);
 void resource_limits_raise_limits_reached(resource_limits_t *resource_limit);
 void resource_limits_increment_render_score(resource_limits_t *resource_limits, long amount);
+void resource_limits_increment_assign_score(resource_limits_t *resource_limits, long amount);
 void resource_limits_increment_write_score(resource_limits_t *resource_limits, VALUE output);
 
 #endif
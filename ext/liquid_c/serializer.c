@@ -0,0 +1,358 @@
+#include <string.h>
+#include "liquid.h"
+#include "serializer.h"
+#include "document_body.h"
+#include "block.h"
+#include "expression.h"
+
+enum value_tag {
+    VALUE_TAG_NIL = 0,
+    VALUE_TAG_TRUE,
+    VALUE_TAG_FALSE,
+    VALUE_TAG_FIXNUM,
+    VALUE_TAG_FLOAT,
+    VALUE_TAG_BIGNUM,
+    VALUE_TAG_STRING,
+    VALUE_TAG_SYMBOL,
+    VALUE_TAG_RANGE,
+    VALUE_TAG_ARRAY,
+    VALUE_TAG_HASH,
+    VALUE_TAG_BLOCK_BODY,
+    VALUE_TAG_EXPRESSION,
+    VALUE_TAG_NODE,
+};
+
+#define STRING_FLAG_FROZEN (1 << 0)
+
+static VALUE cLiquidCInvalidDump, mMarshal;
+static ID id_dump, id_load;
+
+void raise_invalid_dump(const char *reason)
+{
+    rb_raise(cLiquidCInvalidDump, "invalid liquid-c dump: %s", reason);
+}
+
+void serializer_write_bytes(serializer_t *serializer, const void *data, size_t size)
+{
+    rb_str_buf_cat(serializer->output, data, size);
+}
+
+void serializer_write_uint32(serializer_t *serializer, uint32_t value)
+{
+    serializer_write_bytes(serializer, &value, sizeof(value));
+}
+
+static void serializer_write_byte(serializer_t *serializer, uint8_t value)
+{
+    serializer_write_bytes(serializer, &value, 1);
+}
+
+static void serializer_write_string_bytes(serializer_t *serializer, VALUE string)
+{
+    long len = RSTRING_LEN(string);
+    if (len > UINT32_MAX)
+        rb_raise(rb_eArgError, "string constant too large to dump");
+    serializer_write_uint32(serializer, (uint32_t)len);
+    serializer_write_bytes(serializer, RSTRING_PTR(string), len);
+}
+
+static void serializer_write_encoding(serializer_t *serializer, VALUE string)
+{
+    int encoding_index = ENCODING_GET(string);
+    if (encoding_index == utf8_encoding_index) {
+        serializer_write_byte(serializer, 0);
+    } else {
+        const char *name = rb_enc_name(rb_enc_from_index(encoding_index));
+        size_t name_len = strlen(name);
+        assert(name_len > 0 && name_len < 256);
+        serializer_write_byte(serializer, (uint8_t)name_len);
+        serializer_write_bytes(serializer, name, name_len);
+    }
+}
+
+static void serializer_write_length(serializer_t *serializer, long len)
+{
+    if (len > UINT32_MAX)
+        rb_raise(rb_eArgError, "constant too large to dump");
+    serializer_write_uint32(serializer, (uint32_t)len);
+}
+
+static void serialize_block_body(serializer_t *serializer, VALUE block_body_obj)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(block_body_obj, body);
+
+    if (!body->compiled || body->as.compiled.document_body_entry.body->self != serializer->document_body)
+        rb_raise(rb_eArgError, "can't dump a Liquid::C::BlockBody outside of its document body");
+    serializer_write_byte(serializer, VALUE_TAG_BLOCK_BODY);
+    serializer_write_uint32(serializer, (uint32_t)body->as.compiled.document_body_entry.buffer_offset);
+}
+
+static void serialize_expression(serializer_t *serializer, VALUE expression_obj)
+{
+    expression_t *expression;
+    Expression_Get_Struct(expression_obj, expression);
+    vm_assembler_t *code = &expression->code;
+
+    serializer_write_byte(serializer, VALUE_TAG_EXPRESSION);
+    serializer_write_uint32(serializer, (uint32_t)code->max_stack_size);
+    serializer_write_uint32(serializer, (uint32_t)c_buffer_size(&code->instructions));
+    serializer_write_bytes(serializer, code->instructions.data, c_buffer_size(&code->instructions));
+
+    size_t constants_len = c_buffer_size(&code->constants) / sizeof(VALUE);
+    serializer_write_uint32(serializer, (uint32_t)constants_len);
+    const VALUE *constants = (const VALUE *)code->constants.data;
+    for (size_t i = 0; i < constants_len; i++) {
+        serializer_write_value(serializer, constants[i]);
+    }
+}
+
+static int serialize_hash_pair(VALUE key, VALUE value, VALUE arg)
+{
+    serializer_t *serializer = (serializer_t *)arg;
+    serializer_write_value(serializer, key);
+    serializer_write_value(serializer, value);
+    return ST_CONTINUE;
+}
+
+static void serialize_node(serializer_t *serializer, VALUE node)
+{
+    VALUE dumped;
+    if (NIL_P(serializer->node_dumper)) {
+        dumped = rb_funcall(mMarshal, id_dump, 1, node);
+    } else {
+        dumped = rb_funcall(serializer->node_dumper, id_call, 1, node);
+        if (!RB_TYPE_P(dumped, T_STRING))
+            rb_raise(rb_eTypeError, "node dumper must return a String, got %"PRIsVALUE, rb_obj_class(dumped));
+    }
+    serializer_write_byte(serializer, VALUE_TAG_NODE);
+    serializer_write_string_bytes(serializer, dumped);
+}
+
+void serializer_write_value(serializer_t *serializer, VALUE value)
+{
+    if (value == Qnil) {
+        serializer_write_byte(serializer, VALUE_TAG_NIL);
+    } else if (value == Qtrue) {
+        serializer_write_byte(serializer, VALUE_TAG_TRUE);
+    } else if (value == Qfalse) {
+        serializer_write_byte(serializer, VALUE_TAG_FALSE);
+    } else if (RB_FIXNUM_P(value)) {
+        int64_t num = FIX2LONG(value);
+        serializer_write_byte(serializer, VALUE_TAG_FIXNUM);
+        serializer_write_bytes(serializer, &num, sizeof(num));
+    } else if (RB_FLOAT_TYPE_P(value)) {
+        double num = RFLOAT_VALUE(value);
+        serializer_write_byte(serializer, VALUE_TAG_FLOAT);
+        serializer_write_bytes(serializer, &num, sizeof(num));
+    } else if (RB_TYPE_P(value, T_BIGNUM)) {
+        serializer_write_byte(serializer, VALUE_TAG_BIGNUM);
+        serializer_write_string_bytes(serializer, rb_big2str(value, 16));
+    } else if (RB_SYMBOL_P(value)) {
+        VALUE name = rb_sym2str(value);
+        serializer_write_byte(serializer, VALUE_TAG_SYMBOL);
+        serializer_write_encoding(serializer, name);
+        serializer_write_string_bytes(serializer, name);
+    } else if (RB_TYPE_P(value, T_STRING) && RBASIC_CLASS(value) == rb_cString) {
+        serializer_write_byte(serializer, VALUE_TAG_STRING);
+        serializer_write_byte(serializer, RB_OBJ_FROZEN(value) ? STRING_FLAG_FROZEN : 0);
+        serializer_write_encoding(serializer, value);
+        serializer_write_string_bytes(serializer, value);
+    } else if (RBASIC_CLASS(value) == rb_cRange) {
+        VALUE range_begin, range_end;
+        int exclude_end;
+        rb_range_values(value, &range_begin, &range_end, &exclude_end);
+        serializer_write_byte(serializer, VALUE_TAG_RANGE);
+        serializer_write_byte(serializer, exclude_end ? 1 : 0);
+        serializer_write_value(serializer, range_begin);
+        serializer_write_value(serializer, range_end);
+    } else if (RB_TYPE_P(value, T_ARRAY) && RBASIC_CLASS(value) == rb_cArray) {
+        long len = RARRAY_LEN(value);
+        serializer_write_byte(serializer, VALUE_TAG_ARRAY);
+        serializer_write_length(serializer, len);
+        for (long i = 0; i < len; i++) {
+            serializer_write_value(serializer, RARRAY_AREF(value, i));
+        }
+    } else if (RB_TYPE_P(value, T_HASH) && RBASIC_CLASS(value) == rb_cHash) {
+        serializer_write_byte(serializer, VALUE_TAG_HASH);
+        serializer_write_length(serializer, RHASH_SIZE(value));
+        rb_hash_foreach(value, serialize_hash_pair, (VALUE)serializer);
+    } else if (rb_typeddata_is_kind_of(value, &block_body_data_type)) {
+        serialize_block_body(serializer, value);
+    } else if (rb_typeddata_is_kind_of(value, &expression_data_type)) {
+        serialize_expression(serializer, value);
+    } else {
+        serialize_node(serializer, value);
+    }
+}
+
+const uint8_t *deserializer_read_bytes(deserializer_t *deserializer, size_t size)
+{
+    if ((size_t)(deserializer->end - deserializer->cursor) < size)
+        raise_invalid_dump("unexpected end of data");
+    const uint8_t *bytes = deserializer->cursor;
+    deserializer->cursor += size;
+    return bytes;
+}
+
+uint32_t deserializer_read_uint32(deserializer_t *deserializer)
+{
+    uint32_t value;
+    memcpy(&value, deserializer_read_bytes(deserializer, sizeof(value)), sizeof(value));
+    return value;
+}
+
+static uint8_t deserializer_read_byte(deserializer_t *deserializer)
+{
+    return *deserializer_read_bytes(deserializer, 1);
+}
+
+static rb_encoding *deserializer_read_encoding(deserializer_t *deserializer)
+{
+    uint8_t name_len = deserializer_read_byte(deserializer);
+    if (name_len == 0)
+        return utf8_encoding;
+
+    char name[256];
+    memcpy(name, deserializer_read_bytes(deserializer, name_len), name_len);
+    name[name_len] = '\0';
+    int encoding_index = rb_enc_find_index(name);
+    if (encoding_index < 0)
+        raise_invalid_dump("unknown encoding");
+    return rb_enc_from_index(encoding_index);
+}
+
+static VALUE deserializer_read_string(deserializer_t *deserializer, rb_encoding *encoding)
+{
+    uint32_t len = deserializer_read_uint32(deserializer);
+    const uint8_t *bytes = deserializer_read_bytes(deserializer, len);
+    return rb_enc_str_new((const char *)bytes, len, encoding);
+}
+
+static VALUE deserialize_block_body(deserializer_t *deserializer)
+{
+    uint32_t buffer_offset = deserializer_read_uint32(deserializer);
+    if (NIL_P(deserializer->document_body))
+        raise_invalid_dump("block body reference outside of a document body");
+    return block_body_new_compiled(deserializer->document_body, buffer_offset);
+}
+
+static VALUE deserialize_expression(deserializer_t *deserializer)
+{
+    expression_t *expression;
+    VALUE expression_obj = expression_new(cLiquidCExpression, &expression);
+    vm_assembler_t *code = &expression->code;
+
+    code->max_stack_size = deserializer_read_uint32(deserializer);
+    uint32_t instructions_bytes = deserializer_read_uint32(deserializer);
+    if (instructions_bytes == 0)
+        raise_invalid_dump("empty expression");
+    const uint8_t *instructions = deserializer_read_bytes(deserializer, instructions_bytes);
+    c_buffer_write(&code->instructions, (void *)instructions, instructions_bytes);
+    if (code->instructions.data[instructions_bytes - 1] != OP_LEAVE)
+        raise_invalid_dump("unterminated expression");
+
+    uint32_t constants_len = deserializer_read_uint32(deserializer);
+    for (uint32_t i = 0; i < constants_len; i++) {
+        VALUE constant = deserializer_read_value(deserializer);
+        c_buffer_write_ruby_value(&code->constants, constant);
+    }
+    code->parsing = false;
+    return expression_obj;
+}
+
+static VALUE deserialize_node(deserializer_t *deserializer)
+{
+    VALUE dumped = deserializer_read_string(deserializer, rb_ascii8bit_encoding());
+    if (NIL_P(deserializer->node_loader))
+        return rb_funcall(mMarshal, id_load, 1, dumped);
+    return rb_funcall(deserializer->node_loader, id_call, 1, dumped);
+}
+
+VALUE deserializer_read_value(deserializer_t *deserializer)
+{
+    uint8_t tag = deserializer_read_byte(deserializer);
+    switch (tag) {
+        case VALUE_TAG_NIL:
+            return Qnil;
+        case VALUE_TAG_TRUE:
+            return Qtrue;
+        case VALUE_TAG_FALSE:
+            return Qfalse;
+        case VALUE_TAG_FIXNUM:
+        {
+            int64_t num;
+            memcpy(&num, deserializer_read_bytes(deserializer, sizeof(num)), sizeof(num));
+            return LL2NUM(num);
+        }
+        case VALUE_TAG_FLOAT:
+        {
+            double num;
+            memcpy(&num, deserializer_read_bytes(deserializer, sizeof(num)), sizeof(num));
+            return DBL2NUM(num);
+        }
+        case VALUE_TAG_BIGNUM:
+            return rb_str_to_inum(deserializer_read_string(deserializer, rb_usascii_encoding()), 16, false);
+        case VALUE_TAG_SYMBOL:
+        {
+            rb_encoding *encoding = deserializer_read_encoding(deserializer);
+            return rb_str_intern(deserializer_read_string(deserializer, encoding));
+        }
+        case VALUE_TAG_STRING:
+        {
+            uint8_t flags = deserializer_read_byte(deserializer);
+            rb_encoding *encoding = deserializer_read_encoding(deserializer);
+            VALUE string = deserializer_read_string(deserializer, encoding);
+            if (flags & STRING_FLAG_FROZEN)
+                rb_obj_freeze(string);
+            return string;
+        }
+        case VALUE_TAG_RANGE:
+        {
+            bool exclude_end = deserializer_read_byte(deserializer);
+            VALUE range_begin = deserializer_read_value(deserializer);
+            VALUE range_end = deserializer_read_value(deserializer);
+            return rb_range_new(range_begin, range_end, exclude_end);
+        }
+        case VALUE_TAG_ARRAY:
+        {
+            uint32_t len = deserializer_read_uint32(deserializer);
+            VALUE array = rb_ary_new();
+            for (uint32_t i = 0; i < len; i++) {
+                rb_ary_push(array, deserializer_read_value(deserializer));
+            }
+            return array;
+        }
+        case VALUE_TAG_HASH:
+        {
+            uint32_t len = deserializer_read_uint32(deserializer);
+            VALUE hash = rb_hash_new();
+            for (uint32_t i = 0; i < len; i++) {
+                VALUE key = deserializer_read_value(deserializer);
+                VALUE value = deserializer_read_value(deserializer);
+                rb_hash_aset(hash, key, value);
+            }
+            return hash;
+        }
+        case VALUE_TAG_BLOCK_BODY:
+            return deserialize_block_body(deserializer);
+        case VALUE_TAG_EXPRESSION:
+            return deserialize_expression(deserializer);
+        case VALUE_TAG_NODE:
+            return deserialize_node(deserializer);
+        default:
+            raise_invalid_dump("unknown constant type");
+    }
+}
+
+void liquid_define_serializer(void)
+{
+    id_dump = rb_intern("dump");
+    id_load = rb_intern("load");
+
+    mMarshal = rb_const_get(rb_cObject, rb_intern("Marshal"));
+    rb_global_variable(&mMarshal);
+
+    cLiquidCInvalidDump = rb_define_class_under(mLiquidC, "InvalidDump", rb_eArgError);
+    rb_global_variable(&cLiquidCInvalidDump);
+}
@@ -0,0 +1,40 @@
+#ifndef LIQUID_SERIALIZER_H
+#define LIQUID_SERIALIZER_H
+
+#include "liquid.h"
+
+/*
+ * Binary encoding of the constants referenced by compiled instructions.
+ * Literal values, filter descriptors, Liquid::C::Expression objects and
+ * references to block bodies in the same document body are encoded inline.
+ * Other objects (e.g. tag nodes) are nodes that are converted to and from a
+ * string using the node_dumper and node_loader callables, which default to
+ * Marshal.
+ */
+
+typedef struct serializer {
+    VALUE output;
+    VALUE document_body; // for encoding Liquid::C::BlockBody references, or Qnil
+    VALUE node_dumper;
+} serializer_t;
+
+typedef struct deserializer {
+    const uint8_t *cursor;
+    const uint8_t *end;
+    VALUE document_body;
+    VALUE node_loader;
+} deserializer_t;
+
+void serializer_write_bytes(serializer_t *serializer, const void *data, size_t size);
+void serializer_write_uint32(serializer_t *serializer, uint32_t value);
+void serializer_write_value(serializer_t *serializer, VALUE value);
+
+const uint8_t *deserializer_read_bytes(deserializer_t *deserializer, size_t size);
+uint32_t deserializer_read_uint32(deserializer_t *deserializer);
+VALUE deserializer_read_value(deserializer_t *deserializer);
+
+__attribute__((noreturn)) void raise_invalid_dump(const char *reason);
+
+void liquid_define_serializer(void);
+
+#endif
@@ -0,0 +1,207 @@
+#include "liquid.h"
+#include "standard_filters.h"
+
+static ID id_downcase, id_upcase;
+
+static inline bool plain_string_p(VALUE value)
+{
+    return RB_TYPE_P(value, T_STRING) && RBASIC_CLASS(value) == rb_cString;
+}
+
+static inline bool plain_array_p(VALUE value)
+{
+    return RB_TYPE_P(value, T_ARRAY) && RBASIC_CLASS(value) == rb_cArray;
+}
+
+static inline bool plain_hash_p(VALUE value)
+{
+    return RB_TYPE_P(value, T_HASH) && RBASIC_CLASS(value) == rb_cHash;
+}
+
+// Equivalent to Liquid::Utils.to_s for the types it handles, otherwise returns Qundef
+static VALUE basic_value_to_s(VALUE value)
+{
+    if (plain_string_p(value))
+        return value;
+    if (RB_FIXNUM_P(value))
+        return rb_fix2str(value, 10);
+    if (value == Qnil)
+        return rb_enc_str_new("", 0, utf8_encoding);
+    return Qundef;
+}
+
+VALUE standard_filter_size(int argc, const VALUE *argv)
+{
+    if (argc != 1)
+        return Qundef;
+
+    VALUE input = argv[0];
+    if (plain_string_p(input))
+        return rb_str_length(input);
+    if (plain_array_p(input))
+        return LONG2NUM(RARRAY_LEN(input));
+    if (plain_hash_p(input))
+        return rb_hash_size(input);
+    if (input == Qnil)
+        return INT2FIX(0);
+    return Qundef;
+}
+
+VALUE standard_filter_downcase(int argc, const VALUE *argv)
+{
+    if (argc != 1 || !plain_string_p(argv[0]))
+        return Qundef;
+    return rb_funcall(argv[0], id_downcase, 0);
+}
+
+VALUE standard_filter_upcase(int argc, const VALUE *argv)
+{
+    if (argc != 1 || !plain_string_p(argv[0]))
+        return Qundef;
+    return rb_funcall(argv[0], id_upcase, 0);
+}
+
+// Equivalent to CGI.escapeHTML
+static VALUE escape_html(VALUE string)
+{
+    const char *start = RSTRING_PTR(string);
+    const char *end = start + RSTRING_LEN(string);
+    const char *unescaped_start = start;
+    VALUE result = Qnil;
+
+    for (const char *ptr = start; ptr < end; ptr++) {
+        const char *replacement;
+        long replacement_len;
+        switch (*ptr) {
+            case '\'': replacement = "&#39;"; replacement_len = 5; break;
+            case '&': replacement = "&amp;"; replacement_len = 5; break;
+            case '"': replacement = "&quot;"; replacement_len = 6; break;
+            case '<': replacement = "&lt;"; replacement_len = 4; break;
+            case '>': replacement = "&gt;"; replacement_len = 4; break;
+            default: continue;
+        }
+        if (result == Qnil) {
+            result = rb_str_buf_new(RSTRING_LEN(string) + 16);
+            rb_enc_copy(result, string);
+        }
+        rb_str_buf_cat(result, unescaped_start, ptr - unescaped_start);
+        rb_str_buf_cat(result, replacement, replacement_len);
+        unescaped_start = ptr + 1;
+    }
+
+    if (result == Qnil)
+        return rb_str_dup(string);
+    rb_str_buf_cat(result, unescaped_start, end - unescaped_start);
+    return result;
+}
+
+VALUE standard_filter_escape(int argc, const VALUE *argv)
+{
+    if (argc != 1)
+        return Qundef;
+
+    VALUE input = argv[0];
+    if (input == Qnil)
+        return Qnil;
+    if (!plain_string_p(input) || !rb_enc_asciicompat(rb_enc_get(input)))
+        return Qundef;
+    return escape_html(input);
+}
+
+VALUE standard_filter_append(int argc, const VALUE *argv)
+{
+    if (argc != 2)
+        return Qundef;
+
+    VALUE input = basic_value_to_s(argv[0]);
+    VALUE string = basic_value_to_s(argv[1]);
+    if (input == Qundef || string == Qundef)
+        return Qundef;
+    return rb_str_plus(input, string);
+}
+
+VALUE standard_filter_prepend(int argc, const VALUE *argv)
+{
+    if (argc != 2)
+        return Qundef;
+
+    VALUE input = basic_value_to_s(argv[0]);
+    VALUE string = basic_value_to_s(argv[1]);
+    if (input == Qundef || string == Qundef)
+        return Qundef;
+    return rb_str_plus(string, input);
+}
+
+/*
+ * Liquid's apply_operation converts floats to BigDecimal for the arithmetic filters,
+ * so only integer arithmetic is done natively. The result of an overflow doesn't fit
+ * in a long, so those are also left to ruby to return a Bignum.
+ */
+
+VALUE standard_filter_plus(int argc, const VALUE *argv)
+{
+    if (argc != 2 || !RB_FIXNUM_P(argv[0]) || !RB_FIXNUM_P(argv[1]))
+        return Qundef;
+    // the sum of two fixnums can't overflow a long
+    return LONG2NUM(FIX2LONG(argv[0]) + FIX2LONG(argv[1]));
+}
+
+VALUE standard_filter_minus(int argc, const VALUE *argv)
+{
+    if (argc != 2 || !RB_FIXNUM_P(argv[0]) || !RB_FIXNUM_P(argv[1]))
+        return Qundef;
+    return LONG2NUM(FIX2LONG(argv[0]) - FIX2LONG(argv[1]));
+}
+
+VALUE standard_filter_times(int argc, const VALUE *argv)
+{
+    if (argc != 2 || !RB_FIXNUM_P(argv[0]) || !RB_FIXNUM_P(argv[1]))
+        return Qundef;
+#if defined(__GNUC__)
+    long result;
+    if (__builtin_mul_overflow(FIX2LONG(argv[0]), FIX2LONG(argv[1]), &result))
+        return Qundef;
+    return LONG2NUM(result);
+#else
+    return Qundef;
+#endif
+}
+
+// Values that are their own liquid value and that have a builtin #empty? if any
+static inline bool basic_value_p(VALUE value)
+{
+    return RB_SPECIAL_CONST_P(value) || RB_FLOAT_TYPE_P(value) ||
+        plain_string_p(value) || plain_array_p(value) || plain_hash_p(value);
+}
+
+VALUE standard_filter_default(int argc, const VALUE *argv)
+{
+    // the allow_false keyword argument is passed as a hash
+    if (argc != 2)
+        return Qundef;
+
+    VALUE input = argv[0];
+    VALUE default_value = argv[1];
+    if (!basic_value_p(input) || !basic_value_p(default_value) || RB_SYMBOL_P(input))
+        return Qundef;
+
+    bool use_default;
+    if (!RTEST(input)) {
+        use_default = true;
+    } else if (plain_string_p(input)) {
+        use_default = RSTRING_LEN(input) == 0;
+    } else if (plain_array_p(input)) {
+        use_default = RARRAY_LEN(input) == 0;
+    } else if (plain_hash_p(input)) {
+        use_default = RHASH_SIZE(input) == 0;
+    } else {
+        use_default = false;
+    }
+    return use_default ? default_value : input;
+}
+
+void liquid_define_standard_filters(void)
+{
+    id_downcase = rb_intern("downcase");
+    id_upcase = rb_intern("upcase");
+}
@@ -0,0 +1,26 @@
+#if !defined(LIQUID_STANDARD_FILTERS_H)
+#define LIQUID_STANDARD_FILTERS_H
+
+#include "liquid.h"
+
+/*
+ * Native implementations of methods from Liquid::StandardFilters, which are
+ * called with the input and arguments of the filter. They return Qundef for
+ * argument types they don't handle, so the filter is invoked on the strainer.
+ */
+typedef VALUE (*native_filter_func_t)(int argc, const VALUE *argv);
+
+VALUE standard_filter_size(int argc, const VALUE *argv);
+VALUE standard_filter_downcase(int argc, const VALUE *argv);
+VALUE standard_filter_upcase(int argc, const VALUE *argv);
+VALUE standard_filter_escape(int argc, const VALUE *argv);
+VALUE standard_filter_append(int argc, const VALUE *argv);
+VALUE standard_filter_prepend(int argc, const VALUE *argv);
+VALUE standard_filter_plus(int argc, const VALUE *argv);
+VALUE standard_filter_minus(int argc, const VALUE *argv);
+VALUE standard_filter_times(int argc, const VALUE *argv);
+VALUE standard_filter_default(int argc, const VALUE *argv);
+
+void liquid_define_standard_filters(void);
+
+#endif
@@ -2,6 +2,7 @@
 #include "liquid.h"
 #include "tokenizer.h"
 #include "stringutil.h"
+#include "tokenizer_scan.h"
 
 VALUE cLiquidTokenizer;
 
@@ -121,13 +122,9 @@ static void tokenizer_next_for_template(tokenizer_t *tokenizer, token_t *token)
     token->str_full = cursor;
     token->type = TOKEN_RAW;
 
-    while (cursor < last) {
-        if (*cursor++ != '{')
-            continue;
-
+    while ((cursor = tokenizer_scan->find_pair(cursor, last, '{', '%', '{')) < last) {
+        cursor++;
         char c = *cursor++;
-        if (c != '%' && c != '{')
-            continue;
         if (cursor <= last && *cursor == '-') {
             cursor++;
             token->rstrip = 1;
@@ -144,14 +141,9 @@ static void tokenizer_next_for_template(tokenizer_t *tokenizer, token_t *token)
         token->lstrip = token->rstrip;
         token->rstrip = 0;
         if (c == '%') {
-            while (cursor < last) {
-                if (*cursor++ != '%')
-                    continue;
-                c = *cursor++;
-                while (c == '%' && cursor <= last)
-                    c = *cursor++;
-                if (c != '}')
-                    continue;
+            cursor = tokenizer_scan->find_pair(cursor, last, '%', '}', '}');
+            if (cursor < last) {
+                cursor += 2;
                 token->type = TOKEN_TAG;
                 if(cursor[-3] == '-')
                     token->rstrip = tokenizer->lstrip_flag = true;
@@ -162,9 +154,9 @@ static void tokenizer_next_for_template(tokenizer_t *tokenizer, token_t *token)
             tokenizer->lstrip_flag = false;
             goto found;
         } else {
-            while (cursor < last) {
-                if (*cursor++ != '}')
-                    continue;
+            cursor = tokenizer_scan->find_byte(cursor, last, '}');
+            if (cursor < last) {
+                cursor++;
                 if (*cursor++ != '}') {
                     // variable incomplete end, used to end raw tags
                     cursor--;
@@ -280,8 +272,39 @@ static VALUE tokenizer_bug_compatible_whitespace_trimming(VALUE self) {
     return Qnil;
 }
 
+static void push_scan_name(const tokenizer_scan_t *scan, void *data)
+{
+    rb_ary_push((VALUE)data, ID2SYM(rb_intern(scan->name)));
+}
+
+static VALUE tokenizer_scan_implementations_method(VALUE klass)
+{
+    VALUE names = rb_ary_new();
+    tokenizer_scan_each_supported(push_scan_name, (void *)names);
+    return names;
+}
+
+static VALUE tokenizer_scan_implementation_method(VALUE klass)
+{
+    return ID2SYM(rb_intern(tokenizer_scan->name));
+}
+
+// Allows comparing the output and performance of the delimiter scanning
+// implementations, which default to the fastest one the CPU supports
+static VALUE tokenizer_set_scan_implementation_method(VALUE klass, VALUE name)
+{
+    Check_Type(name, T_SYMBOL);
+    const tokenizer_scan_t *scan = tokenizer_scan_lookup(rb_id2name(rb_sym2id(name)));
+    if (!scan)
+        rb_raise(rb_eArgError, "unsupported scan implementation %"PRIsVALUE, name);
+    tokenizer_scan = scan;
+    return name;
+}
+
 void liquid_define_tokenizer(void)
 {
+    init_tokenizer_scan();
+
     cLiquidTokenizer = rb_define_class_under(mLiquidC, "Tokenizer", rb_cObject);
     rb_global_variable(&cLiquidTokenizer);
 
@@ -292,6 +315,10 @@ void liquid_define_tokenizer(void)
     rb_define_method(cLiquidTokenizer, "bug_compatible_whitespace_trimming!", tokenizer_bug_compatible_whitespace_trimming, 0);
     rb_define_method(cLiquidTokenizer, "shift", tokenizer_shift_method, 0);
 
+    rb_define_singleton_method(cLiquidTokenizer, "scan_implementations", tokenizer_scan_implementations_method, 0);
+    rb_define_singleton_method(cLiquidTokenizer, "scan_implementation", tokenizer_scan_implementation_method, 0);
+    rb_define_singleton_method(cLiquidTokenizer, "scan_implementation=", tokenizer_set_scan_implementation_method, 1);
+
     // For testing the internal token representation.
     rb_define_private_method(cLiquidTokenizer, "shift_trimmed", tokenizer_shift_trimmed_method, 0);
 }
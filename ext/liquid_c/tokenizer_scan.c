@@ -0,0 +1,215 @@
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "tokenizer_scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define HAVE_SCAN_SSE2 1
+#include <emmintrin.h>
+#if defined(__has_attribute)
+#if __has_attribute(target)
+#define HAVE_SCAN_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+static const char *scalar_find_byte(const char *start, const char *last, char c)
+{
+    if (start >= last)
+        return last;
+    const char *found = memchr(start, c, last - start);
+    return found ? found : last;
+}
+
+static const char *scalar_find_pair(const char *start, const char *last, char first, char second_a, char second_b)
+{
+    for (const char *p = start; p < last; p++) {
+        if (p[0] == first && (p[1] == second_a || p[1] == second_b))
+            return p;
+    }
+    return last;
+}
+
+static const tokenizer_scan_t scalar_scan = { "scalar", scalar_find_byte, scalar_find_pair };
+
+#if defined(HAVE_SCAN_SSE2)
+static const char *sse2_find_byte(const char *start, const char *last, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    const char *p = start;
+    for (; last - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return scalar_find_byte(p, last, c);
+}
+
+// Compares each byte with the byte following it, so the following byte can be
+// read from the next chunk without reading past last
+static const char *sse2_find_pair(const char *start, const char *last, char first, char second_a, char second_b)
+{
+    const __m128i first_needle = _mm_set1_epi8(first);
+    const __m128i second_a_needle = _mm_set1_epi8(second_a);
+    const __m128i second_b_needle = _mm_set1_epi8(second_b);
+    const char *p = start;
+    for (; last - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i next_chunk = _mm_loadu_si128((const __m128i *)(p + 1));
+        __m128i matches = _mm_and_si128(
+            _mm_cmpeq_epi8(chunk, first_needle),
+            _mm_or_si128(_mm_cmpeq_epi8(next_chunk, second_a_needle), _mm_cmpeq_epi8(next_chunk, second_b_needle))
+        );
+        int mask = _mm_movemask_epi8(matches);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return scalar_find_pair(p, last, first, second_a, second_b);
+}
+
+static const tokenizer_scan_t sse2_scan = { "sse2", sse2_find_byte, sse2_find_pair };
+#endif
+
+#if defined(HAVE_SCAN_AVX2)
+__attribute__((target("avx2")))
+static const char *avx2_find_byte(const char *start, const char *last, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    const char *p = start;
+    for (; last - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return sse2_find_byte(p, last, c);
+}
+
+__attribute__((target("avx2")))
+static const char *avx2_find_pair(const char *start, const char *last, char first, char second_a, char second_b)
+{
+    const __m256i first_needle = _mm256_set1_epi8(first);
+    const __m256i second_a_needle = _mm256_set1_epi8(second_a);
+    const __m256i second_b_needle = _mm256_set1_epi8(second_b);
+    const char *p = start;
+    for (; last - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        __m256i next_chunk = _mm256_loadu_si256((const __m256i *)(p + 1));
+        __m256i matches = _mm256_and_si256(
+            _mm256_cmpeq_epi8(chunk, first_needle),
+            _mm256_or_si256(_mm256_cmpeq_epi8(next_chunk, second_a_needle), _mm256_cmpeq_epi8(next_chunk, second_b_needle))
+        );
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(matches);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return sse2_find_pair(p, last, first, second_a, second_b);
+}
+
+static const tokenizer_scan_t avx2_scan = { "avx2", avx2_find_byte, avx2_find_pair };
+#endif
+
+#if defined(HAVE_SCAN_NEON)
+// NEON has no movemask, so narrow each byte of the comparison to a nibble
+static inline uint64_t neon_match_nibbles(uint8x16_t matches)
+{
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
+
+static const char *neon_find_byte(const char *start, const char *last, char c)
+{
+    const uint8x16_t needle = vdupq_n_u8((uint8_t)c);
+    const char *p = start;
+    for (; last - p >= 16; p += 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *)p);
+        uint64_t nibbles = neon_match_nibbles(vceqq_u8(chunk, needle));
+        if (nibbles)
+            return p + (__builtin_ctzll(nibbles) >> 2);
+    }
+    return scalar_find_byte(p, last, c);
+}
+
+static const char *neon_find_pair(const char *start, const char *last, char first, char second_a, char second_b)
+{
+    const uint8x16_t first_needle = vdupq_n_u8((uint8_t)first);
+    const uint8x16_t second_a_needle = vdupq_n_u8((uint8_t)second_a);
+    const uint8x16_t second_b_needle = vdupq_n_u8((uint8_t)second_b);
+    const char *p = start;
+    for (; last - p >= 16; p += 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *)p);
+        uint8x16_t next_chunk = vld1q_u8((const uint8_t *)(p + 1));
+        uint8x16_t matches = vandq_u8(
+            vceqq_u8(chunk, first_needle),
+            vorrq_u8(vceqq_u8(next_chunk, second_a_needle), vceqq_u8(next_chunk, second_b_needle))
+        );
+        uint64_t nibbles = neon_match_nibbles(matches);
+        if (nibbles)
+            return p + (__builtin_ctzll(nibbles) >> 2);
+    }
+    return scalar_find_pair(p, last, first, second_a, second_b);
+}
+
+static const tokenizer_scan_t neon_scan = { "neon", neon_find_byte, neon_find_pair };
+#endif
+
+const tokenizer_scan_t *tokenizer_scan = &scalar_scan;
+
+static bool scan_supported(const tokenizer_scan_t *scan)
+{
+#if defined(HAVE_SCAN_AVX2)
+    if (scan == &avx2_scan) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return true;
+}
+
+// In order of preference
+static const tokenizer_scan_t *const scans[] = {
+#if defined(HAVE_SCAN_AVX2)
+    &avx2_scan,
+#endif
+#if defined(HAVE_SCAN_SSE2)
+    &sse2_scan,
+#endif
+#if defined(HAVE_SCAN_NEON)
+    &neon_scan,
+#endif
+    &scalar_scan,
+};
+
+void tokenizer_scan_each_supported(void (*func)(const tokenizer_scan_t *scan, void *data), void *data)
+{
+    for (size_t i = 0; i < sizeof(scans) / sizeof(scans[0]); i++) {
+        if (scan_supported(scans[i]))
+            func(scans[i], data);
+    }
+}
+
+const tokenizer_scan_t *tokenizer_scan_lookup(const char *name)
+{
+    for (size_t i = 0; i < sizeof(scans) / sizeof(scans[0]); i++) {
+        if (strcmp(scans[i]->name, name) == 0 && scan_supported(scans[i]))
+            return scans[i];
+    }
+    return NULL;
+}
+
+void init_tokenizer_scan(void)
+{
+    for (size_t i = 0; i < sizeof(scans) / sizeof(scans[0]); i++) {
+        if (scan_supported(scans[i])) {
+            tokenizer_scan = scans[i];
+            return;
+        }
+    }
+}
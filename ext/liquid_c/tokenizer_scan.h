@@ -0,0 +1,24 @@
+#if !defined(LIQUID_TOKENIZER_SCAN_H)
+#define LIQUID_TOKENIZER_SCAN_H
+
+/*
+ * Delimiter scanning used by the template tokenizer, which is vectorized
+ * when the CPU supports it. Both functions search [start, last) and return
+ * last if there is no match.
+ */
+typedef struct tokenizer_scan {
+    const char *name;
+    // Find the first byte equal to c
+    const char *(*find_byte)(const char *start, const char *last, char c);
+    // Find the first byte equal to first that is followed by second_a or second_b,
+    // where the byte following it may be last
+    const char *(*find_pair)(const char *start, const char *last, char first, char second_a, char second_b);
+} tokenizer_scan_t;
+
+extern const tokenizer_scan_t *tokenizer_scan;
+
+void init_tokenizer_scan(void);
+const tokenizer_scan_t *tokenizer_scan_lookup(const char *name);
+void tokenizer_scan_each_supported(void (*func)(const tokenizer_scan_t *scan, void *data), void *data);
+
+#endif
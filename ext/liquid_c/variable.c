@@ -106,7 +106,7 @@ static VALUE variable_strict_parse_rescue(VALUE uncast_args, VALUE exception)
         const_ptr++;
     }
 
-    code->instructions.data_end = code->instructions.data + rescue_args->instructions_size;
+    vm_assembler_truncate_instructions(code, rescue_args->instructions_size);
     code->constants.data_end = last_constants_data_end;
     code->stack_size = rescue_args->stack_size;
 
@@ -1,7 +1,72 @@
 #include "liquid.h"
 #include "context.h"
+#include "variable_lookup.h"
 
-static ID id_has_key, id_aref, id_fetch, id_to_liquid_value;
+static ID id_has_key, id_aref, id_fetch, id_c_lookup_method;
+static VALUE cLiquidDrop;
+
+#define DROP_LOOKUP_CACHE_SIZE 256
+
+/*
+ * Remembers the method that Liquid::Drop#[] invokes for a constant key on
+ * instances of a class, so it can be called directly. The entries are
+ * invalidated by changes to the methods of drop classes using
+ * class_cache_generation, since ruby doesn't expose the class serials that
+ * it uses for its own method caches.
+ */
+typedef struct drop_lookup_cache_entry {
+    VALUE klass;
+    VALUE key;
+    ID method; // 0 if the key can't be looked up directly
+    uint64_t generation;
+} drop_lookup_cache_entry_t;
+
+static drop_lookup_cache_entry_t drop_lookup_cache[DROP_LOOKUP_CACHE_SIZE];
+static VALUE drop_lookup_cache_obj;
+
+static void drop_lookup_cache_mark(void *ptr)
+{
+    for (size_t i = 0; i < DROP_LOOKUP_CACHE_SIZE; i++) {
+        drop_lookup_cache_entry_t *entry = &drop_lookup_cache[i];
+        if (entry->generation == class_cache_generation) {
+            rb_gc_mark(entry->klass);
+            rb_gc_mark(entry->key);
+        }
+    }
+}
+
+static const rb_data_type_t drop_lookup_cache_data_type = {
+    "liquid_drop_lookup_cache",
+    { drop_lookup_cache_mark, NULL, NULL, },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static inline drop_lookup_cache_entry_t *drop_lookup_cache_entry(VALUE klass, VALUE key)
+{
+    uint64_t hash = (((uint64_t)klass >> 3) ^ ((uint64_t)key >> 3)) * UINT64_C(0x9E3779B97F4A7C15);
+    return &drop_lookup_cache[hash >> 56];
+}
+static_assert(DROP_LOOKUP_CACHE_SIZE == 1 << (64 - 56), "drop lookup cache index must cover the cache");
+
+static ID drop_lookup_method(VALUE klass, VALUE key)
+{
+    // methods added to singleton classes wouldn't clear the cache
+    if (!RB_TYPE_P(key, T_STRING) || FL_TEST(klass, FL_SINGLETON) || rb_class_inherited_p(klass, cLiquidDrop) != Qtrue)
+        return 0;
+    VALUE method_name = rb_funcall(klass, id_c_lookup_method, 1, key);
+    return NIL_P(method_name) ? 0 : SYM2ID(method_name);
+}
+
+// Equivalent to `Hash#[]` on a plain hash, if the hash has the key
+static inline bool hash_lookup_key(VALUE object, VALUE key, VALUE *value_out)
+{
+    if (RB_SPECIAL_CONST_P(object) || RBASIC_CLASS(object) != rb_cHash)
+        return false;
+    if (!rb_method_basic_definition_p(rb_cHash, id_aref) || !rb_method_basic_definition_p(rb_cHash, id_has_key))
+        return false;
+    *value_out = rb_hash_lookup2(object, key, Qundef);
+    return *value_out != Qundef;
+}
 
 VALUE variable_lookup_key(VALUE context, VALUE object, VALUE key, bool is_command)
 {
@@ -13,11 +78,17 @@ VALUE variable_lookup_key(VALUE context, VALUE object, VALUE key, bool is_comman
         }
     }
 
+    VALUE next_object;
+    if (hash_lookup_key(object, key, &next_object)) {
+        next_object = materialize_proc(context, object, key, next_object);
+        return value_to_liquid_and_set_context(next_object, context);
+    }
+
     if (rb_respond_to(object, id_aref) && (
         (rb_respond_to(object, id_has_key) && rb_funcall(object, id_has_key, 1, key)) ||
         (rb_obj_is_kind_of(key, rb_cInteger) && rb_respond_to(object, id_fetch))
     )) {
-        VALUE next_object = rb_funcall(object, id_aref, 1, key);
+        next_object = rb_funcall(object, id_aref, 1, key);
         next_object = materialize_proc(context, object, key, next_object);
         return value_to_liquid_and_set_context(next_object, context);
     }
@@ -35,10 +106,42 @@ VALUE variable_lookup_key(VALUE context, VALUE object, VALUE key, bool is_comman
     return Qnil;
 }
 
+// Looks up a key from the constants of compiled code, which calls the method
+// of a drop directly if Liquid::Drop#[] would invoke it
+VALUE variable_lookup_const_key(VALUE context, VALUE object, VALUE key, bool is_command)
+{
+    if (!RB_SPECIAL_CONST_P(object) && RB_BUILTIN_TYPE(object) == T_OBJECT) {
+        VALUE klass = RBASIC_CLASS(object);
+        drop_lookup_cache_entry_t *entry = drop_lookup_cache_entry(klass, key);
+        if (entry->klass != klass || entry->key != key || entry->generation != class_cache_generation) {
+            uint64_t generation = class_cache_generation;
+            ID method = drop_lookup_method(klass, key);
+            entry->klass = klass;
+            entry->key = key;
+            entry->method = method;
+            entry->generation = generation;
+        }
+
+        ID method = entry->method;
+        if (method) {
+            VALUE next_object = rb_funcall(object, method, 0);
+            next_object = materialize_proc(context, object, key, next_object);
+            return value_to_liquid_and_set_context(next_object, context);
+        }
+    }
+    return variable_lookup_key(context, object, key, is_command);
+}
+
 void liquid_define_variable_lookup(void)
 {
     id_has_key = rb_intern("key?");
     id_aref = rb_intern("[]");
     id_fetch = rb_intern("fetch");
-    id_to_liquid_value = rb_intern("to_liquid_value");
+    id_c_lookup_method = rb_intern("c_lookup_method");
+
+    cLiquidDrop = rb_const_get(mLiquid, rb_intern("Drop"));
+    rb_global_variable(&cLiquidDrop);
+
+    drop_lookup_cache_obj = TypedData_Wrap_Struct(0, &drop_lookup_cache_data_type, drop_lookup_cache);
+    rb_global_variable(&drop_lookup_cache_obj);
 }
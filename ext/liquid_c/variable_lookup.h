@@ -3,6 +3,7 @@
 
 void liquid_define_variable_lookup(void);
 VALUE variable_lookup_key(VALUE context, VALUE object, VALUE key, bool is_command);
+VALUE variable_lookup_const_key(VALUE context, VALUE object, VALUE key, bool is_command);
 
 #endif
 
@@ -2,31 +2,36 @@
 #include "vm_assembler.h"
 #include "expression.h"
 #include "liquid_vm.h"
+#include "condition.h"
+#include "for_loop.h"
+#include "variable.h"
+#include "partial.h"
 
 #define ARRAY_LENGTH(array) (sizeof(array) / sizeof(array[0]))
 
 static st_table *builtin_filter_table;
+static ID id_operator;
 
 // methods from Liquid::StandardFilters
 filter_desc_t builtin_filters[] = {
-    { .name = "size" },
-    { .name = "downcase" },
-    { .name = "upcase" },
-    { .name = "capitalize" },
-    { .name = "h" },
-    { .name = "escape" },
-    { .name = "escape_once" },
-    { .name = "url_encode" },
-    { .name = "url_decode" },
-    { .name = "slice" },
-    { .name = "truncate" },
-    { .name = "truncatewords" },
+    { .name = "size", .pure = true, .native = standard_filter_size },
+    { .name = "downcase", .pure = true, .native = standard_filter_downcase },
+    { .name = "upcase", .pure = true, .native = standard_filter_upcase },
+    { .name = "capitalize", .pure = true },
+    { .name = "h", .pure = true, .native = standard_filter_escape },
+    { .name = "escape", .pure = true, .native = standard_filter_escape },
+    { .name = "escape_once", .pure = true },
+    { .name = "url_encode", .pure = true },
+    { .name = "url_decode", .pure = true },
+    { .name = "slice", .pure = true },
+    { .name = "truncate", .pure = true },
+    { .name = "truncatewords", .pure = true },
     { .name = "split" },
-    { .name = "strip" },
-    { .name = "lstrip" },
-    { .name = "rstrip" },
-    { .name = "strip_html" },
-    { .name = "strip_newlines" },
+    { .name = "strip", .pure = true },
+    { .name = "lstrip", .pure = true },
+    { .name = "rstrip", .pure = true },
+    { .name = "strip_html", .pure = true },
+    { .name = "strip_newlines", .pure = true },
     { .name = "join" },
     { .name = "sort" },
     { .name = "sort_natural" },
@@ -35,38 +40,88 @@ filter_desc_t builtin_filters[] = {
     { .name = "reverse" },
     { .name = "map" },
     { .name = "compact" },
-    { .name = "replace" },
-    { .name = "replace_first" },
-    { .name = "remove" },
-    { .name = "remove_first" },
-    { .name = "append" },
+    { .name = "replace", .pure = true },
+    { .name = "replace_first", .pure = true },
+    { .name = "remove", .pure = true },
+    { .name = "remove_first", .pure = true },
+    { .name = "append", .pure = true, .native = standard_filter_append },
     { .name = "concat" },
-    { .name = "prepend" },
-    { .name = "newline_to_br" },
+    { .name = "prepend", .pure = true, .native = standard_filter_prepend },
+    { .name = "newline_to_br", .pure = true },
     { .name = "date" },
     { .name = "first" },
     { .name = "last" },
-    { .name = "abs" },
-    { .name = "plus" },
-    { .name = "minus" },
-    { .name = "times" },
-    { .name = "divided_by" },
-    { .name = "modulo" },
-    { .name = "round" },
-    { .name = "ceil" },
-    { .name = "floor" },
-    { .name = "at_least" },
-    { .name = "at_most" },
-    { .name = "default" },
+    { .name = "abs", .pure = true },
+    { .name = "plus", .pure = true, .native = standard_filter_plus },
+    { .name = "minus", .pure = true, .native = standard_filter_minus },
+    { .name = "times", .pure = true, .native = standard_filter_times },
+    { .name = "divided_by", .pure = true },
+    { .name = "modulo", .pure = true },
+    { .name = "round", .pure = true },
+    { .name = "ceil", .pure = true },
+    { .name = "floor", .pure = true },
+    { .name = "at_least", .pure = true },
+    { .name = "at_most", .pure = true },
+    { .name = "default", .native = standard_filter_default },
 };
 static_assert(ARRAY_LENGTH(builtin_filters) < 256,
         "support for larger than byte sized indexing of filters has not yet been implemented");
+static_assert(ARRAY_LENGTH(builtin_filters) <= 64,
+        "context_t.native_filters needs a bit for each builtin filter");
+
+// Names of the opcodes, like in the disassembly
+const char *const vm_opcode_names[OPCODE_COUNT] = {
+    [OP_LEAVE] = "leave",
+    [OP_WRITE_RAW_W] = "write_raw_w",
+    [OP_WRITE_NODE] = "write_node",
+    [OP_POP_WRITE] = "pop_write",
+    [OP_WRITE_RAW_SKIP] = "write_raw_skip",
+    [OP_PUSH_CONST] = "push_const",
+    [OP_PUSH_NIL] = "push_nil",
+    [OP_PUSH_TRUE] = "push_true",
+    [OP_PUSH_FALSE] = "push_false",
+    [OP_PUSH_INT8] = "push_int8",
+    [OP_PUSH_INT16] = "push_int16",
+    [OP_FIND_STATIC_VAR] = "find_static_var",
+    [OP_FIND_VAR] = "find_var",
+    [OP_LOOKUP_CONST_KEY] = "lookup_const_key",
+    [OP_LOOKUP_KEY] = "lookup_key",
+    [OP_LOOKUP_COMMAND] = "lookup_command",
+    [OP_NEW_INT_RANGE] = "new_int_range",
+    [OP_HASH_NEW] = "hash_new",
+    [OP_FILTER] = "filter",
+    [OP_BUILTIN_FILTER] = "builtin_filter",
+    [OP_RENDER_VARIABLE_RESCUE] = "render_variable_rescue",
+    [OP_WRITE_RAW] = "write_raw",
+    [OP_JUMP_FWD_W] = "jump_fwd_w",
+    [OP_JUMP_FWD] = "jump_fwd",
+    [OP_RENDER_TAG_RESCUE] = "render_tag_rescue",
+    [OP_END_TAG] = "end_tag",
+    [OP_COMPARE] = "compare",
+    [OP_JUMP] = "jump",
+    [OP_JUMP_IF_FALSE] = "jump_if_false",
+    [OP_JUMP_IF_TRUE] = "jump_if_true",
+    [OP_RENDER_BODY] = "render_body",
+    [OP_FOR_INIT] = "for_init",
+    [OP_FOR_NEXT] = "for_next",
+    [OP_FOR_END] = "for_end",
+    [OP_ASSIGN] = "assign",
+    [OP_CAPTURE] = "capture",
+    [OP_CASE_DISPATCH] = "case_dispatch",
+    [OP_RENDER_PARTIAL] = "render_partial",
+    [OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY] = "find_static_var_lookup_const_key",
+    [OP_WRITE_STATIC_VAR] = "write_static_var",
+    [OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY] = "write_static_var_lookup_const_key",
+};
+
+const size_t builtin_filters_count = ARRAY_LENGTH(builtin_filters);
 
 static void vm_assembler_common_init(vm_assembler_t *code)
 {
     code->max_stack_size = 0;
     code->stack_size = 0;
     code->protected_stack_size = 0;
+    code->peephole_offset = SIZE_MAX;
     code->parsing = true;
 }
 
@@ -109,7 +164,7 @@ VALUE vm_assembler_disassemble(const uint8_t *start_ip, const uint8_t *end_ip, c
 
         if (vm_assembler_opcode_has_constant(*ip)) {
             uint16_t constant_index = (ip[1] << 8) | ip[2];
-            constant = RARRAY_AREF(*constants, constant_index);
+            constant = constants[constant_index];
         }
 
         switch (*ip) {
@@ -219,6 +274,114 @@ VALUE vm_assembler_disassemble(const uint8_t *start_ip, const uint8_t *end_ip, c
                 rb_str_catf(output, "builtin_filter(name: :%s, num_args: %u)\n", builtin_filters[ip[1]].name, ip[2]);
                 break;
 
+            case OP_RENDER_TAG_RESCUE:
+                rb_str_catf(output, "render_tag_rescue(%+"PRIsVALUE")\n", constant);
+                break;
+
+            case OP_END_TAG:
+                rb_str_catf(output, "end_tag\n");
+                break;
+
+            case OP_COMPARE:
+                rb_str_catf(output, "compare(%s)\n", condition_operator_name(ip[3]));
+                break;
+
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            {
+                const char *name;
+                if (*ip == OP_JUMP) {
+                    name = "jump";
+                } else if (*ip == OP_JUMP_IF_FALSE) {
+                    name = "jump_if_false";
+                } else {
+                    name = "jump_if_true";
+                }
+                size_t target = (ip + 4 + bytes_to_uint24(&ip[1])) - start_ip;
+                rb_str_catf(output, "%s(0x%04lx)\n", name, target);
+                break;
+            }
+
+            case OP_RENDER_BODY:
+                rb_str_catf(output, "render_body(%+"PRIsVALUE")\n", constant);
+                break;
+
+            case OP_FOR_INIT:
+            {
+                uint16_t name_index = (ip[3] << 8) | ip[4];
+                VALUE name = constants[name_index];
+                size_t else_target = (ip + 9 + bytes_to_uint24(&ip[6])) - start_ip;
+                rb_str_catf(output, "for_init(variable_name: %+"PRIsVALUE", name: %+"PRIsVALUE", reversed: %s, offset_continue: %s, else: 0x%04lx)\n",
+                            constant, name, ip[5] & FOR_LOOP_REVERSED ? "true" : "false",
+                            ip[5] & FOR_LOOP_OFFSET_CONTINUE ? "true" : "false", else_target);
+                break;
+            }
+
+            case OP_FOR_NEXT:
+                rb_str_catf(output, "for_next(%+"PRIsVALUE")\n", constant);
+                break;
+
+            case OP_FOR_END:
+                rb_str_catf(output, "for_end\n");
+                break;
+
+            case OP_ASSIGN:
+                rb_str_catf(output, "assign(%+"PRIsVALUE")\n", constant);
+                break;
+
+            case OP_CAPTURE:
+            {
+                uint16_t body_index = (ip[3] << 8) | ip[4];
+                VALUE block_body = constants[body_index];
+                rb_str_catf(output, "capture(%+"PRIsVALUE", %+"PRIsVALUE")\n", constant, block_body);
+                break;
+            }
+
+            case OP_CASE_DISPATCH:
+            {
+                unsigned int branch_count = ip[3];
+                const uint8_t *targets = &ip[4];
+                const uint8_t *end = targets + (branch_count + 2) * 3;
+                rb_str_catf(output, "case_dispatch(%+"PRIsVALUE", branches: [", constant);
+                for (unsigned int i = 0; i < branch_count; i++) {
+                    size_t target = (end + bytes_to_uint24(&targets[i * 3])) - start_ip;
+                    rb_str_catf(output, i ? ", 0x%04lx" : "0x%04lx", target);
+                }
+                size_t else_target = (end + bytes_to_uint24(&targets[branch_count * 3])) - start_ip;
+                size_t compare_target = (end + bytes_to_uint24(&targets[(branch_count + 1) * 3])) - start_ip;
+                rb_str_catf(output, "], else: 0x%04lx, compare: 0x%04lx)\n", else_target, compare_target);
+                break;
+            }
+
+            case OP_RENDER_PARTIAL:
+            {
+                VALUE template_name = constants[(ip[3] << 8) | ip[4]];
+                VALUE variable_name = constants[(ip[5] << 8) | ip[6]];
+                rb_str_catf(output, "render_partial(%+"PRIsVALUE", variable_name: %+"PRIsVALUE", attributes: %u, for: %s)\n",
+                            template_name, variable_name, ip[7], ip[8] & RENDER_PARTIAL_FOR_LOOP ? "true" : "false");
+                break;
+            }
+
+            case OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY:
+            {
+                VALUE key = constants[(ip[3] << 8) | ip[4]];
+                rb_str_catf(output, "find_static_var_lookup_const_key(%+"PRIsVALUE", %+"PRIsVALUE")\n", constant, key);
+                break;
+            }
+
+            case OP_WRITE_STATIC_VAR:
+                rb_str_catf(output, "write_static_var(%+"PRIsVALUE", line_number: %u)\n", constant, bytes_to_uint24(&ip[3]));
+                break;
+
+            case OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY:
+            {
+                VALUE key = constants[(ip[3] << 8) | ip[4]];
+                rb_str_catf(output, "write_static_var_lookup_const_key(%+"PRIsVALUE", %+"PRIsVALUE", line_number: %u)\n",
+                            constant, key, bytes_to_uint24(&ip[5]));
+                break;
+            }
+
             default:
                 rb_str_catf(output, "<opcode number %d disassembly not implemented>\n", ip[0]);
                 break;
@@ -243,17 +406,27 @@ static int merge_constants_table(st_data_t key, st_data_t value, VALUE _arg)
     return ST_CONTINUE;
 }
 
-void update_instructions_constants_table_index_ref(c_buffer_t *instructions, size_t increment_amount, c_buffer_t *constants)
+static void update_instructions_constants_table_index_ref(uint8_t *ip, const uint8_t *end_ip, size_t increment_amount)
 {
-    uint8_t *ip = instructions->data;
-
-    while (ip < instructions->data_end) {
+    while (ip < end_ip) {
         if (vm_assembler_opcode_has_constant(*ip)) {
             uint16_t constant_index = (ip[1] << 8) | ip[2];
             uint16_t new_constant_index = constant_index + increment_amount;
             ip[1] = new_constant_index >> 8;
             ip[2] = (uint8_t)new_constant_index;
         }
+        if (vm_assembler_opcode_has_second_constant(*ip)) {
+            uint16_t constant_index = (ip[3] << 8) | ip[4];
+            uint16_t new_constant_index = constant_index + increment_amount;
+            ip[3] = new_constant_index >> 8;
+            ip[4] = (uint8_t)new_constant_index;
+        }
+        if (vm_assembler_opcode_has_third_constant(*ip)) {
+            uint16_t constant_index = (ip[5] << 8) | ip[6];
+            uint16_t new_constant_index = constant_index + increment_amount;
+            ip[5] = new_constant_index >> 8;
+            ip[6] = (uint8_t)new_constant_index;
+        }
 
         liquid_vm_next_instruction((const uint8_t **)&ip);
     }
@@ -272,14 +445,18 @@ void vm_assembler_concat(vm_assembler_t *dest, vm_assembler_t *src)
     // merge constants array
     c_buffer_concat(&dest->constants, &src->constants);
 
-    update_instructions_constants_table_index_ref(&src->instructions, dest_element_count, &dest->constants);
+    // update the copy of the instructions, since the same expression can be added more than once
+    size_t instructions_offset = c_buffer_size(&dest->instructions);
     c_buffer_concat(&dest->instructions, &src->instructions);
+    update_instructions_constants_table_index_ref(dest->instructions.data + instructions_offset,
+                                                  dest->instructions.data_end, dest_element_count);
 
     size_t max_src_stack_size = dest->stack_size + src->max_stack_size;
     if (max_src_stack_size > dest->max_stack_size)
         dest->max_stack_size = max_src_stack_size;
 
     dest->stack_size += src->stack_size;
+    dest->peephole_offset = SIZE_MAX;
 }
 
 void vm_assembler_require_stack_args(vm_assembler_t *code, unsigned int count)
@@ -305,6 +482,89 @@ void vm_assembler_add_write_raw(vm_assembler_t *code, const char *string, size_t
     c_buffer_write(&code->instructions, (char *)string, size);
 }
 
+void vm_assembler_patch_jump(vm_assembler_t *code, size_t label)
+{
+    size_t offset = c_buffer_size(&code->instructions) - label;
+    if (offset >= (1 << 24))
+        rb_enc_raise(utf8_encoding, cLiquidSyntaxError, "Tag body is too large to jump over");
+    uint24_to_bytes((unsigned int)offset, code->instructions.data + label - 3);
+    // the jump target is the end of the instructions, so the next instruction must not be fused into the previous one
+    code->peephole_offset = SIZE_MAX;
+}
+
+void vm_assembler_patch_case_dispatch(vm_assembler_t *code, size_t label, unsigned int target)
+{
+    uint8_t *ip = code->instructions.data + label;
+    assert(*ip == OP_CASE_DISPATCH && target < ip[3] + 2u);
+    size_t end = label + 4 + ((size_t)ip[3] + 2) * 3;
+    size_t offset = c_buffer_size(&code->instructions) - end;
+    if (offset >= (1 << 24))
+        rb_enc_raise(utf8_encoding, cLiquidSyntaxError, "Tag body is too large to jump over");
+    uint24_to_bytes((unsigned int)offset, &ip[4 + target * 3]);
+    code->peephole_offset = SIZE_MAX;
+}
+
+static inline const uint8_t *peephole_instruction(vm_assembler_t *code, enum opcode op, size_t size)
+{
+    size_t offset = code->peephole_offset;
+    if (offset == SIZE_MAX || offset + size != c_buffer_size(&code->instructions))
+        return NULL;
+    const uint8_t *ip = code->instructions.data + offset;
+    return *ip == op ? ip : NULL;
+}
+
+// Peephole optimization that fuses find_static_var followed by lookup_const_key
+// into the find_static_var_lookup_const_key superinstruction
+bool vm_assembler_fuse_lookup_const_key(vm_assembler_t *code, VALUE key)
+{
+    if (!peephole_instruction(code, OP_FIND_STATIC_VAR, 3))
+        return false;
+
+    uint16_t key_index = vm_assembler_write_ruby_constant(code, key);
+    uint8_t *ip = code->instructions.data + code->peephole_offset;
+    ip[0] = OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY;
+    uint8_t *instructions = c_buffer_extend_for_write(&code->instructions, 2);
+    instructions[0] = key_index >> 8;
+    instructions[1] = (uint8_t)key_index;
+    return true;
+}
+
+// Peephole optimization that fuses a variable render that only writes a static variable,
+// optionally with a constant key lookup, into a single write_static_var or
+// write_static_var_lookup_const_key instruction
+bool vm_assembler_fuse_pop_write(vm_assembler_t *code)
+{
+    const uint8_t *lookup_ip;
+    size_t lookup_size;
+    enum opcode fused_op;
+
+    if ((lookup_ip = peephole_instruction(code, OP_FIND_STATIC_VAR, 3))) {
+        lookup_size = 3;
+        fused_op = OP_WRITE_STATIC_VAR;
+    } else if ((lookup_ip = peephole_instruction(code, OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY, 5))) {
+        lookup_size = 5;
+        fused_op = OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY;
+    } else {
+        return false;
+    }
+
+    // The variable's expression leaves exactly one value on the stack, so the lookup
+    // is the whole expression when it directly follows render_variable_rescue
+    if (code->peephole_offset < 4 || lookup_ip[-4] != OP_RENDER_VARIABLE_RESCUE)
+        return false;
+
+    uint8_t fused[8];
+    fused[0] = fused_op;
+    memcpy(&fused[1], &lookup_ip[1], lookup_size - 1); // constant indexes
+    memcpy(&fused[lookup_size], &lookup_ip[-3], 3); // line number
+
+    uint8_t *start = code->instructions.data + code->peephole_offset - 4;
+    memcpy(start, fused, lookup_size + 3);
+    code->instructions.data_end = start + lookup_size + 3;
+    code->peephole_offset = SIZE_MAX;
+    return true;
+}
+
 void vm_assembler_add_write_node(vm_assembler_t *code, VALUE node)
 {
     vm_assembler_add_op_with_constant(code, node, OP_WRITE_NODE);
@@ -384,7 +644,7 @@ void vm_assembler_add_evaluate_expression_from_ruby(vm_assembler_t *code, VALUE
 
     switch (RB_BUILTIN_TYPE(expression)) {
         case T_DATA:
-            if (RBASIC_CLASS(expression) == cLiquidCExpression) {
+            if (RBASIC_CLASS(expression) == cLiquidCExpression || RBASIC_CLASS(expression) == cLiquidCVariableExpression) {
                 vm_assembler_concat(code, &((expression_t *)DATA_PTR(expression))->code);
                 vm_assembler_remove_leave(code);
                 return;
@@ -466,6 +726,132 @@ void vm_assembler_add_filter_from_ruby(vm_assembler_t *code, VALUE filter_name,
     vm_assembler_add_filter(code, filter_name, arg_count);
 }
 
+void vm_assembler_add_compare_from_ruby(vm_assembler_t *code, VALUE condition)
+{
+    ensure_parsing(code);
+    vm_assembler_require_stack_args(code, 2);
+    if (!rb_obj_is_kind_of(condition, cLiquidCondition))
+        rb_raise(rb_eTypeError, "expected a Liquid::Condition");
+
+    VALUE operator = rb_funcall(condition, id_operator, 0);
+    vm_assembler_add_compare(code, condition, condition_operator_from_ruby(operator));
+}
+
+size_t vm_assembler_add_jump_from_ruby(vm_assembler_t *code, enum opcode op)
+{
+    ensure_parsing(code);
+    if (op != OP_JUMP)
+        vm_assembler_require_stack_args(code, 1);
+    return vm_assembler_add_jump(code, op);
+}
+
+void vm_assembler_patch_jump_from_ruby(vm_assembler_t *code, VALUE label_obj)
+{
+    ensure_parsing(code);
+    size_t label = NUM2SIZET(label_obj);
+    if (label < 4 || label > c_buffer_size(&code->instructions))
+        rb_raise(rb_eArgError, "invalid jump label");
+
+    uint8_t op = code->instructions.data[label - 4];
+    bool jump_op = op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE;
+    if (!jump_op && (label < 9 || code->instructions.data[label - 9] != OP_FOR_INIT))
+        rb_raise(rb_eArgError, "invalid jump label");
+
+    vm_assembler_patch_jump(code, label);
+}
+
+void vm_assembler_add_assign_from_ruby(vm_assembler_t *code, VALUE name)
+{
+    ensure_parsing(code);
+    vm_assembler_require_stack_args(code, 1);
+    StringValue(name);
+
+    // frozen so it can be used as a scope key without being copied on each assign
+    vm_assembler_add_assign(code, rb_str_new_frozen(name));
+}
+
+void vm_assembler_add_capture_from_ruby(vm_assembler_t *code, VALUE name, VALUE block_body)
+{
+    ensure_parsing(code);
+    StringValue(name);
+
+    vm_assembler_add_capture(code, rb_str_new_frozen(name), block_body);
+}
+
+size_t vm_assembler_add_for_init_from_ruby(vm_assembler_t *code, VALUE variable_name, VALUE name, VALUE reversed, VALUE offset_continue)
+{
+    ensure_parsing(code);
+    vm_assembler_require_stack_args(code, 3);
+    StringValue(variable_name);
+    StringValue(name);
+
+    uint8_t flags = 0;
+    if (RTEST(reversed))
+        flags |= FOR_LOOP_REVERSED;
+    if (RTEST(offset_continue))
+        flags |= FOR_LOOP_OFFSET_CONTINUE;
+
+    // frozen so it can be used as a scope key without being copied on each iteration
+    variable_name = rb_str_new_frozen(variable_name);
+    return vm_assembler_add_for_init(code, variable_name, name, flags);
+}
+
+static int check_case_dispatch_entry(VALUE key, VALUE branch, VALUE branch_count)
+{
+    // bignums can't be equal to a value that is looked up in the table
+    if (!case_dispatch_key_p(key) && !RB_TYPE_P(key, T_BIGNUM))
+        rb_raise(rb_eArgError, "case dispatch value %+"PRIsVALUE" can be equal to a value of a different type", key);
+    if (!RB_FIXNUM_P(branch) || FIX2LONG(branch) < 0 || FIX2LONG(branch) >= FIX2LONG(branch_count))
+        rb_raise(rb_eArgError, "invalid case dispatch branch %+"PRIsVALUE, branch);
+    return ST_CONTINUE;
+}
+
+size_t vm_assembler_add_case_dispatch_from_ruby(vm_assembler_t *code, VALUE table, VALUE branch_count_obj)
+{
+    ensure_parsing(code);
+    vm_assembler_require_stack_args(code, 1);
+    Check_Type(table, T_HASH);
+    unsigned int branch_count = NUM2UINT(branch_count_obj);
+    if (branch_count > UINT8_MAX)
+        rb_raise(rb_eArgError, "too many case dispatch branches");
+    rb_hash_foreach(table, check_case_dispatch_entry, UINT2NUM(branch_count));
+
+    table = rb_hash_dup(table);
+    rb_obj_freeze(table);
+    return vm_assembler_add_case_dispatch(code, table, (uint8_t)branch_count);
+}
+
+void vm_assembler_patch_case_dispatch_from_ruby(vm_assembler_t *code, VALUE label_obj, VALUE target_obj)
+{
+    ensure_parsing(code);
+    size_t label = NUM2SIZET(label_obj);
+    unsigned int target = NUM2UINT(target_obj);
+    if (label + 4 > c_buffer_size(&code->instructions) || code->instructions.data[label] != OP_CASE_DISPATCH)
+        rb_raise(rb_eArgError, "invalid case dispatch label");
+    if (target >= code->instructions.data[label + 3] + 2u)
+        rb_raise(rb_eArgError, "invalid case dispatch target");
+
+    vm_assembler_patch_case_dispatch(code, label, target);
+}
+
+void vm_assembler_add_render_partial_from_ruby(vm_assembler_t *code, VALUE node, VALUE template_name, VALUE variable_name,
+                                               VALUE attribute_count_obj, VALUE for_loop)
+{
+    ensure_parsing(code);
+    StringValue(template_name);
+    StringValue(variable_name);
+    unsigned int attribute_count = NUM2UINT(attribute_count_obj);
+    if (attribute_count > UINT8_MAX)
+        rb_raise(rb_eArgError, "too many render attributes");
+    vm_assembler_require_stack_args(code, 1 + attribute_count * 2);
+
+    // frozen so it can be used as a scope key without being copied on each render
+    variable_name = rb_str_new_frozen(variable_name);
+    template_name = rb_str_new_frozen(template_name);
+    uint8_t flags = RTEST(for_loop) ? RENDER_PARTIAL_FOR_LOOP : 0;
+    vm_assembler_add_render_partial(code, node, template_name, variable_name, (uint8_t)attribute_count, flags);
+}
+
 bool vm_assembler_opcode_has_constant(uint8_t ip) {
     if (
         ip == OP_PUSH_CONST ||
@@ -473,15 +859,66 @@ bool vm_assembler_opcode_has_constant(uint8_t ip) {
         ip == OP_FIND_STATIC_VAR ||
         ip == OP_LOOKUP_CONST_KEY ||
         ip == OP_LOOKUP_COMMAND ||
-        ip == OP_FILTER
+        ip == OP_FILTER ||
+        ip == OP_RENDER_TAG_RESCUE ||
+        ip == OP_COMPARE ||
+        ip == OP_RENDER_BODY ||
+        ip == OP_FOR_INIT ||
+        ip == OP_FOR_NEXT ||
+        ip == OP_ASSIGN ||
+        ip == OP_CAPTURE ||
+        ip == OP_CASE_DISPATCH ||
+        ip == OP_RENDER_PARTIAL ||
+        ip == OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY ||
+        ip == OP_WRITE_STATIC_VAR ||
+        ip == OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY
+    ) {
+        return true;
+    }
+    return false;
+}
+
+// Opcodes with another constant index in the two bytes following the first one
+bool vm_assembler_opcode_has_second_constant(uint8_t ip) {
+    if (
+        ip == OP_FOR_INIT ||
+        ip == OP_CAPTURE ||
+        ip == OP_RENDER_PARTIAL ||
+        ip == OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY ||
+        ip == OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY
     ) {
         return true;
     }
     return false;
 }
 
+// Opcodes with another constant index in the two bytes following the second one
+bool vm_assembler_opcode_has_third_constant(uint8_t ip) {
+    return ip == OP_RENDER_PARTIAL;
+}
+
+/*
+ * Identifies the opcodes and builtin filter indexes that compiled instructions
+ * depend on, so instructions dumped by another build can be rejected.
+ */
+uint32_t vm_assembler_instruction_set_fingerprint(void)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ OPCODE_COUNT) * 16777619u;
+    for (size_t i = 0; i < ARRAY_LENGTH(builtin_filters); i++) {
+        for (const char *c = builtin_filters[i].name; ; c++) {
+            hash = (hash ^ (uint8_t)*c) * 16777619u;
+            if (!*c) break;
+        }
+    }
+    return hash;
+}
+
 void liquid_define_vm_assembler(void)
 {
+    id_operator = rb_intern("operator");
+
     builtin_filter_table = st_init_numtable_with_size(ARRAY_LENGTH(builtin_filters));
     for (unsigned int i = 0; i < ARRAY_LENGTH(builtin_filters); i++) {
         filter_desc_t *filter = &builtin_filters[i];
@@ -5,6 +5,7 @@
 #include "liquid.h"
 #include "c_buffer.h"
 #include "intutil.h"
+#include "standard_filters.h"
 
 enum opcode {
     OP_LEAVE = 0,
@@ -31,14 +32,37 @@ enum opcode {
     OP_WRITE_RAW,
     OP_JUMP_FWD_W,
     OP_JUMP_FWD,
+    OP_RENDER_TAG_RESCUE, // setup state to rescue rendering of a compiled tag
+    OP_END_TAG,
+    OP_COMPARE,
+    OP_JUMP, // jumps use a 24-bit offset relative to the end of the instruction
+    OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE,
+    OP_RENDER_BODY,
+    OP_FOR_INIT, // jumps to the else body when the segment is empty
+    OP_FOR_NEXT, // renders the body for the next item or falls through after the last item
+    OP_FOR_END,
+    OP_ASSIGN,
+    OP_CAPTURE,
+    OP_CASE_DISPATCH, // jumps to the target of the when branch that the popped value maps to in a hash of constant values
+    OP_RENDER_PARTIAL, // renders a partial in an isolated context, like the render tag
+    // superinstructions fused by the assembler's peephole optimizations
+    OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY,
+    OP_WRITE_STATIC_VAR, // render_variable_rescue, find_static_var, pop_write
+    OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY, // render_variable_rescue, find_static_var_lookup_const_key, pop_write
+    OPCODE_COUNT // not an instruction, new opcodes must be added before it
 };
 
 typedef struct {
     const char *name;
     VALUE sym;
+    bool pure; // result only depends on the arguments, so it can be evaluated at compile time
+    native_filter_func_t native; // optional fast path used when the filter isn't overridden
 } filter_desc_t;
 
 extern filter_desc_t builtin_filters[];
+extern const char *const vm_opcode_names[OPCODE_COUNT];
+extern const size_t builtin_filters_count;
 
 typedef struct vm_assembler {
     c_buffer_t instructions;
@@ -47,6 +71,7 @@ typedef struct vm_assembler {
     size_t max_stack_size;
     size_t stack_size;
     size_t protected_stack_size;
+    size_t peephole_offset; // start of the last instruction if the next one can be fused with it, otherwise SIZE_MAX
     bool parsing; // prevent executing when incomplete or extending when complete
 } vm_assembler_t;
 
@@ -64,6 +89,10 @@ void vm_assembler_add_write_node(vm_assembler_t *code, VALUE node);
 void vm_assembler_add_push_fixnum(vm_assembler_t *code, VALUE num);
 void vm_assembler_add_push_literal(vm_assembler_t *code, VALUE literal);
 void vm_assembler_add_filter(vm_assembler_t *code, VALUE filter_name, size_t arg_count);
+void vm_assembler_patch_jump(vm_assembler_t *code, size_t label);
+void vm_assembler_patch_case_dispatch(vm_assembler_t *code, size_t label, unsigned int target);
+bool vm_assembler_fuse_lookup_const_key(vm_assembler_t *code, VALUE key);
+bool vm_assembler_fuse_pop_write(vm_assembler_t *code);
 
 void vm_assembler_add_evaluate_expression_from_ruby(vm_assembler_t *code, VALUE code_obj, VALUE expression);
 void vm_assembler_add_find_variable_from_ruby(vm_assembler_t *code, VALUE code_obj, VALUE expression);
@@ -72,8 +101,21 @@ void vm_assembler_add_lookup_key_from_ruby(vm_assembler_t *code, VALUE code_obj,
 void vm_assembler_add_new_int_range_from_ruby(vm_assembler_t *code);
 void vm_assembler_add_hash_new_from_ruby(vm_assembler_t *code, VALUE hash_size_obj);
 void vm_assembler_add_filter_from_ruby(vm_assembler_t *code, VALUE filter_name, VALUE arg_count_obj);
-
+void vm_assembler_add_compare_from_ruby(vm_assembler_t *code, VALUE condition);
+size_t vm_assembler_add_jump_from_ruby(vm_assembler_t *code, enum opcode op);
+void vm_assembler_patch_jump_from_ruby(vm_assembler_t *code, VALUE label_obj);
+void vm_assembler_add_assign_from_ruby(vm_assembler_t *code, VALUE name);
+void vm_assembler_add_capture_from_ruby(vm_assembler_t *code, VALUE name, VALUE block_body);
+size_t vm_assembler_add_for_init_from_ruby(vm_assembler_t *code, VALUE variable_name, VALUE name, VALUE reversed, VALUE offset_continue);
+size_t vm_assembler_add_case_dispatch_from_ruby(vm_assembler_t *code, VALUE table, VALUE branch_count_obj);
+void vm_assembler_patch_case_dispatch_from_ruby(vm_assembler_t *code, VALUE label_obj, VALUE target_obj);
+void vm_assembler_add_render_partial_from_ruby(vm_assembler_t *code, VALUE node, VALUE template_name, VALUE variable_name,
+                                               VALUE attribute_count_obj, VALUE for_loop);
+
+uint32_t vm_assembler_instruction_set_fingerprint(void);
 bool vm_assembler_opcode_has_constant(uint8_t ip);
+bool vm_assembler_opcode_has_second_constant(uint8_t ip);
+bool vm_assembler_opcode_has_third_constant(uint8_t ip);
 
 static inline size_t vm_assembler_alloc_memsize(const vm_assembler_t *code)
 {
@@ -135,9 +177,18 @@ static inline void vm_assembler_remove_leave(vm_assembler_t *code)
     assert(*code->instructions.data_end == OP_LEAVE);
 }
 
+// Discards the instructions written after instructions_size, e.g. to undo a partial compile
+static inline void vm_assembler_truncate_instructions(vm_assembler_t *code, size_t instructions_size)
+{
+    code->instructions.data_end = code->instructions.data + instructions_size;
+    code->peephole_offset = SIZE_MAX;
+}
+
 static inline void vm_assembler_add_pop_write(vm_assembler_t *code)
 {
     code->stack_size -= 1;
+    if (vm_assembler_fuse_pop_write(code))
+        return;
     vm_assembler_write_opcode(code, OP_POP_WRITE);
 }
 
@@ -197,6 +248,7 @@ static inline void vm_assembler_add_push_const(vm_assembler_t *code, VALUE const
 static inline void vm_assembler_add_find_static_variable(vm_assembler_t *code, VALUE key)
 {
     vm_assembler_increment_stack_size(code, 1);
+    code->peephole_offset = c_buffer_size(&code->instructions);
     vm_assembler_add_op_with_constant(code, key, OP_FIND_STATIC_VAR);
 }
 
@@ -209,6 +261,8 @@ static inline void vm_assembler_add_find_variable(vm_assembler_t *code)
 static inline void vm_assembler_add_lookup_const_key(vm_assembler_t *code, VALUE key)
 {
     vm_assembler_reserve_stack_size(code, 1); // push 1, pop 2, push 1
+    if (vm_assembler_fuse_lookup_const_key(code, key))
+        return;
     vm_assembler_add_op_with_constant(code, key, OP_LOOKUP_CONST_KEY);
 }
 
@@ -237,4 +291,119 @@ static inline void vm_assembler_add_render_variable_rescue(vm_assembler_t *code,
     uint24_to_bytes((unsigned int)node_line_number, &instructions[1]);
 }
 
+static inline void vm_assembler_add_render_tag_rescue(vm_assembler_t *code, VALUE node)
+{
+    vm_assembler_add_op_with_constant(code, node, OP_RENDER_TAG_RESCUE);
+}
+
+static inline void vm_assembler_add_end_tag(vm_assembler_t *code)
+{
+    vm_assembler_write_opcode(code, OP_END_TAG);
+}
+
+static inline void vm_assembler_add_compare(vm_assembler_t *code, VALUE condition, uint8_t comparison_operator)
+{
+    code->stack_size--; // pop 2, push 1
+    vm_assembler_add_op_with_constant(code, condition, OP_COMPARE);
+    c_buffer_write_byte(&code->instructions, comparison_operator);
+}
+
+// Returns a label for the jump that is passed to vm_assembler_patch_jump
+// to set its target to the end of the instructions written at that point
+static inline size_t vm_assembler_add_jump(vm_assembler_t *code, enum opcode op)
+{
+    assert(op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE);
+    if (op != OP_JUMP)
+        code->stack_size--; // pop 1
+    uint8_t *instructions = c_buffer_extend_for_write(&code->instructions, 4);
+    instructions[0] = op;
+    uint24_to_bytes(0, &instructions[1]);
+    return c_buffer_size(&code->instructions);
+}
+
+static inline void vm_assembler_add_render_body(vm_assembler_t *code, VALUE block_body)
+{
+    vm_assembler_add_op_with_constant(code, block_body, OP_RENDER_BODY);
+}
+
+// Pops the offset, collection and limit. Returns a jump label for the else body.
+static inline size_t vm_assembler_add_for_init(vm_assembler_t *code, VALUE variable_name, VALUE name, uint8_t flags)
+{
+    code->stack_size -= 3;
+    vm_assembler_add_op_with_constant(code, variable_name, OP_FOR_INIT);
+    uint16_t name_index = vm_assembler_write_ruby_constant(code, name);
+    uint8_t *instructions = c_buffer_extend_for_write(&code->instructions, 6);
+    instructions[0] = name_index >> 8;
+    instructions[1] = (uint8_t)name_index;
+    instructions[2] = flags;
+    uint24_to_bytes(0, &instructions[3]);
+    return c_buffer_size(&code->instructions);
+}
+
+static inline void vm_assembler_add_for_next(vm_assembler_t *code, VALUE block_body)
+{
+    vm_assembler_add_op_with_constant(code, block_body, OP_FOR_NEXT);
+}
+
+static inline void vm_assembler_add_for_end(vm_assembler_t *code)
+{
+    vm_assembler_write_opcode(code, OP_FOR_END);
+}
+
+static inline void vm_assembler_add_assign(vm_assembler_t *code, VALUE name)
+{
+    code->stack_size--; // pop 1
+    vm_assembler_add_op_with_constant(code, name, OP_ASSIGN);
+}
+
+static inline void vm_assembler_add_capture(vm_assembler_t *code, VALUE name, VALUE block_body)
+{
+    vm_assembler_add_op_with_constant(code, name, OP_CAPTURE);
+    uint16_t body_index = vm_assembler_write_ruby_constant(code, block_body);
+    uint8_t *instructions = c_buffer_extend_for_write(&code->instructions, 2);
+    instructions[0] = body_index >> 8;
+    instructions[1] = (uint8_t)body_index;
+}
+
+/*
+ * Pops the case value and jumps to one of the targets that follow the table
+ * constant and the number of when branches. The table maps constant values
+ * to the index of the target for their when branch. The target after those
+ * of the branches is used when the value isn't in the table, and the last
+ * one when the value could be equal to a value of a different type, so it
+ * needs to be compared with each value instead. Returns a label for
+ * vm_assembler_patch_case_dispatch, which is the start of the instruction.
+ */
+static inline size_t vm_assembler_add_case_dispatch(vm_assembler_t *code, VALUE table, uint8_t branch_count)
+{
+    code->stack_size--; // pop 1
+    size_t label = c_buffer_size(&code->instructions);
+    vm_assembler_add_op_with_constant(code, table, OP_CASE_DISPATCH);
+    size_t targets_size = ((size_t)branch_count + 2) * 3;
+    uint8_t *instructions = c_buffer_extend_for_write(&code->instructions, 1 + targets_size);
+    instructions[0] = branch_count;
+    memset(&instructions[1], 0, targets_size);
+    return label;
+}
+
+/*
+ * Pops the key and value of each attribute, then the variable passed with
+ * `with` or `for`, and renders the partial for the render tag node.
+ */
+static inline void vm_assembler_add_render_partial(vm_assembler_t *code, VALUE node, VALUE template_name,
+                                                   VALUE variable_name, uint8_t attribute_count, uint8_t flags)
+{
+    code->stack_size -= 1 + (size_t)attribute_count * 2;
+    vm_assembler_add_op_with_constant(code, node, OP_RENDER_PARTIAL);
+    uint16_t template_name_index = vm_assembler_write_ruby_constant(code, template_name);
+    uint16_t variable_name_index = vm_assembler_write_ruby_constant(code, variable_name);
+    uint8_t *instructions = c_buffer_extend_for_write(&code->instructions, 6);
+    instructions[0] = template_name_index >> 8;
+    instructions[1] = (uint8_t)template_name_index;
+    instructions[2] = variable_name_index >> 8;
+    instructions[3] = (uint8_t)variable_name_index;
+    instructions[4] = attribute_count;
+    instructions[5] = flags;
+}
+
 #endif
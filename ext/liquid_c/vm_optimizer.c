@@ -0,0 +1,1003 @@
+#include "liquid.h"
+#include "vm_optimizer.h"
+#include "liquid_vm.h"
+#include "intutil.h"
+#include "condition.h"
+
+/*
+ * Optimization passes that run over the instructions of a block body when it
+ * is frozen, after which no more instructions can be added to it. Each pass
+ * rewrites the instructions into a new buffer, relocating the jumps whose
+ * instructions moved.
+ */
+
+enum optimizer_pass {
+    PASS_DROP_DEAD_JUMPS,
+    PASS_MERGE_RAW_WRITES,
+    PASS_FOLD_CONSTANT_FILTERS,
+    PASS_FOLD_CONSTANT_BRANCHES,
+    PASS_MAX_STACK_SIZE,
+    PASS_SPECIALIZE_STATIC_LOOKUPS,
+    PASS_FOLD_CONSTANT_WRITES,
+    PASS_COUNT,
+};
+
+typedef struct optimizer_pass_stats {
+    const char *name;
+    unsigned long long rewrites;
+    unsigned long long saved; // instruction bytes, or stack values for PASS_MAX_STACK_SIZE
+} optimizer_pass_stats_t;
+
+static optimizer_pass_stats_t pass_stats[PASS_COUNT] = {
+    [PASS_DROP_DEAD_JUMPS] = { .name = "drop_dead_jumps" },
+    [PASS_MERGE_RAW_WRITES] = { .name = "merge_raw_writes" },
+    [PASS_FOLD_CONSTANT_FILTERS] = { .name = "fold_constant_filters" },
+    [PASS_FOLD_CONSTANT_BRANCHES] = { .name = "fold_constant_branches" },
+    [PASS_MAX_STACK_SIZE] = { .name = "max_stack_size" },
+    [PASS_SPECIALIZE_STATIC_LOOKUPS] = { .name = "specialize_static_lookups" },
+    [PASS_FOLD_CONSTANT_WRITES] = { .name = "fold_constant_writes" },
+};
+static unsigned long long stats_block_bodies, stats_bytes_before, stats_bytes_after;
+
+static bool fold_constant_filters = true;
+static VALUE mLiquidCOptimizer;
+static ID id_evaluate_constant_filter;
+
+typedef struct output_instruction {
+    size_t offset;
+    bool jump_target;
+} output_instruction_t;
+
+typedef struct pending_jump {
+    size_t offset_position; // where the 24-bit offset is in the output
+    size_t end_offset; // end of the jump instruction in the output, which the offset is relative to
+    size_t old_target;
+} pending_jump_t;
+
+typedef struct rewrite {
+    vm_assembler_t *code;
+    const uint8_t *start;
+    size_t size;
+    bool *jump_targets; // indexed by offset in the old instructions
+    size_t *offset_map; // old instruction offset to its offset in the output
+    c_buffer_t output;
+    c_buffer_t output_instructions; // output_instruction_t
+    c_buffer_t pending_jumps; // pending_jump_t
+} rewrite_t;
+
+// Returns the number of 24-bit jump offsets that the instruction ends with,
+// setting *offsets to the first of them. The offsets are relative to the end
+// of the instruction.
+static size_t jump_offsets(const uint8_t *ip, const uint8_t **offsets)
+{
+    switch (*ip) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            *offsets = ip + 1;
+            return 1;
+        case OP_FOR_INIT:
+            *offsets = ip + 6;
+            return 1;
+        case OP_CASE_DISPATCH:
+            *offsets = ip + 4;
+            return ip[3] + 2;
+        default:
+            return 0;
+    }
+}
+
+static void rewrite_begin(rewrite_t *rw, vm_assembler_t *code)
+{
+    rw->code = code;
+    rw->start = code->instructions.data;
+    rw->size = c_buffer_size(&code->instructions);
+    rw->jump_targets = ZALLOC_N(bool, rw->size + 1);
+    rw->offset_map = ALLOC_N(size_t, rw->size + 1);
+    rw->output = c_buffer_allocate(rw->size);
+    rw->output_instructions = c_buffer_init();
+    rw->pending_jumps = c_buffer_init();
+
+    const uint8_t *ip = rw->start;
+    const uint8_t *end_ip = rw->start + rw->size;
+    while (ip < end_ip) {
+        const uint8_t *offsets;
+        size_t count = jump_offsets(ip, &offsets);
+        liquid_vm_next_instruction(&ip);
+        for (size_t i = 0; i < count; i++) {
+            size_t target = (ip + bytes_to_uint24(offsets + i * 3)) - rw->start;
+            rw->jump_targets[target] = true;
+        }
+    }
+}
+
+static inline size_t rewrite_offset(rewrite_t *rw, const uint8_t *ip)
+{
+    return ip - rw->start;
+}
+
+static inline size_t rewrite_output_instructions_count(rewrite_t *rw)
+{
+    return c_buffer_size(&rw->output_instructions) / sizeof(output_instruction_t);
+}
+
+static inline output_instruction_t *rewrite_output_instruction(rewrite_t *rw, size_t index_from_end)
+{
+    return ((output_instruction_t *)rw->output_instructions.data_end) - index_from_end;
+}
+
+// Starts writing the output for the instruction at ip
+static void rewrite_start_instruction(rewrite_t *rw, const uint8_t *ip)
+{
+    size_t offset = rewrite_offset(rw, ip);
+    rw->offset_map[offset] = c_buffer_size(&rw->output);
+    output_instruction_t instruction = {
+        .offset = c_buffer_size(&rw->output),
+        .jump_target = rw->jump_targets[offset],
+    };
+    c_buffer_write(&rw->output_instructions, &instruction, sizeof(instruction));
+}
+
+// Removes the last count output instructions, returning the offset they started at
+static size_t rewrite_truncate_output(rewrite_t *rw, size_t count)
+{
+    size_t offset = rewrite_output_instruction(rw, count)->offset;
+    rw->output_instructions.data_end -= count * sizeof(output_instruction_t);
+    rw->output.data_end = rw->output.data + offset;
+    return offset;
+}
+
+// Copies the instruction at ip to the output
+static void rewrite_copy(rewrite_t *rw, const uint8_t *ip)
+{
+    const uint8_t *next_ip = ip;
+    liquid_vm_next_instruction(&next_ip);
+
+    rewrite_start_instruction(rw, ip);
+    size_t output_offset = c_buffer_size(&rw->output);
+    c_buffer_write(&rw->output, (void *)ip, next_ip - ip);
+
+    const uint8_t *offsets;
+    size_t count = jump_offsets(ip, &offsets);
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *offset = offsets + i * 3;
+        pending_jump_t jump = {
+            .offset_position = output_offset + (offset - ip),
+            .end_offset = c_buffer_size(&rw->output),
+            .old_target = rewrite_offset(rw, next_ip + bytes_to_uint24(offset)),
+        };
+        c_buffer_write(&rw->pending_jumps, &jump, sizeof(jump));
+    }
+}
+
+// Writes a jump to the old instruction at old_target, which is relocated with the other jumps
+static void rewrite_write_jump(rewrite_t *rw, size_t old_target)
+{
+    uint8_t *instructions = c_buffer_extend_for_write(&rw->output, 4);
+    instructions[0] = OP_JUMP;
+    pending_jump_t jump = {
+        .offset_position = c_buffer_size(&rw->output) - 3,
+        .end_offset = c_buffer_size(&rw->output),
+        .old_target = old_target,
+    };
+    c_buffer_write(&rw->pending_jumps, &jump, sizeof(jump));
+}
+
+static void rewrite_write_raw(rewrite_t *rw, const char *text, size_t size)
+{
+    if (size > UINT8_MAX) {
+        uint8_t *instructions = c_buffer_extend_for_write(&rw->output, 4);
+        instructions[0] = OP_WRITE_RAW_W;
+        uint24_to_bytes((unsigned int)size, &instructions[1]);
+    } else {
+        uint8_t *instructions = c_buffer_extend_for_write(&rw->output, 2);
+        instructions[0] = OP_WRITE_RAW;
+        instructions[1] = (uint8_t)size;
+    }
+    c_buffer_write(&rw->output, (void *)text, size);
+}
+
+// Replaces the last count output instructions with a new one that starts at the same
+// offset, which is a jump target if the first of them was one
+static void rewrite_replace_output(rewrite_t *rw, size_t count)
+{
+    bool jump_target = rewrite_output_instruction(rw, count)->jump_target;
+    size_t offset = rewrite_truncate_output(rw, count);
+    output_instruction_t instruction = { .offset = offset, .jump_target = jump_target };
+    c_buffer_write(&rw->output_instructions, &instruction, sizeof(instruction));
+}
+
+static void rewrite_free(rewrite_t *rw)
+{
+    xfree(rw->jump_targets);
+    xfree(rw->offset_map);
+    c_buffer_free(&rw->output);
+    c_buffer_free(&rw->output_instructions);
+    c_buffer_free(&rw->pending_jumps);
+}
+
+// Relocates the jumps and replaces the instructions with the output
+static void rewrite_finish(rewrite_t *rw, enum optimizer_pass pass)
+{
+    rw->offset_map[rw->size] = c_buffer_size(&rw->output);
+
+    pending_jump_t *jumps_end = (pending_jump_t *)rw->pending_jumps.data_end;
+    for (pending_jump_t *jump = (pending_jump_t *)rw->pending_jumps.data; jump < jumps_end; jump++) {
+        size_t new_target = rw->offset_map[jump->old_target];
+        assert(new_target >= jump->end_offset);
+        uint24_to_bytes((unsigned int)(new_target - jump->end_offset), rw->output.data + jump->offset_position);
+    }
+
+    if (c_buffer_size(&rw->output) < rw->size)
+        pass_stats[pass].saved += rw->size - c_buffer_size(&rw->output);
+
+    c_buffer_t old_instructions = rw->code->instructions;
+    rw->code->instructions = rw->output;
+    rw->output = old_instructions;
+    rewrite_free(rw);
+}
+
+// Drops the jump_fwd instructions that block_body_remove_blank_strings uses
+// to skip over removed text and unconditional jumps to the next instruction
+static void drop_dead_jumps(vm_assembler_t *code)
+{
+    rewrite_t rw;
+    rewrite_begin(&rw, code);
+
+    const uint8_t *ip = rw.start;
+    const uint8_t *end_ip = rw.start + rw.size;
+    while (ip < end_ip) {
+        bool dead;
+        switch (*ip) {
+            case OP_JUMP_FWD:
+            case OP_JUMP_FWD_W:
+                dead = true;
+                break;
+            case OP_JUMP:
+                dead = bytes_to_uint24(ip + 1) == 0;
+                break;
+            default:
+                dead = false;
+                break;
+        }
+
+        if (dead) {
+            // jumps to it go to the next instruction in the output instead
+            rw.offset_map[rewrite_offset(&rw, ip)] = c_buffer_size(&rw.output);
+            pass_stats[PASS_DROP_DEAD_JUMPS].rewrites++;
+        } else {
+            rewrite_copy(&rw, ip);
+        }
+        liquid_vm_next_instruction(&ip);
+    }
+
+    rewrite_finish(&rw, PASS_DROP_DEAD_JUMPS);
+}
+
+static inline bool write_raw_p(const uint8_t *ip)
+{
+    return *ip == OP_WRITE_RAW || *ip == OP_WRITE_RAW_W;
+}
+
+static void write_raw_text(const uint8_t *ip, const uint8_t **text, size_t *size)
+{
+    if (*ip == OP_WRITE_RAW_W) {
+        *size = bytes_to_uint24(&ip[1]);
+        *text = &ip[4];
+    } else {
+        *size = ip[1];
+        *text = &ip[2];
+    }
+}
+
+// Merges adjacent raw writes into one, unless jumping to one of them
+static void merge_raw_writes(vm_assembler_t *code)
+{
+    rewrite_t rw;
+    rewrite_begin(&rw, code);
+
+    const uint8_t *ip = rw.start;
+    const uint8_t *end_ip = rw.start + rw.size;
+    while (ip < end_ip) {
+        const uint8_t *next_ip = ip;
+        liquid_vm_next_instruction(&next_ip);
+
+        if (!write_raw_p(ip) || next_ip >= end_ip || !write_raw_p(next_ip) || rw.jump_targets[rewrite_offset(&rw, next_ip)]) {
+            rewrite_copy(&rw, ip);
+            ip = next_ip;
+            continue;
+        }
+
+        // find the run of raw writes to merge
+        const uint8_t *text;
+        size_t size, total_size = 0;
+        const uint8_t *run_end = ip;
+        do {
+            write_raw_text(run_end, &text, &size);
+            if (total_size + size >= (1 << 24))
+                break;
+            total_size += size;
+            liquid_vm_next_instruction(&run_end);
+        } while (run_end < end_ip && write_raw_p(run_end) && !rw.jump_targets[rewrite_offset(&rw, run_end)]);
+
+        size_t merged_offset = c_buffer_size(&rw.output);
+        rewrite_start_instruction(&rw, ip);
+        if (total_size > UINT8_MAX) {
+            uint8_t *instructions = c_buffer_extend_for_write(&rw.output, 4);
+            instructions[0] = OP_WRITE_RAW_W;
+            uint24_to_bytes((unsigned int)total_size, &instructions[1]);
+        } else {
+            uint8_t *instructions = c_buffer_extend_for_write(&rw.output, 2);
+            instructions[0] = OP_WRITE_RAW;
+            instructions[1] = (uint8_t)total_size;
+        }
+        size_t merged_count = 0;
+        while (ip < run_end) {
+            rw.offset_map[rewrite_offset(&rw, ip)] = merged_offset;
+            write_raw_text(ip, &text, &size);
+            c_buffer_write(&rw.output, (void *)text, size);
+            liquid_vm_next_instruction(&ip);
+            merged_count++;
+        }
+        pass_stats[PASS_MERGE_RAW_WRITES].rewrites += merged_count - 1;
+    }
+
+    rewrite_finish(&rw, PASS_MERGE_RAW_WRITES);
+}
+
+// Returns the constant pushed by the instruction or Qundef if it isn't a constant push
+static VALUE constant_push_value(vm_assembler_t *code, const uint8_t *ip)
+{
+    switch (*ip) {
+        case OP_PUSH_NIL:
+            return Qnil;
+        case OP_PUSH_TRUE:
+            return Qtrue;
+        case OP_PUSH_FALSE:
+            return Qfalse;
+        case OP_PUSH_INT8:
+            return INT2FIX(*(int8_t *)&ip[1]);
+        case OP_PUSH_INT16:
+            return INT2FIX((int16_t)((ip[1] << 8) | ip[2]));
+        case OP_PUSH_CONST:
+            return ((VALUE *)code->constants.data)[(ip[1] << 8) | ip[2]];
+        default:
+            return Qundef;
+    }
+}
+
+// Values that can be pushed by an instruction in place of a folded filter
+static bool foldable_result_p(VALUE value)
+{
+    if (RB_SPECIAL_CONST_P(value))
+        return value == Qnil || value == Qtrue || value == Qfalse || RB_FIXNUM_P(value) || RB_FLOAT_TYPE_P(value);
+    VALUE klass = RBASIC_CLASS(value);
+    return klass == rb_cString || klass == rb_cFloat;
+}
+
+// Writes the instruction that pushes value, adding it to the constants if needed
+static void rewrite_write_push(rewrite_t *rw, VALUE value)
+{
+    if (value == Qnil) {
+        c_buffer_write_byte(&rw->output, OP_PUSH_NIL);
+    } else if (value == Qtrue) {
+        c_buffer_write_byte(&rw->output, OP_PUSH_TRUE);
+    } else if (value == Qfalse) {
+        c_buffer_write_byte(&rw->output, OP_PUSH_FALSE);
+    } else if (RB_FIXNUM_P(value) && FIX2LONG(value) >= INT8_MIN && FIX2LONG(value) <= INT8_MAX) {
+        uint8_t *instructions = c_buffer_extend_for_write(&rw->output, 2);
+        instructions[0] = OP_PUSH_INT8;
+        instructions[1] = (uint8_t)(int8_t)FIX2LONG(value);
+    } else if (RB_FIXNUM_P(value) && FIX2LONG(value) >= INT16_MIN && FIX2LONG(value) <= INT16_MAX) {
+        int16_t num = (int16_t)FIX2LONG(value);
+        uint8_t *instructions = c_buffer_extend_for_write(&rw->output, 3);
+        instructions[0] = OP_PUSH_INT16;
+        instructions[1] = (uint16_t)num >> 8;
+        instructions[2] = (uint8_t)num;
+    } else {
+        if (RB_TYPE_P(value, T_STRING))
+            value = rb_str_new_frozen(value);
+        uint16_t index = vm_assembler_write_ruby_constant(rw->code, value);
+        uint8_t *instructions = c_buffer_extend_for_write(&rw->output, 3);
+        instructions[0] = OP_PUSH_CONST;
+        instructions[1] = index >> 8;
+        instructions[2] = (uint8_t)index;
+    }
+}
+
+typedef struct evaluate_constant_filter_args {
+    VALUE filter_name;
+    VALUE filter_args;
+} evaluate_constant_filter_args_t;
+
+static VALUE evaluate_constant_filter(VALUE uncast_args)
+{
+    evaluate_constant_filter_args_t *args = (void *)uncast_args;
+    return rb_funcall(mLiquidCOptimizer, id_evaluate_constant_filter, 2, args->filter_name, args->filter_args);
+}
+
+static bool compute_max_stack_size(vm_assembler_t *code, size_t *max_stack_size_ptr);
+
+// Folds pure builtin filters with constant inputs and arguments into a push of their result,
+// keeping a copy of the instructions from before in unfolded when any were folded.
+// Returns the state of an exception raised by Ruby code, after the instructions are left unchanged.
+static int fold_constant_filters_pass(vm_assembler_t *code, vm_unfolded_instructions_t *unfolded)
+{
+    rewrite_t rw;
+    rewrite_begin(&rw, code);
+    int exception_state = 0;
+    uint64_t folded_filters = 0;
+
+    const uint8_t *ip = rw.start;
+    const uint8_t *end_ip = rw.start + rw.size;
+    while (ip < end_ip) {
+        if (*ip != OP_BUILTIN_FILTER || exception_state || !builtin_filters[ip[1]].pure ||
+            rw.jump_targets[rewrite_offset(&rw, ip)])
+        {
+            rewrite_copy(&rw, ip);
+            liquid_vm_next_instruction(&ip);
+            continue;
+        }
+
+        size_t num_args = ip[2];
+        VALUE filter_args = Qnil;
+        if (num_args <= rewrite_output_instructions_count(&rw)) {
+            filter_args = rb_ary_new_capa(num_args);
+            for (size_t i = num_args; i > 0; i--) {
+                output_instruction_t *arg_instruction = rewrite_output_instruction(&rw, i);
+                VALUE value = constant_push_value(code, rw.output.data + arg_instruction->offset);
+                // only the first argument can be jumped to, since the filter is evaluated after it
+                if (value == Qundef || (i < num_args && arg_instruction->jump_target)) {
+                    filter_args = Qnil;
+                    break;
+                }
+                rb_ary_push(filter_args, value);
+            }
+        }
+
+        VALUE result = Qnil;
+        if (filter_args != Qnil) {
+            evaluate_constant_filter_args_t args = {
+                .filter_name = builtin_filters[ip[1]].sym,
+                .filter_args = filter_args,
+            };
+            result = rb_protect(evaluate_constant_filter, (VALUE)&args, &exception_state);
+            if (exception_state || !RB_TYPE_P(result, T_ARRAY) || RARRAY_LEN(result) != 1 ||
+                !foldable_result_p(RARRAY_AREF(result, 0)))
+            {
+                result = Qnil;
+            }
+        }
+
+        if (result == Qnil) {
+            rewrite_copy(&rw, ip);
+            liquid_vm_next_instruction(&ip);
+            continue;
+        }
+
+        rewrite_replace_output(&rw, num_args);
+        rw.offset_map[rewrite_offset(&rw, ip)] = rewrite_output_instruction(&rw, 1)->offset;
+        rewrite_write_push(&rw, RARRAY_AREF(result, 0));
+        folded_filters |= UINT64_C(1) << ip[1];
+        pass_stats[PASS_FOLD_CONSTANT_FILTERS].rewrites++;
+        liquid_vm_next_instruction(&ip);
+    }
+
+    if (exception_state || !folded_filters) {
+        rewrite_free(&rw);
+        return exception_state;
+    }
+
+    unfolded->folded_filters = folded_filters;
+    unfolded->instructions = c_buffer_allocate(rw.size);
+    c_buffer_write(&unfolded->instructions, (void *)rw.start, rw.size);
+    size_t max_stack_size;
+    if (compute_max_stack_size(code, &max_stack_size) && max_stack_size < code->max_stack_size) {
+        unfolded->max_stack_size = max_stack_size;
+    } else {
+        unfolded->max_stack_size = code->max_stack_size;
+    }
+    rewrite_finish(&rw, PASS_FOLD_CONSTANT_FILTERS);
+    return 0;
+}
+
+// Returns the constant pushed by the last output instruction, or Qundef if it isn't
+// a constant push or it can only be jumped to when it is the first of count instructions
+static VALUE rewrite_output_constant(rewrite_t *rw, size_t index_from_end, size_t count)
+{
+    if (rewrite_output_instructions_count(rw) < index_from_end)
+        return Qundef;
+    output_instruction_t *instruction = rewrite_output_instruction(rw, index_from_end);
+    if (index_from_end < count && instruction->jump_target)
+        return Qundef;
+    return constant_push_value(rw->code, rw->output.data + instruction->offset);
+}
+
+/*
+ * Folds comparisons of constants that are evaluated natively, and conditional
+ * jumps on constants into an unconditional jump or nothing, dropping the
+ * instructions that can no longer be reached. e.g. resolves the branches of
+ * an if tag with a constant condition.
+ */
+static void fold_constant_branches_pass(vm_assembler_t *code)
+{
+    rewrite_t rw;
+    rewrite_begin(&rw, code);
+
+    const uint8_t *ip = rw.start;
+    const uint8_t *end_ip = rw.start + rw.size;
+    bool unreachable = false;
+    while (ip < end_ip) {
+        const uint8_t *next_ip = ip;
+        liquid_vm_next_instruction(&next_ip);
+        bool jump_target = rw.jump_targets[rewrite_offset(&rw, ip)];
+
+        if (unreachable && !jump_target) {
+            pass_stats[PASS_FOLD_CONSTANT_BRANCHES].rewrites++;
+            ip = next_ip;
+            continue;
+        }
+        unreachable = false;
+
+        if (*ip == OP_COMPARE && !jump_target) {
+            VALUE left = rewrite_output_constant(&rw, 2, 2);
+            VALUE right = rewrite_output_constant(&rw, 1, 2);
+            VALUE result = Qundef;
+            if (left != Qundef && right != Qundef && foldable_result_p(left) && foldable_result_p(right))
+                result = condition_compare_native(ip[3], left, right);
+            if (result != Qundef) {
+                rewrite_replace_output(&rw, 2);
+                rw.offset_map[rewrite_offset(&rw, ip)] = rewrite_output_instruction(&rw, 1)->offset;
+                rewrite_write_push(&rw, RTEST(result) ? Qtrue : Qfalse);
+                pass_stats[PASS_FOLD_CONSTANT_BRANCHES].rewrites++;
+                ip = next_ip;
+                continue;
+            }
+        } else if ((*ip == OP_JUMP_IF_FALSE || *ip == OP_JUMP_IF_TRUE) && !jump_target) {
+            VALUE value = rewrite_output_constant(&rw, 1, 1);
+            if (value != Qundef) {
+                bool jump_when = *ip == OP_JUMP_IF_TRUE;
+                size_t offset = rewrite_truncate_output(&rw, 1);
+                rw.offset_map[rewrite_offset(&rw, ip)] = offset;
+                if (value_truthy_p(value) == jump_when) {
+                    rewrite_start_instruction(&rw, ip);
+                    rewrite_write_jump(&rw, rewrite_offset(&rw, next_ip + bytes_to_uint24(ip + 1)));
+                    unreachable = true;
+                }
+                pass_stats[PASS_FOLD_CONSTANT_BRANCHES].rewrites++;
+                ip = next_ip;
+                continue;
+            }
+        }
+
+        rewrite_copy(&rw, ip);
+        unreachable = *ip == OP_JUMP;
+        ip = next_ip;
+    }
+
+    rewrite_finish(&rw, PASS_FOLD_CONSTANT_BRANCHES);
+}
+
+// Values of a static environment that are pushed as constants in place of being
+// looked up, which Liquid::Context#find_variable wouldn't convert with to_liquid
+static bool static_value_p(VALUE value)
+{
+    if (RB_SPECIAL_CONST_P(value))
+        return value == Qnil || value == Qtrue || value == Qfalse || RB_FIXNUM_P(value) || RB_FLOAT_TYPE_P(value);
+    VALUE klass = RBASIC_CLASS(value);
+    return klass == rb_cString || klass == rb_cFloat || klass == rb_cInteger || klass == rb_cArray || klass == rb_cHash;
+}
+
+// Looks up a constant key in a frozen Hash, returning Qundef if the key could be missing
+// or its value could change
+static VALUE static_lookup(VALUE hash, VALUE key)
+{
+    if (hash == Qundef || !RB_TYPE_P(hash, T_HASH) || RBASIC_CLASS(hash) != rb_cHash || !RB_OBJ_FROZEN(hash))
+        return Qundef;
+    VALUE value = rb_hash_lookup2(hash, key, Qundef);
+    return value != Qundef && static_value_p(value) ? value : Qundef;
+}
+
+typedef struct specialization {
+    VALUE static_environment;
+    VALUE assigned_names; // variables that could be assigned instead of found in the static environment
+} specialization_t;
+
+static VALUE specialization_find_variable(specialization_t *specialization, VALUE name)
+{
+    if (rb_hash_lookup2(specialization->assigned_names, name, Qundef) != Qundef)
+        return Qundef;
+    return static_lookup(specialization->static_environment, name);
+}
+
+// Replaces lookups of the variables in the static environment and their frozen keys by
+// pushes of their values, which the other passes can then fold
+static void specialize_static_lookups(vm_assembler_t *code, specialization_t *specialization)
+{
+    rewrite_t rw;
+    rewrite_begin(&rw, code);
+
+    const uint8_t *ip = rw.start;
+    const uint8_t *end_ip = rw.start + rw.size;
+    while (ip < end_ip) {
+        const uint8_t *constant_ip = ip + 1;
+        const VALUE *constants = (const VALUE *)code->constants.data;
+        VALUE value = Qundef, key_value = Qundef;
+        switch (*ip) {
+            case OP_FIND_STATIC_VAR:
+            case OP_WRITE_STATIC_VAR:
+                value = specialization_find_variable(specialization, constants[(ip[1] << 8) | ip[2]]);
+                break;
+            case OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY:
+            case OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY:
+                value = specialization_find_variable(specialization, constants[(ip[1] << 8) | ip[2]]);
+                key_value = static_lookup(value, constants[(ip[3] << 8) | ip[4]]);
+                break;
+            case OP_LOOKUP_CONST_KEY:
+                if (!rw.jump_targets[rewrite_offset(&rw, ip)]) {
+                    VALUE object = rewrite_output_constant(&rw, 1, 1);
+                    key_value = static_lookup(object, constants[(ip[1] << 8) | ip[2]]);
+                }
+                break;
+        }
+
+        if (value == Qundef && key_value == Qundef) {
+            rewrite_copy(&rw, ip);
+            liquid_vm_next_instruction(&ip);
+            continue;
+        }
+
+        if (*ip == OP_LOOKUP_CONST_KEY) {
+            rewrite_replace_output(&rw, 1);
+            rw.offset_map[rewrite_offset(&rw, ip)] = rewrite_output_instruction(&rw, 1)->offset;
+        } else {
+            rewrite_start_instruction(&rw, ip);
+        }
+        bool write = *ip == OP_WRITE_STATIC_VAR || *ip == OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY;
+        bool lookup = *ip == OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY || *ip == OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY;
+        if (write) {
+            // the fused instruction ends with the line number of the variable
+            uint8_t *instructions = c_buffer_extend_for_write(&rw.output, 4);
+            instructions[0] = OP_RENDER_VARIABLE_RESCUE;
+            memcpy(&instructions[1], lookup ? &ip[5] : &ip[3], 3);
+        }
+        if (key_value != Qundef) {
+            rewrite_write_push(&rw, key_value);
+        } else {
+            rewrite_write_push(&rw, value);
+            if (lookup) {
+                uint8_t *instructions = c_buffer_extend_for_write(&rw.output, 3);
+                instructions[0] = OP_LOOKUP_CONST_KEY;
+                memcpy(&instructions[1], &constant_ip[2], 2);
+            }
+        }
+        if (write)
+            c_buffer_write_byte(&rw.output, OP_POP_WRITE);
+
+        pass_stats[PASS_SPECIALIZE_STATIC_LOOKUPS].rewrites++;
+        liquid_vm_next_instruction(&ip);
+    }
+
+    rewrite_finish(&rw, PASS_SPECIALIZE_STATIC_LOOKUPS);
+}
+
+// Returns the text that writing value outputs if it can't depend on when it is written,
+// or Qundef otherwise
+static VALUE constant_write_text(VALUE value)
+{
+    if (value == Qnil)
+        return rb_str_new(NULL, 0);
+    if (value == Qtrue || value == Qfalse || RB_FIXNUM_P(value))
+        return rb_obj_as_string(value);
+    if (RB_TYPE_P(value, T_STRING) && RBASIC_CLASS(value) == rb_cString && RB_OBJ_FROZEN(value) &&
+        (ENCODING_GET(value) == rb_utf8_encindex() || rb_enc_str_asciionly_p(value)))
+        return value;
+    return Qundef;
+}
+
+// Replaces variable renders that only write a constant by a raw write of its text. This
+// skips the global filter, which is why it is only done for specialized block bodies.
+static void fold_constant_writes(vm_assembler_t *code)
+{
+    rewrite_t rw;
+    rewrite_begin(&rw, code);
+
+    const uint8_t *ip = rw.start;
+    const uint8_t *end_ip = rw.start + rw.size;
+    while (ip < end_ip) {
+        if (*ip != OP_POP_WRITE || rw.jump_targets[rewrite_offset(&rw, ip)] || rewrite_output_instructions_count(&rw) < 2 ||
+            *(rw.output.data + rewrite_output_instruction(&rw, 2)->offset) != OP_RENDER_VARIABLE_RESCUE)
+        {
+            rewrite_copy(&rw, ip);
+            liquid_vm_next_instruction(&ip);
+            continue;
+        }
+
+        VALUE value = rewrite_output_constant(&rw, 1, 2);
+        VALUE text = value != Qundef ? constant_write_text(value) : Qundef;
+        if (text == Qundef) {
+            rewrite_copy(&rw, ip);
+            liquid_vm_next_instruction(&ip);
+            continue;
+        }
+
+        rewrite_replace_output(&rw, 2);
+        size_t offset = rewrite_output_instruction(&rw, 1)->offset;
+        rw.offset_map[rewrite_offset(&rw, ip)] = offset;
+        if (RSTRING_LEN(text) > 0) {
+            rewrite_write_raw(&rw, RSTRING_PTR(text), RSTRING_LEN(text));
+        } else {
+            rewrite_truncate_output(&rw, 1);
+        }
+        RB_GC_GUARD(text);
+        pass_stats[PASS_FOLD_CONSTANT_WRITES].rewrites++;
+        liquid_vm_next_instruction(&ip);
+    }
+
+    rewrite_finish(&rw, PASS_FOLD_CONSTANT_WRITES);
+}
+
+// Computes the max stack size from the stack effect of each instruction. Jumps
+// don't need to be followed, since the compiled branches leave the stack the same.
+// Returns false for instructions it doesn't know the stack effect of.
+static bool compute_max_stack_size(vm_assembler_t *code, size_t *max_stack_size_ptr)
+{
+    const uint8_t *ip = code->instructions.data;
+    const uint8_t *end_ip = code->instructions.data_end;
+    const VALUE *constants = (const VALUE *)code->constants.data;
+    long stack_size = 0, max_stack_size = 0;
+
+    while (ip < end_ip) {
+        long pop = 0, push = 0;
+        switch (*ip) {
+            case OP_PUSH_CONST:
+            case OP_PUSH_NIL:
+            case OP_PUSH_TRUE:
+            case OP_PUSH_FALSE:
+            case OP_PUSH_INT8:
+            case OP_PUSH_INT16:
+            case OP_FIND_STATIC_VAR:
+            case OP_FIND_STATIC_VAR_LOOKUP_CONST_KEY:
+                push = 1;
+                break;
+            case OP_FIND_VAR:
+                pop = 1, push = 1;
+                break;
+            case OP_LOOKUP_CONST_KEY:
+            case OP_LOOKUP_COMMAND:
+                // pushes the key before popping it with the object
+                if (stack_size + 1 > max_stack_size)
+                    max_stack_size = stack_size + 1;
+                pop = 1, push = 1;
+                break;
+            case OP_LOOKUP_KEY:
+            case OP_NEW_INT_RANGE:
+            case OP_COMPARE:
+                pop = 2, push = 1;
+                break;
+            case OP_HASH_NEW:
+                pop = ip[1] * 2, push = 1;
+                break;
+            case OP_FILTER:
+                pop = FIX2LONG(RARRAY_AREF(constants[(ip[1] << 8) | ip[2]], 1)), push = 1;
+                break;
+            case OP_BUILTIN_FILTER:
+                pop = ip[2], push = 1;
+                break;
+            case OP_POP_WRITE:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_ASSIGN:
+            case OP_CASE_DISPATCH:
+                pop = 1;
+                break;
+            case OP_FOR_INIT:
+                pop = 3;
+                break;
+            case OP_RENDER_PARTIAL:
+                pop = 1 + ip[7] * 2;
+                break;
+            case OP_LEAVE:
+            case OP_WRITE_RAW_W:
+            case OP_WRITE_RAW:
+            case OP_WRITE_NODE:
+            case OP_RENDER_VARIABLE_RESCUE:
+            case OP_JUMP_FWD_W:
+            case OP_JUMP_FWD:
+            case OP_RENDER_TAG_RESCUE:
+            case OP_END_TAG:
+            case OP_JUMP:
+            case OP_RENDER_BODY:
+            case OP_FOR_NEXT:
+            case OP_FOR_END:
+            case OP_CAPTURE:
+            case OP_WRITE_STATIC_VAR:
+            case OP_WRITE_STATIC_VAR_LOOKUP_CONST_KEY:
+                break;
+            default:
+                return false;
+        }
+        if (pop > stack_size)
+            return false;
+        stack_size += push - pop;
+        if (stack_size > max_stack_size)
+            max_stack_size = stack_size;
+        liquid_vm_next_instruction(&ip);
+    }
+
+    *max_stack_size_ptr = max_stack_size;
+    return true;
+}
+
+static void fold_constant_branches(vm_assembler_t *code)
+{
+    unsigned long long rewrites;
+    do {
+        rewrites = pass_stats[PASS_FOLD_CONSTANT_BRANCHES].rewrites;
+        fold_constant_branches_pass(code);
+        if (pass_stats[PASS_FOLD_CONSTANT_BRANCHES].rewrites == rewrites)
+            break;
+        // the branches that are always taken leave jumps to the next instruction and adjacent
+        // raw writes, and the branches that are never taken are only dropped once the jumps
+        // to them are gone
+        drop_dead_jumps(code);
+        merge_raw_writes(code);
+    } while (true);
+}
+
+/*
+ * Builtin filters are only folded for a context whose strainer doesn't override them,
+ * which isn't known until rendering, so the instructions from before they were folded
+ * are kept in unfolded to render with a context that does. unfolded->folded_filters is
+ * 0 when nothing was folded, otherwise unfolded->instructions must be freed.
+ */
+void vm_assembler_optimize(vm_assembler_t *code, vm_unfolded_instructions_t *unfolded)
+{
+    assert(!code->parsing);
+    size_t bytes_before = c_buffer_size(&code->instructions);
+    *unfolded = (vm_unfolded_instructions_t) { .folded_filters = 0, .instructions = c_buffer_init() };
+
+    drop_dead_jumps(code);
+    merge_raw_writes(code);
+    fold_constant_branches(code);
+
+    int exception_state = 0;
+    if (fold_constant_filters)
+        exception_state = fold_constant_filters_pass(code, unfolded);
+    if (unfolded->folded_filters)
+        fold_constant_branches(code);
+
+    size_t max_stack_size;
+    if (!exception_state && compute_max_stack_size(code, &max_stack_size) && max_stack_size < code->max_stack_size) {
+        pass_stats[PASS_MAX_STACK_SIZE].rewrites++;
+        pass_stats[PASS_MAX_STACK_SIZE].saved += code->max_stack_size - max_stack_size;
+        code->max_stack_size = max_stack_size;
+    }
+
+    stats_block_bodies++;
+    stats_bytes_before += bytes_before;
+    stats_bytes_after += c_buffer_size(&code->instructions);
+
+    if (exception_state)
+        rb_jump_tag(exception_state);
+}
+
+/*
+ * Optimizes a copy of the instructions of a compiled block body for rendering
+ * with a frozen static environment, see Liquid::C::BlockBody#specialize.
+ */
+void vm_assembler_specialize(vm_assembler_t *code, VALUE static_environment, VALUE assigned_names,
+                             vm_unfolded_instructions_t *unfolded)
+{
+    specialization_t specialization = {
+        .static_environment = static_environment,
+        .assigned_names = assigned_names,
+    };
+    specialize_static_lookups(code, &specialization);
+    vm_assembler_optimize(code, unfolded);
+    fold_constant_writes(code);
+    merge_raw_writes(code);
+}
+
+/*
+ * Returns the output of optimized instructions that only write raw text and variables
+ * whose value is a constant, e.g. after folding their filters, as a frozen string.
+ * Returns Qundef if the output depends on the context or nothing is written.
+ */
+VALUE vm_assembler_constant_output(vm_assembler_t *code)
+{
+    const uint8_t *ip = code->instructions.data;
+    const uint8_t *end_ip = code->instructions.data_end;
+    VALUE output = rb_utf8_str_new(NULL, 0);
+    bool written = false;
+
+    while (ip < end_ip && *ip != OP_LEAVE) {
+        if (write_raw_p(ip)) {
+            const uint8_t *text;
+            size_t size;
+            write_raw_text(ip, &text, &size);
+            rb_str_cat(output, (const char *)text, size);
+            written = true;
+        } else if (*ip == OP_RENDER_VARIABLE_RESCUE) {
+            // e.g. render_variable_rescue, push_const, pop_write
+            const uint8_t *push_ip = ip;
+            liquid_vm_next_instruction(&push_ip);
+            const uint8_t *write_ip = push_ip;
+            liquid_vm_next_instruction(&write_ip);
+            if (write_ip >= end_ip || *write_ip != OP_POP_WRITE)
+                return Qundef;
+            VALUE value = constant_push_value(code, push_ip);
+            // string literals aren't frozen, but nothing else can change the one that is written
+            if (RB_TYPE_P(value, T_STRING))
+                value = rb_str_new_frozen(value);
+            VALUE text = value != Qundef ? constant_write_text(value) : Qundef;
+            if (text == Qundef)
+                return Qundef;
+            rb_str_buf_append(output, text);
+            written = true;
+            ip = write_ip;
+        } else if (*ip != OP_JUMP_FWD && *ip != OP_JUMP_FWD_W && // left by remove_blank_strings
+                   *ip != OP_RENDER_TAG_RESCUE && *ip != OP_END_TAG) // e.g. around an inlined partial
+        {
+            return Qundef;
+        }
+        liquid_vm_next_instruction(&ip);
+    }
+
+    return written ? rb_str_freeze(output) : Qundef;
+}
+
+static VALUE optimizer_stats(VALUE self)
+{
+    VALUE passes = rb_hash_new();
+    for (int pass = 0; pass < PASS_COUNT; pass++) {
+        VALUE pass_hash = rb_hash_new();
+        rb_hash_aset(pass_hash, ID2SYM(rb_intern("rewrites")), ULL2NUM(pass_stats[pass].rewrites));
+        const char *saved_key = pass == PASS_MAX_STACK_SIZE ? "stack_size_saved" : "bytes_saved";
+        rb_hash_aset(pass_hash, ID2SYM(rb_intern(saved_key)), ULL2NUM(pass_stats[pass].saved));
+        rb_hash_aset(passes, ID2SYM(rb_intern(pass_stats[pass].name)), pass_hash);
+    }
+
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("block_bodies")), ULL2NUM(stats_block_bodies));
+    rb_hash_aset(stats, ID2SYM(rb_intern("bytes_before")), ULL2NUM(stats_bytes_before));
+    rb_hash_aset(stats, ID2SYM(rb_intern("bytes_after")), ULL2NUM(stats_bytes_after));
+    rb_hash_aset(stats, ID2SYM(rb_intern("passes")), passes);
+    return stats;
+}
+
+static VALUE optimizer_reset_stats(VALUE self)
+{
+    for (int pass = 0; pass < PASS_COUNT; pass++) {
+        pass_stats[pass].rewrites = 0;
+        pass_stats[pass].saved = 0;
+    }
+    stats_block_bodies = 0;
+    stats_bytes_before = 0;
+    stats_bytes_after = 0;
+    return Qnil;
+}
+
+static VALUE optimizer_fold_constant_filters_p(VALUE self)
+{
+    return fold_constant_filters ? Qtrue : Qfalse;
+}
+
+static VALUE optimizer_set_fold_constant_filters(VALUE self, VALUE value)
+{
+    fold_constant_filters = RTEST(value);
+    return value;
+}
+
+void liquid_define_vm_optimizer(void)
+{
+    id_evaluate_constant_filter = rb_intern("evaluate_constant_filter");
+
+    mLiquidCOptimizer = rb_define_module_under(mLiquidC, "Optimizer");
+    rb_global_variable(&mLiquidCOptimizer);
+
+    rb_define_singleton_method(mLiquidCOptimizer, "stats", optimizer_stats, 0);
+    rb_define_singleton_method(mLiquidCOptimizer, "reset_stats", optimizer_reset_stats, 0);
+    rb_define_singleton_method(mLiquidCOptimizer, "fold_constant_filters", optimizer_fold_constant_filters_p, 0);
+    rb_define_singleton_method(mLiquidCOptimizer, "fold_constant_filters=", optimizer_set_fold_constant_filters, 1);
+}
@@ -0,0 +1,18 @@
+#ifndef LIQUID_VM_OPTIMIZER_H
+#define LIQUID_VM_OPTIMIZER_H
+
+#include "vm_assembler.h"
+
+typedef struct vm_unfolded_instructions {
+    uint64_t folded_filters; // bitmask of the builtin_filters that were folded
+    c_buffer_t instructions;
+    size_t max_stack_size;
+} vm_unfolded_instructions_t;
+
+void liquid_define_vm_optimizer(void);
+void vm_assembler_optimize(vm_assembler_t *code, vm_unfolded_instructions_t *unfolded);
+void vm_assembler_specialize(vm_assembler_t *code, VALUE static_environment, VALUE assigned_names,
+                             vm_unfolded_instructions_t *unfolded);
+VALUE vm_assembler_constant_output(vm_assembler_t *code);
+
+#endif
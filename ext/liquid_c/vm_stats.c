@@ -0,0 +1,160 @@
+#include <time.h>
+#include "vm_stats.h"
+#include "vm_assembler.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define VM_STATS_TIME_UNIT "cycles"
+#elif defined(__aarch64__)
+#define VM_STATS_TIME_UNIT "ticks"
+#else
+#define VM_STATS_TIME_UNIT "nanoseconds"
+#endif
+
+typedef struct vm_stats_counter {
+    uint64_t count;
+    uint64_t time;
+} vm_stats_counter_t;
+
+// Not an instruction, for time spent outside of the VM
+#define VM_STATS_OUTSIDE_VM OPCODE_COUNT
+
+bool vm_stats_enabled = false;
+vm_stats_position_t vm_stats_position = { VM_STATS_OUTSIDE_VM, 0 };
+static uint64_t position_start_time;
+static vm_stats_counter_t opcode_counters[OPCODE_COUNT + 1];
+static st_table *filter_counters; // filter name ID => vm_stats_counter_t *
+
+static inline uint64_t vm_stats_time(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static vm_stats_counter_t *filter_counter(ID filter)
+{
+    st_data_t counter;
+    if (!st_lookup(filter_counters, (st_data_t)filter, &counter)) {
+        counter = (st_data_t)ZALLOC(vm_stats_counter_t);
+        st_insert(filter_counters, (st_data_t)filter, counter);
+    }
+    return (vm_stats_counter_t *)counter;
+}
+
+static void vm_stats_move_to(vm_stats_position_t position)
+{
+    uint64_t now = vm_stats_time();
+    uint64_t elapsed = now - position_start_time;
+    opcode_counters[vm_stats_position.op].time += elapsed;
+    if (vm_stats_position.filter)
+        filter_counter(vm_stats_position.filter)->time += elapsed;
+    vm_stats_position = position;
+    position_start_time = now;
+}
+
+void vm_stats_record(const uint8_t *ip, const VALUE *constants)
+{
+    vm_stats_position_t position = { *ip, 0 };
+    if (position.op == OP_FILTER) {
+        VALUE filter = constants[(ip[1] << 8) | ip[2]];
+        position.filter = rb_sym2id(RARRAY_AREF(filter, 0));
+    } else if (position.op == OP_BUILTIN_FILTER) {
+        position.filter = rb_sym2id(builtin_filters[ip[1]].sym);
+    }
+
+    vm_stats_move_to(position);
+    opcode_counters[position.op].count++;
+    if (position.filter)
+        filter_counter(position.filter)->count++;
+}
+
+void vm_stats_leave(vm_stats_position_t caller)
+{
+    vm_stats_move_to(caller);
+}
+
+static int free_filter_counter(st_data_t key, st_data_t value, st_data_t arg)
+{
+    xfree((void *)value);
+    return ST_DELETE;
+}
+
+static void vm_stats_reset(void)
+{
+    memset(opcode_counters, 0, sizeof(opcode_counters));
+    st_foreach(filter_counters, free_filter_counter, 0);
+    vm_stats_position = (vm_stats_position_t) { VM_STATS_OUTSIDE_VM, 0 };
+    position_start_time = vm_stats_time();
+}
+
+static VALUE counter_to_hash(const vm_stats_counter_t *counter)
+{
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("count")), ULL2NUM(counter->count));
+    rb_hash_aset(hash, ID2SYM(rb_intern(VM_STATS_TIME_UNIT)), ULL2NUM(counter->time));
+    return hash;
+}
+
+static int filter_counter_to_hash(st_data_t key, st_data_t value, st_data_t hash)
+{
+    rb_hash_aset((VALUE)hash, ID2SYM((ID)key), counter_to_hash((vm_stats_counter_t *)value));
+    return ST_CONTINUE;
+}
+
+static VALUE vm_stats_method(VALUE self)
+{
+    VALUE opcodes = rb_hash_new();
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        if (opcode_counters[op].count)
+            rb_hash_aset(opcodes, ID2SYM(rb_intern(vm_opcode_names[op])), counter_to_hash(&opcode_counters[op]));
+    }
+
+    VALUE filters = rb_hash_new();
+    st_foreach(filter_counters, filter_counter_to_hash, (st_data_t)filters);
+
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("opcodes")), opcodes);
+    rb_hash_aset(stats, ID2SYM(rb_intern("filters")), filters);
+    return stats;
+}
+
+static VALUE vm_reset_stats_method(VALUE self)
+{
+    vm_stats_reset();
+    return Qnil;
+}
+
+static VALUE vm_stats_enabled_method(VALUE self)
+{
+    return vm_stats_enabled ? Qtrue : Qfalse;
+}
+
+static VALUE vm_set_stats_enabled_method(VALUE self, VALUE enabled)
+{
+    vm_stats_enabled = RTEST(enabled);
+    vm_stats_position = (vm_stats_position_t) { VM_STATS_OUTSIDE_VM, 0 };
+    position_start_time = vm_stats_time();
+    return enabled;
+}
+
+void liquid_define_vm_stats(void)
+{
+    filter_counters = st_init_numtable();
+
+    VALUE cLiquidCVM = rb_const_get(mLiquidC, rb_intern("VM"));
+    // Unit of the time in the stats, which depends on the clock available on the platform
+    rb_define_const(cLiquidCVM, "STATS_TIME_UNIT", ID2SYM(rb_intern(VM_STATS_TIME_UNIT)));
+    rb_define_singleton_method(cLiquidCVM, "stats", vm_stats_method, 0);
+    rb_define_singleton_method(cLiquidCVM, "reset_stats", vm_reset_stats_method, 0);
+    rb_define_singleton_method(cLiquidCVM, "stats_enabled?", vm_stats_enabled_method, 0);
+    rb_define_singleton_method(cLiquidCVM, "stats_enabled=", vm_set_stats_enabled_method, 1);
+}
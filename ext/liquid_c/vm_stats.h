@@ -0,0 +1,31 @@
+#ifndef LIQUID_VM_STATS_H
+#define LIQUID_VM_STATS_H
+
+#include "liquid.h"
+
+/*
+ * Opt-in execution counts and time per opcode and per filter for the VM,
+ * enabled with Liquid::C::VM.stats_enabled = true. The time between two
+ * instruction dispatches is attributed to the first instruction, except
+ * that the time spent rendering a nested block body is attributed to the
+ * instructions of that block body.
+ */
+
+// The instruction that time is currently being attributed to
+typedef struct vm_stats_position {
+    uint8_t op;
+    ID filter; // for filter instructions, otherwise 0
+} vm_stats_position_t;
+
+extern bool vm_stats_enabled;
+extern vm_stats_position_t vm_stats_position;
+
+// Called before dispatching the instruction at ip
+void vm_stats_record(const uint8_t *ip, const VALUE *constants);
+// Called when leaving a block body to go back to attributing time to the
+// instruction that rendered it
+void vm_stats_leave(vm_stats_position_t caller);
+
+void liquid_define_vm_stats(void);
+
+#endif
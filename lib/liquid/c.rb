@@ -24,12 +24,77 @@ module Liquid
       rescue => exc
         rescue_render_node(context, output, line_number, exc, blank_tag)
       end
+
+      # Renders a node like Liquid::BlockBody#render_node would with a profiler
+      def c_profile_render_node(context, output, node)
+        context.profiler.profile_node(context.template_name, code: node.raw, line_number: node.line_number) do
+          render_node(context, output, node)
+        end
+      end
+
+      # Starts timing a node that the VM renders without a block, so it can't
+      # use Liquid::Profiler#profile_node. The result is passed to
+      # c_profile_end_node when the node is done rendering.
+      def c_profile_start_node(profiler, template_name, code, line_number)
+        timing = Liquid::Profiler::Timing.new(code: code, template_name: template_name, line_number: line_number)
+        parent_children = profiler.instance_variable_get(:@current_children)
+        profiler.instance_variable_set(:@current_children, timing.children)
+        [timing, parent_children, Process.clock_gettime(Process::CLOCK_MONOTONIC)]
+      end
+
+      def c_profile_end_node(profiler, started)
+        timing, parent_children, start_time = started
+        timing.total_time = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start_time
+        profiler.instance_variable_set(:@current_children, parent_children)
+        parent_children << timing
+        nil
+      end
     end
   end
 end
 
 module Liquid
   module C
+    # Number of static environments that Liquid::Template#specialize keeps a copy for
+    MAX_SPECIALIZATIONS = 4
+
+    # Whether the VM can time compiled nodes for a Liquid::Profiler. The
+    # c_profile_start_node and c_profile_end_node hooks swap the profiler's
+    # private @current_children, so the `liquid_c_profile` option falls back
+    # to the Ruby AST if this version of liquid doesn't keep them there.
+    PROFILE_COMPILED_NODES = Liquid::Profiler.new.instance_variable_defined?(:@current_children) &&
+      Liquid::Profiler::Timing.method_defined?(:children)
+
+    # Output buffer used by Liquid::Template#render_to_stream, which the VM
+    # passes to write_chunk when it has at least chunk_size bytes.
+    class StreamBuffer
+      DEFAULT_CHUNK_SIZE = 16 * 1024
+
+      def initialize(target, chunk_size)
+        raise ArgumentError, "chunk_size must be positive" unless chunk_size.positive?
+
+        super("", encoding: Encoding::UTF_8, capacity: chunk_size)
+        @target = target
+        @chunk_size = chunk_size
+      end
+
+      def write_chunk(chunk)
+        if @target.respond_to?(:write)
+          @target.write(chunk)
+        else
+          @target.call(chunk)
+        end
+      end
+
+      def flush
+        return if empty?
+
+        chunk = String.new(self)
+        clear
+        write_chunk(chunk)
+      end
+    end
+
     # Placeholder for variables in the Liquid::C::BlockBody#nodelist.
     class VariablePlaceholder
       class << self
@@ -40,6 +105,136 @@ module Liquid
     class Tokenizer
       MAX_SOURCE_BYTE_SIZE = (1 << 24) - 1
     end
+
+    module Optimizer
+      # Evaluates builtin filters with constant arguments when frozen block bodies
+      # are optimized. The instructions from before they were folded are kept to
+      # render with a strainer whose custom filters override these builtins.
+      class ConstantFilters
+        include Liquid::StandardFilters
+      end
+      private_constant :ConstantFilters
+
+      class << self
+        # @api private
+        def evaluate_constant_filter(filter_name, args)
+          [ConstantFilters.new.public_send(filter_name, *args)]
+        rescue StandardError
+          # leave the error to be rendered
+          nil
+        end
+      end
+    end
+  end
+end
+
+Liquid::Template.class_eval do
+  # Serializes the compiled template, so it can be loaded by another process
+  # using Liquid::Template.load_compiled instead of parsing it again. See
+  # Liquid::C::BlockBody#dump for how tag nodes are serialized.
+  def dump_compiled(&node_dumper)
+    liquid_c_body.dump(&node_dumper)
+  end
+
+  # Sizes of the output of previous renders, which are used to reserve the
+  # capacity of the output buffer before rendering.
+  def render_stats
+    liquid_c_body.render_stats
+  end
+
+  def reset_render_stats
+    liquid_c_body.reset_render_stats
+  end
+
+  # Template name => source of the partials written into the template with
+  # the inline_partials parse option, including the ones they inlined.
+  def inlined_partials
+    liquid_c_body.inlined_partials
+  end
+
+  # Whether the source of an inlined partial is different in file_system, in
+  # which case the template has to be parsed again to render the new partial.
+  def inlined_partials_changed?(file_system)
+    inlined_partials.any? do |template_name, source|
+      file_system.read_template_file(template_name) != source
+    rescue Liquid::FileSystemError
+      true
+    end
+  end
+
+  # Returns a copy of the template for rendering with static_environment as
+  # the first static environment of the context, where its variables are
+  # replaced by their values. Contexts that the copy wouldn't render the same
+  # for are rendered with the template instead, see
+  # Liquid::C::BlockBody#specialize.
+  #
+  # The static environment must be frozen, along with the hashes in it whose
+  # keys are looked up. The copies are cached for the last few static
+  # environment objects.
+  def specialize(static_environment)
+    body = liquid_c_body
+    @specializations ||= {}.compare_by_identity
+    template = @specializations.delete(static_environment)
+    template ||= self.class.send(:from_liquid_c_body, body.specialize(static_environment))
+    @specializations.shift if @specializations.size >= Liquid::C::MAX_SPECIALIZATIONS
+    @specializations[static_environment] = template
+  end
+
+  # Reserves size bytes for the output instead of the average output size
+  # of previous renders, or goes back to using the average when nil.
+  def output_size_hint=(size)
+    liquid_c_body.output_size_hint = size
+  end
+
+  # Renders like #render, except that the output is written to target in
+  # chunks of at least chunk_size bytes while rendering, instead of being
+  # returned. target is an IO, anything else with a write method, or nil to
+  # yield the chunks to the block.
+  def render_to_stream(target = nil, *args, chunk_size: Liquid::C::StreamBuffer::DEFAULT_CHUNK_SIZE, &block)
+    target ||= block
+    raise ArgumentError, "render_to_stream requires a target or a block" unless target
+
+    liquid_c_body
+    buffer = Liquid::C::StreamBuffer.new(target, chunk_size)
+    args << {} if args.empty?
+    if args.size > 1 && args.last.is_a?(Hash)
+      args << args.pop.merge(output: buffer)
+    else
+      args << { output: buffer }
+    end
+    result = render(*args)
+    buffer.flush
+    # e.g. the error message for Liquid::MemoryError is returned instead of being written
+    buffer.write_chunk(result) unless result.equal?(buffer) || result.empty?
+    nil
+  end
+
+  class << self
+    # The data can also be a Liquid::C::MappedFile with the dump at offset, so
+    # the compiled instructions are shared by the processes that map the file.
+    def load_compiled(data, offset = 0, &node_loader)
+      from_liquid_c_body(Liquid::C::BlockBody.load(data, offset, &node_loader))
+    end
+
+    private
+
+    def from_liquid_c_body(body)
+      document = Liquid::Document.allocate
+      document.instance_variable_set(:@parse_context, Liquid::ParseContext.new)
+      document.instance_variable_set(:@body, body)
+      template = new
+      template.root = document
+      template
+    end
+  end
+
+  private
+
+  def liquid_c_body
+    body = root&.body
+    raise ArgumentError, "template wasn't compiled by liquid-c" unless body.is_a?(Liquid::C::BlockBody)
+
+    body
   end
 end
 
@@ -71,6 +266,17 @@ Liquid::ParseContext.class_eval do
     end
   end
 
+  # @api private
+  # Parses a partial being inlined like Liquid::PartialCache, except with its
+  # own document body, keeping track of the partials being inlined so a
+  # partial that renders itself isn't inlined forever.
+  def inline_partial_parse_context(template_name)
+    inlining_partials = [*@template_options[:inlining_partials], template_name]
+    parse_context = Liquid::ParseContext.new(@template_options.merge(inlining_partials: inlining_partials))
+    parse_context.partial = true
+    parse_context
+  end
+
   alias_method :ruby_new_tokenizer, :new_tokenizer
   def new_tokenizer(source, start_line_number: nil, for_liquid_tag: false)
     unless liquid_c_nodes_disabled?
@@ -97,13 +303,18 @@ Liquid::ParseContext.class_eval do
   # @api private
   def liquid_c_nodes_disabled?
     # Liquid::Profiler exposes the internal parse tree that we don't want to build when
-    # parsing with liquid-c, so consider liquid-c to be disabled when using it.
+    # parsing with liquid-c, so consider liquid-c to be disabled when using it, unless
+    # the `liquid_c_profile` option is also given and Liquid::C::PROFILE_COMPILED_NODES,
+    # in which case the VM times the compiled nodes for the profiler instead. The timings
+    # of compiled variables don't have their code, since their markup isn't kept after
+    # compiling them.
     # Also, some templates are parsed before the profiler is running, on which case we
     # provide the `disable_liquid_c_nodes` option to enable the Ruby AST to be produced
     # so the profiler can use it on future runs.
     return @liquid_c_nodes_disabled if defined?(@liquid_c_nodes_disabled)
 
-    @liquid_c_nodes_disabled = !Liquid::C.enabled || @template_options[:profile] ||
+    @liquid_c_nodes_disabled = !Liquid::C.enabled ||
+      (@template_options[:profile] && !(@template_options[:liquid_c_profile] && Liquid::C::PROFILE_COMPILED_NODES)) ||
       @template_options[:disable_liquid_c_nodes] || self.class.liquid_c_nodes_disabled
   end
 end
@@ -183,6 +394,37 @@ Liquid::Variable.class_eval do
   end
 end
 
+Liquid::Condition.class_eval do
+  # Called from the VM for comparisons that it doesn't handle natively, with
+  # the operands already evaluated and converted with Liquid::Utils.to_liquid_value
+  def c_interpret_operation(left, right)
+    operation = self.class.operators[operator] || raise(Liquid::ArgumentError, "Unknown operator #{operator}")
+
+    if operation.respond_to?(:call)
+      operation.call(self, left, right)
+    elsif left.respond_to?(operation) && right.respond_to?(operation) && !left.is_a?(Hash) && !right.is_a?(Hash)
+      begin
+        left.send(operation, right)
+      rescue ::ArgumentError => e
+        raise Liquid::ArgumentError, e.message
+      end
+    end
+  end
+end
+
+Liquid::Render.class_eval do
+  # Called from the VM the first time it renders this tag in a render, which
+  # keeps the result for the rest of the render. The partial's compiled body
+  # is rendered directly by the VM, so the partial is rendered through ruby
+  # when it wasn't compiled by liquid-c.
+  def c_load_partial(context)
+    partial = Liquid::PartialCache.load(@template_name_expr, context: context, parse_context: parse_context)
+    body = partial.root&.body
+    body = nil unless body.instance_of?(Liquid::C::BlockBody)
+    [partial, partial.name, body, self.class.send(:disabled_tags)].freeze
+  end
+end
+
 Liquid::StrainerTemplate.class_eval do
   class << self
     private
@@ -195,6 +437,16 @@ Liquid::StrainerTemplate.class_eval do
       end
     end
 
+    # Filters that haven't been overridden, so liquid-c can use a native
+    # implementation of them
+    def standard_filter_methods_hash
+      @standard_filter_methods_hash ||= {}.tap do |hash|
+        filter_methods.each do |method_name|
+          hash[method_name.to_sym] = true if instance_method(method_name).owner == Liquid::StandardFilters
+        end
+      end
+    end
+
     # Convert wrong number of argument error into a liquid exception to
     # treat it as an error in the template, not an internal error.
     def arg_exc_to_liquid_exc(argument_error)
@@ -205,6 +457,79 @@ Liquid::StrainerTemplate.class_eval do
   end
 end
 
+Liquid::Drop.singleton_class.class_eval do
+  # The method that Liquid::Drop#[] invokes for key on instances of this
+  # class, which liquid-c calls directly unless key lookups are customized
+  def c_lookup_method(key)
+    Liquid::C.watch_class_ancestors(self)
+    return unless instance_method(:[]).owner == Liquid::Drop && instance_method(:key?).owner == Liquid::Drop &&
+      method(:invokable?).owner == Liquid::Drop.singleton_class
+
+    key.to_sym if invokable?(key)
+  end
+end
+
+module Liquid
+  module C
+    # Classes whose instances can have what liquid-c needs to know about them
+    # cached, since changes to their methods clear the cache
+    CLASS_CACHE_ROOTS = [Liquid::Drop, String, Array, Hash, Numeric, Range, Time, (::Date if defined?(::Date))].compact.freeze
+
+    # Only the definitions from liquid are known to return self
+    liquid_lib_dir = File.dirname(Liquid::Template.instance_method(:render).source_location.first)
+    TO_LIQUID_SELF_METHODS = CLASS_CACHE_ROOTS.filter_map do |klass|
+      next unless klass.method_defined?(:to_liquid)
+
+      method = klass.instance_method(:to_liquid)
+      method if method.source_location&.first&.start_with?(liquid_lib_dir)
+    end.freeze
+
+    class << self
+      # Returns whether instances of klass respond to #context= and whether
+      # their #to_liquid returns self, or nil if that can't be cached
+      def value_class_capabilities(klass)
+        return unless CLASS_CACHE_ROOTS.any? { |root| klass <= root }
+        return unless klass.instance_method(:respond_to?).owner == Kernel &&
+          klass.instance_method(:respond_to_missing?).owner == Kernel
+        return unless klass.method_defined?(:to_liquid)
+
+        watch_class_ancestors(klass)
+        [klass.public_method_defined?(:context=), TO_LIQUID_SELF_METHODS.include?(klass.instance_method(:to_liquid))]
+      end
+
+      # @api private
+      # Modules included or prepended in a cached class don't have the hooks that
+      # the subclasses of the roots inherit, so they get their own
+      def watch_class_ancestors(klass)
+        klass.ancestors.each do |mod|
+          next if mod.is_a?(Class) || mod.singleton_class.include?(ClassCacheInvalidation)
+
+          mod.singleton_class.prepend(ClassCacheInvalidation)
+        end
+      end
+    end
+
+    ClassCacheInvalidation = Module.new do
+      [:method_added, :method_removed, :method_undefined].each do |hook|
+        define_method(hook) do |name|
+          Liquid::C.clear_class_caches
+          super(name)
+        end
+      end
+
+      [:include, :prepend].each do |method_name|
+        define_method(method_name) do |*modules|
+          Liquid::C.clear_class_caches
+          super(*modules)
+        end
+      end
+    end
+    private_constant :ClassCacheInvalidation
+
+    CLASS_CACHE_ROOTS.each { |klass| klass.singleton_class.prepend(ClassCacheInvalidation) }
+  end
+end
+
 Liquid::C::Expression.class_eval do
   class << self
     def lax_parse(markup)
@@ -234,6 +559,18 @@ Liquid::Context.class_eval do
   def c_parse_evaluate(expression)
     c_evaluate(Liquid::C::Expression.lax_parse(expression))
   end
+
+  # Ruby code called while rendering, e.g. filters and drops, changes the scopes with
+  # these methods, after which the VM can't skip to where it last found a variable
+  prepend(Module.new do
+    [:[]=, :push, :pop, :merge].each do |method_name|
+      define_method(method_name) do |*args|
+        super(*args)
+      ensure
+        c_invalidate_variable_cache
+      end
+    end
+  end)
 end
 
 Liquid::ResourceLimits.class_eval do
@@ -257,6 +594,9 @@ module Liquid
     class << self
       attr_reader :enabled
 
+      # Partials with larger sources aren't inlined by the inline_partials parse option
+      attr_accessor :inline_partial_max_bytes
+
       def enabled=(value)
         @enabled = value
         if value
@@ -274,5 +614,6 @@ module Liquid
     end
 
     self.enabled = true
+    self.inline_partial_max_bytes = 4096
   end
 end
@@ -42,3 +42,278 @@ Liquid::RangeLookup.class_eval do
     code.add_new_int_range
   end
 end
+
+Liquid::Condition.class_eval do
+  def compile_evaluate(code)
+    code.add_evaluate_expression(left)
+    return unless operator
+
+    code.add_evaluate_expression(right)
+    code.add_compare(self)
+  end
+
+  # Adds the instructions to evaluate the condition along with any
+  # conditions chained with `and`/`or`, which fall through when it is
+  # truthy. Returns the labels of the jumps to patch to skip the body.
+  def compile_branch(code)
+    false_labels = []
+    true_labels = []
+    condition = self
+    loop do
+      condition.compile_evaluate(code)
+      case condition.child_relation
+      when :or
+        true_labels << code.add_jump_if_true
+      when :and
+        false_labels << code.add_jump_if_false
+      else
+        false_labels << code.add_jump_if_false
+        break
+      end
+      condition = condition.child_condition
+    end
+    true_labels.each { |label| code.patch_jump(label) }
+    false_labels
+  end
+
+  # @api private
+  def c_compilable?
+    condition = self
+    while condition
+      return false unless condition.instance_of?(Liquid::Condition) || condition.instance_of?(Liquid::ElseCondition)
+
+      condition = condition.child_condition
+    end
+    attachment.instance_of?(Liquid::C::BlockBody)
+  end
+end
+
+Liquid::If.class_eval do
+  def compile_render(code)
+    return false unless instance_of?(Liquid::If) && blocks.all?(&:c_compilable?)
+
+    compile_blocks(code, blocks)
+    true
+  end
+
+  private
+
+  def compile_blocks(code, condition_blocks)
+    end_labels = []
+    condition_blocks.each do |block|
+      if block.else?
+        code.add_render_body(block.attachment)
+        break
+      end
+      false_labels = block.compile_branch(code)
+      code.add_render_body(block.attachment)
+      end_labels << code.add_jump unless block.equal?(condition_blocks.last)
+      false_labels.each { |label| code.patch_jump(label) }
+    end
+    end_labels.each { |label| code.patch_jump(label) }
+  end
+end
+
+Liquid::Unless.class_eval do
+  def compile_render(code)
+    return false unless instance_of?(Liquid::Unless) && blocks.all?(&:c_compilable?)
+
+    # The first condition is interpreted backwards, the rest are like an if tag
+    first_block = blocks.first
+    false_labels = first_block.compile_branch(code)
+    next_label = code.add_jump
+    false_labels.each { |label| code.patch_jump(label) }
+    code.add_render_body(first_block.attachment)
+    if blocks.size > 1
+      end_label = code.add_jump
+      code.patch_jump(next_label)
+      compile_blocks(code, blocks.drop(1))
+      code.patch_jump(end_label)
+    else
+      code.patch_jump(next_label)
+    end
+    true
+  end
+end
+
+Liquid::Case.class_eval do
+  def compile_render(code)
+    return false unless instance_of?(Liquid::Case) && @blocks.all?(&:c_compilable?)
+
+    dispatch_table = case_dispatch_table
+    if dispatch_table
+      compile_case_dispatch(code, dispatch_table)
+    else
+      compile_when_blocks(code)
+    end
+    true
+  end
+
+  private
+
+  # Maps the value of each when block to its index when they are all constants
+  # that can be found with a hash lookup, so the case value can be compared with
+  # them without calling #== on each of them.
+  def case_dispatch_table
+    when_blocks = @blocks.reject(&:else?)
+    return if when_blocks.empty? || when_blocks.size > 255
+
+    table = {}
+    when_blocks.each_with_index do |block, index|
+      return unless block.operator == "==" && block.child_condition.nil? && block.left.equal?(@left)
+
+      value = block.right
+      return unless value.nil? || value == true || value == false || value.instance_of?(String) || value.is_a?(Integer)
+      # each when block renders when its value matches, so duplicates have to be compared one at a time
+      return if table.key?(value)
+
+      table[value] = index
+    end
+    table
+  end
+
+  def compile_case_dispatch(code, dispatch_table)
+    branch_count = dispatch_table.size
+    code.add_evaluate_expression(@left)
+    label = code.add_case_dispatch(dispatch_table, branch_count)
+
+    # Like Liquid::Case#render_to_output_buffer, the else blocks before the matching
+    # when block are rendered along with it, or all of them when none match
+    end_labels = []
+    else_bodies = []
+    branch = 0
+    @blocks.each do |block|
+      if block.else?
+        else_bodies << block.attachment
+        next
+      end
+      code.patch_case_dispatch(label, branch)
+      else_bodies.each { |body| code.add_render_body(body) }
+      code.add_render_body(block.attachment)
+      end_labels << code.add_jump
+      branch += 1
+    end
+    code.patch_case_dispatch(label, branch_count)
+    else_bodies.each { |body| code.add_render_body(body) }
+    end_labels << code.add_jump
+
+    # Values like drops and floats could be equal to a value of a different type
+    code.patch_case_dispatch(label, branch_count + 1)
+    compile_when_blocks(code)
+    end_labels.each { |end_label| code.patch_jump(end_label) }
+  end
+
+  # Evaluates each when condition like Liquid::Case#render_to_output_buffer, rendering
+  # the body of each one that matches and the else blocks until one matches.
+  def compile_when_blocks(code)
+    has_else = @blocks.any?(&:else?)
+    matched_labels = []
+    @blocks.each do |block|
+      if block.else?
+        code.add_render_body(block.attachment)
+        next
+      end
+      false_labels = block.compile_branch(code)
+      code.add_render_body(block.attachment)
+      matched_labels << code.add_jump if has_else
+      false_labels.each { |label| code.patch_jump(label) }
+    end
+    return unless has_else
+
+    # After a when block matches, the ones after it are evaluated without the else blocks
+    end_label = code.add_jump
+    when_blocks = @blocks.reject(&:else?)
+    matched_labels.each_with_index do |matched_label, index|
+      code.patch_jump(matched_label)
+      next_block = when_blocks[index + 1]
+      next unless next_block
+
+      false_labels = next_block.compile_branch(code)
+      code.add_render_body(next_block.attachment)
+      false_labels.each { |label| code.patch_jump(label) }
+    end
+    code.patch_jump(end_label)
+  end
+end
+
+Liquid::For.class_eval do
+  def compile_render(code)
+    return false unless instance_of?(Liquid::For) && @for_block.instance_of?(Liquid::C::BlockBody) &&
+      (@else_block.nil? || @else_block.instance_of?(Liquid::C::BlockBody))
+
+    offset_continue = @from == :continue
+    code.add_evaluate_expression(offset_continue ? nil : @from)
+    code.add_evaluate_expression(@collection_name)
+    code.add_evaluate_expression(@limit)
+    else_label = code.add_for_init(@variable_name, @name, @reversed, offset_continue)
+    code.add_for_next(@for_block)
+    code.add_for_end
+    if @else_block
+      end_label = code.add_jump
+      code.patch_jump(else_label)
+      code.add_render_body(@else_block)
+      code.patch_jump(end_label)
+    else
+      code.patch_jump(else_label)
+    end
+    true
+  end
+end
+
+Liquid::Assign.class_eval do
+  def compile_render(code)
+    return false unless instance_of?(Liquid::Assign) && from.instance_of?(Liquid::Variable)
+
+    from.compile_evaluate(code)
+    code.add_assign(to)
+    true
+  end
+end
+
+Liquid::Capture.class_eval do
+  def compile_render(code)
+    return false unless instance_of?(Liquid::Capture) && @body.instance_of?(Liquid::C::BlockBody)
+
+    code.add_capture(@to, @body)
+    true
+  end
+end
+
+Liquid::Render.class_eval do
+  def compile_render(code)
+    return false unless instance_of?(Liquid::Render) && @template_name_expr.is_a?(String) && @attributes.size <= 255
+    return true if compile_inlined_partial(code)
+
+    code.add_evaluate_expression(@variable_name_expr)
+    @attributes.each do |key, value|
+      code.add_evaluate_expression(key)
+      code.add_evaluate_expression(value)
+    end
+    variable_name = @alias_name || @template_name_expr.split("/").last
+    code.add_render_partial(self, @template_name_expr, variable_name, @attributes.size, @is_for_loop)
+    true
+  end
+
+  private
+
+  # With the inline_partials parse option set to a file system, a small partial
+  # that is rendered without a variable or attributes is parsed along with the
+  # template, and its output is written directly if it is only raw text. Its
+  # source is recorded in Liquid::Template#inlined_partials to be able to tell
+  # when the template needs to be parsed again.
+  def compile_inlined_partial(code)
+    file_system = parse_context[:inline_partials]
+    return false unless file_system && @variable_name_expr.nil? && @attributes.empty?
+    return false if parse_context[:inlining_partials]&.include?(@template_name_expr)
+
+    source = file_system.read_template_file(@template_name_expr)
+    return false unless source.is_a?(String) && source.bytesize <= Liquid::C.inline_partial_max_bytes
+
+    partial = Liquid::Template.parse(source, parse_context.inline_partial_parse_context(@template_name_expr))
+    body = partial.root.body
+    body.instance_of?(Liquid::C::BlockBody) && code.add_inlined_partial(@template_name_expr, source, body)
+  rescue StandardError
+    # leave the error to be rendered by the render tag
+    false
+  end
+end
@@ -11,6 +11,11 @@ unless TASK_NAMES.include?(task_name)
   raise "Unsupported task '#{task_name}' (must be one of #{TASK_NAMES})"
 end
 
+# Instruments is only available on macOS, use `rake perf:compile` or `rake perf:render` on Linux
+unless RbConfig::CONFIG["host_os"].include?("darwin")
+  abort("Profiling with instruments requires macOS, use `rake perf:#{task_name == "run" ? "render" : task_name}` on Linux")
+end
+
 task = ThemeRunner.new.method(task_name)
 
 runner_id = fork do
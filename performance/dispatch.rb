@@ -0,0 +1,35 @@
+# frozen_string_literal: true
+
+# Benchmarks rendering the liquid ThemeRunner templates with the VM instruction
+# dispatch that the loaded liquid_c extension was compiled with. The results are
+# written as JSON to the path given as an argument, so `rake benchmark:dispatch`
+# can compare builds of the extension using computed goto and switch dispatch.
+
+require "benchmark/ips"
+require "json"
+require "liquid"
+require "liquid/c"
+liquid_lib_dir = $LOAD_PATH.detect { |p| File.exist?(File.join(p, "liquid.rb")) }
+require File.join(File.dirname(liquid_lib_dir), "performance/theme_runner")
+
+json_path = ARGV.first
+dispatch = Liquid::C::VM::DISPATCH
+
+Liquid::Template.error_mode = :lax
+profiler = ThemeRunner.new
+
+report = Benchmark.ips do |x|
+  x.time = 10
+  x.warmup = 5
+
+  puts
+  puts "Running render benchmark with #{dispatch} dispatch for #{x.time} seconds (with #{x.warmup} seconds warmup)."
+  puts
+
+  x.report("render (#{dispatch})") { profiler.render }
+end
+
+if json_path
+  entry = report.entries.first
+  File.write(json_path, JSON.generate(dispatch: dispatch, ips: entry.ips, ips_sd: entry.ips_sd))
+end
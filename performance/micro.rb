@@ -0,0 +1,190 @@
+# frozen_string_literal: true
+
+# Benchmarks each part of liquid-c in isolation, unlike the liquid ThemeRunner
+# benchmark that mixes them together.
+#
+# Usage: ruby performance/micro.rb [--json PATH] [SUITE...]
+#
+# Only the given suites are run, or all of them if none are given. With --json,
+# the results are also written to PATH along with the versions they were
+# measured with, so they can be compared between releases. MICRO_TIME and
+# MICRO_WARMUP set the seconds each case is measured and warmed up for.
+
+require "benchmark/ips"
+require "json"
+require "liquid"
+require "liquid/c"
+
+Liquid::Template.error_mode = :strict
+
+SECTION = <<~LIQUID
+  <div class="product-card" data-product-id="{{ product.id }}">
+    <a href="{{ product.url }}" class="product-card__link">
+      {%- if product.featured_image -%}
+        <img src="{{ product.featured_image | img_url: '300x' }}" alt="{{ product.title | escape }}">
+      {%- endif -%}
+    </a>
+    {% for tag in product.tags %}<span class="tag">{{ tag | upcase }}</span>{% endfor %}
+    <p class="product-card__description">{{ product.description | strip_html | truncate: 120 }}</p>
+  </div>
+LIQUID
+
+PRODUCT = {
+  "id" => 1,
+  "url" => "/products/shirt",
+  "title" => "Shirt & Tie",
+  "featured_image" => nil,
+  "tags" => ["cotton", "summer", "sale"],
+  "description" => "<p>#{"A comfortable cotton shirt. " * 8}</p>",
+}
+
+# Input and arguments for each filter that liquid-c compiles to a builtin filter instruction
+FILTERS = {
+  "size" => ["title", []],
+  "downcase" => ["Title", []],
+  "upcase" => ["title", []],
+  "capitalize" => ["title", []],
+  "h" => ["<b>&</b>", []],
+  "escape" => ["<b>&</b>", []],
+  "escape_once" => ["&lt;b&gt; & <b>", []],
+  "url_encode" => ["a b&c", []],
+  "url_decode" => ["a+b%26c", []],
+  "slice" => ["title", [1, 3]],
+  "truncate" => ["A comfortable cotton shirt", [10]],
+  "truncatewords" => ["A comfortable cotton shirt", [2]],
+  "split" => ["a,b,c", [","]],
+  "strip" => ["  title  ", []],
+  "lstrip" => ["  title  ", []],
+  "rstrip" => ["  title  ", []],
+  "strip_html" => ["<p>title</p>", []],
+  "strip_newlines" => ["a\nb\nc", []],
+  "join" => [["a", "b", "c"], [","]],
+  "sort" => [[3, 1, 2], []],
+  "sort_natural" => [["b", "A", "c"], []],
+  "where" => [[{ "a" => 1 }, { "a" => 2 }], ["a", 1]],
+  "uniq" => [[1, 1, 2], []],
+  "reverse" => [[1, 2, 3], []],
+  "map" => [[{ "a" => 1 }, { "a" => 2 }], ["a"]],
+  "compact" => [[1, nil, 2], []],
+  "replace" => ["a-b-c", ["-", "+"]],
+  "replace_first" => ["a-b-c", ["-", "+"]],
+  "remove" => ["a-b-c", ["-"]],
+  "remove_first" => ["a-b-c", ["-"]],
+  "append" => ["title", ["-suffix"]],
+  "concat" => [[1, 2], [[3]]],
+  "prepend" => ["title", ["prefix-"]],
+  "newline_to_br" => ["a\nb", []],
+  "date" => ["2024-01-02", ["%Y"]],
+  "first" => [[1, 2, 3], []],
+  "last" => [[1, 2, 3], []],
+  "abs" => [-5, []],
+  "plus" => [5, [3]],
+  "minus" => [5, [3]],
+  "times" => [5, [3]],
+  "divided_by" => [6, [3]],
+  "modulo" => [7, [3]],
+  "round" => [1.55, [1]],
+  "ceil" => [1.5, []],
+  "floor" => [1.5, []],
+  "at_least" => [1, [5]],
+  "at_most" => [10, [5]],
+  "default" => [nil, ["fallback"]],
+}
+
+SUITES = {
+  "tokenizer" => lambda do |x|
+    source = SECTION * 64
+    x.report("Tokenizer#shift (#{source.bytesize / 1024} KB)") do
+      tokenizer = Liquid::C::Tokenizer.new(source, 0, false)
+      nil while tokenizer.shift
+    end
+  end,
+
+  "expression_parse" => lambda do |x|
+    ["product.title", "product.tags[0].size", "(1..product.tags.size)", "'a string'"].each do |markup|
+      x.report("Expression.strict_parse(#{markup})") { Liquid::C::Expression.strict_parse(markup) }
+    end
+  end,
+
+  "variable_parse" => lambda do |x|
+    parse_context = Liquid::ParseContext.new(error_mode: :strict)
+    ["product.title", "product.title | escape", "product.price | times: 100 | plus: 5 | divided_by: 3"].each do |markup|
+      x.report("Variable#c_strict_parse(#{markup})") { Liquid::Variable.new(markup, parse_context) }
+    end
+  end,
+
+  "expression_evaluate" => lambda do |x|
+    context = Liquid::Context.new({ "product" => PRODUCT })
+    ["product.title", "product.tags[0].size", "(1..product.tags.size)"].each do |markup|
+      expression = Liquid::C::Expression.strict_parse(markup)
+      x.report("Expression#evaluate(#{markup})") { expression.evaluate(context) }
+    end
+  end,
+
+  "block_render" => lambda do |x|
+    template = Liquid::Template.parse(SECTION)
+    assigns = { "product" => PRODUCT }
+    x.report("BlockBody render (section)") { template.render!(assigns) }
+  end,
+
+  "find_variable" => lambda do |x|
+    [1, 4, 16].each do |depth|
+      context = Liquid::Context.new({ "product" => PRODUCT })
+      (depth - 1).times { |i| context.push("local#{i}" => i) }
+      x.report("context_find_variable (#{depth} scopes)") { context.c_find_variable("product", false) }
+    end
+  end,
+
+  "filters" => lambda do |x|
+    FILTERS.each do |name, (input, args)|
+      arguments = args.each_index.map { |i| "a#{i}" }
+      markup = arguments.empty? ? "{{ v | #{name} }}" : "{{ v | #{name}: #{arguments.join(", ")} }}"
+      template = Liquid::Template.parse(markup)
+      assigns = { "v" => input }
+      args.each_with_index { |arg, i| assigns["a#{i}"] = arg }
+      x.report("filter #{name}") { template.render!(assigns) }
+    end
+  end,
+}
+
+json_path = nil
+if (json_index = ARGV.index("--json"))
+  json_path = ARGV.delete_at(json_index + 1) || abort("--json requires a path")
+  ARGV.delete_at(json_index)
+end
+suite_names = ARGV.empty? ? SUITES.keys : ARGV
+unknown = suite_names - SUITES.keys
+abort("Unknown suites #{unknown.join(", ")} (must be one of #{SUITES.keys.join(", ")})") unless unknown.empty?
+
+results = suite_names.flat_map do |suite_name|
+  puts
+  puts "== #{suite_name}"
+  report = Benchmark.ips do |x|
+    x.time = Float(ENV.fetch("MICRO_TIME", "2"))
+    x.warmup = Float(ENV.fetch("MICRO_WARMUP", "1"))
+    SUITES.fetch(suite_name).call(x)
+  end
+  report.entries.map do |entry|
+    {
+      suite: suite_name,
+      name: entry.label,
+      ips: entry.ips,
+      ips_sd: entry.ips_sd,
+      iterations: entry.iterations,
+      cycles: entry.measurement_cycle,
+    }
+  end
+end
+
+if json_path
+  File.write(json_path, JSON.pretty_generate(
+    liquid_c_version: Liquid::C::VERSION,
+    liquid_version: Liquid::VERSION,
+    ruby_version: RUBY_DESCRIPTION,
+    dispatch: Liquid::C::VM::DISPATCH,
+    tokenizer_scan: Liquid::C::Tokenizer.scan_implementation,
+    results: results,
+  ))
+  puts
+  puts "Results written to #{json_path}"
+end
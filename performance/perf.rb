@@ -0,0 +1,193 @@
+# frozen_string_literal: true
+
+# Runs a liquid ThemeRunner workload under Linux `perf` to check it for
+# performance regressions against a baseline from a previous run:
+#
+# * `perf stat` counts hardware events (IPC, branch and cache misses and
+#   instructions per iteration of the workload)
+# * `perf record` samples call stacks, which are written as folded stacks
+#   (e.g. for flamegraph.pl) along with the share of samples spent in each
+#   function of the liquid_c extension itself
+#
+# Usage: ruby performance/perf.rb compile|render [--save-baseline]
+#
+# The results are written to tmp/perf/<task>.json and compared with
+# tmp/perf/baseline/<task>.json, exiting with a failure status when a metric
+# regressed by more than the tolerance. The following environment variables
+# can be used to configure it:
+#
+# PERF_ITERATIONS   - number of times to run the workload (default 200)
+# PERF_TOLERANCE    - allowed relative regression of a metric (default 0.05)
+# PERF_OUTPUT_DIR   - where to write results (default tmp/perf)
+# PERF_BASELINE_DIR - where baselines are saved (default $PERF_OUTPUT_DIR/baseline)
+# PERF_CALL_GRAPH   - the `perf record --call-graph` mode (default dwarf)
+
+require "fileutils"
+require "json"
+require "rbconfig"
+
+TASK_NAMES = ["compile", "render"]
+COUNTER_EVENTS = ["cycles", "instructions", "branches", "branch-misses", "cache-references", "cache-misses"]
+# Fraction of samples a liquid_c function can newly take up before it is considered a regression
+SELF_SHARE_TOLERANCE = 0.01
+
+def load_theme_runner
+  require "liquid"
+  require "liquid/c"
+  liquid_lib_dir = $LOAD_PATH.detect { |p| File.exist?(File.join(p, "liquid.rb")) }
+  require File.join(File.dirname(liquid_lib_dir), "performance/theme_runner")
+  Liquid::Template.error_mode = :lax
+end
+
+if ARGV.first == "--workload"
+  _, task_name, iterations = ARGV
+  load_theme_runner
+  task = ThemeRunner.new.method(task_name)
+  Integer(iterations).times { task.call }
+  exit
+end
+
+task_name = ARGV.first
+unless TASK_NAMES.include?(task_name)
+  abort("Unsupported task '#{task_name}' (must be one of #{TASK_NAMES})")
+end
+save_baseline = ARGV.include?("--save-baseline")
+
+unless RbConfig::CONFIG["host_os"].include?("linux") && system("perf --version", out: File::NULL, err: File::NULL)
+  abort("Linux perf is required, e.g. from the linux-tools package")
+end
+
+iterations = Integer(ENV.fetch("PERF_ITERATIONS", "200"))
+tolerance = Float(ENV.fetch("PERF_TOLERANCE", "0.05"))
+output_dir = File.expand_path(ENV.fetch("PERF_OUTPUT_DIR", "tmp/perf"))
+baseline_dir = File.expand_path(ENV.fetch("PERF_BASELINE_DIR", File.join(output_dir, "baseline")))
+call_graph = ENV.fetch("PERF_CALL_GRAPH", "dwarf")
+FileUtils.mkdir_p(output_dir)
+
+# Run the workload with the same liquid_c extension as this script
+require "liquid"
+require "liquid/c"
+extension_path = $LOADED_FEATURES.detect { |path| File.basename(path, ".*") == "liquid_c" }
+extension_name = File.basename(extension_path)
+workload = [RbConfig.ruby, "-I", File.dirname(extension_path), __FILE__, "--workload", task_name, iterations.to_s]
+
+def run!(*command)
+  system(*command) || abort("Failed to run: #{command.join(" ")}")
+end
+
+def counters(stat_path)
+  File.foreach(stat_path).each_with_object({}) do |line, counters|
+    value, _unit, event = line.split(",")
+    next unless event && value.match?(/\A[\d.]+\z/)
+
+    counters[event.delete_suffix(":u")] = Float(value)
+  end
+end
+
+# Folds the call stacks printed by `perf script` into one line per unique stack,
+# from the root to the leaf frame, followed by the number of samples it had.
+def fold_stacks(script_output, extension_name)
+  folded = Hash.new(0)
+  extension_self = Hash.new(0)
+  samples = 0
+  script_output.split(/\n\n+/).each do |sample|
+    header, *frames = sample.lines(chomp: true)
+    next if header.nil? || frames.empty?
+
+    frames = frames.filter_map do |frame|
+      _address, symbol, dso = frame.strip.match(/\A(\h+)\s+(.*?)\s+\((.*)\)\z/)&.captures
+      [symbol.sub(/\+0x\h+\z/, ""), dso] if symbol
+    end
+    next if frames.empty?
+
+    samples += 1
+    comm = header.strip.split(/\s+/).first
+    folded[[comm, *frames.reverse.map(&:first)].join(";")] += 1
+    leaf_symbol, leaf_dso = frames.first
+    extension_self[leaf_symbol] += 1 if File.basename(leaf_dso) == extension_name
+  end
+  self_share = extension_self.transform_values { |count| count.fdiv(samples) }
+  [folded, self_share.sort_by { |_symbol, share| -share }.to_h]
+end
+
+stat_path = File.join(output_dir, "#{task_name}.stat.csv")
+events = COUNTER_EVENTS.map { |event| "#{event}:u" }.join(",")
+run!("perf", "stat", "-x", ",", "-o", stat_path, "-e", events, "--", *workload)
+counts = counters(stat_path)
+
+record_path = File.join(output_dir, "#{task_name}.perf.data")
+run!("perf", "record", "-q", "-F", "999", "--call-graph", call_graph, "-o", record_path, "--", *workload)
+script_output = IO.popen(["perf", "script", "-F", "comm,pid,tid,time,event,ip,sym,dso", "-i", record_path], &:read)
+folded, extension_self_share = fold_stacks(script_output, extension_name)
+folded_path = File.join(output_dir, "#{task_name}.folded")
+File.write(folded_path, folded.map { |stack, count| "#{stack} #{count}\n" }.join)
+
+# Counters that aren't supported, e.g. in virtual machines, are left out of the metrics
+ratio = ->(numerator, denominator) { counts[numerator].fdiv(counts[denominator]) if counts[numerator] && counts[denominator] }
+metrics = {
+  "ipc" => ratio.call("instructions", "cycles"),
+  "instructions_per_iteration" => (counts["instructions"] / iterations if counts["instructions"]),
+  "branch_miss_rate" => ratio.call("branch-misses", "branches"),
+  "cache_miss_rate" => ratio.call("cache-misses", "cache-references"),
+}.compact
+result = {
+  "task" => task_name,
+  "iterations" => iterations,
+  "counters" => counts,
+  "metrics" => metrics,
+  "extension_self_share" => extension_self_share,
+}
+File.write(File.join(output_dir, "#{task_name}.json"), JSON.pretty_generate(result))
+
+puts
+puts format("%-28s %16s", task_name, "value")
+metrics.each { |name, value| puts format("%-28s %16.4f", name, value) }
+puts
+puts format("%-40s %8s", "liquid_c functions", "samples")
+extension_self_share.first(15).each { |symbol, share| puts format("%-40s %7.2f%%", symbol, share * 100) }
+puts
+puts "Folded stacks written to #{folded_path}"
+
+baseline_path = File.join(baseline_dir, "#{task_name}.json")
+if save_baseline
+  FileUtils.mkdir_p(baseline_dir)
+  File.write(baseline_path, JSON.pretty_generate(result))
+  puts "Baseline saved to #{baseline_path}"
+  exit
+end
+
+unless File.exist?(baseline_path)
+  puts "No baseline to compare with at #{baseline_path}, save one with --save-baseline"
+  exit
+end
+
+baseline = JSON.parse(File.read(baseline_path))
+if baseline["iterations"] != iterations
+  abort("The baseline was run with #{baseline["iterations"]} iterations instead of #{iterations}")
+end
+
+# Whether a higher value of the metric is better
+higher_is_better = { "ipc" => true }
+regressions = metrics.filter_map do |name, value|
+  base = baseline["metrics"][name]
+  next unless base
+
+  change = (value - base) / base
+  change = -change if higher_is_better[name]
+  format("%s: %.4f -> %.4f (%+.1f%%)", name, base, value, change * 100) if change > tolerance
+end
+extension_self_share.each do |symbol, share|
+  base = baseline["extension_self_share"].fetch(symbol, 0.0)
+  if share - base > SELF_SHARE_TOLERANCE
+    regressions << format("%s: %.2f%% -> %.2f%% of samples", symbol, base * 100, share * 100)
+  end
+end
+
+puts
+if regressions.empty?
+  puts "No regressions compared to #{baseline_path}"
+else
+  puts "Regressions compared to #{baseline_path}:"
+  regressions.each { |regression| puts "  #{regression}" }
+  exit(false)
+end
@@ -0,0 +1,43 @@
+# frozen_string_literal: true
+
+# Benchmarks Liquid::C::Tokenizer#shift on a large template of mostly raw HTML,
+# like a section template, with each delimiter scanning implementation the CPU
+# supports.
+
+require "benchmark/ips"
+require "liquid"
+require "liquid/c"
+
+section = <<~LIQUID
+  <div class="product-card" data-product-id="{{ product.id }}">
+    <style>.product-card { display: flex; } .product-card .price { color: #333; }</style>
+    <a href="{{ product.url }}" class="product-card__link">
+      {%- if product.featured_image -%}
+        <img src="{{ product.featured_image | img_url: '300x' }}" alt="{{ product.title | escape }}" loading="lazy">
+      {%- endif -%}
+    </a>
+    <script>window.products = window.products || {}; window.products["x"] = { available: true };</script>
+    <p class="product-card__description">#{"Lorem ipsum dolor sit amet, consectetur adipiscing elit. " * 8}</p>
+  </div>
+LIQUID
+source = section * (256 * 1024 / section.bytesize)
+
+def tokenize(source)
+  tokenizer = Liquid::C::Tokenizer.new(source, 0, false)
+  nil while tokenizer.shift
+end
+
+puts "Tokenizing a #{source.bytesize / 1024} KB template"
+Benchmark.ips do |x|
+  x.time = 5
+  x.warmup = 2
+
+  Liquid::C::Tokenizer.scan_implementations.each do |name|
+    x.report("shift (#{name})") do
+      Liquid::C::Tokenizer.scan_implementation = name
+      tokenize(source)
+    end
+  end
+
+  x.compare!
+end
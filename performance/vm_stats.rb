@@ -0,0 +1,36 @@
+# frozen_string_literal: true
+
+# Renders the liquid ThemeRunner templates with Liquid::C::VM.stats enabled
+# and prints where the VM spent its time, by opcode and by filter.
+
+require "liquid"
+require "liquid/c"
+liquid_lib_dir = $LOAD_PATH.detect { |p| File.exist?(File.join(p, "liquid.rb")) }
+require File.join(File.dirname(liquid_lib_dir), "performance/theme_runner")
+
+Liquid::Template.error_mode = :lax
+runner = ThemeRunner.new
+runner.render # warmup
+
+Liquid::C::VM.reset_stats
+Liquid::C::VM.stats_enabled = true
+end_time = Time.now + 5.0
+runner.render until Time.now >= end_time
+Liquid::C::VM.stats_enabled = false
+
+unit = Liquid::C::VM::STATS_TIME_UNIT
+stats = Liquid::C::VM.stats
+[:opcodes, :filters].each do |kind|
+  counters = stats[kind].sort_by { |_name, counter| -counter[unit] }
+  total = counters.sum { |_name, counter| counter[unit] }
+  next if total.zero?
+
+  puts
+  puts format("%-36s %14s %14s %8s %12s", kind, "count", unit, "%", "#{unit}/count")
+  counters.each do |name, counter|
+    puts format(
+      "%-36s %14d %14d %7.2f%% %12.1f",
+      name, counter[:count], counter[unit], 100.0 * counter[unit] / total, counter[unit].fdiv(counter[:count]),
+    )
+  end
+end
@@ -1,8 +1,16 @@
 # frozen_string_literal: true
 
 require "test_helper"
+require "objspace"
+require "stringio"
 
 class BlockTest < Minitest::Test
+  module ShoutFilter
+    def upcase(input)
+      "#{input.upcase}!"
+    end
+  end
+
   def test_no_allocation_of_trimmed_strings
     template = Liquid::Template.parse("{{ a -}}     {{- b }}")
     assert_equal(2, template.root.nodelist.size)
@@ -89,6 +97,239 @@ class BlockTest < Minitest::Test
     ASM
   end
 
+  def test_disassemble_superinstructions
+    template = Liquid::Template.parse("{{ a }}{{ a.b }}{{ a.b.c }}{{ a.b | upcase }}", line_numbers: true)
+    block_body = template.root.body
+    assert_equal(<<~ASM, block_body.disassemble)
+      0x0000: write_static_var("a", line_number: 1)
+      0x0006: write_static_var_lookup_const_key("a", "b", line_number: 1)
+      0x000e: render_variable_rescue(line_number: 1)
+      0x0012: find_static_var_lookup_const_key("a", "b")
+      0x0017: lookup_const_key("c")
+      0x001a: pop_write
+      0x001b: render_variable_rescue(line_number: 1)
+      0x001f: find_static_var_lookup_const_key("a", "b")
+      0x0024: builtin_filter(name: :upcase, num_args: 1)
+      0x0027: pop_write
+      0x0028: leave
+    ASM
+    assert_equal(4, block_body.nodelist.size)
+    assert(block_body.nodelist.all? { |node| node.is_a?(Liquid::C::VariablePlaceholder) })
+  end
+
+  def test_superinstructions_render
+    template = Liquid::Template.parse("{{ s }},{{ a.b }},{{ a['b'] }},{{ a.size }},{{ missing.b }}")
+    assert_equal("x,1,1,2,", template.render!({ "s" => "x", "a" => { "b" => 1, "c" => 2 } }))
+
+    template = Liquid::Template.parse("{{ a.b }}\n{{ a.b }}", line_numbers: true)
+    drop = Class.new(Liquid::Drop) do
+      def b
+        raise Liquid::Error, "boom"
+      end
+    end.new
+    assert_equal("Liquid error (line 1): boom\nLiquid error (line 2): boom", template.render({ "a" => drop }))
+  end
+
+  def test_disassemble_if
+    template = Liquid::Template.parse("{% if a == 1 %}x{% elsif b %}y{% else %}z{% endif %}")
+    block_body = template.root.body
+    if_node = block_body.nodelist.first
+    assert_instance_of(Liquid::If, if_node)
+    if_body, elsif_body, else_body = if_node.blocks.map(&:attachment)
+    assert_equal(<<~ASM, block_body.disassemble)
+      0x0000: render_tag_rescue(#{if_node.inspect})
+      0x0003: find_static_var("a")
+      0x0006: push_int8(1)
+      0x0008: compare(==)
+      0x000c: jump_if_false(0x0017)
+      0x0010: render_body(#{if_body.inspect})
+      0x0013: jump(0x0028)
+      0x0017: find_static_var("b")
+      0x001a: jump_if_false(0x0025)
+      0x001e: render_body(#{elsif_body.inspect})
+      0x0021: jump(0x0028)
+      0x0025: render_body(#{else_body.inspect})
+      0x0028: end_tag
+      0x0029: leave
+    ASM
+  end
+
+  def test_compiled_if_and_unless
+    source = "{% if n > 1 or b and c %}if{% elsif s contains 'x' %}elsif{% else %}else{% endif %}," \
+      "{% unless s == empty %}unless{% elsif b %}elsif{% endunless %}"
+    template = Liquid::Template.parse(source)
+    assert_equal("if,unless", template.render!({ "n" => 2 }))
+    assert_equal("else,unless", template.render!({ "n" => 1, "b" => true }))
+    assert_equal("if,unless", template.render!({ "n" => 1, "b" => true, "c" => 1 }))
+    assert_equal("elsif,unless", template.render!({ "s" => "xyz" }))
+    assert_equal("else,elsif", template.render!({ "s" => "", "b" => 1 }))
+    assert_equal("else,unless", template.render!({}))
+  end
+
+  def test_compiled_if_error_rendered_with_line_number
+    source = "{% if a %}\n{{ 1 | divided_by: 0 }}{% endif %}{% if 1 < 'x' %}y{% endif %},after"
+    template = Liquid::Template.parse(source, line_numbers: true)
+    assert_equal(
+      "Liquid error (line 2): divided by 0" \
+        "Liquid error (line 2): comparison of Integer with String failed,after",
+      template.render({ "a" => true }),
+    )
+  end
+
+  def test_compiled_if_interrupt
+    template = Liquid::Template.parse("{% for i in (1..3) %}{% if i == 2 %}{% break %}{% endif %}{{ i }}{% endfor %}")
+    assert_equal("1", template.render!)
+  end
+
+  def test_disassemble_case
+    template = Liquid::Template.parse("{% case x %}{% when 'a' %}A{% when 'b' %}B{% else %}E{% endcase %}")
+    block_body = template.root.body
+    case_node = block_body.nodelist.first
+    assert_instance_of(Liquid::Case, case_node)
+    a_body, b_body, else_body = case_node.blocks.map(&:attachment)
+    assert_equal(<<~ASM, block_body.disassemble)
+      0x0000: render_tag_rescue(#{case_node.inspect})
+      0x0003: find_static_var("x")
+      0x0006: case_dispatch(#{{ "a" => 0, "b" => 1 }.inspect}, branches: [0x0016, 0x001d], else: 0x0024, compare: 0x002b)
+      0x0016: render_body(#{a_body.inspect})
+      0x0019: jump(0x006d)
+      0x001d: render_body(#{b_body.inspect})
+      0x0020: jump(0x006d)
+      0x0024: render_body(#{else_body.inspect})
+      0x0027: jump(0x006d)
+      0x002b: find_static_var("x")
+      0x002e: push_const("a")
+      0x0031: compare(==)
+      0x0035: jump_if_false(0x0040)
+      0x0039: render_body(#{a_body.inspect})
+      0x003c: jump(0x005c)
+      0x0040: find_static_var("x")
+      0x0043: push_const("b")
+      0x0046: compare(==)
+      0x004a: jump_if_false(0x0055)
+      0x004e: render_body(#{b_body.inspect})
+      0x0051: jump(0x006d)
+      0x0055: render_body(#{else_body.inspect})
+      0x0058: jump(0x006d)
+      0x005c: find_static_var("x")
+      0x005f: push_const("b")
+      0x0062: compare(==)
+      0x0066: jump_if_false(0x006d)
+      0x006a: render_body(#{b_body.inspect})
+      0x006d: end_tag
+      0x006e: leave
+    ASM
+  end
+
+  def test_compiled_case
+    drop = Class.new(Liquid::Drop) do
+      def ==(other)
+        other == "b" || other == 2
+      end
+    end.new
+    sources = [
+      "{% case x %}{% when 'a', 'b' %}ab{% when 1 %}one{% when nil %}nil{% when true %}true{% else %}else{% endcase %}",
+      "{% case x %}{% else %}e1{% when 'a' %}a{% else %}e2{% when 'b' %}b{% endcase %}",
+      "{% case x %}{% when 'a' %}a1{% when 'b' %}b{% when 'a' %}a2{% else %}else{% endcase %}",
+      "{% case x %}{% when 1.5 %}float{% when 2 %}two{% when x %}self{% endcase %}",
+    ]
+    values = ["a", "b", "c", 1, 1.0, 2, 2.0, 1.5, nil, true, false, drop, "a".b, [1]]
+    sources.each do |source|
+      compiled = Liquid::Template.parse(source)
+      assert_instance_of(Liquid::C::BlockBody, compiled.root.body)
+      ruby = Liquid::Template.parse(source, disable_liquid_c_nodes: true)
+      values.each do |value|
+        assigns = { "x" => value }
+        assert_equal(ruby.render!(assigns), compiled.render!(assigns), "#{source} with #{value.inspect}")
+      end
+    end
+  end
+
+  def test_disassemble_for
+    template = Liquid::Template.parse("{% for x in xs reversed limit: 2 %}{{ x }}{% else %}empty{% endfor %}")
+    block_body = template.root.body
+    for_node = block_body.nodelist.first
+    assert_instance_of(Liquid::For, for_node)
+    for_body, else_body = for_node.nodelist
+    assert_equal(<<~ASM, block_body.disassemble)
+      0x0000: render_tag_rescue(#{for_node.inspect})
+      0x0003: push_nil
+      0x0004: find_static_var("xs")
+      0x0007: push_int8(2)
+      0x0009: for_init(variable_name: "x", name: "x-xs", reversed: true, offset_continue: false, else: 0x001a)
+      0x0012: for_next(#{for_body.inspect})
+      0x0015: for_end
+      0x0016: jump(0x001d)
+      0x001a: render_body(#{else_body.inspect})
+      0x001d: end_tag
+      0x001e: leave
+    ASM
+  end
+
+  def test_compiled_for
+    source = "{% for x in xs offset: 1 limit: 3 %}" \
+      "{{ forloop.index }}{{ forloop.index0 }}{{ forloop.rindex }}{{ forloop.rindex0 }}" \
+      "{{ forloop.first }}{{ forloop.last }}{{ forloop.length }}:{{ x }} " \
+      "{% endfor %}|{% for x in xs reversed %}{{ x }}{% else %}empty{% endfor %}"
+    template = Liquid::Template.parse(source)
+    assert_equal(
+      "1032truefalse3:b 2121falsefalse3:c 3210falsetrue3:d |edcba",
+      template.render!({ "xs" => ["a", "b", "c", "d", "e"] }),
+    )
+    assert_equal("|empty", template.render!({ "xs" => [] }))
+    assert_equal("1032truefalse3:2 2121falsefalse3:3 3210falsetrue3:4 |54321", template.render!({ "xs" => (1..5) }))
+  end
+
+  def test_compiled_for_interrupts_and_nesting
+    source = "{% for i in (1..5) %}{% if i == 2 %}{% continue %}{% endif %}{% if i == 4 %}{% break %}{% endif %}" \
+      "{% for j in (1..2) %}{{ forloop.parentloop.index }}-{{ j }} {% endfor %}{% endfor %}{{ i }}{{ j }}{{ forloop }}"
+    template = Liquid::Template.parse(source)
+    assert_equal("1-1 1-2 3-1 3-2 ", template.render!)
+  end
+
+  def test_compiled_for_offset_continue
+    source = "{% for x in xs limit: 2 %}{{ x }}{% endfor %},{% for x in xs offset: continue %}{{ x }}{% endfor %}"
+    template = Liquid::Template.parse(source)
+    assert_equal("12,345", template.render!({ "xs" => [1, 2, 3, 4, 5] }))
+  end
+
+  def test_compiled_for_exception_unwinds_scope
+    source = "{% for x in (1..2) %}{% for y in (1..2) %}{{ y | divided_by: 0 }}{% endfor %}{% endfor %}"
+    template = Liquid::Template.parse(source)
+    context = Liquid::Context.new
+    context.exception_renderer = ->(exc) { raise exc }
+    assert_raises(Liquid::ZeroDivisionError) do
+      template.render(context)
+    end
+    assert_equal(1, context.scopes.size)
+    assert_equal([], context.registers[:for_stack])
+  end
+
+  def test_disassemble_assign_and_capture
+    template = Liquid::Template.parse("{% assign x = a.b %}{% capture y %}z{% endcapture %}")
+    block_body = template.root.body
+    assign_node, capture_node = block_body.nodelist
+    capture_body = capture_node.nodelist.first
+    assert_equal(<<~ASM, block_body.disassemble)
+      0x0000: render_tag_rescue(#{assign_node.inspect})
+      0x0003: find_static_var_lookup_const_key("a", "b")
+      0x0008: assign("x")
+      0x000b: end_tag
+      0x000c: render_tag_rescue(#{capture_node.inspect})
+      0x000f: capture("y", #{capture_body.inspect})
+      0x0014: end_tag
+      0x0015: leave
+    ASM
+  end
+
+  def test_compiled_assign_and_capture
+    source = "{% for i in (1..3) %}{% assign last = i | times: 2 %}" \
+      "{% capture all %}{{ all }}{{ last }}{% if i == 2 %}{% break %}{% endif %},{% endcapture %}{% endfor %}" \
+      "{{ last }}|{{ all }}"
+    template = Liquid::Template.parse(source)
+    assert_equal("4|2,4", template.render!)
+  end
+
   def test_exception_renderer_exception
     original_error = Liquid::Error.new("original")
     handler_error = RuntimeError.new("exception handler error")
@@ -129,10 +370,311 @@ class BlockTest < Minitest::Test
     end
   end
 
+  def test_disassemble_render
+    template = Liquid::Template.parse("{% render 'item' for items as x, a: 1 %}")
+    block_body = template.root.body
+    render_node = block_body.nodelist.first
+    assert_instance_of(Liquid::Render, render_node)
+    assert_equal(<<~ASM, block_body.disassemble)
+      0x0000: render_tag_rescue(#{render_node.inspect})
+      0x0003: find_static_var("items")
+      0x0006: push_const("a")
+      0x0009: push_int8(1)
+      0x000b: render_partial("item", variable_name: "x", attributes: 1, for: true)
+      0x0014: end_tag
+      0x0015: leave
+    ASM
+  end
+
+  def test_compiled_render
+    file_system = StubFileSystem.new({
+      "card" => "[{{ card.title }}|{{ forloop.index }}/{{ forloop.length }}|{{ size }}|{{ outer }}]",
+      "dir/item" => "<{{ item }}{{ x }}:{{ forloop.first }}:{{ a }}>{% render 'card' with item %}",
+      "include" => "{% include 'card' %}",
+      "assign" => "{% assign outer = 'changed' %}{{ outer }}",
+    })
+    sources = [
+      "{% render 'card' for products, size: 'big' %}",
+      "{% render 'card' with products[0] %}{% render 'card' %}",
+      "{% render 'dir/item' for words, a: products[1].title %}",
+      "{% render 'dir/item' for words as x %}{% render 'dir/item' for hash %}{% render 'dir/item' for missing %}",
+      "{% for p in products %}{% render 'card', card: p, outer: forloop.index %}{% endfor %}",
+      "{% render 'include' %}{% render 'assign' %}{{ outer }}",
+    ]
+    assigns = {
+      "products" => [{ "title" => "A" }, { "title" => "B" }],
+      "words" => ["x", "y"],
+      "hash" => { "k" => "v" },
+      "outer" => "O",
+    }
+    sources.each do |source|
+      compiled = Liquid::Template.parse(source)
+      assert_instance_of(Liquid::C::BlockBody, compiled.root.body)
+      ruby = Liquid::Template.parse(source, disable_liquid_c_nodes: true)
+      assert_equal(
+        ruby.render(assigns, registers: { file_system: file_system }),
+        compiled.render(assigns, registers: { file_system: file_system }),
+        source,
+      )
+    end
+  end
+
+  def test_compiled_render_loads_partial_once_per_render
+    reads = Hash.new(0)
+    file_system = Object.new
+    file_system.define_singleton_method(:read_template_file) do |name|
+      reads[name] += 1
+      name == "outer" ? "({% render 'inner', v: v %})" : "{{ v }}"
+    end
+    template = Liquid::Template.parse("{% for v in (1..3) %}{% render 'outer', v: v %}{% endfor %}")
+    assert_equal("(1)(2)(3)", template.render!({}, registers: { file_system: file_system }))
+    assert_equal({ "outer" => 1, "inner" => 1 }, reads)
+  end
+
+  def test_compiled_render_partials_for_reused_context
+    render_twice = lambda do |template|
+      file_system = StubFileSystem.new({ "item" => "old" })
+      context = Liquid::Context.new({}, {}, { file_system: file_system })
+      first = template.render!(context)
+      file_system.partials["item"] = "new"
+      [first, template.render!(context)]
+    end
+    source = "{% render 'item' %}"
+    compiled = Liquid::Template.parse(source)
+    assert_instance_of(Liquid::C::BlockBody, compiled.root.body)
+    ruby = Liquid::Template.parse(source, disable_liquid_c_nodes: true)
+    assert_equal(render_twice.call(ruby), render_twice.call(compiled))
+  end
+
+  def test_inline_raw_partials
+    file_system = StubFileSystem.new({
+      "icon" => "<svg/>",
+      "icons" => "[{%- render 'icon' -%}]",
+      "var" => "{{ x }}",
+      "self" => "{% render 'self' %}",
+    })
+    template = Liquid::Template.parse(
+      "{% render 'icons' %}{% render 'var' %}{% render 'icon', x: 1 %}{% render 'self' %}",
+      inline_partials: file_system,
+    )
+    render_nodes = template.root.body.nodelist
+    assert_equal(<<~ASM, template.root.body.disassemble)
+      0x0000: render_tag_rescue(#{render_nodes[0].inspect})
+      0x0003: write_raw("[<svg/>]")
+      0x000d: end_tag
+      0x000e: render_tag_rescue(#{render_nodes[1].inspect})
+      0x0011: push_nil
+      0x0012: render_partial("var", variable_name: "var", attributes: 0, for: false)
+      0x001b: end_tag
+      0x001c: render_tag_rescue(#{render_nodes[2].inspect})
+      0x001f: push_nil
+      0x0020: push_const("x")
+      0x0023: push_int8(1)
+      0x0025: render_partial("icon", variable_name: "icon", attributes: 1, for: false)
+      0x002e: end_tag
+      0x002f: render_tag_rescue(#{render_nodes[3].inspect})
+      0x0032: push_nil
+      0x0033: render_partial("self", variable_name: "self", attributes: 0, for: false)
+      0x003c: end_tag
+      0x003d: leave
+    ASM
+    assert_equal({ "icons" => "[{%- render 'icon' -%}]", "icon" => "<svg/>" }, template.inlined_partials)
+    refute(template.inlined_partials_changed?(file_system))
+
+    file_system.partials["icon"] = "<img/>"
+    assert(template.inlined_partials_changed?(file_system))
+    file_system.partials.delete("icon")
+    assert(template.inlined_partials_changed?(file_system))
+  end
+
+  def test_inline_partials_is_opt_in
+    template = Liquid::Template.parse("{% render 'icon' %}")
+    assert_equal({}, template.inlined_partials)
+    assert_equal(
+      "<svg/>",
+      template.render!({}, registers: { file_system: StubFileSystem.new({ "icon" => "<svg/>" }) }),
+    )
+  end
+
+  def test_inline_partials_skips_large_and_missing_partials
+    old_max_bytes = Liquid::C.inline_partial_max_bytes
+    Liquid::C.inline_partial_max_bytes = 3
+    file_system = StubFileSystem.new({ "icon" => "<svg/>" })
+    template = Liquid::Template.parse("{% render 'icon' %}{% render 'missing' %}", inline_partials: file_system)
+    assert_equal({}, template.inlined_partials)
+    assert_match(%r{\A<svg/>Liquid error}, template.render({}, registers: { file_system: file_system }))
+  ensure
+    Liquid::C.inline_partial_max_bytes = old_max_bytes
+  end
+
+  def test_specialize
+    template = Liquid::Template.parse("{{ settings.color }},{{ settings.title | upcase }},{% if settings.show %}{{ x }}{% endif %}")
+    if_node = template.root.nodelist.last
+    settings = { "color" => "red", "title" => "t", "show" => false }.freeze
+    static_environment = { "settings" => settings }.freeze
+
+    specialized = template.specialize(static_environment)
+    assert_equal(<<~ASM, specialized.root.body.disassemble)
+      0x0000: write_raw("red,T,")
+      0x0008: render_tag_rescue(#{if_node.inspect})
+      0x000b: end_tag
+      0x000c: leave
+    ASM
+    context = Liquid::Context.new({ "x" => "X" }, {}, {}, false, nil, static_environment)
+    assert_equal("red,T,", specialized.render!(context))
+    assert_equal("red,T,", template.render!(Liquid::Context.new({ "x" => "X" }, {}, {}, false, nil, static_environment)))
+
+    shown = { "settings" => settings.merge("show" => true).freeze }.freeze
+    context = Liquid::Context.new({ "x" => "X" }, {}, {}, false, nil, shown)
+    assert_equal("red,T,X", template.specialize(shown).render!(context))
+  end
+
+  def test_specialize_is_cached_by_static_environment
+    template = Liquid::Template.parse("{{ a }}")
+    static_environment = { "a" => 1 }.freeze
+    specialized = template.specialize(static_environment)
+    assert_same(specialized, template.specialize(static_environment))
+    refute_same(specialized, template.specialize({ "a" => 1 }.freeze))
+
+    Liquid::C::MAX_SPECIALIZATIONS.times { |i| template.specialize({ "b" => i }.freeze) }
+    refute_same(specialized, template.specialize(static_environment))
+    assert_raises(ArgumentError) { template.specialize({ "a" => 1 }) }
+  end
+
+  def test_specialize_falls_back_for_other_contexts
+    static_environment = { "settings" => { "color" => "red" }.freeze }.freeze
+    specialized = Liquid::Template.parse("{{ settings.color }}").specialize(static_environment)
+    assert_equal("red", specialized.render!(Liquid::Context.new({}, {}, {}, false, nil, static_environment)))
+
+    shadowed = Liquid::Context.new({ "settings" => { "color" => "blue" } }, {}, {}, false, nil, static_environment)
+    assert_equal("blue", specialized.render!(shadowed))
+    other = { "settings" => { "color" => "green" }.freeze }.freeze
+    assert_equal("green", specialized.render!(Liquid::Context.new({}, {}, {}, false, nil, other)))
+    context = Liquid::Context.new({}, {}, {}, false, nil, static_environment)
+    context.global_filter = ->(output) { output.upcase }
+    assert_equal("RED", specialized.render!(context))
+    assert_raises(ArgumentError) { specialized.dump_compiled }
+  end
+
+  def test_specialize_leaves_assigned_variables
+    static_environment = { "a" => 1, "i" => 2 }.freeze
+    template = Liquid::Template.parse("{% assign a = 'x' %}{{ a }}{% for i in (5..6) %}{{ i }}{% endfor %}")
+    context = Liquid::Context.new({}, {}, {}, false, nil, static_environment)
+    assert_equal("x56", template.specialize(static_environment).render!(context))
+  end
+
+  def test_constant_output
+    template = Liquid::Template.parse("a{{ 1 }}{{ 'b' | upcase }}{{ nil }}c")
+    assert_equal("a1Bc", template.root.body.constant_output)
+    assert_equal("a1Bc", template.render!)
+    assert_equal(5, template.resource_limits.render_score)
+    assert_equal("a<1><B><>c", template.render!({}, global_filter: ->(output) { "<#{output}>" }))
+    # the constant output has the folded filter, which this strainer overrides
+    assert_equal("a1B!c", template.render!({}, filters: [ShoutFilter]))
+
+    template.resource_limits.render_length_limit = 3
+    assert_equal("Liquid error: Memory limits exceeded", template.render)
+
+    assert_nil(Liquid::Template.parse("a{{ b }}").root.body.constant_output)
+    assert_nil(Liquid::Template.parse("a{% assign b = 1 %}").root.body.constant_output)
+  end
+
   def test_assign_filter_argument_exception
     source = "{% assign v = 'IN' | truncate: 123, liquid_error %}{{ v | default: 'err swallowed' }}"
     template = Liquid::Template.parse(source)
     output = template.render({ "liquid_error" => -> { raise Liquid::Error, "var lookup error" } })
     assert_equal("err swallowed", output)
   end
+
+  def test_render_stats
+    template = Liquid::Template.parse("{{ text }}")
+    assert_equal({ render_count: 0, last_output_size: 0, average_output_size: 0, output_size_hint: nil }, template.render_stats)
+
+    template.render!({ "text" => "a" * 800 })
+    assert_equal({ render_count: 1, last_output_size: 800, average_output_size: 800, output_size_hint: nil }, template.render_stats)
+
+    template.render!({ "text" => "a" * 1600 })
+    stats = template.render_stats
+    assert_equal(2, stats[:render_count])
+    assert_equal(1600, stats[:last_output_size])
+    assert_equal(900, stats[:average_output_size])
+
+    template.output_size_hint = 4096
+    template.reset_render_stats
+    assert_equal({ render_count: 0, last_output_size: 0, average_output_size: 0, output_size_hint: 4096 }, template.render_stats)
+  end
+
+  def test_output_buffer_capacity_reserved_from_previous_renders
+    template = Liquid::Template.parse("{{ text }}")
+    template.render!({ "text" => "a" * 100_000 })
+
+    output = +""
+    template.root.body.render_to_output_buffer(Liquid::Context.new({ "text" => "b" }), output)
+    assert_equal("b", output)
+    assert_operator(ObjectSpace.memsize_of(output), :>=, 100_000)
+  end
+
+  def test_render_to_stream
+    template = Liquid::Template.parse("{% for i in (1..20) %}{{ text }}-{{ i }};{% endfor %}end")
+    assigns = { "text" => "abcdefgh" }
+    chunks = []
+    assert_nil(template.render_to_stream(assigns, chunk_size: 32) { |chunk| chunks << chunk })
+    assert_operator(chunks.size, :>, 1)
+    assert(chunks[0...-1].all? { |chunk| chunk.bytesize >= 32 })
+    assert_equal(template.render!(assigns), chunks.join)
+
+    io = StringIO.new
+    template.render_to_stream(io, assigns, { strict_variables: true }, chunk_size: 16)
+    assert_equal(template.render!(assigns), io.string)
+  end
+
+  def test_render_to_stream_counts_flushed_output_towards_render_length_limit
+    template = Liquid::Template.parse("{% for i in (1..20) %}{{ text }}{% endfor %}")
+    template.resource_limits.render_length_limit = 100
+    chunks = []
+    template.render_to_stream({ "text" => "abcdefgh" }, chunk_size: 16) { |chunk| chunks << chunk }
+    assert(template.resource_limits.reached?)
+    assert_equal("Liquid error: Memory limits exceeded", chunks.last)
+  end
+
+  def test_render_to_stream_write_error_is_not_rescued
+    template = Liquid::Template.parse("{% if true %}{% for i in (1..20) %}{{ text }}{% endfor %}{% endif %}")
+    assert_raises(IOError) do
+      template.render_to_stream({ "text" => "abcdefgh" }, chunk_size: 16) { raise IOError, "closed stream" }
+    end
+    assert_equal("abcdefgh" * 20, template.render!({ "text" => "abcdefgh" }))
+  end
+
+  def test_profile_compiled_template
+    source = "{% if true %}{{ a }}{% endif %}\n{% for i in (1..2) %}{{ i }}{% endfor %}"
+    template = Liquid::Template.parse(source, profile: true, liquid_c_profile: true)
+    assert_instance_of(Liquid::C::BlockBody, template.root.body)
+    assert_equal("1\n12", template.render!({ "a" => 1 }))
+
+    if_timing, for_timing = template.profiler.children
+    assert_equal(["if true", 1], [if_timing.code.strip, if_timing.line_number])
+    assert_equal([[nil, 1]], if_timing.children.map { |timing| [timing.code, timing.line_number] })
+    assert_equal(["for i in (1..2)", 2], [for_timing.code.strip, for_timing.line_number])
+    assert_equal(2, for_timing.children.size)
+    assert(template.profiler.total_render_time >= for_timing.total_time)
+  end
+
+  def test_profile_without_liquid_c_profile_option_uses_ruby_nodes
+    template = Liquid::Template.parse("{{ a }}", profile: true)
+    refute_instance_of(Liquid::C::BlockBody, template.root.body)
+  end
+
+  def test_liquid_c_profile_option_uses_ruby_nodes_without_profiler_support
+    assert(Liquid::C::PROFILE_COMPILED_NODES)
+    Liquid::C.send(:remove_const, :PROFILE_COMPILED_NODES)
+    Liquid::C.const_set(:PROFILE_COMPILED_NODES, false)
+
+    template = Liquid::Template.parse("{{ a }}", profile: true, liquid_c_profile: true)
+    refute_instance_of(Liquid::C::BlockBody, template.root.body)
+    assert_equal("1", template.render!({ "a" => 1 }))
+    assert_equal(["a"], template.profiler.children.map { |timing| timing.code.strip })
+  ensure
+    Liquid::C.send(:remove_const, :PROFILE_COMPILED_NODES)
+    Liquid::C.const_set(:PROFILE_COMPILED_NODES, true)
+  end
 end
@@ -82,4 +82,79 @@ class ContextTest < Minitest::Test
     context.strict_variables = true
     assert_equal(true, context.strict_variables)
   end
+
+  class ShadowTag < Liquid::Tag
+    def render_to_output_buffer(context, output)
+      context.scopes.first[@markup.strip] = "shadowed"
+      output
+    end
+  end
+
+  def test_static_variable_lookups_see_scope_changes
+    with_custom_tag("shadow", ShadowTag) do
+      environment = { "x" => "global" }
+      assert_equal("global,local", render("{{ x }},{% assign x = 'local' %}{{ x }}", environment))
+      assert_equal("global,shadowed", render("{{ x }},{% shadow x %}{{ x }}", environment))
+      assert_equal("global,1,2,global", render("{{ x }},{% for x in (1..2) %}{{ x }},{% endfor %}{{ x }}", environment))
+      assert_equal("global,captured", render("{{ x }},{% capture x %}captured{% endcapture %}{{ x }}", environment))
+    end
+
+    context = Liquid::Context.new({ "x" => "global" })
+    template = Liquid::Template.parse("{{ x }}")
+    assert_equal("global", template.render!(context))
+    context.scopes.last["x"] = "local"
+    assert_equal("local", template.render!(context))
+  end
+
+  module ShadowFilter
+    def shadow(input)
+      @context["x"] = input
+      input
+    end
+
+    def merge_shadow(input)
+      @context.merge("x" => input)
+      input
+    end
+  end
+
+  class ShadowDrop < Liquid::Drop
+    def shadow
+      @context["x"] = "dropped"
+    end
+  end
+
+  def test_static_variable_lookups_see_ruby_code_changes
+    environment = { "x" => "global", "drop" => ShadowDrop.new }
+    template = Liquid::Template.parse("{{ x }},{{ 'filtered' | shadow }},{{ x }}")
+    assert_equal("global,filtered,filtered", template.render!(environment.dup, filters: [ShadowFilter]))
+    template = Liquid::Template.parse("{{ x }},{{ 'merged' | merge_shadow }},{{ x }}")
+    assert_equal("global,merged,merged", template.render!(environment.dup, filters: [ShadowFilter]))
+    assert_equal("global,dropped,dropped", render("{{ x }},{{ drop.shadow }},{{ x }}", environment))
+  end
+
+  def test_static_variable_lookups_with_default_proc
+    calls = 0
+    environment = Hash.new { |_hash, key| key == "x" && (calls += 1) > 1 ? "default" : nil }
+    context = Liquid::Context.new([environment, { "x" => "found" }])
+    assert_equal("found,default", Liquid::Template.parse("{{ x }},{{ x }}").render!(context))
+  end
+
+  private
+
+  def render(source, environment)
+    Liquid::Template.parse(source).render!(environment.dup)
+  end
+
+  def with_custom_tag(tag_name, tag_class)
+    old_tag = Liquid::Template.tags[tag_name]
+    Liquid::Template.register_tag(tag_name, tag_class)
+    yield
+  ensure
+    if old_tag
+      Liquid::Template.tags[tag_name] = old_tag
+    else
+      Liquid::Template.tags.delete(tag_name)
+    end
+  end
 end
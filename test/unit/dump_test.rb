@@ -0,0 +1,143 @@
+# frozen_string_literal: true
+
+require "test_helper"
+require "tempfile"
+require "objspace"
+
+class DumpTest < Minitest::Test
+  def test_round_trip_with_marshaled_nodes
+    source = "a {{ x | upcase | append: '!' }} {{ y.z[0] | plus: 1 }} {{ 1.5 }} {{ (1..3) | join: ',' }}"
+    template = Liquid::Template.parse(source)
+    loaded = Liquid::Template.load_compiled(template.dump_compiled)
+
+    assert_equal(template.root.body.disassemble, loaded.root.body.disassemble)
+    assigns = { "x" => "hi", "y" => { "z" => [41] } }
+    assert_equal(template.render!(assigns), loaded.render!(assigns))
+    assert_equal("a HI! 42 1.5 1,2,3", loaded.render!(assigns))
+  end
+
+  def test_round_trip_with_node_hook
+    source = <<~LIQUID
+      {%- if a > 1 -%}
+        {%- for i in (1..a) reversed -%}{{ i }}{%- else -%}none{%- endfor -%}
+      {%- else -%}
+        {%- capture b -%}{{ a | default: 'zero' }}{%- endcapture -%}{%- assign c = b | size -%}{{ b }}:{{ c }}
+      {%- endif -%}
+      {%- increment n -%}
+    LIQUID
+    template = Liquid::Template.parse(source)
+
+    nodes = []
+    data = template.dump_compiled do |node|
+      nodes << node
+      (nodes.size - 1).to_s
+    end
+    loaded = Liquid::Template.load_compiled(data) { |index| nodes.fetch(Integer(index)) }
+
+    assert_equal(template.root.nodelist.size, loaded.root.nodelist.size)
+    [0, 1, 3].each do |a|
+      assert_equal(template.render!({ "a" => a }), loaded.render!({ "a" => a }))
+    end
+    assert_equal("3210", loaded.render!({ "a" => 3 }))
+    assert_equal("zero:40", loaded.render!({ "a" => nil }))
+  end
+
+  def test_round_trip_with_inlined_partials
+    file_system = Object.new
+    file_system.define_singleton_method(:read_template_file) { |_name| "<svg/>" }
+    template = Liquid::Template.parse("({% render 'icon' %})", inline_partials: file_system)
+    loaded = Liquid::Template.load_compiled(template.dump_compiled)
+
+    assert_equal("(<svg/>)", loaded.render!)
+    assert_equal("(<svg/>)", loaded.root.body.constant_output)
+    assert_equal({ "icon" => "<svg/>" }, loaded.inlined_partials)
+  end
+
+  def test_expression_marshal
+    expression = Liquid::C::Expression.strict_parse("a.b['c'] | size")
+    loaded = Marshal.load(Marshal.dump(expression))
+    assert_equal(expression.disassemble, loaded.disassemble)
+    context = Liquid::Context.new({ "a" => { "b" => { "c" => "abc" } } })
+    assert_equal(expression.evaluate(context), loaded.evaluate(context))
+  end
+
+  def test_block_body_marshal_outside_of_dump
+    template = Liquid::Template.parse("{{ a }}")
+    assert_raises(TypeError) do
+      Marshal.dump(template.root.body)
+    end
+  end
+
+  def test_invalid_dump
+    data = Liquid::Template.parse("{{ a }}{% if b %}c{% endif %}").dump_compiled { |_node| Marshal.dump(nil) }
+
+    assert_raises(Liquid::C::InvalidDump) do
+      Liquid::Template.load_compiled(data[0, data.bytesize / 2])
+    end
+    assert_raises(Liquid::C::InvalidDump) do
+      Liquid::Template.load_compiled("LQDX" + data.byteslice(4..))
+    end
+
+    # simulate a dump from another version
+    version = data.byteslice(4, 4).unpack1("L")
+    assert_raises(Liquid::C::InvalidDump) do
+      Liquid::Template.load_compiled(data.byteslice(0, 4) + [version + 1].pack("L") + data.byteslice(8..))
+    end
+  end
+
+  def test_load_from_mapped_file
+    templates = [
+      Liquid::Template.parse("{% for i in (1..x) %}{{ i | plus: 1 }}{% endfor %}"),
+      Liquid::Template.parse("{% if x > 1 %}{{ x | append: 'b' }}{% endif %}"),
+    ]
+    dumps = templates.map(&:dump_compiled)
+    dumps.each { |data| assert_equal(0, data.bytesize % 8) }
+
+    Tempfile.create("liquid-c-cache") do |file|
+      file.binmode
+      file.write(dumps.join)
+      file.flush
+      mapped_file = Liquid::C::MappedFile.new(file.path)
+      assert_equal(dumps.sum(&:bytesize), mapped_file.bytesize)
+
+      offset = 0
+      templates.zip(dumps).each do |template, data|
+        loaded = Liquid::Template.load_compiled(mapped_file, offset)
+        offset += data.bytesize
+        assert_equal(template.root.body.disassemble, loaded.root.body.disassemble)
+        assert_equal(template.render!({ "x" => 3 }), loaded.render!({ "x" => 3 }))
+      end
+
+      assert_raises(ArgumentError) do
+        Liquid::Template.load_compiled(mapped_file, 4)
+      end
+    end
+  end
+
+  def test_mapped_document_body_memsize_excludes_instructions
+    template = Liquid::Template.parse("{{ a }}" * 100)
+    data = template.dump_compiled
+    copied = Liquid::Template.load_compiled(data)
+
+    Tempfile.create("liquid-c-cache") do |file|
+      file.binmode
+      file.write(data)
+      file.flush
+      mapped_file = Liquid::C::MappedFile.new(file.path)
+      skip("file can't be memory mapped") unless mapped_file.mapped?
+
+      mapped = Liquid::Template.load_compiled(mapped_file)
+      assert_operator(document_body_memsize(mapped), :<, document_body_memsize(copied))
+      assert_equal(copied.render!({ "a" => 1 }), mapped.render!({ "a" => 1 }))
+    end
+  end
+
+  private
+
+  def document_body_memsize(template)
+    document_body = ObjectSpace.reachable_objects_from(template.root.body).find do |object|
+      object.is_a?(Liquid::C::DocumentBody)
+    end
+    ObjectSpace.memsize_of(document_body)
+  end
+end
@@ -142,11 +142,10 @@ class ExpressionTest < Minitest::Test
   def test_disassemble
     expression = Liquid::C::Expression.strict_parse("foo.bar[123]")
     assert_equal(<<~ASM, expression.disassemble)
-      0x0000: find_static_var("foo")
-      0x0003: lookup_const_key("bar")
-      0x0006: push_int8(123)
-      0x0008: lookup_key
-      0x0009: leave
+      0x0000: find_static_var_lookup_const_key("foo", "bar")
+      0x0005: push_int8(123)
+      0x0007: lookup_key
+      0x0008: leave
     ASM
   end
 
@@ -0,0 +1,156 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class OptimizerTest < Minitest::Test
+  class EmptyJumpTag < Liquid::Tag
+    def compile_render(code)
+      code.patch_jump(code.add_jump)
+      true
+    end
+
+    def render_to_output_buffer(_context, output)
+      output
+    end
+  end
+
+  module ShoutFilter
+    def upcase(input)
+      "#{input.upcase}!"
+    end
+  end
+
+  def setup
+    Liquid::C::Optimizer.reset_stats
+  end
+
+  def teardown
+    Liquid::C::Optimizer.fold_constant_filters = true
+  end
+
+  def test_merge_raw_writes
+    template = Liquid::Template.parse("a{% raw %}{{ b }}{% endraw %}c")
+    assert_equal(<<~ASM, template.root.body.disassemble)
+      0x0000: write_raw("a{{ b }}c")
+      0x000b: leave
+    ASM
+    assert_equal("a{{ b }}c", template.render!)
+    assert_equal(2, Liquid::C::Optimizer.stats.dig(:passes, :merge_raw_writes, :rewrites))
+  end
+
+  def test_drop_dead_jumps
+    with_custom_tag("empty_jump", EmptyJumpTag) do
+      template = Liquid::Template.parse("{% empty_jump %}")
+      tag = template.root.nodelist.first
+      assert_equal(<<~ASM, template.root.body.disassemble)
+        0x0000: render_tag_rescue(#{tag.inspect})
+        0x0003: end_tag
+        0x0004: leave
+      ASM
+    end
+
+    template = Liquid::Template.parse("{% if a %} \n {% assign x = 1 %} {% endif %}")
+    if_body = template.root.nodelist.first.nodelist.first
+    assert_equal(<<~ASM, if_body.disassemble)
+      0x0000: render_tag_rescue(#{if_body.nodelist.first.inspect})
+      0x0003: push_int8(1)
+      0x0005: assign("x")
+      0x0008: end_tag
+      0x0009: leave
+    ASM
+    assert_equal("", template.render!({ "a" => true }))
+
+    passes = Liquid::C::Optimizer.stats[:passes]
+    assert_equal(3, passes[:drop_dead_jumps][:rewrites])
+    assert_equal(12, passes[:drop_dead_jumps][:bytes_saved])
+  end
+
+  def test_fold_constant_filters
+    template = Liquid::Template.parse('{{ "abc" | upcase | append: "d" }},{{ 7 | plus: 1 }}', line_numbers: true)
+    assert_equal(<<~ASM, template.root.body.disassemble)
+      0x0000: render_variable_rescue(line_number: 1)
+      0x0004: push_const("ABCd")
+      0x0007: pop_write
+      0x0008: write_raw(",")
+      0x000b: render_variable_rescue(line_number: 1)
+      0x000f: push_int8(8)
+      0x0011: pop_write
+      0x0012: leave
+    ASM
+    assert_equal("ABCd,8", template.render!)
+    assert_equal(3, Liquid::C::Optimizer.stats.dig(:passes, :fold_constant_filters, :rewrites))
+  end
+
+  def test_fold_constant_filters_leaves_errors_and_variables
+    template = Liquid::Template.parse("{{ 1 | divided_by: 0 }},{{ x | upcase }},{{ 'a' | split: '' }}")
+    assert_equal("Liquid error: divided by 0,X,a", template.render({ "x" => "x" }))
+    assert_equal(0, Liquid::C::Optimizer.stats.dig(:passes, :fold_constant_filters, :rewrites))
+  end
+
+  def test_fold_constant_filters_with_overridden_filter
+    template = Liquid::Template.parse("{{ 'abc' | upcase }}{% if true %}{{ 'd' | upcase | append: 'e' }}{% endif %}")
+    assert_equal(3, Liquid::C::Optimizer.stats.dig(:passes, :fold_constant_filters, :rewrites))
+    assert_equal("ABC!D!e", template.render!({}, filters: [ShoutFilter]))
+    assert_equal("ABCDe", template.render!)
+  end
+
+  def test_disable_fold_constant_filters
+    Liquid::C::Optimizer.fold_constant_filters = false
+    template = Liquid::Template.parse("{{ 'a' | upcase }}")
+    assert_equal(<<~ASM, template.root.body.disassemble)
+      0x0000: render_variable_rescue(line_number: 0)
+      0x0004: push_const("a")
+      0x0007: builtin_filter(name: :upcase, num_args: 1)
+      0x000a: pop_write
+      0x000b: leave
+    ASM
+  end
+
+  def test_fold_constant_branches
+    template = Liquid::Template.parse("{% if 1 == 1 %}a{% else %}b{% endif %}{% unless true %}c{% endunless %}")
+    if_node, unless_node = template.root.nodelist
+    assert_equal(<<~ASM, template.root.body.disassemble)
+      0x0000: render_tag_rescue(#{if_node.inspect})
+      0x0003: render_body(#{if_node.blocks.first.attachment.inspect})
+      0x0006: end_tag
+      0x0007: render_tag_rescue(#{unless_node.inspect})
+      0x000a: end_tag
+      0x000b: leave
+    ASM
+    assert_equal("a", template.render!)
+    assert_operator(Liquid::C::Optimizer.stats.dig(:passes, :fold_constant_branches, :rewrites), :>, 0)
+  end
+
+  def test_max_stack_size
+    template = Liquid::Template.parse("{{ 'a' | append: 'b' | append: 'c' }}")
+    assert_equal("abc", template.render!)
+    stats = Liquid::C::Optimizer.stats
+    assert_equal(1, stats.dig(:passes, :max_stack_size, :rewrites))
+    assert_equal(1, stats.dig(:passes, :max_stack_size, :stack_size_saved))
+  end
+
+  def test_stats
+    Liquid::Template.parse("a{% if b %}c{% endif %}")
+    stats = Liquid::C::Optimizer.stats
+    assert_equal(2, stats[:block_bodies])
+    assert_operator(stats[:bytes_before], :>, 0)
+    assert_equal(stats[:bytes_before], stats[:bytes_after])
+
+    Liquid::C::Optimizer.reset_stats
+    assert_equal(0, Liquid::C::Optimizer.stats[:block_bodies])
+  end
+
+  private
+
+  def with_custom_tag(tag_name, tag_class)
+    old_tag = Liquid::Template.tags[tag_name]
+    Liquid::Template.register_tag(tag_name, tag_class)
+    yield
+  ensure
+    if old_tag
+      Liquid::Template.tags[tag_name] = old_tag
+    else
+      Liquid::Template.tags.delete(tag_name)
+    end
+  end
+end
@@ -47,4 +47,18 @@ class ResourceLimitsTest < Minitest::Test
 
     assert_equal(3, resource_limits.assign_score)
   end
+
+  def test_compiled_assign_and_capture_assign_score
+    source = "{% for i in (1..2) %}{% assign a = 'abc' | split: '' %}" \
+      "{% capture c %}{{ i }}xy{% endcapture %}{% endfor %}{{ a | join }}{{ c }}"
+    template = Liquid::Template.parse(source)
+    assert_equal("a b c2xy", template.render!)
+    assert_equal(2 * (4 + 3), template.resource_limits.assign_score)
+  end
+
+  def test_compiled_assign_score_limit
+    template = Liquid::Template.parse("{% for i in (1..3) %}{% assign a = 'abcd' %}{% endfor %}")
+    template.resource_limits.assign_score_limit = 10
+    assert_equal("Liquid error: Memory limits exceeded", template.render)
+  end
 end
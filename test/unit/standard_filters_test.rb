@@ -0,0 +1,88 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class StandardFiltersTest < Minitest::Test
+  module ShoutFilter
+    def upcase(input)
+      "#{input.to_s.upcase}!"
+    end
+  end
+
+  class ArrayDrop < Liquid::Drop
+    def size
+      42
+    end
+  end
+
+  def setup
+    Liquid::C::Optimizer.fold_constant_filters = false
+  end
+
+  def teardown
+    Liquid::C::Optimizer.fold_constant_filters = true
+  end
+
+  INPUTS = [
+    nil, true, false, 0, 7, -3, 2**62, 1.5, "", "abc", "MiXeD", "<a href='x'>&\"</a>",
+    "日本語", [], [1, 2], {}, { "a" => 1 },
+  ].freeze
+
+  def test_unary_filters_match_ruby
+    ["size", "downcase", "upcase", "escape", "h"].each do |filter|
+      INPUTS.each do |input|
+        assert_filter_matches_ruby(filter, input)
+      end
+    end
+  end
+
+  def test_binary_filters_match_ruby
+    ["append", "prepend", "plus", "minus", "times", "default"].each do |filter|
+      INPUTS.each do |input|
+        [nil, 2, -5, 2**62, 0.5, "", "x"].each do |arg|
+          assert_filter_matches_ruby(filter, input, arg)
+        end
+      end
+    end
+  end
+
+  def test_times_overflow_falls_back_to_ruby
+    template = Liquid::Template.parse("{{ x | times: x }}")
+    assert_equal((2**62 * 2**62).to_s, template.render!({ "x" => 2**62 }))
+  end
+
+  def test_overridden_filter_is_invoked
+    template = Liquid::Template.parse("{{ x | upcase }}")
+    assert_equal("ABC!", template.render!({ "x" => "abc" }, filters: [ShoutFilter]))
+    assert_equal("ABC", template.render!({ "x" => "abc" }))
+  end
+
+  def test_drop_falls_back_to_ruby
+    template = Liquid::Template.parse("{{ x | size }}")
+    assert_equal("42", template.render!({ "x" => ArrayDrop.new }))
+  end
+
+  def test_default_allow_false
+    template = Liquid::Template.parse("{{ x | default: 1, allow_false: true }},{{ x | default: 1 }}")
+    assert_equal("false,1", template.render!({ "x" => false }))
+  end
+
+  private
+
+  def assert_filter_matches_ruby(filter, *args)
+    source = "{% assign out = x | #{filter}#{args.size > 1 ? ": y" : ""} %}{{ out }}"
+    assigns = { "x" => args[0], "y" => args[1] }
+    expected = begin
+      ruby_value = Liquid::Context.new.strainer.invoke(filter, *args)
+      Liquid::Template.parse("{{ out }}").render!({ "out" => ruby_value })
+    rescue StandardError => e
+      e.class
+    end
+    actual = begin
+      Liquid::Template.parse(source).render!(assigns)
+    rescue StandardError => e
+      e.class
+    end
+    assert_equal(expected, actual, "#{filter} with #{args.inspect}")
+  end
+end
@@ -96,8 +96,50 @@ class TokenizerTest < Minitest::Test
     assert_equal(true, parse_context.liquid_c_nodes_disabled?)
   end
 
+  def test_scan_implementations_match_scalar
+    padding = "<div class=\"x\">{ }</div>\n" * 3
+    sources = [
+      "#{padding}{{ a }}#{padding}{%- if b -%}#{padding}{% endif %}",
+      "#{padding}{%%}#{padding}{{-}}{%-%%}{{ a }#{padding}}",
+      "#{padding}{{ unterminated #{padding}",
+      "#{padding}{% unterminated %#{padding}",
+      "#{padding}{{ a }}",
+      "#{padding}{",
+      "#{padding}{%",
+      "#{padding}{{-",
+    ]
+    # shift the delimiters to each offset within a vector
+    sources = sources.product((0..32).to_a).map { |source, offset| ("a" * offset) + source }
+    expected = with_scan_implementation(:scalar) do
+      sources.map { |source| [tokenize(source), tokenize(source, trimmed: true)] }
+    end
+
+    Liquid::C::Tokenizer.scan_implementations.each do |name|
+      with_scan_implementation(name) do
+        sources.each_with_index do |source, i|
+          actual = [tokenize(source), tokenize(source, trimmed: true)]
+          assert_equal(expected[i], actual, "#{name}: #{source.inspect}")
+        end
+      end
+    end
+  end
+
+  def test_unsupported_scan_implementation
+    assert_raises(ArgumentError) do
+      Liquid::C::Tokenizer.scan_implementation = :unknown
+    end
+  end
+
   private
 
+  def with_scan_implementation(name)
+    old_name = Liquid::C::Tokenizer.scan_implementation
+    Liquid::C::Tokenizer.scan_implementation = name
+    yield
+  ensure
+    Liquid::C::Tokenizer.scan_implementation = old_name
+  end
+
   def new_tokenizer(source, parse_context: Liquid::ParseContext.new)
     parse_context.new_tokenizer(source)
   end
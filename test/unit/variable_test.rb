@@ -134,6 +134,36 @@ class VariableTest < Minitest::Test
     assert_equal("", output)
   end
 
+  def test_write_integer_matches_to_s
+    template = Liquid::Template.parse("{{ num }}")
+    [0, 7, -7, 10, 2**62 - 1, -2**62, 2**64, -2**64].each do |num|
+      assert_equal(num.to_s, template.render!({ "num" => num }))
+    end
+  end
+
+  def test_write_float_matches_to_s
+    template = Liquid::Template.parse("{{ num }}")
+    floats = [
+      0.0, -0.0, 0.5, -1.0, 19.99, 0.1 + 0.2, 1.0 / 3, 100.0, 1500.0, 0.001, 0.0001, 0.00001, 1.5e-7,
+      123456789012345.0, 1e15, 1e16, 2.0**53, 5e-324, Float::MAX, Float::MIN, Float::EPSILON,
+      Float::INFINITY, -Float::INFINITY, Float::NAN,
+    ]
+    random = Random.new(42)
+    1000.times do
+      floats << random.rand(-10**6..10**6) / 10.0**random.rand(0..8)
+      floats << random.rand * 10.0**random.rand(-20..20)
+      floats << random.bytes(8).unpack1("D")
+    end
+    floats.each do |num|
+      assert_equal(num.to_s, template.render!({ "num" => num }), "#{num.inspect} written incorrectly")
+    end
+  end
+
+  def test_write_symbol_and_booleans
+    output = Liquid::Template.parse("{{ ary }},{{ t }},{{ f }}").render!({ "ary" => [:"sym 日本", true, false], "t" => true, "f" => false })
+    assert_equal("sym 日本truefalse,true,false", output)
+  end
+
   class StringConvertible
     def initialize(as_string)
       @as_string = as_string
@@ -257,6 +287,103 @@ class VariableTest < Minitest::Test
     assert_equal("2", output)
   end
 
+  class ProductDrop < Liquid::Drop
+    def title
+      "Shirt"
+    end
+  end
+
+  def test_drop_lookup_after_drop_class_changes
+    drop_class = Class.new(ProductDrop)
+    template = variable_strict_parse("product.title")
+    assert_equal("Shirt", template.render!({ "product" => drop_class.new }))
+    assert_equal("", variable_strict_parse("product.missing").render!({ "product" => drop_class.new }))
+
+    drop_class.class_eval do
+      def title
+        "Hat"
+      end
+    end
+    assert_equal("Hat", template.render!({ "product" => drop_class.new }))
+
+    drop_class.class_eval do
+      def [](key)
+        "#{key}!"
+      end
+    end
+    assert_equal("title!", template.render!({ "product" => drop_class.new }))
+  end
+
+  class ContextDrop < Liquid::Drop
+    def context_set?
+      !@context.nil?
+    end
+  end
+
+  class ContextValue
+    attr_writer :context
+
+    def to_liquid
+      ContextDrop.new
+    end
+  end
+
+  def test_lookup_results_after_value_class_changes
+    value_class = Class.new(ContextDrop)
+    template = variable_strict_parse("value.context_set?")
+    assert_equal("true", template.render!({ "value" => value_class.new }))
+    assert_equal("true", template.render!({ "value" => ContextValue.new }))
+
+    value_class.class_eval do
+      def to_liquid
+        { "context_set?" => "replaced" }
+      end
+    end
+    assert_equal("replaced", template.render!({ "value" => value_class.new }))
+
+    number_class = Class.new(Numeric) do
+      def to_liquid
+        "number"
+      end
+    end
+    assert_equal("number", variable_strict_parse("value").render!({ "value" => number_class.new }))
+  end
+
+  def test_cached_value_class_skips_dynamic_checks
+    drop_class = Class.new(ContextDrop)
+    assert_equal([true, true], Liquid::C.value_class_capabilities(drop_class))
+
+    to_liquid_calls = 0
+    trace = TracePoint.new(:call) do |tp|
+      to_liquid_calls += 1 if tp.method_id == :to_liquid && tp.self.is_a?(drop_class)
+    end
+    template = variable_strict_parse("value.context_set?")
+    trace.enable { assert_equal("true", template.render!({ "value" => drop_class.new })) }
+    assert_equal(0, to_liquid_calls)
+  end
+
+  def test_lookup_results_after_included_module_changes
+    helpers = Module.new
+    drop_class = Class.new(ContextDrop) { include(helpers) }
+    template = variable_strict_parse("value.context_set?")
+    assert_equal("true", template.render!({ "value" => drop_class.new }))
+
+    helpers.define_method(:to_liquid) { { "context_set?" => "replaced" } }
+    assert_equal("replaced", template.render!({ "value" => drop_class.new }))
+  end
+
+  def test_hash_lookup_with_custom_hash_class
+    custom_hash_class = Class.new(Hash) do
+      def [](key)
+        "#{super}!"
+      end
+    end
+    product = custom_hash_class.new
+    product["title"] = "Shirt"
+    assert_equal("Shirt!", variable_strict_parse("product.title").render!({ "product" => product }))
+    assert_equal("Shirt", variable_strict_parse("product.title").render!({ "product" => { "title" => "Shirt" } }))
+  end
+
   def test_encoding_error_message_with_multi_byte_characters
     # 2 byte character
     exc = assert_raises(Liquid::SyntaxError) do
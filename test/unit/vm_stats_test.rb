@@ -0,0 +1,39 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class VMStatsTest < Minitest::Test
+  def setup
+    Liquid::C::VM.reset_stats
+  end
+
+  def teardown
+    Liquid::C::VM.stats_enabled = false
+    Liquid::C::VM.reset_stats
+  end
+
+  def test_disabled_by_default
+    refute(Liquid::C::VM.stats_enabled?)
+    Liquid::Template.parse("{{ x }}").render!({ "x" => 1 })
+    assert_equal({ opcodes: {}, filters: {} }, Liquid::C::VM.stats)
+  end
+
+  def test_counts_opcodes_and_filters
+    template = Liquid::Template.parse("{% for i in (1..3) %}{{ i | plus: 1 }},{{ x | upcase }}{% endfor %}")
+    Liquid::C::VM.stats_enabled = true
+    assert_equal("2,A3,A4,A", template.render!({ "x" => "a" }))
+    Liquid::C::VM.stats_enabled = false
+
+    unit = Liquid::C::VM::STATS_TIME_UNIT
+    stats = Liquid::C::VM.stats
+    assert_equal(4, stats.dig(:opcodes, :for_next, :count))
+    assert_equal(3, stats.dig(:opcodes, :write_raw, :count))
+    assert_equal(6, stats.dig(:opcodes, :builtin_filter, :count))
+    assert_equal(3, stats.dig(:filters, :plus, :count))
+    assert_equal(3, stats.dig(:filters, :upcase, :count))
+    assert_operator(stats.dig(:opcodes, :for_init, unit), :>, 0)
+
+    Liquid::C::VM.reset_stats
+    assert_equal({ opcodes: {}, filters: {} }, Liquid::C::VM.stats)
+  end
+end